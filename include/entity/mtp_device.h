@@ -26,7 +26,7 @@ extern "C" {
 #include "mtp_property.h"
 
 /*This number can be changed based on MAX number or stores allowed*/
-#define	MAX_NUM_DEVICE_STORES		1
+#define	MAX_NUM_DEVICE_STORES		8
 
 #define MTP_STANDARD_VERSION		0x64
 #define MTP_VENDOR_EXTN_ID		0x06
@@ -110,6 +110,22 @@ mtp_uint32 _get_device_info_size(void);
  */
 mtp_uint32 _pack_device_info(mtp_uchar *buf, mtp_uint32 buf_sz);
 
+/*
+ * mtp_uchar *_device_get_device_info_blk(mtp_uint32 *blk_len)
+ * This function returns the DeviceInfo data container, header included.
+ * The dataset is packed on first use and reused until invalidated.
+ * @param[out]	blk_len	length of the returned block
+ * @return	pointer to the block owned by the device, NULL on failure.
+ */
+mtp_uchar *_device_get_device_info_blk(mtp_uint32 *blk_len);
+
+/*
+ * void _device_invalidate_device_info_blk(void)
+ * This function drops the packed DeviceInfo data container.
+ * @return	none.
+ */
+void _device_invalidate_device_info_blk(void);
+
 /*
  * void _reset_mtp_device()
  * This functions resets device state to IDLE/Command Ready
@@ -130,6 +146,32 @@ mtp_bool _device_install_storage(void);
  */
 mtp_bool _device_uninstall_storage(void);
 
+/*
+ * void _device_update_removable_storage(ptp_array_t *added,
+ *		ptp_array_t *removed)
+ * This function adds and removes the removable stores as their file
+ * systems were mounted or unmounted. The store lock is held for write.
+ * @param[out]	added		IDs of the stores added
+ * @param[out]	removed		IDs of the stores removed
+ * @return	none
+ */
+void _device_update_removable_storage(ptp_array_t *added,
+		ptp_array_t *removed);
+
+/*
+ * mtp_bool _device_has_removable_storage(void)
+ * This function tells whether removable stores are configured.
+ * @return	TRUE if any, otherwise FALSE.
+ */
+mtp_bool _device_has_removable_storage(void);
+
+/*
+ * mtp_uint32 _device_get_num_storage_slots(void)
+ * This function returns the number of stores configured, mounted or not.
+ * @return	the number of stores.
+ */
+mtp_uint32 _device_get_num_storage_slots(void);
+
 /*
  * mtp_store_t *_device_get_store(mtp_uint32 store_id)
  * This function will get the store with store_id.
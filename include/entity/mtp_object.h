@@ -56,6 +56,7 @@ typedef struct {
 	mtp_char *file_path;
 	ptp_array_t child_array;	/* Include all the renferences */
 	slist_t propval_list;	/* Object Properties implemented */
+	mtp_bool is_unread;	/* folder whose children are not read yet */
 } mtp_obj_t;
 
 mtp_bool _entity_get_file_times(mtp_obj_t *obj, ptp_time_string_t *create_tm,
@@ -70,6 +71,11 @@ mtp_uint32 _entity_parse_raw_obj_info(mtp_uchar *buf, mtp_uint32 buf_sz,
 void _entity_copy_obj_info(obj_info_t *dst, obj_info_t *src);
 mtp_uint32 _entity_pack_obj_info(mtp_obj_t *obj, ptp_string_t *file_name,
 		mtp_uchar *buf, mtp_uint32 buf_sz);
+mtp_uchar *_entity_pack_obj_info_blk(mtp_obj_t *obj, mtp_uint32 *blk_len);
+mtp_uchar *_entity_get_obj_info_blk(mtp_obj_t *obj, mtp_uint32 *blk_len);
+void _entity_invalidate_obj_info_blk(mtp_uint32 obj_handle);
+mtp_uint32 _entity_get_obj_change_count(void);
+void _entity_clear_obj_info_blks(void);
 #define _entity_dealloc_obj_info(info) g_free(info)
 #define _entity_alloc_mtp_object(...) (((mtp_obj_t *)g_malloc(sizeof(mtp_obj_t))))
 mtp_bool _entity_init_mtp_object_params(
@@ -90,6 +96,7 @@ mtp_bool _entity_set_reference_child_array(mtp_obj_t *obj, mtp_uchar *buf,
 		mtp_uint32 buf_sz);
 void _entity_copy_mtp_object(mtp_obj_t *dst, mtp_obj_t *src);
 mtp_bool _entity_remove_reference_child_array(mtp_obj_t *obj, mtp_uint32 handle);
+void _entity_invalidate_obj_propvals(mtp_obj_t *obj);
 void _entity_dealloc_mtp_obj(mtp_obj_t *obj);
 
 #ifdef __cplusplus
@@ -230,6 +230,8 @@ mtp_uint32 _prop_pack_obj_prop_desc(obj_prop_desc_t *prop, mtp_uchar *buf,
 		mtp_uint32 size);
 obj_prop_desc_t *_prop_get_obj_prop_desc(mtp_uint32 format_code,
 		mtp_uint32 prop_code);
+mtp_uchar *_prop_get_obj_prop_desc_blk(mtp_uint32 format_code,
+		mtp_uint32 propcode, mtp_uint32 *blk_len);
 
 /*
  * ObjectProplist Functions
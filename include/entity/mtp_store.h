@@ -54,6 +54,11 @@ typedef struct {
 	store_info_t store_info;
 	slist_t obj_list;
 	mtp_bool is_hidden;	/*for hidden storage*/
+	mtp_uchar *info_blk;	/* packed StorageInfo data container */
+	mtp_uint32 info_blk_len;
+	mtp_uint64 info_blk_free_space;	/* free space info_blk was packed with */
+	slist_t dirty_list;	/* folder paths whose objects may be stale */
+	mtp_bool is_enumerated;	/* root folder is read, see is_unread */
 } mtp_store_t;
 
 typedef struct {
@@ -66,14 +71,25 @@ typedef enum {
 	MTP_EXTERNAL_STORE_ID = 0x20001
 } mtp_store_id_t;
 
+/* The store configured in the given place, the first one is external */
+#define MTP_STORE_ID(slot)	(MTP_EXTERNAL_STORE_ID + ((slot) << 16))
+
+mtp_bool _entity_init_store_lock(void);
+void _entity_lock_stores_read(void);
+void _entity_lock_stores_write(void);
+mtp_bool _entity_trylock_stores_write(void);
+void _entity_unlock_stores(void);
 void _entity_update_store_info_run_time(store_info_t *info,
 		mtp_char *root_path);
 mtp_uint32 _entity_get_store_info_size(store_info_t *info);
 mtp_uint32 _entity_pack_store_info(store_info_t *info, mtp_uchar *buf,
 		mtp_uint32 buf_sz);
+mtp_uchar *_entity_get_store_info_blk(mtp_store_t *store,
+		mtp_uint32 *blk_len);
+void _entity_invalidate_store_info_blk(mtp_store_t *store);
 mtp_uint32 _entity_get_store_id_by_path(const mtp_char *path_name);
 mtp_bool _entity_init_mtp_store(mtp_store_t *store, mtp_uint32 store_id,
-		mtp_char *store_path);
+		mtp_char *store_path, mtp_bool is_removable);
 mtp_obj_t *_entity_add_file_to_store(mtp_store_t *store, mtp_uint32 h_parent,
 		mtp_char *file_path, mtp_char *file_name, dir_entry_t *file_info);
 mtp_obj_t *_entity_add_folder_to_store(mtp_store_t *store, mtp_uint32 h_parent,
@@ -104,8 +120,13 @@ mtp_uint32 _entity_get_object_tree_size(mtp_store_t *store, mtp_obj_t *obj);
 mtp_bool _entity_check_if_B_parent_of_A(mtp_store_t *store,
 		mtp_uint32 handleA, mtp_uint32 handleB);
 void _entity_destroy_mtp_store(mtp_store_t *store);
-void _entity_store_recursive_enum_folder_objects(mtp_store_t *store,
-		mtp_obj_t *pobj);
+void _entity_store_read_folder(mtp_store_t *store, mtp_obj_t *pobj);
+void _entity_store_read_all_folders(mtp_store_t *store);
+void _entity_mark_folder_dirty(mtp_store_t *store, const mtp_char *folder_path);
+mtp_bool _entity_is_folder_dirty(mtp_store_t *store,
+		const mtp_char *folder_path);
+mtp_bool _entity_is_path_excluded(mtp_store_t *store, const mtp_char *path);
+void _entity_sync_dirty_folders(mtp_store_t *store, mtp_uint32 h_parent);
 void _entity_copy_store_data(mtp_store_t *dst, mtp_store_t *src);
 
 #ifdef __cplusplus
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STORE_INDEX_H_
+#define _MTP_STORE_INDEX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_store.h"
+
+#define MTP_STORE_INDEX_MAGIC		0x5850544d	/* "MTPX" */
+#define MTP_STORE_INDEX_VERSION		2	/* 2 : real format codes for files */
+#define MTP_STORE_INDEX_FILE		"store-%08x.idx"
+/* Folders changed this recently may have events not applied yet */
+#define MTP_STORE_INDEX_MTIME_MARGIN	10	/* s */
+
+/* store_index_rec_t flags */
+#define MTP_STORE_INDEX_UNREAD		0x1	/* children not read yet */
+
+/*
+ * Layout of an index file, in host byte order so it can be used straight
+ * from the mapping: the header, num_objs records with every parent before
+ * its children, then names_len bytes of names. The root path of the store
+ * is the first root_len bytes of the names.
+ */
+typedef struct {
+	mtp_uint32 magic;
+	mtp_uint32 version;
+	mtp_uint32 store_id;
+	mtp_uint32 next_handle;	/* g_next_obj_handle when it was saved */
+	mtp_uint32 num_objs;
+	mtp_uint32 names_len;
+	mtp_int64 root_mtime;	/* ns, 0 forces a rescan */
+	mtp_uint32 root_len;
+	mtp_uint32 reserved;
+} store_index_hdr_t;
+
+typedef struct {
+	mtp_uint64 file_size;
+	mtp_int64 mtime;	/* ns, folders only, 0 forces a rescan */
+	mtp_uint32 obj_handle;
+	mtp_uint32 h_parent;
+	mtp_uint32 name_off;	/* into the names, not NUL terminated */
+	mtp_uint16 name_len;
+	mtp_uint16 obj_fmt;
+	mtp_uint16 protcn_status;
+	mtp_uint16 association_type;
+	mtp_uint32 flags;
+} store_index_rec_t;
+
+mtp_bool _entity_load_store_index(mtp_store_t *store);
+void _entity_load_store_indexes(void);
+void _entity_save_store_indexes(void);
+mtp_bool _entity_start_store_index_saver(void);
+void _entity_stop_store_index_saver(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_STORE_INDEX_H_ */
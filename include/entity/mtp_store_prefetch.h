@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STORE_PREFETCH_H_
+#define _MTP_STORE_PREFETCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_store.h"
+
+/* Folders waiting to be read, the oldest ones are dropped first */
+#define MTP_PREFETCH_QUEUE_MAX		256
+
+mtp_bool _entity_start_prefetch(void);
+void _entity_stop_prefetch(void);
+void _entity_prefetch_subfolders(mtp_store_t *store, mtp_uint32 h_parent);
+void _entity_prefetch_store(mtp_uint32 store_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_STORE_PREFETCH_H_ */
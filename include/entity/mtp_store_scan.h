@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STORE_SCAN_H_
+#define _MTP_STORE_SCAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_store.h"
+
+#define MTP_MAX_ENUM_THREADS		16
+
+void _entity_scan_folder(mtp_store_t *store, mtp_obj_t *pobj);
+void _entity_scan_folder_unlocked(mtp_uint32 store_id, mtp_uint32 obj_handle);
+void _entity_scan_unread_folders(mtp_store_t *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_STORE_SCAN_H_ */
@@ -30,7 +30,11 @@ typedef struct {
 } obj_data_t;
 
 mtp_err_t _hutil_get_prop_desc(mtp_uint32 format, mtp_uint32 prop_code, void *data);
+mtp_err_t _hutil_get_prop_desc_blk(mtp_uint32 format, mtp_uint32 prop_code,
+		mtp_uchar **blk, mtp_uint32 *blk_len);
 mtp_err_t _hutil_get_storage_entry(mtp_uint32 store_id, store_info_t *info);
+mtp_err_t _hutil_get_storage_info_blk(mtp_uint32 store_id, mtp_uchar **blk,
+		mtp_uint32 *blk_len);
 mtp_err_t _hutil_get_storage_ids(ptp_array_t *store_ids);
 mtp_err_t _hutil_add_object_entry(obj_info_t *obj_info, mtp_char *file_name,
 		mtp_obj_t **new_obj);
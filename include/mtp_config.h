@@ -55,6 +55,9 @@
 
 #define MTP_STORAGE_DESC_EXT		"Card Storage"
 
+/* Repack the cached StorageInfo once free space drifts by more than this */
+#define MTP_STORE_INFO_FREE_SPACE_DELTA	(1024 * 1024)	/* 1MB */
+
 /* about 976kbytes for object property value like sample data*/
 #define MTP_MAX_PROP_DATASIZE          1000000
 
@@ -105,8 +108,28 @@
 #define MTP_SCHEDPOLICY			'o'
 #define MTP_FILE_SCHEDPARAM		0
 #define MTP_USB_SCHEDPARAM		0
+#define MTP_MAX_THREAD_OPT_LEN		64	/* cpu list or ioprio string */
+
+#define MTP_OBJ_INFO_CACHE_SIZE		1024	/* entries, 0 disables */
+#define MTP_USE_FANOTIFY		false
+#define MTP_INOTI_STORM_THRESHOLD	500	/* events/s per folder tree, 0 disables */
+#define MTP_STORE_INDEX_DIR		"/var/lib/cmtp-responder"	/* "" disables */
+#define MTP_STORE_INDEX_INTERVAL	300	/* s, 0 : only when stopping */
+#define MTP_ENUM_THREADS		4	/* 0 : read in the command thread */
+#define MTP_ENUM_DETERMINISTIC		false
+#define MTP_EXCLUDE			"lost+found:LOST.DIR"	/* "" excludes nothing */
+#define MTP_STORAGE_BACKEND		"posix"	/* or "memory" */
+#define MTP_MAX_STORAGE_BACKEND_LEN	16
+#define MTP_MEM_STORAGE_SIZE		1024	/* MiB */
+#define MTP_MEM_STORAGE_LATENCY		0	/* us per operation */
+#define MTP_MEM_STORAGE_BANDWIDTH	0	/* KiB/s, 0 : unlimited */
+#define MTP_STORAGES			MTP_EXTERNAL_PATH_CHAR	/* ':' separated */
+#define MTP_REMOVABLE_STORAGES		""	/* only while mounted */
+
+#define MTP_LOG_LEVEL			2	/* 0 : None, 1 : Error, 2 : Debug */
 
 #define MTP_CONFIG_FILE_PATH		"/etc/cmtp-responder.conf"
+#define MTP_MOUNTINFO_PATH		"/proc/self/mountinfo"
 
 typedef struct {
 	/* Speed related config */
@@ -133,13 +156,37 @@ typedef struct {
 	char schedpolicy;	/* f : FIFO, r : Round Robin, o : Other */
 	int file_schedparam;	/* File I/O thread's priority for scheduling */
 	int usb_schedparam;	/* USB I/O thread's priority for scheduling */
+	char usb_cpus[MTP_MAX_THREAD_OPT_LEN];	/* CPUs for the USB I/O threads, e.g. "4-7" */
+	char file_cpus[MTP_MAX_THREAD_OPT_LEN];	/* CPUs for the file I/O thread */
+	char bg_cpus[MTP_MAX_THREAD_OPT_LEN];	/* CPUs for the event loop and enumeration */
+	char usb_ioprio[MTP_MAX_THREAD_OPT_LEN];	/* rt:<0-7>, be:<0-7> or idle */
+	char file_ioprio[MTP_MAX_THREAD_OPT_LEN];
+	char bg_ioprio[MTP_MAX_THREAD_OPT_LEN];
 
 	/* Experimental (End) */
 	/* Speed related config (End) */
 
 	/* MTP Features */
+	int obj_info_cache_size;	/* Max. number of packed ObjectInfo datasets kept, 0 disables */
+	bool use_fanotify;	/* Track file system changes with fanotify if the kernel supports it */
+	int inoti_storm_threshold;	/* Events/s in one folder tree above which it is rescanned instead, 0 disables */
+	char store_index_dir[MTP_MAX_PATHNAME_SIZE + 1];	/* Where the object index of each store is saved, "" disables */
+	int store_index_interval;	/* Seconds between saves of a changed index, 0 : only when stopping */
+	int enum_threads;	/* Threads reading the folders of a whole store */
+	bool enum_deterministic;	/* Read folders in name order, so handles are the same on every run */
+	char exclude[MTP_MAX_PATHNAME_SIZE + 1];	/* Paths the host does not see, see mtp_exclude.h */
+	char storage_backend[MTP_MAX_STORAGE_BACKEND_LEN];	/* Where the stores live, see mtp_storage.h */
+	int mem_storage_size;	/* MiB the memory backend holds */
+	int mem_storage_latency;	/* us the memory backend takes per operation */
+	int mem_storage_bandwidth;	/* KiB/s the memory backend reads and writes at, 0 : unlimited */
+	char storages[MTP_MAX_PATHNAME_SIZE + 1];	/* Folders which are always stores */
+	char removable_storages[MTP_MAX_PATHNAME_SIZE + 1];	/* Mount points which are stores while mounted */
 	/* MTP Features (End) */
 
+	/* Debug */
+	int log_level;	/* 0 : None, 1 : Error, 2 : Debug */
+	/* Debug (End) */
+
 	/* Vendor Features */
 	/* Features (End) */
 
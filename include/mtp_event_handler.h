@@ -28,7 +28,9 @@ extern "C" {
 
 typedef enum {
 	USB_INSERTED,
-	USB_REMOVED
+	USB_REMOVED,
+	USB_CONNECTED,		/* Host enabled the function again */
+	USB_DISCONNECTED	/* Host disabled the function, store is kept */
 } usb_state_t;
 
 typedef struct {
@@ -45,6 +47,12 @@ typedef enum {
 	EVENT_USB_REMOVED,
 	EVENT_OBJECT_ADDED,
 	EVENT_OBJECT_REMOVED,
+	EVENT_OBJECT_INFO_CHANGED,
+	EVENT_STORAGE_INFO_CHANGED,
+	EVENT_STORE_ADDED,
+	EVENT_STORE_REMOVED,
+	EVENT_USB_CONNECTED,
+	EVENT_USB_DISCONNECTED,
 	EVENT_START_DATAIN,
 	EVENT_DONE_DATAIN,
 	EVENT_START_DATAOUT,
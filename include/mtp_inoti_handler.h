@@ -31,23 +31,69 @@ extern "C" {
 #include "mtp_datatype.h"
 
 #define INOTI_EVENT_SIZE	(sizeof(struct inotify_event))
-#define INOTI_BUF_LEN		(INOTI_EVENT_SIZE + NAME_MAX + 1)
-#define INOTI_FOLDER_COUNT_MAX	(1024)
+#define INOTI_BUF_LEN		(64 * 1024)	/* Many events per read() */
+#define INOTI_MAX_USER_WATCHES_PATH	"/proc/sys/fs/inotify/max_user_watches"
+#define INOTI_MAX_USER_WATCHES_DEFAULT	(8192)	/* Kernel default */
+#define INOTI_SELF_CHANGES_MAX		(4096)	/* Journal entries */
+#define INOTI_SELF_CHANGE_TTL		(30 * 1000000)	/* us */
+#define INOTI_MODIFY_DEBOUNCE		(200 * 1000)	/* us, quiet time */
+#define INOTI_MODIFY_MAX_DELAY		(1000 * 1000)	/* us, for busy writers */
+#define INOTI_STORM_WINDOW		(1000 * 1000)	/* us, rate period */
+#define INOTI_STORM_SETTLE		(1000 * 1000)	/* us, quiet time */
+#define INOTI_LOCK_RETRY		(10)	/* ms, while a command holds the store */
+#define INOTI_EVENT_MASK		(IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB)
+
+/* Changes made by MTP itself, whose events must not be processed again */
+typedef enum {
+	INOTI_SELF_CREATE_DIR = 0,
+	INOTI_SELF_DELETE,
+	INOTI_SELF_MOVE,
+	INOTI_SELF_COPY,
+	INOTI_SELF_MODIFY	/* Matches every event until it expires */
+} inoti_self_op_t;
 
 typedef struct {
 	mtp_int32 wd;
 	mtp_char *forlder_name;
 } inoti_watches_t;
 
+/*
+ * One file system event, whichever of inotify or fanotify reported it.
+ * mask holds IN_* bits.
+ */
+typedef struct {
+	mtp_uint32 mask;
+	mtp_bool is_paired;	/* IN_CREATE and IN_CLOSE_WRITE in one batch */
+	mtp_char *path;
+	mtp_char *parent;
+	mtp_char *name;		/* Points into path */
+} fs_event_t;
+
+/* Pending ObjectInfoChanged for one object */
+typedef struct {
+	mtp_int64 first;	/* First change, us */
+	mtp_int64 deadline;	/* Trailing edge, us */
+} modified_info_t;
+
+/* Event rate of one top level folder of a store */
+typedef struct {
+	mtp_int64 window_start;	/* us */
+	mtp_uint32 count;	/* Events since window_start */
+	mtp_bool is_storm;	/* Per object events are suspended */
+	mtp_int64 last;		/* Last event, us */
+} storm_info_t;
+
 typedef struct _open_files_info {
-	mtp_char *name;
-	mtp_int32 wd;
+	mtp_char *name;		/* Full path */
 	struct _open_files_info* previous;
 	struct _open_files_info* next;
 } open_files_info_t;
 
-void *_thread_inoti(void *arg);
+void _inoti_record_self_change(const mtp_char *path, inoti_self_op_t op);
+void _inoti_forget_self_change(const mtp_char *path, inoti_self_op_t op);
 void _inoti_add_watch_for_fs_events(mtp_char *path);
+void _inoti_remove_watch_for_fs_events(mtp_char *path);
 mtp_bool _inoti_init_filesystem_evnts();
 void _inoti_deinit_filesystem_events();
 #endif /* MTP_SUPPORT_OBJECTADDDELETE_EVENT */
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_MOUNT_HANDLER_H_
+#define _MTP_MOUNT_HANDLER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_datatype.h"
+
+#define MOUNT_LOCK_RETRY	(10)	/* ms, while the store is held */
+
+mtp_bool _mount_init_storage_events(void);
+void _mount_deinit_storage_events(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_MOUNT_HANDLER_H_ */
@@ -28,6 +28,8 @@ extern "C" {
 
 #define MAX_MTP_PARAMS			5
 #define MTP_USB_HEADER_LENGTH		12
+/* Data of 4 GB or more, which ends with a short packet */
+#define MTP_CONTAINER_LEN_UNKNOWN	0xFFFFFFFF
 
 typedef enum {
 	CONTAINER_UNDEFINED = 0x00,
@@ -90,6 +92,8 @@ void _hdlr_init_data_container(data_container_t *dst, mtp_uint16 code,
 mtp_uchar *_hdlr_alloc_buf_data_container(data_container_t *dst,
 		mtp_uint32 bufsz, mtp_uint64 pkt_size);
 mtp_bool _hdlr_send_data_container(data_container_t *dst);
+mtp_bool _hdlr_send_cached_data_container(mtp_uchar *blk, mtp_uint32 len,
+		mtp_uint32 tid);
 mtp_bool _hdlr_send_bulk_data(mtp_uchar *dst, mtp_uint32 len);
 mtp_bool _hdlr_rcv_data_container(data_container_t *dst, mtp_uint32 size);
 mtp_bool _hdlr_rcv_file_in_data_container(data_container_t *dst,
@@ -149,6 +149,7 @@
 #define	MTP_OPCODE_GETOBJECTPROPDESC		0x9802
 #define	MTP_OPCODE_GETOBJECTPROPVALUE		0x9803
 #define	MTP_OPCODE_SETOBJECTPROPVALUE		0x9804
+#define	MTP_OPCODE_GETOBJECTPROPLIST		0x9805
 #define MTP_OPCODE_GETINTERDEPPROPDESC		0x9807
 
 /* Operation for Windows Media 10 MTP extension */
@@ -168,6 +169,8 @@
 #define PTP_EVENTCODE_CANCELTRANSACTION		0x4001
 #define PTP_EVENTCODE_OBJECTADDED		0x4002
 #define PTP_EVENTCODE_OBJECTREMOVED		0x4003
+#define PTP_EVENTCODE_STOREADDED		0x4004
+#define PTP_EVENTCODE_STOREREMOVED		0x4005
 #define PTP_EVENTCODE_DEVICEPROPCHANGED		0x4006
 #define PTP_EVENTCODE_OBJECTINFOCHANGED		0x4007
 #define PTP_EVENTCODE_DEVICEINFOCHANGED		0x4008
@@ -380,17 +383,27 @@
 #define  PTP_FMT_ASSOCIATION		0x3001
 #define  PTP_FMT_SCRIPT			0x3002
 #define  PTP_FMT_EXEC			0x3003
+#define  PTP_FMT_TEXT			0x3004
 #define  PTP_FMT_HTML			0x3005
 #define  PTP_FMT_DPOF			0x3006
 #define  PTP_FMT_AIFF			0x3007
+#define  PTP_FMT_WAVE			0x3008
+#define  PTP_FMT_MP3			0x3009
+#define  PTP_FMT_AVI			0x300A
+#define  PTP_FMT_MPEG			0x300B
+#define  PTP_FMT_ASF			0x300C
 
 #define  PTP_FMT_IMG_UNDEF		0x3800
+#define  PTP_FMT_IMG_EXIF		0x3801
 #define  PTP_FMT_IMG_TIFFEP		0x3802
 #define  PTP_FMT_IMG_FLASHPIX		0x3803
+#define  PTP_FMT_IMG_BMP		0x3804
 #define  PTP_FMT_IMG_CIFF		0x3805
+#define  PTP_FMT_IMG_GIF		0x3807
 #define  PTP_FMT_IMG_JFIF		0x3808
 #define  PTP_FMT_IMG_PCD		0x3809
 #define  PTP_FMT_IMG_PICT		0x380A
+#define  PTP_FMT_IMG_PNG		0x380B
 #define  PTP_FMT_IMG_TIFF		0x380D
 #define  PTP_FMT_IMG_TIFFIT		0x380E
 #define  PTP_FMT_IMG_JP2		0x380F
@@ -400,7 +413,16 @@
 #define  MTP_FMT_UNDEFINED_FIRMWARE		0xB802
 #define  MTP_FMT_WINDOWS_IMG_FORMAT		0xB881
 #define  MTP_FMT_UNDEFINED_AUDIO		0xB900
+#define  MTP_FMT_WMA				0xB901
+#define  MTP_FMT_OGG				0xB902
+#define  MTP_FMT_AAC				0xB903
+#define  MTP_FMT_AUDIBLE			0xB904
+#define  MTP_FMT_FLAC				0xB906
 #define  MTP_FMT_UNDEFINED_VIDEO		0xB980
+#define  MTP_FMT_WMV				0xB981
+#define  MTP_FMT_MP4_CONTAINER			0xB982
+#define  MTP_FMT_MP2				0xB983
+#define  MTP_FMT_3GP_CONTAINER			0xB984
 #define  MTP_FMT_UNDEFINED_COLLECTION		0xBA00
 #define  MTP_FMT_ABSTRACT_MULTIMEDIA_ALBUM	0xBA01
 #define  MTP_FMT_ABSTRACT_IMG_ALBUM		0xBA02
@@ -408,8 +430,18 @@
 #define  MTP_FMT_ABSTRACT_CONTACT_GROUP		0xBA06
 #define  MTP_FMT_ABSTRACT_MESSAGE_FOLDER	0xBA07
 #define  MTP_FMT_ABSTRACT_CHAPTERED_PRODUCTION  0xBA08
+#define  MTP_FMT_WPL_PLAYLIST			0xBA10
+#define  MTP_FMT_M3U_PLAYLIST			0xBA11
+#define  MTP_FMT_MPL_PLAYLIST			0xBA12
+#define  MTP_FMT_ASX_PLAYLIST			0xBA13
+#define  MTP_FMT_PLS_PLAYLIST			0xBA14
 #define  MTP_FMT_UNDEFINED_DOC			0xBA80
 #define  MTP_FMT_ABSTRACT_DOC			0xBA81
+#define  MTP_FMT_XML_DOC			0xBA82
+#define  MTP_FMT_MS_WORD_DOC			0xBA83
+#define  MTP_FMT_MHT_HTML_DOC			0xBA84
+#define  MTP_FMT_MS_EXCEL_SPREADSHEET		0xBA85
+#define  MTP_FMT_MS_POWERPOINT_PRESENTATION	0xBA86
 #define  MTP_FMT_UNDEFINED_MESSAGE		0xBB00
 #define  MTP_FMT_ABSTRACT_MESSAGE		0xBB01
 #define  MTP_FMT_UNDEFINED_CONTACT		0xBB80
@@ -32,6 +32,7 @@ typedef struct {
 	mtp_state_t mtp_op_state;
 	mtp_bool cancel_intialization;
 	mtp_bool is_usb_discon;
+	mtp_bool is_cancelling;	/* Host cancel request not completed yet */
 } status_info_t;
 
 typedef void (*_cmd_handler_cb)(mtp_char *buf, mtp_int32 pkt_len);
@@ -48,8 +49,11 @@ mtp_uint32 _transport_send_pkt_to_tx_mq(const mtp_byte *buf, mtp_uint32 pkt_len)
 mtp_uint32 _transport_send_bulk_pkt_to_tx_mq(const mtp_byte *buf,
 		mtp_uint32 pkt_len);
 void _transport_send_zlp(void);
+void _transport_finish_cancel(void);
 mtp_bool _transport_init_interfaces(_cmd_handler_cb func);
 void _transport_usb_finalize(void);
+void _transport_usb_suspend(void);
+mtp_bool _transport_usb_resume(void);
 void _transport_init_status_info(void);
 
 #ifdef __cplusplus
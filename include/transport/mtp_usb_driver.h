@@ -36,11 +36,22 @@ typedef struct mtp_max_pkt_size {
 /* Maximum repeat count for USB error recovery */
 #define MTP_USB_ERROR_MAX_RETRY		5
 
+/* Events sent on the interrupt endpoint */
+#define MTP_USB_EVENT_QUEUE_LEN		32	/* Events waiting for the host */
+#define MTP_USB_EVENT_TIMEOUT		5000	/* ms, for the host to read one */
+#define MTP_USB_EVENT_WAIT_SLICE	100	/* ms, between cancellation checks */
+
+/* A cancelled write holds its AIO slot until it completes */
+#define MTP_USB_AIO_MAX_REQS		4
+
 mtp_bool _transport_init_usb_device(void);
 void _transport_deinit_usb_device(void);
 void *_transport_thread_usb_write(void *arg);
 void *_transport_thread_usb_read(void *arg);
-void *_transport_thread_usb_control(void *arg);
+mtp_bool _transport_watch_usb_control(void);
+void _transport_unwatch_usb_control(void);
+void *_transport_thread_usb_event(void *arg);
+mtp_bool _transport_queue_usb_event(const mtp_uchar *buf, mtp_uint32 len);
 mtp_int32 _transport_mq_init(msgq_id_t *rx_mqid, msgq_id_t *tx_mqid);
 mtp_bool _transport_mq_deinit(msgq_id_t *rx_mqid, msgq_id_t *tx_mqid);
 mtp_uint32 _transport_get_usb_packet_len(void);
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_EXCLUDE_H_
+#define _MTP_EXCLUDE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_datatype.h"
+
+#define MTP_EXCLUDE_SEPARATOR		":"
+/* Tokens of one glob rule, each is a state of its matcher */
+#define MTP_EXCLUDE_MAX_GLOB_LEN	63
+
+void _util_exclude_compile(const mtp_char *rules);
+void _util_exclude_free(void);
+mtp_bool _util_is_excluded(const mtp_char *rel_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_EXCLUDE_H_ */
@@ -24,10 +24,9 @@ extern "C" {
 #include <dirent.h>
 #include "mtp_datatype.h"
 #include "mtp_config.h"
+#include "mtp_log.h"
 
 #define MTP_FILE_ATTR_INVALID		0xFFFFFFFF
-#define MTP_LOG_FILE			"/var/log/mtp.log"
-#define MTP_LOG_MAX_SIZE		5 * 1024 * 1024 /*5MB*/
 
 typedef enum {
 	MTP_FILE_TYPE = 0,
@@ -56,6 +55,12 @@ typedef struct {
 	file_attr_t attrs;
 } dir_entry_t;
 
+#define MTP_DIR_SCAN_BUF_SIZE		32768	/* getdents64 batch */
+/* Also hidden entries and what is neither a file nor a folder */
+#define MTP_DIR_SCAN_ALL		0x1
+
+typedef struct dir_scan dir_scan_t;
+
 typedef enum {
 	MTP_FILE_READ = 0x1,
 	MTP_FILE_WRITE = 0x2,
@@ -81,16 +86,20 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 mtp_bool _util_file_move(const mtp_char *origpath, const mtp_char *newpath,
 		mtp_int32 *error);
 mtp_bool _util_get_file_attrs(const mtp_char *filename, file_attr_t *attrs);
+mtp_bool _util_file_get_size(FILE *fhandle, const mtp_char *filename,
+		mtp_uint64 *size);
 mtp_bool _util_set_file_attrs(const mtp_char *filename, mtp_dword attrs);
 mtp_bool _util_dir_create(const mtp_char *dirname, mtp_int32 *error);
+mtp_int32 _util_file_remove(const mtp_char *fullpath);
+mtp_int32 _util_dir_remove(const mtp_char *dirname);
+mtp_bool _util_file_exists(const mtp_char *fullpath);
 mtp_int32 _util_remove_dir_children_recursive(const mtp_char *dirname,
 		mtp_uint32 *num_of_deleted_file, mtp_uint32 *num_of_file, mtp_bool readonly);
-mtp_bool _util_ifind_next(char *dir_name, DIR *dirp, dir_entry_t *dir_info);
-mtp_bool _util_ifind_first(char *dir_name, DIR **dirp, dir_entry_t *dir_info);
+dir_scan_t *_util_dir_scan_open(const mtp_char *dir_name, mtp_uint32 flags);
+mtp_bool _util_dir_scan_next(dir_scan_t *scan, dir_entry_t *dir_info);
+void _util_dir_scan_close(dir_scan_t *scan);
 mtp_bool _util_is_file_opened(const mtp_char *fullpath);
 mtp_bool _util_get_filesystem_info(mtp_char *storepath, fs_info_t *fs_info);
-void _FLOGD(const char *file, const char *fmt, ...);
-#define FLOGD(arg...) _FLOGD(__FILE__, ##arg)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_LOG_H_
+#define _MTP_LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_datatype.h"
+
+#define MTP_LOG_FILE			"/var/log/mtp.log"
+#define MTP_LOG_MAX_SIZE		5 * 1024 * 1024 /*5MB*/
+
+#define MTP_LOG_RECORD_SIZE		512	/* Bytes, longer lines are truncated */
+#define MTP_LOG_RING_RECORDS		128	/* Per thread, must be a power of 2 */
+#define MTP_LOG_FLUSH_INTERVAL		20000	/* us, to gather records */
+
+typedef enum {
+	MTP_LOG_LEVEL_NONE = 0,
+	MTP_LOG_LEVEL_ERROR,
+	MTP_LOG_LEVEL_DEBUG
+} mtp_log_level_t;
+
+extern mtp_int32 g_log_level;
+
+/*
+ * The level is checked before any argument is evaluated, so filtered out
+ * messages cost a single comparison.
+ */
+#define MTP_LOG(level, format, args...) \
+	do { \
+		if ((level) <= g_log_level) \
+			_util_log_write((level), __FILE__, format, ##args); \
+	} while (0)
+
+#define FLOGD(format, args...) MTP_LOG(MTP_LOG_LEVEL_DEBUG, format, ##args)
+
+void _util_log_write(mtp_int32 level, const char *file, const char *fmt, ...);
+void _util_log_set_level(mtp_int32 level);
+mtp_bool _util_log_init(void);
+void _util_log_apply_thread_class(void);
+void _util_log_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_LOG_H_ */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _MTP_LOOP_H_
+#define _MTP_LOOP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mtp_datatype.h"
+#include "mtp_util.h"
+
+#define MTP_LOOP_MAX_EVENTS	16
+
+typedef void (*loop_fd_cb_t)(mtp_int32 fd, void *data);
+
+mtp_bool _util_loop_init(void);
+void _util_loop_deinit(void);
+void _util_loop_run(void);
+void _util_loop_quit(void);
+mtp_bool _util_loop_add_fd(mtp_int32 fd, loop_fd_cb_t cb, void *data);
+mtp_bool _util_loop_add_fd_events(mtp_int32 fd, mtp_uint32 events,
+		loop_fd_cb_t cb, void *data);
+mtp_bool _util_loop_enable_fd(mtp_int32 fd, mtp_bool enable);
+void _util_loop_remove_fd(mtp_int32 fd);
+mtp_int32 _util_loop_add_timer(loop_fd_cb_t cb, void *data);
+mtp_bool _util_loop_set_timer(mtp_int32 tfd, mtp_int32 timeout);
+void _util_loop_remove_timer(mtp_int32 tfd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_LOOP_H_ */
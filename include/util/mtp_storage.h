@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STORAGE_H_
+#define _MTP_STORAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "mtp_datatype.h"
+#include "mtp_fs.h"
+
+#define MTP_STORAGE_POSIX		"posix"
+#define MTP_STORAGE_MEMORY		"memory"
+
+/*
+ * Where the objects of the stores live. The _util_file_*, _util_dir_* and
+ * _util_dir_scan_* functions of mtp_fs.h go through the backend selected
+ * at start up, nothing else touches the files of a store.
+ *
+ * Like the system calls they stand for, the operations returning an
+ * mtp_int32 return 0 on success and -1 with errno set on failure. open
+ * returns a stdio stream, so file data is read and written the same way
+ * whatever the backend.
+ */
+typedef struct mtp_storage_ops {
+	const mtp_char *name;
+	mtp_bool has_fs_events;	/* inotify and fanotify see its changes */
+	mtp_bool is_persistent;	/* its objects outlive the process */
+
+	mtp_bool (*init)(void);
+	void (*deinit)(void);
+
+	FILE *(*open)(const mtp_char *path, file_mode_t mode);
+	mtp_int32 (*remove)(const mtp_char *path);
+	mtp_int32 (*rmdir)(const mtp_char *path);
+	mtp_int32 (*mkdir)(const mtp_char *path);
+	mtp_int32 (*rename)(const mtp_char *from, const mtp_char *to);
+	mtp_int32 (*chmod)(const mtp_char *path, mtp_uint32 mode);
+	mtp_int32 (*stat)(const mtp_char *path, file_attr_t *attrs);
+	mtp_int32 (*statfs)(const mtp_char *path, fs_info_t *fs_info);
+	mtp_bool (*is_opened)(const mtp_char *path);
+
+	dir_scan_t *(*scan_open)(const mtp_char *path, mtp_uint32 flags);
+	mtp_bool (*scan_next)(dir_scan_t *scan, dir_entry_t *dir_info);
+	void (*scan_close)(dir_scan_t *scan);
+} mtp_storage_ops_t;
+
+extern const mtp_storage_ops_t g_posix_storage_ops;
+extern const mtp_storage_ops_t g_mem_storage_ops;
+
+mtp_bool _util_storage_select(const mtp_char *name);
+void _util_storage_release(void);
+const mtp_storage_ops_t *_util_storage_get_ops(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MTP_STORAGE_H_ */
@@ -27,11 +27,6 @@ extern "C" {
 #include "mtp_datatype.h"
 #include "mtp_config.h"
 
-typedef struct {
-	mtp_char *extn;
-	mtp_uint16 fmt_code;
-} fmt_code_t;
-
 /*
  * Convert byte order for big endian architecture
  */
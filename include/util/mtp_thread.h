@@ -27,6 +27,14 @@ extern "C" {
 
 typedef void *(*thread_func_t) (void *pArg);
 
+/* Selects the configured scheduling, CPU affinity and I/O priority */
+typedef enum {
+	MTP_THREAD_CLASS_NONE = 0,	/* Keep the creator's settings */
+	MTP_THREAD_CLASS_USB,		/* USB endpoint I/O */
+	MTP_THREAD_CLASS_FILE,		/* Command processing and file I/O */
+	MTP_THREAD_CLASS_BG		/* Enumeration, indexing, logging */
+} mtp_thread_class_t;
+
 #define UTIL_LOCK_MUTEX(mut)\
 	do {\
 		int lock_ret = 0;\
@@ -56,7 +64,9 @@ typedef void *(*thread_func_t) (void *pArg);
 	} while (0);\
 
 mtp_bool _util_thread_create(pthread_t *tid, const mtp_char *tname,
-		mtp_int32 thread_state, thread_func_t thread_func, void *arg);
+		mtp_int32 thread_state, mtp_thread_class_t tclass,
+		thread_func_t thread_func, void *arg);
+void _util_thread_set_class(mtp_thread_class_t tclass);
 mtp_bool _util_thread_join(pthread_t tid, void **data);
 mtp_bool _util_thread_cancel(pthread_t tid);
 void _util_thread_exit(void *val_ptr);
@@ -31,10 +31,10 @@ extern "C" {
 #define DEVICE_VERSION "devv_DUMMY_VERSION"
 #define SERIAL "DUMMY_SERIAL"
 
-#define DBG(format, args...) FLOGD(format, ##args)
-#define ERR(format, args...) FLOGD(format, ##args)
-#define DBG_SECURE(format, args...) FLOGD(format, ##args)
-#define ERR_SECURE(format, args...) FLOGD(format, ##args)
+#define DBG(format, args...) MTP_LOG(MTP_LOG_LEVEL_DEBUG, format, ##args)
+#define ERR(format, args...) MTP_LOG(MTP_LOG_LEVEL_ERROR, format, ##args)
+#define DBG_SECURE(format, args...) MTP_LOG(MTP_LOG_LEVEL_DEBUG, format, ##args)
+#define ERR_SECURE(format, args...) MTP_LOG(MTP_LOG_LEVEL_ERROR, format, ##args)
 
 #define ret_if(expr) \
 	do { \
@@ -124,7 +124,6 @@ typedef struct {
 } usb_status_req_t;
 
 void _util_print_error();
-void _util_get_external_path(char *external_path);
 
 #ifdef __cplusplus
 }
@@ -15,6 +15,8 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <unistd.h>
 #include <glib.h>
 #include "mtp_support.h"
@@ -22,6 +24,9 @@
 #include "ptp_datacodes.h"
 #include "mtp_device.h"
 #include "mtp_transport.h"
+#include "mtp_inoti_handler.h"
+#include "mtp_store_prefetch.h"
+#include "mtp_storage.h"
 #include "ptp_container.h"
 
 #define MTP_DEVICE_VERSION_CHAR		"V1.0"
@@ -32,10 +37,29 @@
 static mtp_device_t _g_device = { 0 };
 mtp_device_t *g_device = &_g_device;
 
+extern mtp_config_t g_conf;
+
+/*
+ * The stores of the configuration: the folders of storages, always
+ * installed, then the mount points of removable_storages, installed while
+ * a file system is mounted on them. A store gets the ID of its place in
+ * the list, so its index and what the host knows of it outlive remounts
+ * and restarts.
+ */
+typedef struct {
+	mtp_char *path;
+	mtp_bool is_removable;
+} store_slot_t;
+
 /*
  * STATIC VARIABLES
  */
 static mtp_store_t g_store_list[MAX_NUM_DEVICE_STORES];
+static store_slot_t g_store_slots[MAX_NUM_DEVICE_STORES];
+static mtp_uint32 g_num_store_slots = 0;
+static mtp_bool g_has_removable_slots = FALSE;
+static mtp_uchar *g_device_info_blk = NULL;
+static mtp_uint32 g_device_info_blk_len = 0;
 
 static mtp_uint16 g_ops_supported[] = {
 	PTP_OPCODE_GETDEVICEINFO,
@@ -67,14 +91,54 @@ static mtp_uint16 g_ops_supported[] = {
 static mtp_uint16 g_event_supported[] = {
 	PTP_EVENTCODE_OBJECTADDED,
 	PTP_EVENTCODE_OBJECTREMOVED,
+	PTP_EVENTCODE_STOREADDED,
+	PTP_EVENTCODE_STOREREMOVED,
+	PTP_EVENTCODE_OBJECTINFOCHANGED,
+	PTP_EVENTCODE_STORAGEINFOCHANGED,
 };
 
 static mtp_uint16 g_capture_fmts[] = {
 	0
 };
 
+/* Every format _util_get_fmtcode() can give */
 static mtp_uint16 g_object_fmts[] = {
+	PTP_FMT_UNDEF,
 	PTP_FMT_ASSOCIATION,
+	PTP_FMT_TEXT,
+	PTP_FMT_HTML,
+	PTP_FMT_AIFF,
+	PTP_FMT_WAVE,
+	PTP_FMT_MP3,
+	PTP_FMT_AVI,
+	PTP_FMT_MPEG,
+	PTP_FMT_ASF,
+	PTP_FMT_IMG_EXIF,
+	PTP_FMT_IMG_BMP,
+	PTP_FMT_IMG_GIF,
+	PTP_FMT_IMG_PNG,
+	PTP_FMT_IMG_TIFF,
+	PTP_FMT_IMG_JP2,
+	PTP_FMT_IMG_JPX,
+	MTP_FMT_WMA,
+	MTP_FMT_OGG,
+	MTP_FMT_AAC,
+	MTP_FMT_AUDIBLE,
+	MTP_FMT_FLAC,
+	MTP_FMT_MP2,
+	MTP_FMT_WMV,
+	MTP_FMT_MP4_CONTAINER,
+	MTP_FMT_3GP_CONTAINER,
+	MTP_FMT_WPL_PLAYLIST,
+	MTP_FMT_M3U_PLAYLIST,
+	MTP_FMT_MPL_PLAYLIST,
+	MTP_FMT_ASX_PLAYLIST,
+	MTP_FMT_PLS_PLAYLIST,
+	MTP_FMT_XML_DOC,
+	MTP_FMT_MS_WORD_DOC,
+	MTP_FMT_MHT_HTML_DOC,
+	MTP_FMT_MS_EXCEL_SPREADSHEET,
+	MTP_FMT_MS_POWERPOINT_PRESENTATION,
 };
 
 /*
@@ -109,6 +173,8 @@ static mtp_err_t __clear_store_data(mtp_uint32 store_id)
 			g_device->store_list[count - 1].store_id = 0;
 			g_device->store_list[count - 1].root_path = NULL;
 			g_device->store_list[count - 1].is_hidden = FALSE;
+			g_device->store_list[count - 1].info_blk = NULL;
+			g_device->store_list[count - 1].info_blk_len = 0;
 			_util_init_list(&(g_device->store_list[count - 1].obj_list));
 
 			/*Initialize the destroyed store*/
@@ -124,6 +190,8 @@ void _init_mtp_device(void)
 	device_info_t *info = &(g_device->device_info);
 	mtp_wchar wtemp[MAX_PTP_STRING_CHARS + 1] = { 0 };
 
+	_device_invalidate_device_info_blk();
+
 	g_device->status = DEVICE_STATUSOK;
 	g_device->phase = DEVICE_PHASE_IDLE;
 	g_device->num_stores = 0;
@@ -315,6 +383,41 @@ mtp_uint32 _pack_device_info(mtp_uchar *buf, mtp_uint32 buf_sz)
 	return (mtp_uint32)(ptr - buf);
 }
 
+mtp_uchar *_device_get_device_info_blk(mtp_uint32 *blk_len)
+{
+	data_blk_t blk = { 0 };
+	mtp_uint32 num_bytes = 0;
+	mtp_uchar *ptr = NULL;
+
+	retv_if(NULL == blk_len, NULL);
+
+	if (g_device_info_blk == NULL) {
+		_hdlr_init_data_container(&blk, PTP_OPCODE_GETDEVICEINFO, 0);
+		num_bytes = _get_device_info_size();
+		ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
+		retvm_if(!ptr, NULL, "_hdlr_alloc_buf_data_container() Fail\n");
+
+		if (num_bytes != _pack_device_info(ptr, num_bytes)) {
+			ERR("_pack_device_info() Fail\n");
+			g_free(blk.data);
+			return NULL;
+		}
+
+		g_device_info_blk = blk.data;
+		g_device_info_blk_len = blk.len;
+	}
+
+	*blk_len = g_device_info_blk_len;
+	return g_device_info_blk;
+}
+
+void _device_invalidate_device_info_blk(void)
+{
+	g_free(g_device_info_blk);
+	g_device_info_blk = NULL;
+	g_device_info_blk_len = 0;
+}
+
 void _reset_mtp_device(void)
 {
 	g_status->ctrl_event_code = 0;
@@ -328,23 +431,131 @@ void _reset_mtp_device(void)
 }
 /* LCOV_EXCL_STOP */
 
+static void __add_store_slots(const mtp_char *list, mtp_bool is_removable)
+{
+	mtp_char *paths = NULL;
+	mtp_char *path = NULL;
+	mtp_char *saveptr = NULL;
+	mtp_uint32 len = 0;
+
+	paths = g_strdup(list);
+	for (path = strtok_r(paths, ":", &saveptr); path != NULL;
+			path = strtok_r(NULL, ":", &saveptr)) {
+		len = strlen(path);
+		while (len > 1 && path[len - 1] == '/')
+			path[--len] = '\0';
+
+		if (path[0] != '/') {
+			ERR_SECURE("Store [%s] is not absolute\n", path);
+			continue;
+		}
+		if (g_num_store_slots == MAX_NUM_DEVICE_STORES) {
+			ERR_SECURE("Store [%s] is over the max [%d]\n", path,
+					MAX_NUM_DEVICE_STORES);
+			break;
+		}
+
+		g_store_slots[g_num_store_slots].path = g_strdup(path);
+		g_store_slots[g_num_store_slots].is_removable = is_removable;
+		g_num_store_slots++;
+		g_has_removable_slots |= is_removable;
+	}
+	g_free(paths);
+}
+
+/* mountinfo escapes blanks, new lines and backslashes as \ooo */
+static void __unescape_mount_point(mtp_char *str)
+{
+	mtp_char *dst = str;
+
+	for (; *str != '\0'; str++, dst++) {
+		if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3' &&
+				str[2] >= '0' && str[2] <= '7' &&
+				str[3] >= '0' && str[3] <= '7') {
+			*dst = (str[1] - '0') << 6 | (str[2] - '0') << 3 |
+				(str[3] - '0');
+			str += 3;
+		} else {
+			*dst = *str;
+		}
+	}
+	*dst = '\0';
+}
+
+/* Returns the set of the current mount points, NULL on failure */
+static GHashTable *__read_mount_points(void)
+{
+	FILE *fp = NULL;
+	GHashTable *mounts = NULL;
+	mtp_char *line = NULL;
+	mtp_char *field = NULL;
+	mtp_char *saveptr = NULL;
+	size_t size = 0;
+	mtp_int32 i = 0;
+
+	fp = fopen(MTP_MOUNTINFO_PATH, "r");
+	retvm_if(fp == NULL, NULL, "Cannot open %s\n", MTP_MOUNTINFO_PATH);
+
+	mounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	while (getline(&line, &size, fp) > 0) {
+		/* id parent major:minor root mount_point options ... */
+		field = strtok_r(line, " ", &saveptr);
+		for (i = 0; i < 4 && field != NULL; i++)
+			field = strtok_r(NULL, " ", &saveptr);
+		if (field == NULL)
+			continue;
+
+		__unescape_mount_point(field);
+		g_hash_table_add(mounts, g_strdup(field));
+	}
+	free(line);
+	fclose(fp);
+
+	return mounts;
+}
+
+/* Like mkdir -p, through the storage backend */
+static mtp_bool __create_store_folder(const mtp_char *path)
+{
+	mtp_char folder[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	mtp_char *slash = NULL;
+	mtp_int32 error = 0;
+
+	g_strlcpy(folder, path, sizeof(folder));
+	slash = folder;
+	while (1) {
+		slash = strchr(slash + 1, '/');
+		if (slash != NULL)
+			*slash = '\0';
+		if (!_util_file_exists(folder) &&
+				!_util_dir_create(folder, &error) &&
+				error != EEXIST) {
+			ERR_SECURE("Cannot make directory [%s]\n", folder);
+			return FALSE;
+		}
+		if (slash == NULL)
+			return TRUE;
+		*slash = '/';
+	}
+}
+
 /*
- * static mtp_bool _device_add_store(void)
- * This function will add the store to the device.
+ * static mtp_bool __add_store_to_device(mtp_uint32 slot)
+ * This function will add the store of a configuration slot to the device.
+ * @param[in]	slot	Index of the store in the configuration
  * @return	TRUE if success, otherwise FALSE.
  */
-static mtp_bool __add_store_to_device(void)
+static mtp_bool __add_store_to_device(mtp_uint32 slot)
 {
-	mtp_char *storage_path = NULL;
-	mtp_uint32 store_id = 0;
+	store_slot_t *info = &g_store_slots[slot];
+	mtp_uint32 store_id = MTP_STORE_ID(slot);
 	file_attr_t attrs = { 0, };
-	char sto_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
 
-	_util_get_external_path(sto_path);
-	storage_path = (mtp_char *)sto_path;
-	store_id = MTP_EXTERNAL_STORE_ID;
+	/* A removable store is the file system mounted there */
+	if (!info->is_removable && !__create_store_folder(info->path))
+		return FALSE;
 
-	retvm_if(!_util_get_file_attrs(storage_path, &attrs), FALSE,
+	retvm_if(!_util_get_file_attrs(info->path, &attrs), FALSE,
 		"_util_get_file_attrs() Fail\n");
 
 	retvm_if(MTP_FILE_ATTR_INVALID == attrs.attribute ||
@@ -356,28 +567,27 @@ static mtp_bool __add_store_to_device(void)
 		"reached to max [%d]\n", MAX_NUM_DEVICE_STORES);
 
 	retvm_if(!_entity_init_mtp_store(&(g_device->store_list[g_device->num_stores]),
-		store_id, storage_path), FALSE,
+		store_id, info->path, info->is_removable), FALSE,
 		"_entity_init_mtp_store() Fail\n");
 
 	g_device->num_stores++;
-	g_device->is_mounted[0] = TRUE;
+	g_device->is_mounted[slot] = TRUE;
+	DBG_SECURE("Store [0x%x] is [%s]\n", store_id, info->path);
 
 	return TRUE;
 }
 
 /*
- * static mtp_bool _device_remove_store(void)
- * This function will remove the store from the device.
+ * static mtp_bool __remove_store_from_device(mtp_uint32 slot)
+ * This function will remove the store of a configuration slot.
+ * @param[in]	slot	Index of the store in the configuration
  * @return	TRUE if success, otherwise FALSE.
  */
 /* LCOV_EXCL_START */
-static mtp_bool __remove_store_from_device(void)
+static mtp_bool __remove_store_from_device(mtp_uint32 slot)
 {
-	mtp_store_t *store = NULL;
-
-	store = &(g_device->store_list[0]);
-	__clear_store_data(store->store_id);
-	g_device->is_mounted[0] = FALSE;
+	__clear_store_data(MTP_STORE_ID(slot));
+	g_device->is_mounted[slot] = FALSE;
 
 	return TRUE;
 }
@@ -386,24 +596,109 @@ static mtp_bool __remove_store_from_device(void)
 
 mtp_bool _device_install_storage(void)
 {
+	mtp_uint32 slot = 0;
+	GHashTable *mounts = NULL;
+
 	DBG("ADD Storage\n");
+	if (g_num_store_slots == 0) {
+		__add_store_slots(g_conf.storages, FALSE);
+		/* Nothing is mounted in the memory storage */
+		if (_util_storage_get_ops()->has_fs_events)
+			__add_store_slots(g_conf.removable_storages, TRUE);
+	}
+	if (g_has_removable_slots)
+		mounts = __read_mount_points();
+
 	/* LCOV_EXCL_START */
-	if (g_device->is_mounted[0] == FALSE)
-		__add_store_to_device();
+	for (slot = 0; slot < g_num_store_slots; slot++) {
+		if (g_device->is_mounted[slot])
+			continue;
+		if (g_store_slots[slot].is_removable && (mounts == NULL ||
+					!g_hash_table_contains(mounts,
+						g_store_slots[slot].path)))
+			continue;
+
+		__add_store_to_device(slot);
+	}
 	/* LCOV_EXCL_STOP */
 
+	if (mounts != NULL)
+		g_hash_table_destroy(mounts);
+
 	return TRUE;
 }
 
 /* LCOV_EXCL_START */
 mtp_bool _device_uninstall_storage(void)
 {
-	if (TRUE == g_device->is_mounted[0])
-		__remove_store_from_device();
+	mtp_uint32 slot = 0;
+
+	for (slot = 0; slot < g_num_store_slots; slot++) {
+		if (TRUE == g_device->is_mounted[slot])
+			__remove_store_from_device(slot);
+	}
 
 	return TRUE;
 }
 
+/*
+ * Adds the removable stores mounted and removes the ones unmounted since
+ * the last call. Only the store list changes here: a store coming back is
+ * filled from its index later by the prefetch thread. A store going away
+ * keeps the index last saved while it was mounted: its files can no
+ * longer be stat'ed to save it again. The other stores are left alone.
+ */
+void _device_update_removable_storage(ptp_array_t *added,
+		ptp_array_t *removed)
+{
+	mtp_uint32 slot = 0;
+	mtp_bool is_mounted = FALSE;
+	mtp_store_t *store = NULL;
+	GHashTable *mounts = NULL;
+
+	ret_if(!g_has_removable_slots);
+
+	mounts = __read_mount_points();
+	ret_if(mounts == NULL);
+
+	for (slot = 0; slot < g_num_store_slots; slot++) {
+		if (!g_store_slots[slot].is_removable)
+			continue;
+
+		is_mounted = g_hash_table_contains(mounts,
+				g_store_slots[slot].path);
+		if (is_mounted == g_device->is_mounted[slot])
+			continue;
+
+		if (is_mounted) {
+			if (!__add_store_to_device(slot))
+				continue;
+
+			store = _device_get_store(MTP_STORE_ID(slot));
+			_entity_prefetch_store(store->store_id);
+			_prop_append_ele_ptparray(added, store->store_id);
+		} else {
+			store = _device_get_store(MTP_STORE_ID(slot));
+#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
+			_inoti_remove_watch_for_fs_events(store->root_path);
+#endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
+			_prop_append_ele_ptparray(removed, store->store_id);
+			__remove_store_from_device(slot);
+		}
+	}
+
+	g_hash_table_destroy(mounts);
+}
+
+mtp_bool _device_has_removable_storage(void)
+{
+	return g_has_removable_slots;
+}
+
+mtp_uint32 _device_get_num_storage_slots(void)
+{
+	return g_num_store_slots;
+}
 /* LCOV_EXCL_STOP */
 
 mtp_store_t *_device_get_store(mtp_uint32 store_id)
@@ -425,7 +720,8 @@ mtp_uint32 _device_get_store_ids(ptp_array_t *store_ids)
 	mtp_store_t *store = NULL;
 	mtp_int32 ii = 0;
 
-	for (ii = g_device->num_stores - 1; ii >= 0; ii--) {
+	/* In the order of the configuration, removable ones once mounted */
+	for (ii = 0; ii < g_device->num_stores; ii++) {
 
 		store = &(g_device->store_list[ii]);
 		if ((store != NULL) && (FALSE == store->is_hidden))
@@ -19,14 +19,45 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <glib.h>
 #include "mtp_fs.h"
 #include "mtp_support.h"
 #include "mtp_util.h"
 #include "mtp_device.h"
+#include "ptp_container.h"
 
 extern mtp_bool g_is_full_enum;
 extern mtp_uint32 g_next_obj_handle;
+extern mtp_config_t g_conf;
+
+/*
+ * Packed GetObjectInfo data containers keyed by object handle. The most
+ * recently used entry sits at the head of the queue and the tail is
+ * evicted once more than g_conf.obj_info_cache_size entries are kept.
+ */
+typedef struct {
+	GList link;
+	mtp_uint32 obj_handle;
+	mtp_uint32 blk_len;
+	mtp_uchar *blk;
+} obj_info_blk_t;
+
+static GHashTable *g_obj_info_blks = NULL;
+static GQueue g_obj_info_lru;
+static pthread_mutex_t g_obj_info_blk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped whenever an object is added, changed or removed */
+static mtp_uint32 g_obj_changes = 0;
+
+static void __free_obj_info_blk(gpointer data)
+{
+	obj_info_blk_t *entry = (obj_info_blk_t *)data;
+
+	g_queue_unlink(&g_obj_info_lru, &(entry->link));
+	g_free(entry->blk);
+	g_free(entry);
+}
 
 
 /* LCOV_EXCL_START */
@@ -123,15 +154,13 @@ mtp_uint32 _entity_get_object_info_size(mtp_obj_t *obj, ptp_string_t *file_name)
 void _entity_init_object_info_params(obj_info_t *info, mtp_uint32 store_id,
 		mtp_uint32 parent_handle, mtp_char *file_name, dir_entry_t *dir)
 {
-	mtp_char extn[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	mtp_char *extn = NULL;
 
 	_entity_init_object_info(info);
 
 	info->store_id = store_id;
 	info->h_parent = parent_handle;
 
-	_util_get_file_extn(file_name, extn);
-
 	retm_if(dir->attrs.attribute == MTP_FILE_ATTR_INVALID, "File attribute invalid\n");
 
 #ifndef MTP_SUPPORT_SET_PROTECTION
@@ -150,7 +179,8 @@ void _entity_init_object_info_params(obj_info_t *info, mtp_uint32 store_id,
 	}
 
 	info->file_size = dir->attrs.fsize;
-	info->obj_fmt = _util_get_fmtcode(extn);
+	extn = strrchr(file_name, '.');
+	info->obj_fmt = extn ? _util_get_fmtcode(extn + 1) : PTP_FMT_UNDEF;
 }
 
 mtp_uint32 _entity_parse_raw_obj_info(mtp_uchar *buf, mtp_uint32 buf_sz,
@@ -159,14 +189,19 @@ mtp_uint32 _entity_parse_raw_obj_info(mtp_uchar *buf, mtp_uint32 buf_sz,
 	mtp_uchar *temp = buf;
 	ptp_string_t str = {0};
 	mtp_uint32 bytes_parsed = 0;
+	mtp_uint32 size = 0;
 
 	retv_if(buf == NULL, 0);
 	retvm_if(buf_sz < FIXED_LENGTH_MEMBERS_SIZE, 0, "buf_sz[%d] is less\n", buf_sz);
 
 	/* LCOV_EXCL_START */
-	/* Copy Obj Props from store_id till file_size */
-	memcpy(&(info->store_id), temp, (sizeof(mtp_uint16) * 2 + sizeof(mtp_uint32) * 2));
-	temp += (sizeof(mtp_uint16) * 2 + sizeof(mtp_uint32) * 2);
+	/* Copy Obj Props from store_id till protcn_status */
+	memcpy(&(info->store_id), temp, (sizeof(mtp_uint16) * 2 + sizeof(mtp_uint32)));
+	temp += (sizeof(mtp_uint16) * 2 + sizeof(mtp_uint32));
+
+	/* 0xFFFFFFFF for 4 GB or more, the size comes with ObjectSize */
+	memcpy(&size, temp, sizeof(mtp_uint32));
+	temp += sizeof(mtp_uint32);
 
 	/* Skip ObjProp:thumb format .No need to store ,the prop has
 	 * a default value.
@@ -199,13 +234,14 @@ mtp_uint32 _entity_parse_raw_obj_info(mtp_uchar *buf, mtp_uint32 buf_sz,
 	_util_conv_byte_order(&(info->obj_fmt), sizeof(info->obj_fmt));
 	_util_conv_byte_order(&(info->protcn_status),
 			sizeof(info->protcn_status));
-	_util_conv_byte_order(&(info->file_size), sizeof(info->file_size));
+	_util_conv_byte_order(&size, sizeof(size));
 	_util_conv_byte_order(&(info->thumb_file_size),
 			sizeof(info->thumb_file_size));
 	_util_conv_byte_order(&(info->h_parent), sizeof(info->h_parent));
 	_util_conv_byte_order(&(info->association_type),
 			sizeof(info->association_type));
 #endif /*__BIG_ENDIAN__*/
+	info->file_size = size;
 
 	ptp_string_t fname = { 0 };
 	bytes_parsed = _prop_parse_rawstring(&fname, temp, buf_sz);
@@ -389,6 +425,138 @@ mtp_uint32 _entity_pack_obj_info(mtp_obj_t *obj, ptp_string_t *file_name,
 }
 /* LCOV_EXCL_STOP */
 
+/*
+ * Packs the GetObjectInfo data container of obj, header included.
+ * The returned block must be freed by the caller.
+ */
+mtp_uchar *_entity_pack_obj_info_blk(mtp_obj_t *obj, mtp_uint32 *blk_len)
+{
+	data_blk_t blk = { 0 };
+	mtp_uint32 num_bytes = 0;
+	mtp_uchar *ptr = NULL;
+	mtp_char f_name[MTP_MAX_FILENAME_SIZE + 1] = { 0 };
+	mtp_wchar wf_name[MTP_MAX_FILENAME_SIZE + 1] = { 0 };
+	ptp_string_t ptp_string = { 0 };
+
+	retv_if(obj == NULL, NULL);
+	retv_if(blk_len == NULL, NULL);
+
+	_util_get_file_name(obj->file_path, f_name);
+	_util_utf8_to_utf16(wf_name, sizeof(wf_name) / WCHAR_SIZ, f_name);
+	_prop_copy_char_to_ptpstring(&ptp_string, wf_name, WCHAR_TYPE);
+
+	_hdlr_init_data_container(&blk, PTP_OPCODE_GETOBJECTINFO, 0);
+	num_bytes = _entity_get_object_info_size(obj, &ptp_string);
+	retv_if(num_bytes == 0, NULL);
+
+	ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
+	retvm_if(!ptr, NULL, "_hdlr_alloc_buf_data_container() Fail\n");
+
+	if (num_bytes != _entity_pack_obj_info(obj, &ptp_string, ptr,
+				num_bytes)) {
+		ERR("_entity_pack_obj_info() Fail\n");
+		g_free(blk.data);
+		return NULL;
+	}
+
+	*blk_len = blk.len;
+	return blk.data;
+}
+
+/*
+ * Returns the cached GetObjectInfo data container of obj, packing it on a
+ * miss. The block is owned by the cache and stays valid until the object
+ * is changed or freed. Returns NULL when the cache is disabled.
+ */
+mtp_uchar *_entity_get_obj_info_blk(mtp_obj_t *obj, mtp_uint32 *blk_len)
+{
+	obj_info_blk_t *entry = NULL;
+	obj_info_blk_t *tail = NULL;
+	mtp_uchar *blk = NULL;
+	mtp_uint32 len = 0;
+
+	retv_if(obj == NULL, NULL);
+	retv_if(blk_len == NULL, NULL);
+
+	if (g_conf.obj_info_cache_size <= 0)
+		return NULL;
+
+	pthread_mutex_lock(&g_obj_info_blk_mutex);
+	if (g_obj_info_blks == NULL) {
+		g_queue_init(&g_obj_info_lru);
+		g_obj_info_blks = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, __free_obj_info_blk);
+	}
+
+	entry = g_hash_table_lookup(g_obj_info_blks,
+			GUINT_TO_POINTER(obj->obj_handle));
+	if (entry != NULL) {
+		g_queue_unlink(&g_obj_info_lru, &(entry->link));
+		g_queue_push_head_link(&g_obj_info_lru, &(entry->link));
+		*blk_len = entry->blk_len;
+		blk = entry->blk;
+		pthread_mutex_unlock(&g_obj_info_blk_mutex);
+		return blk;
+	}
+	pthread_mutex_unlock(&g_obj_info_blk_mutex);
+
+	blk = _entity_pack_obj_info_blk(obj, &len);
+	retv_if(blk == NULL, NULL);
+
+	entry = (obj_info_blk_t *)g_malloc0(sizeof(obj_info_blk_t));
+	if (entry == NULL) {
+		ERR("g_malloc0() Fail\n");
+		g_free(blk);
+		return NULL;
+	}
+	entry->link.data = entry;
+	entry->obj_handle = obj->obj_handle;
+	entry->blk_len = len;
+	entry->blk = blk;
+
+	pthread_mutex_lock(&g_obj_info_blk_mutex);
+	g_hash_table_replace(g_obj_info_blks, GUINT_TO_POINTER(entry->obj_handle),
+			entry);
+	g_queue_push_head_link(&g_obj_info_lru, &(entry->link));
+
+	while (g_hash_table_size(g_obj_info_blks) >
+			(guint)g_conf.obj_info_cache_size) {
+		tail = (obj_info_blk_t *)g_queue_peek_tail_link(&g_obj_info_lru)->data;
+		g_hash_table_remove(g_obj_info_blks,
+				GUINT_TO_POINTER(tail->obj_handle));
+	}
+	pthread_mutex_unlock(&g_obj_info_blk_mutex);
+
+	*blk_len = len;
+	return blk;
+}
+
+void _entity_invalidate_obj_info_blk(mtp_uint32 obj_handle)
+{
+	/* Every change to an object drops its packed ObjectInfo */
+	__atomic_add_fetch(&g_obj_changes, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&g_obj_info_blk_mutex);
+	if (g_obj_info_blks != NULL) {
+		g_hash_table_remove(g_obj_info_blks,
+				GUINT_TO_POINTER(obj_handle));
+	}
+	pthread_mutex_unlock(&g_obj_info_blk_mutex);
+}
+
+mtp_uint32 _entity_get_obj_change_count(void)
+{
+	return __atomic_load_n(&g_obj_changes, __ATOMIC_RELAXED);
+}
+
+void _entity_clear_obj_info_blks(void)
+{
+	pthread_mutex_lock(&g_obj_info_blk_mutex);
+	if (g_obj_info_blks != NULL)
+		g_hash_table_remove_all(g_obj_info_blks);
+	pthread_mutex_unlock(&g_obj_info_blk_mutex);
+}
+
 mtp_bool _entity_init_mtp_object_params(
 		mtp_obj_t *obj,
 		mtp_uint32 store_id,
@@ -402,6 +570,7 @@ mtp_bool _entity_init_mtp_object_params(
 	obj->obj_handle = 0;
 	obj->obj_info = NULL;
 	obj->file_path = NULL;
+	obj->is_unread = FALSE;
 	obj->obj_handle = g_next_obj_handle++;
 	_entity_set_object_file_path(obj, file_path, CHAR_TYPE);
 	obj->obj_info = _entity_alloc_object_info();
@@ -425,6 +594,9 @@ mtp_bool _entity_set_object_file_path(mtp_obj_t *obj, void *file_path,
 {
 	mtp_char temp[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
 
+	/* The ObjectInfo filename is derived from the path */
+	_entity_invalidate_obj_info_blk(obj->obj_handle);
+
 	if (char_type == WCHAR_TYPE) {
 		_util_utf16_to_utf8(temp, sizeof(temp), (mtp_wchar *)file_path);
 		g_free(obj->file_path);
@@ -671,21 +843,18 @@ mtp_bool _entity_remove_reference_child_array(mtp_obj_t *obj, mtp_uint32 handle)
 	return _prop_rem_elem_ptparray(&(obj->child_array), handle);
 }
 
-void _entity_dealloc_mtp_obj(mtp_obj_t *obj)
+/*
+ * Drops the property values of obj, they are built again from the file
+ * the next time they are needed.
+ */
+void _entity_invalidate_obj_propvals(mtp_obj_t *obj)
 {
-	mtp_uint16 ii = 0;
+	mtp_uint32 ii = 0;
 	slist_node_t *node = NULL;
 	slist_node_t *next_node = NULL;
 
 	ret_if(NULL == obj);
 
-	if (obj->obj_info) {
-		_entity_dealloc_obj_info(obj->obj_info);
-		obj->obj_info = NULL;
-	}
-
-	_entity_remove_reference_child_array(obj, PTP_OBJECTHANDLE_ALL);
-
 	for (ii = 0, next_node = obj->propval_list.start;
 			ii < obj->propval_list.nnodes; ii++) {
 		node = next_node;
@@ -693,6 +862,22 @@ void _entity_dealloc_mtp_obj(mtp_obj_t *obj)
 		_prop_destroy_obj_propval((obj_prop_val_t *)node->value);
 		g_free(node);
 	}
+	_util_init_list(&(obj->propval_list));
+}
+
+void _entity_dealloc_mtp_obj(mtp_obj_t *obj)
+{
+	ret_if(NULL == obj);
+
+	_entity_invalidate_obj_info_blk(obj->obj_handle);
+
+	if (obj->obj_info) {
+		_entity_dealloc_obj_info(obj->obj_info);
+		obj->obj_info = NULL;
+	}
+
+	_entity_remove_reference_child_array(obj, PTP_OBJECTHANDLE_ALL);
+	_entity_invalidate_obj_propvals(obj);
 
 	g_free(obj->file_path);
 	g_free(obj);
@@ -19,6 +19,7 @@
 #include "mtp_property.h"
 #include "mtp_support.h"
 #include "mtp_transport.h"
+#include "ptp_container.h"
 
 /*
  * EXTERN AND GLOBAL VARIABLES
@@ -28,6 +29,9 @@ obj_interdep_proplist_t interdep_proplist;
  * STATIC VARIABLES
  */
 static obj_prop_desc_t props_list_default[NUM_OBJECT_PROP_DESC_DEFAULT];
+/* GetObjectPropDesc data containers, packed on first use */
+static mtp_uchar *props_desc_blk[NUM_OBJECT_PROP_DESC_DEFAULT];
+static mtp_uint32 props_desc_blk_len[NUM_OBJECT_PROP_DESC_DEFAULT];
 
 /*
  * FUNCTIONS
@@ -1487,6 +1491,46 @@ obj_prop_desc_t *_prop_get_obj_prop_desc(mtp_uint32 format_code,
 	return NULL;
 }
 
+/*
+ * Returns the ObjectPropDesc data container for propcode, header included.
+ * Property descriptions never change once built, so each one is packed
+ * only once.
+ */
+mtp_uchar *_prop_get_obj_prop_desc_blk(mtp_uint32 format_code,
+		mtp_uint32 propcode, mtp_uint32 *blk_len)
+{
+	mtp_uint32 idx = 0;
+	data_blk_t blk = { 0 };
+	mtp_uint32 num_bytes = 0;
+	mtp_uchar *ptr = NULL;
+	obj_prop_desc_t *prop = NULL;
+
+	retv_if(blk_len == NULL, NULL);
+
+	prop = _prop_get_obj_prop_desc(format_code, propcode);
+	retv_if(prop == NULL, NULL);
+
+	idx = (mtp_uint32)(prop - props_list_default);
+	if (props_desc_blk[idx] == NULL) {
+		_hdlr_init_data_container(&blk, MTP_OPCODE_GETOBJECTPROPDESC, 0);
+		num_bytes = _prop_size_obj_prop_desc(prop);
+		ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
+		retvm_if(!ptr, NULL, "_hdlr_alloc_buf_data_container() Fail\n");
+
+		if (num_bytes != _prop_pack_obj_prop_desc(prop, ptr, num_bytes)) {
+			ERR("_prop_pack_obj_prop_desc() Fail\n");
+			g_free(blk.data);
+			return NULL;
+		}
+
+		props_desc_blk[idx] = blk.data;
+		props_desc_blk_len[idx] = blk.len;
+	}
+
+	*blk_len = props_desc_blk_len[idx];
+	return props_desc_blk[idx];
+}
+
 /* Objectproplist functions */
 static mtp_bool __append_obj_proplist(obj_proplist_t *prop_list, mtp_uint32 obj_handle,
 		mtp_uint16 propcode, mtp_uint32 data_type, mtp_uchar *val)
@@ -17,6 +17,7 @@
 
 #include <glib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include "mtp_util.h"
@@ -24,11 +25,23 @@
 #include "mtp_device.h"
 #include "mtp_transport.h"
 #include "mtp_inoti_handler.h"
+#include "mtp_store_scan.h"
+#include "mtp_exclude.h"
+#include "ptp_container.h"
 
 
-extern mtp_char g_last_deleted[MTP_MAX_PATHNAME_SIZE + 1];
 mtp_uint32 g_next_obj_handle = 1;
 
+/*
+ * Guards the stores, their objects and the inotify watch tables.
+ * Commands that only look at objects take it shared, anything that adds,
+ * removes or renames objects takes it exclusive, including reading a
+ * folder for the first time. Lazy caches in an object (e.g. the property
+ * list) are still filled under the shared lock; that is fine because only
+ * the command thread uses them.
+ */
+static pthread_rwlock_t g_store_rwlock;
+
 
 static inline mtp_bool UTIL_CHECK_LIST_NEXT(slist_iterator *iter)
 {
@@ -145,18 +158,87 @@ mtp_uint32 _entity_pack_store_info(store_info_t *info, mtp_uchar *buf,
 	return num_bytes;
 }
 
+/*
+ * Returns the StorageInfo data container of the store, header included.
+ * Capacity and free space are refreshed on every call, but the dataset is
+ * only repacked once free space moved by more than
+ * MTP_STORE_INFO_FREE_SPACE_DELTA since the cached copy was built.
+ */
+mtp_uchar *_entity_get_store_info_blk(mtp_store_t *store, mtp_uint32 *blk_len)
+{
+	data_blk_t blk = { 0 };
+	mtp_uint32 num_bytes = 0;
+	mtp_uint64 delta = 0;
+	mtp_uchar *ptr = NULL;
+
+	retv_if(store == NULL, NULL);
+	retv_if(blk_len == NULL, NULL);
+
+	_entity_update_store_info_run_time(&(store->store_info),
+			store->root_path);
+
+	if (store->info_blk != NULL) {
+		delta = (store->store_info.free_space > store->info_blk_free_space) ?
+			store->store_info.free_space - store->info_blk_free_space :
+			store->info_blk_free_space - store->store_info.free_space;
+		if (delta > MTP_STORE_INFO_FREE_SPACE_DELTA)
+			_entity_invalidate_store_info_blk(store);
+	}
+
+	if (store->info_blk == NULL) {
+		_hdlr_init_data_container(&blk, PTP_OPCODE_GETSTORAGEINFO, 0);
+		num_bytes = _entity_get_store_info_size(&(store->store_info));
+		ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
+		retvm_if(!ptr, NULL, "_hdlr_alloc_buf_data_container() Fail\n");
+
+		if (num_bytes != _entity_pack_store_info(&(store->store_info),
+					ptr, num_bytes)) {
+			ERR("_entity_pack_store_info() Fail\n");
+			g_free(blk.data);
+			return NULL;
+		}
+
+		store->info_blk = blk.data;
+		store->info_blk_len = blk.len;
+		store->info_blk_free_space = store->store_info.free_space;
+	}
+
+	*blk_len = store->info_blk_len;
+	return store->info_blk;
+}
+
+void _entity_invalidate_store_info_blk(mtp_store_t *store)
+{
+	ret_if(store == NULL);
+
+	g_free(store->info_blk);
+	store->info_blk = NULL;
+	store->info_blk_len = 0;
+	store->info_blk_free_space = 0;
+}
+
 mtp_uint32 _entity_get_store_id_by_path(const mtp_char *path_name)
 {
 	mtp_uint32 store_id = 0;
-	char ext_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	mtp_uint32 len = 0;
+	mtp_uint32 best_len = 0;
+	mtp_uint32 ii = 0;
+	mtp_store_t *store = NULL;
 
 	retv_if(NULL == path_name, FALSE);
 
-	_util_get_external_path(ext_path);
+	/* The store with the longest root the path is in */
+	for (ii = 0; ii < g_device->num_stores; ii++) {
+		store = &(g_device->store_list[ii]);
+		len = strlen(store->root_path);
+		if (len <= best_len ||
+				strncmp(path_name, store->root_path, len))
+			continue;
+		if (path_name[len] != '\0' && path_name[len] != '/')
+			continue;
 
-	if (!strncmp(path_name, ext_path,
-				strlen(ext_path))) {
-		store_id = MTP_EXTERNAL_STORE_ID;
+		store_id = store->store_id;
+		best_len = len;
 	}
 
 	DBG_SECURE("Path : %s, store_id : 0x%x\n", path_name, store_id);
@@ -166,8 +248,9 @@ mtp_uint32 _entity_get_store_id_by_path(const mtp_char *path_name)
 /* LCOV_EXCL_STOP */
 
 mtp_bool _entity_init_mtp_store(mtp_store_t *store, mtp_uint32 store_id,
-		mtp_char *store_path)
+		mtp_char *store_path, mtp_bool is_removable)
 {
+	mtp_char *name = NULL;
 	mtp_char temp[MTP_SERIAL_LEN_MAX + 1] = { 0 };
 	mtp_wchar wtemp[MTP_MAX_REG_STRING + 1] = { 0 };
 	mtp_char serial[MTP_MAX_REG_STRING + 1] = { 0 };
@@ -177,6 +260,7 @@ mtp_bool _entity_init_mtp_store(mtp_store_t *store, mtp_uint32 store_id,
 
 	store->store_id = store_id;
 	store->root_path = g_strdup(store_path);
+	_entity_invalidate_store_info_blk(store);
 
 	__init_store_info(&(store->store_info));
 	_entity_update_store_info_run_time(&(store->store_info),
@@ -187,25 +271,28 @@ mtp_bool _entity_init_mtp_store(mtp_store_t *store, mtp_uint32 store_id,
 	g_snprintf(serial, sizeof(serial), "%s-%x", temp, store_id);
 	_util_utf8_to_utf16(wserial, sizeof(wserial) / WCHAR_SIZ, serial);
 
-	switch (store_id) {
-	case MTP_EXTERNAL_STORE_ID:
 	/* LCOV_EXCL_START */
-		store->is_hidden = FALSE;
+	/* The other stores are named after their folder */
+	if (store_id == MTP_EXTERNAL_STORE_ID) {
 		_util_utf8_to_utf16(wtemp, sizeof(wtemp) / WCHAR_SIZ,
 				MTP_STORAGE_DESC_EXT);
-		__init_store_info_params(&(store->store_info),
-				store->store_info.capacity,
-				PTP_STORAGETYPE_FIXEDRAM,
-				PTP_FILESYSTEMTYPE_HIERARCHICAL,
-				PTP_STORAGEACCESS_RWD, wtemp, wserial);
-		break;
-
-	default:
-		ERR("store initialization Fail\n");
-		return FALSE;
+	} else {
+		name = g_path_get_basename(store_path);
+		_util_utf8_to_utf16(wtemp, sizeof(wtemp) / WCHAR_SIZ, name);
+		g_free(name);
 	}
+
+	store->is_hidden = FALSE;
+	__init_store_info_params(&(store->store_info),
+			store->store_info.capacity,
+			is_removable ? PTP_STORAGETYPE_REMOVABLERAM :
+			PTP_STORAGETYPE_FIXEDRAM,
+			PTP_FILESYSTEMTYPE_HIERARCHICAL,
+			PTP_STORAGEACCESS_RWD, wtemp, wserial);
 	/* LCOV_EXCL_STOP */
 	_util_init_list(&(store->obj_list));
+	_util_init_list(&(store->dirty_list));
+	store->is_enumerated = FALSE;
 
 	return TRUE;
 }
@@ -395,10 +482,13 @@ mtp_uint32 _entity_get_objects_from_store_till_depth(mtp_store_t *store,
 		mtp_uint32 obj_handle, mtp_uint32 fmt_code, mtp_uint32 depth,
 		ptp_array_t *obj_arr)
 {
+	mtp_obj_t *obj = NULL;
+
 	retv_if(store == NULL, 0);
 	retv_if(obj_arr == NULL, 0);
 
 	if (PTP_OBJECTHANDLE_ALL == obj_handle) {
+		_entity_store_read_all_folders(store);
 		_entity_get_objects_from_store(store, obj_handle, fmt_code,
 				obj_arr);
 		DBG("Number of object filled [%u]\n", obj_arr->num_ele);
@@ -424,6 +514,15 @@ mtp_uint32 _entity_get_objects_from_store_till_depth(mtp_store_t *store,
 
 		depth--;
 
+		/* The host may ask deeper than it has listed */
+		if (PTP_OBJECTHANDLE_ROOT == obj_handle) {
+			_entity_store_read_folder(store, NULL);
+		} else {
+			obj = _entity_get_object_from_store(store, obj_handle);
+			if (obj != NULL)
+				_entity_store_read_folder(store, obj);
+		}
+
 		_entity_get_child_handles_with_same_format(store, obj_handle,
 				fmt_code, child_arr);
 		ptr = child_arr->array_entry;
@@ -543,6 +642,7 @@ mtp_bool _entity_remove_object_mtp_store(mtp_store_t *store, mtp_obj_t *obj,
 	mtp_uint32 h_parent = 0;
 	obj_info_t *objinfo = NULL;
 	mtp_int32 ret = MTP_ERROR_NONE;
+	mtp_int32 error = 0;
 
 	retv_if(store == NULL, 0);
 
@@ -589,6 +689,9 @@ mtp_bool _entity_remove_object_mtp_store(mtp_store_t *store, mtp_obj_t *obj,
 		ptp_array_t child_arr = { 0 };
 		mtp_obj_t *child_obj = NULL;
 
+		/* Children not read yet would keep the folder from going */
+		_entity_store_read_folder(store, obj);
+
 		_prop_init_ptparray(&child_arr, UINT32_TYPE);
 		_entity_get_child_handles(store, obj->obj_handle, &child_arr);
 
@@ -672,15 +775,15 @@ mtp_bool _entity_remove_object_mtp_store(mtp_store_t *store, mtp_obj_t *obj,
 		_prop_deinit_ptparray(&child_arr);
 
 		if (all_del) {
-			g_snprintf(g_last_deleted,
-					MTP_MAX_PATHNAME_SIZE + 1, "%s",
-					obj->file_path);
+			_inoti_record_self_change(obj->file_path,
+					INOTI_SELF_DELETE);
 
-			if (rmdir(obj->file_path) < 0) {
-				memset(g_last_deleted, 0,
-						MTP_MAX_PATHNAME_SIZE + 1);
+			if (_util_dir_remove(obj->file_path) < 0) {
+				error = errno;
+				_inoti_forget_self_change(obj->file_path,
+						INOTI_SELF_DELETE);
 				*response = PTP_RESPONSE_GEN_ERROR;
-				if (EACCES == errno)
+				if (EACCES == error)
 					*response =
 						PTP_RESPONSE_ACCESSDENIED;
 				return FALSE;
@@ -702,13 +805,13 @@ mtp_bool _entity_remove_object_mtp_store(mtp_store_t *store, mtp_obj_t *obj,
 		}
 
 		/* delete the real file */
-		g_snprintf(g_last_deleted, MTP_MAX_PATHNAME_SIZE + 1,
-				"%s", obj->file_path);
-		if (remove(obj->file_path) < 0) {
-			memset(g_last_deleted, 0,
-					MTP_MAX_PATHNAME_SIZE + 1);
+		_inoti_record_self_change(obj->file_path, INOTI_SELF_DELETE);
+		if (_util_file_remove(obj->file_path) < 0) {
+			error = errno;
+			_inoti_forget_self_change(obj->file_path,
+					INOTI_SELF_DELETE);
 			*response = PTP_RESPONSE_GEN_ERROR;
-			if (EACCES == errno)
+			if (EACCES == error)
 				*response = PTP_RESPONSE_ACCESSDENIED;
 			return FALSE;
 		}
@@ -855,6 +958,7 @@ mtp_uint32 _entity_get_object_tree_size(mtp_store_t *store, mtp_obj_t *obj)
 
 		_prop_init_ptparray(&child_arr, UINT32_TYPE);
 
+		_entity_store_read_folder(store, obj);
 		_entity_get_child_handles(store, obj->obj_handle, &child_arr);
 
 		for (i = 0; i < child_arr.num_ele; i++) {
@@ -908,6 +1012,7 @@ void _entity_destroy_mtp_store(mtp_store_t *store)
 	mtp_uint32 ii = 0;
 	slist_node_t *node = NULL;
 	slist_node_t *next_node = NULL;
+	mtp_char *path = NULL;
 
 	ret_if(store == NULL);
 
@@ -921,81 +1026,401 @@ void _entity_destroy_mtp_store(mtp_store_t *store)
 	}
 
 	_util_init_list(&(store->obj_list));
+	store->is_enumerated = FALSE;
+	_entity_invalidate_store_info_blk(store);
+
+	while (store->dirty_list.start != NULL) {
+		path = store->dirty_list.start->value;
+		g_free(_util_delete_node(&(store->dirty_list), path));
+		g_free(path);
+	}
 }
 /* LCOV_EXCL_STOP */
 
-void _entity_store_recursive_enum_folder_objects(mtp_store_t *store,
-		mtp_obj_t *pobj)
+mtp_bool _entity_init_store_lock(void)
+{
+	pthread_rwlockattr_t attr;
+	mtp_int32 res = 0;
+
+	pthread_rwlockattr_init(&attr);
+	/* A steady stream of readers must not starve the writers */
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	res = pthread_rwlock_init(&g_store_rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	retvm_if(res != 0, FALSE, "pthread_rwlock_init() Fail[%d]\n", res);
+
+	return TRUE;
+}
+
+void _entity_lock_stores_read(void)
+{
+	mtp_int32 res = pthread_rwlock_rdlock(&g_store_rwlock);
+
+	if (res != 0)
+		ERR("pthread_rwlock_rdlock() Fail[%d]\n", res);
+}
+
+void _entity_lock_stores_write(void)
+{
+	mtp_int32 res = pthread_rwlock_wrlock(&g_store_rwlock);
+
+	if (res != 0)
+		ERR("pthread_rwlock_wrlock() Fail[%d]\n", res);
+}
+
+/* For callers that must not wait, e.g. the event loop */
+mtp_bool _entity_trylock_stores_write(void)
+{
+	return pthread_rwlock_trywrlock(&g_store_rwlock) == 0;
+}
+
+void _entity_unlock_stores(void)
+{
+	mtp_int32 res = pthread_rwlock_unlock(&g_store_rwlock);
+
+	if (res != 0)
+		ERR("pthread_rwlock_unlock() Fail[%d]\n", res);
+}
+
+/*
+ * void _entity_store_read_folder(mtp_store_t *store, mtp_obj_t *pobj)
+ * Adds the children of a folder which was not read yet to the store. The
+ * subfolders are only added, their own children are read when needed.
+ *
+ * @param[in]	store	Store holding the folder.
+ * @param[in]	pobj	Folder to read, NULL for the root of the store.
+ * @return	None.
+ */
+void _entity_store_read_folder(mtp_store_t *store, mtp_obj_t *pobj)
 {
-	DIR *h_dir = 0;
-	mtp_char file_name[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-	mtp_bool status = FALSE;
-	mtp_obj_t *obj = NULL;
-	dir_entry_t entry = { { 0 }, 0 };
 	mtp_char *folder_name;
-	mtp_uint32 h_parent;
 
 	ret_if(NULL == store);
 
 	if (!pobj) {
+		ret_if(store->is_enumerated);
 		folder_name = store->root_path;
-		h_parent = PTP_OBJECTHANDLE_ROOT;
 	} else {
+		ret_if(!pobj->is_unread);
 		folder_name = pobj->file_path;
-		h_parent = pobj->obj_handle;
 	}
 
 	retm_if(folder_name == NULL || folder_name[0] != '/',
 		"foldername has no root slash!!\n");
 
-	retm_if(!_util_ifind_first(folder_name, &h_dir, &entry), "No more files\n");
+	_entity_scan_folder(store, pobj);
+}
 
-	do {
-		if (TRUE == g_status->is_usb_discon) {
-			/* LCOV_EXCL_START */
-			DBG("USB is disconnected\n");
-			if (closedir(h_dir) < 0)
-				ERR("Close directory Fail\n");
+/*
+ * void _entity_store_read_all_folders(mtp_store_t *store)
+ * Reads every folder of the store which was not read yet, for queries
+ * about all the objects of the store.
+ *
+ * @param[in]	store	Store to read.
+ * @return	None.
+ */
+void _entity_store_read_all_folders(mtp_store_t *store)
+{
+	ret_if(NULL == store);
 
-			return;
-			/* LCOV_EXCL_STOP */
+	_entity_scan_unread_folders(store);
+}
+
+static mtp_bool __is_path_in_tree(const mtp_char *path, const mtp_char *top)
+{
+	size_t len = strlen(top);
+
+	if (strncmp(path, top, len) != 0)
+		return FALSE;
+
+	return path[len] == '\0' || path[len] == '/';
+}
+
+static void __free_child_objs(gpointer data)
+{
+	g_ptr_array_free((GPtrArray *)data, TRUE);
+}
+
+/*
+ * Groups the objects of the store by parent in one pass, instead of
+ * walking obj_list for every folder which is synced.
+ */
+static GHashTable *__get_store_children(mtp_store_t *store)
+{
+	mtp_uint32 ii = 0;
+	slist_node_t *node = NULL;
+	mtp_obj_t *obj = NULL;
+	GPtrArray *objs = NULL;
+	GHashTable *children = NULL;
+	gpointer key = NULL;
+
+	children = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			__free_child_objs);
+
+	for (ii = 0, node = store->obj_list.start;
+			ii < store->obj_list.nnodes; ii++, node = node->link) {
+		obj = (mtp_obj_t *)node->value;
+		if (obj == NULL || obj->obj_info == NULL)
+			continue;
+
+		key = GUINT_TO_POINTER(obj->obj_info->h_parent);
+		objs = g_hash_table_lookup(children, key);
+		if (objs == NULL) {
+			objs = g_ptr_array_new();
+			g_hash_table_insert(children, key, objs);
 		}
+		g_ptr_array_add(objs, obj);
+	}
+
+	return children;
+}
+
+/*
+ * Removes obj and everything below it from the store only, the files are
+ * already gone. pobj is the parent still referencing obj, NULL if none.
+ */
+static void __forget_store_object(mtp_store_t *store, GHashTable *children,
+		mtp_obj_t *pobj, mtp_obj_t *obj)
+{
+	mtp_uint32 i = 0;
+	GPtrArray *objs = NULL;
+
+	objs = g_hash_table_lookup(children, GUINT_TO_POINTER(obj->obj_handle));
+	for (i = 0; objs != NULL && i < objs->len; i++)
+		__forget_store_object(store, children, NULL,
+				g_ptr_array_index(objs, i));
+
+	if (pobj != NULL)
+		_entity_remove_reference_child_array(pobj, obj->obj_handle);
+
+	g_free(_util_delete_node(&(store->obj_list), obj));
+	_entity_dealloc_mtp_obj(obj);
+}
+
+/*
+ * Compares the objects of a folder with what is on disk. Objects which
+ * still exist keep their handles, so the host does not see them change.
+ */
+static void __sync_store_folder(mtp_store_t *store, GHashTable *children,
+		mtp_obj_t *pobj)
+{
+	dir_scan_t *scan = NULL;
+	mtp_char file_name[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	dir_entry_t entry = { { 0 }, 0 };
+	mtp_char *folder_name = NULL;
+	mtp_uint32 h_parent = PTP_OBJECTHANDLE_ROOT;
+	mtp_uint32 i = 0;
+	mtp_bool is_dir = FALSE;
+	mtp_obj_t *obj = NULL;
+	GPtrArray *objs = NULL;
+	GHashTable *old_objs = NULL;
+	GHashTableIter iter;
+
+	if (pobj == NULL) {
+		/* Read as a whole when it is listed */
+		ret_if(!store->is_enumerated);
+		folder_name = store->root_path;
+	} else {
+		ret_if(pobj->is_unread);
+		folder_name = pobj->file_path;
+		h_parent = pobj->obj_handle;
+	}
+
+	old_objs = g_hash_table_new(g_str_hash, g_str_equal);
+	objs = g_hash_table_lookup(children, GUINT_TO_POINTER(h_parent));
+	for (i = 0; objs != NULL && i < objs->len; i++) {
+		obj = g_ptr_array_index(objs, i);
+		g_hash_table_insert(old_objs, obj->file_path, obj);
+	}
+
+	scan = _util_dir_scan_open(folder_name, 0);
+	if (scan == NULL)
+		goto FORGET;
+
+	while (_util_dir_scan_next(scan, &entry)) {
+		/* Objects excluded since they were added are forgotten */
+		if (_entity_is_path_excluded(store, entry.filename))
+			continue;
 
 		_util_get_file_name(entry.filename, file_name);
-		if (0 == strlen(file_name)) {
-			ERR("szFilename size is 0\n");
-			goto NEXT;
-		}
 
-		if (file_name[0] == '.') {
-			DBG_SECURE("Hidden file [%s]\n", entry.filename);
-		} else if (entry.type == MTP_DIR_TYPE) {
-			obj = _entity_add_folder_to_store(store, h_parent,
-					entry.filename, file_name, &entry);
+		obj = g_hash_table_lookup(old_objs, entry.filename);
+		if (obj != NULL) {
+			g_hash_table_remove(old_objs, entry.filename);
 
-			if (NULL == obj) {
-				ERR("pObject is NULL\n");
-				goto NEXT;
+			is_dir = obj->obj_info->obj_fmt == PTP_FMT_ASSOCIATION;
+			if (is_dir != (entry.type == MTP_DIR_TYPE)) {
+				/* Replaced by an entry of the other type */
+				__forget_store_object(store, children, pobj,
+						obj);
+				obj = NULL;
 			}
+		}
 
-			_entity_store_recursive_enum_folder_objects(store, obj);
-		} else if (entry.type == MTP_FILE_TYPE) {
+		if (obj == NULL && entry.type == MTP_DIR_TYPE) {
+			obj = _entity_add_folder_to_store(store, h_parent,
+					entry.filename, file_name, &entry);
+			if (obj != NULL)
+				obj->is_unread = TRUE;
+		} else if (obj == NULL) {
 			_entity_add_file_to_store(store, h_parent,
 					entry.filename, file_name, &entry);
+		} else if (entry.type == MTP_DIR_TYPE) {
+			__sync_store_folder(store, children, obj);
+		} else {
+			obj->obj_info->file_size = entry.attrs.fsize;
+			_entity_invalidate_obj_info_blk(obj->obj_handle);
+			_entity_invalidate_obj_propvals(obj);
+		}
+	}
+
+	_util_dir_scan_close(scan);
+
+FORGET:
+	g_hash_table_iter_init(&iter, old_objs);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&obj))
+		__forget_store_object(store, children, pobj, obj);
+
+	g_hash_table_destroy(old_objs);
+}
+
+/*
+ * void _entity_mark_folder_dirty(mtp_store_t *store,
+ *		const mtp_char *folder_path)
+ * Records that the objects below folder_path may not match the disk any
+ * more, because its changes were not followed one by one.
+ *
+ * @param[in]	store		Store holding the folder.
+ * @param[in]	folder_path	Folder, or the root path of the store.
+ * @return	None.
+ */
+void _entity_mark_folder_dirty(mtp_store_t *store, const mtp_char *folder_path)
+{
+	slist_node_t *node = NULL;
+	mtp_char *path = NULL;
+
+	ret_if(store == NULL || folder_path == NULL);
+
+	node = store->dirty_list.start;
+	while (node != NULL) {
+		path = (mtp_char *)node->value;
+		node = node->link;
+
+		/* Already covered by a folder above it */
+		if (__is_path_in_tree(folder_path, path))
+			return;
+
+		/* Covered by the new one from now on */
+		if (__is_path_in_tree(path, folder_path)) {
+			g_free(_util_delete_node(&(store->dirty_list), path));
+			g_free(path);
+		}
+	}
+
+	_util_add_node(&(store->dirty_list), g_strdup(folder_path));
+}
+
+/*
+ * mtp_bool _entity_is_path_excluded(mtp_store_t *store,
+ *		const mtp_char *path)
+ * Tells whether the host must not see path, see the exclude option.
+ *
+ * @param[in]	store	Store holding the path.
+ * @param[in]	path	File or folder below the root of the store.
+ * @return	TRUE if it is excluded, otherwise FALSE.
+ */
+mtp_bool _entity_is_path_excluded(mtp_store_t *store, const mtp_char *path)
+{
+	size_t root_len = 0;
+
+	retv_if(store == NULL || store->root_path == NULL, FALSE);
+	retv_if(path == NULL, FALSE);
+
+	root_len = strlen(store->root_path);
+	retv_if(strncmp(path, store->root_path, root_len) != 0, FALSE);
+	retv_if(path[root_len] != '/', FALSE);
+
+	return _util_is_excluded(path + root_len + 1);
+}
+
+/*
+ * mtp_bool _entity_is_folder_dirty(mtp_store_t *store,
+ *		const mtp_char *folder_path)
+ * Tells whether folder_path is in a tree marked dirty and not synced yet.
+ *
+ * @param[in]	store		Store holding the folder.
+ * @param[in]	folder_path	Folder, or the root path of the store.
+ * @return	TRUE if its objects may be stale, otherwise FALSE.
+ */
+mtp_bool _entity_is_folder_dirty(mtp_store_t *store,
+		const mtp_char *folder_path)
+{
+	slist_node_t *node = NULL;
+
+	retv_if(store == NULL || folder_path == NULL, FALSE);
+
+	for (node = store->dirty_list.start; node != NULL; node = node->link) {
+		if (__is_path_in_tree(folder_path, (mtp_char *)node->value))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * void _entity_sync_dirty_folders(mtp_store_t *store, mtp_uint32 h_parent)
+ * Brings the dirty folders in store up to date before h_parent is listed.
+ * PTP_OBJECTHANDLE_ALL and PTP_OBJECTHANDLE_ROOT sync all of them.
+ *
+ * @param[in]	store		Store to sync.
+ * @param[in]	h_parent	Folder about to be listed.
+ * @return	None.
+ */
+void _entity_sync_dirty_folders(mtp_store_t *store, mtp_uint32 h_parent)
+{
+	slist_node_t *node = NULL;
+	mtp_char *path = NULL;
+	mtp_char *listed_path = NULL;
+	mtp_obj_t *obj = NULL;
+	GHashTable *children = NULL;
+
+	ret_if(store == NULL || store->dirty_list.nnodes == 0);
+
+	if (h_parent != PTP_OBJECTHANDLE_ALL &&
+			h_parent != PTP_OBJECTHANDLE_ROOT) {
+		obj = _entity_get_object_from_store(store, h_parent);
+		ret_if(obj == NULL);
+		listed_path = obj->file_path;
+	}
+
+	children = __get_store_children(store);
+
+	node = store->dirty_list.start;
+	while (node != NULL) {
+		path = (mtp_char *)node->value;
+		node = node->link;
+
+		if (listed_path != NULL &&
+				!__is_path_in_tree(listed_path, path))
+			continue;
+
+		DBG_SECURE("Sync [%s] with the disk\n", path);
+		if (!g_strcmp0(path, store->root_path)) {
+			__sync_store_folder(store, children, NULL);
 		} else {
-			DBG("UNKNOWN TYPE\n");
+			/* Folders in dirty_list never contain each other */
+			obj = _entity_get_object_from_store_by_path(store,
+					path);
+			if (obj != NULL)
+				__sync_store_folder(store, children, obj);
 		}
-NEXT:
-		status = (mtp_bool)_util_ifind_next(folder_name, h_dir,
-				&entry);
-	} while (status);
 
-	if (closedir(h_dir) < 0)
-		ERR("close directory fail\n");
+		g_free(_util_delete_node(&(store->dirty_list), path));
+		g_free(path);
+	}
 
-#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
-	_inoti_add_watch_for_fs_events(folder_name);
-#endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
+	g_hash_table_destroy(children);
 }
 
 /* LCOV_EXCL_START */
@@ -1004,8 +1429,13 @@ void _entity_copy_store_data(mtp_store_t *dst, mtp_store_t *src)
 	dst->store_id = src->store_id;
 	dst->root_path = src->root_path;
 	dst->is_hidden = src->is_hidden;
+	dst->info_blk = src->info_blk;
+	dst->info_blk_len = src->info_blk_len;
+	dst->info_blk_free_space = src->info_blk_free_space;
 
 	memcpy(&(dst->obj_list), &(src->obj_list), sizeof(slist_t));
+	memcpy(&(dst->dirty_list), &(src->dirty_list), sizeof(slist_t));
+	dst->is_enumerated = src->is_enumerated;
 	_entity_update_store_info_run_time(&(dst->store_info), dst->root_path);
 	_prop_copy_ptpstring(&(dst->store_info.store_desc), &(src->store_info.store_desc));
 	_prop_copy_ptpstring(&(dst->store_info.vol_label), &(src->store_info.vol_label));
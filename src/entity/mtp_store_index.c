@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "mtp_util.h"
+#include "mtp_support.h"
+#include "mtp_device.h"
+#include "mtp_thread.h"
+#include "mtp_inoti_handler.h"
+#include "mtp_store_index.h"
+#include "mtp_storage.h"
+
+extern mtp_uint32 g_next_obj_handle;
+extern mtp_config_t g_conf;
+
+/* What a rescanned folder holds on disk, keyed by name */
+typedef struct {
+	file_type_t type;
+	mtp_uint64 fsize;
+} index_disk_entry_t;
+
+/* Folder whose files are checked, the last one opened */
+typedef struct {
+	mtp_int32 fd;
+	mtp_uint32 h_folder;
+} index_dir_t;
+
+static pthread_t g_index_thrd;
+static pthread_mutex_t g_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_index_cond;
+static mtp_bool g_index_stop = FALSE;
+static mtp_bool g_index_saver_running = FALSE;
+
+/* Objects of a store which does not outlive the process are not saved */
+static mtp_bool __is_index_enabled(void)
+{
+	return g_conf.store_index_dir[0] != '\0' &&
+		_util_storage_get_ops()->is_persistent;
+}
+
+static mtp_char *__get_index_path(mtp_uint32 store_id)
+{
+	mtp_char name[sizeof(MTP_STORE_INDEX_FILE) + 8] = { 0 };
+
+	g_snprintf(name, sizeof(name), MTP_STORE_INDEX_FILE, store_id);
+	return g_strdup_printf("%s/%s", g_conf.store_index_dir, name);
+}
+
+/* Returns 0 if path cannot be read, which never matches a saved time */
+static mtp_int64 __get_mtime_ns(const mtp_char *path)
+{
+	struct stat st;
+
+	retv_if(stat(path, &st) < 0, 0);
+
+	return (mtp_int64)st.st_mtim.tv_sec * 1000000000LL +
+		st.st_mtim.tv_nsec;
+}
+
+/*
+ * A folder changed within the margin may still have events on their way
+ * to the store, so it is saved as changed and read again at startup.
+ */
+static mtp_int64 __get_saved_mtime(mtp_store_t *store, const mtp_char *path,
+		mtp_int64 now)
+{
+	mtp_int64 mtime = 0;
+
+	retv_if(_entity_is_folder_dirty(store, path), 0);
+
+	mtime = __get_mtime_ns(path);
+	retv_if(mtime > now - MTP_STORE_INDEX_MTIME_MARGIN * 1000000000LL, 0);
+
+	return mtime;
+}
+
+static const mtp_char *__get_obj_name(mtp_obj_t *obj)
+{
+	const mtp_char *name = strrchr(obj->file_path, '/');
+
+	return name ? name + 1 : obj->file_path;
+}
+
+/*
+ * Lists the objects of store with every parent before its children. An
+ * object whose parent is not in the store any more is left out.
+ */
+static GPtrArray *__get_objs_in_tree_order(mtp_store_t *store)
+{
+	mtp_uint32 ii = 0;
+	mtp_uint32 i = 0;
+	mtp_uint32 *handles = NULL;
+	slist_node_t *node = NULL;
+	mtp_obj_t *obj = NULL;
+	mtp_obj_t *child = NULL;
+	GHashTable *unvisited = NULL;
+	GPtrArray *stack = NULL;
+	GPtrArray *order = NULL;
+
+	unvisited = g_hash_table_new(g_direct_hash, g_direct_equal);
+	stack = g_ptr_array_new();
+	order = g_ptr_array_new();
+
+	for (ii = 0, node = store->obj_list.start;
+			ii < store->obj_list.nnodes; ii++, node = node->link) {
+		obj = (mtp_obj_t *)node->value;
+		if (obj == NULL || obj->obj_info == NULL ||
+				obj->file_path == NULL)
+			continue;
+
+		if (obj->obj_info->h_parent == PTP_OBJECTHANDLE_ROOT)
+			g_ptr_array_add(stack, obj);
+		else
+			g_hash_table_insert(unvisited,
+					GUINT_TO_POINTER(obj->obj_handle), obj);
+	}
+
+	while (stack->len > 0) {
+		obj = g_ptr_array_index(stack, stack->len - 1);
+		g_ptr_array_set_size(stack, stack->len - 1);
+		g_ptr_array_add(order, obj);
+
+		if (obj->obj_info->obj_fmt != PTP_FMT_ASSOCIATION)
+			continue;
+
+		handles = (mtp_uint32 *)obj->child_array.array_entry;
+		for (i = 0; i < obj->child_array.num_ele; i++) {
+			child = g_hash_table_lookup(unvisited,
+					GUINT_TO_POINTER(handles[i]));
+			if (child == NULL ||
+					child->obj_info->h_parent != obj->obj_handle)
+				continue;
+
+			/* Taken out so that it is visited once */
+			g_hash_table_remove(unvisited,
+					GUINT_TO_POINTER(handles[i]));
+			g_ptr_array_add(stack, child);
+		}
+	}
+
+	if (g_hash_table_size(unvisited) > 0)
+		ERR("%u objects are not linked to the root\n",
+				g_hash_table_size(unvisited));
+
+	g_hash_table_destroy(unvisited);
+	g_ptr_array_free(stack, TRUE);
+
+	return order;
+}
+
+static mtp_uchar *__pack_store_index(mtp_store_t *store, size_t *len)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 name_len = 0;
+	mtp_uint32 names_len = 0;
+	mtp_int64 now = 0;
+	mtp_uchar *buf = NULL;
+	mtp_char *names = NULL;
+	const mtp_char *name = NULL;
+	mtp_obj_t *obj = NULL;
+	store_index_hdr_t *hdr = NULL;
+	store_index_rec_t *rec = NULL;
+	GPtrArray *order = NULL;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (mtp_int64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	order = __get_objs_in_tree_order(store);
+
+	names_len = strlen(store->root_path);
+	for (i = 0; i < order->len; i++) {
+		obj = g_ptr_array_index(order, i);
+		names_len += strlen(__get_obj_name(obj));
+	}
+
+	*len = sizeof(store_index_hdr_t) +
+		order->len * sizeof(store_index_rec_t) + names_len;
+	buf = (mtp_uchar *)g_malloc0(*len);
+
+	hdr = (store_index_hdr_t *)buf;
+	hdr->magic = MTP_STORE_INDEX_MAGIC;
+	hdr->version = MTP_STORE_INDEX_VERSION;
+	hdr->store_id = store->store_id;
+	hdr->next_handle = g_next_obj_handle;
+	hdr->num_objs = order->len;
+	hdr->names_len = names_len;
+	hdr->root_mtime = __get_saved_mtime(store, store->root_path, now);
+	hdr->root_len = strlen(store->root_path);
+
+	rec = (store_index_rec_t *)(hdr + 1);
+	names = (mtp_char *)(rec + order->len);
+	memcpy(names, store->root_path, hdr->root_len);
+	names_len = hdr->root_len;
+
+	for (i = 0; i < order->len; i++, rec++) {
+		obj = g_ptr_array_index(order, i);
+		name = __get_obj_name(obj);
+		name_len = strlen(name);
+
+		rec->obj_handle = obj->obj_handle;
+		rec->h_parent = obj->obj_info->h_parent;
+		rec->obj_fmt = obj->obj_info->obj_fmt;
+		rec->protcn_status = obj->obj_info->protcn_status;
+		rec->association_type = obj->obj_info->association_type;
+		rec->file_size = obj->obj_info->file_size;
+		if (obj->is_unread)
+			rec->flags |= MTP_STORE_INDEX_UNREAD;
+		else if (obj->obj_info->obj_fmt == PTP_FMT_ASSOCIATION)
+			rec->mtime = __get_saved_mtime(store, obj->file_path,
+					now);
+
+		rec->name_off = names_len;
+		rec->name_len = name_len;
+		memcpy(names + names_len, name, name_len);
+		names_len += name_len;
+	}
+
+	g_ptr_array_free(order, TRUE);
+
+	return buf;
+}
+
+/* Replaces the index of store_id at once, a crash leaves the old one */
+static mtp_bool __write_store_index(mtp_uint32 store_id, mtp_uchar *buf,
+		size_t len)
+{
+	mtp_int32 fd = -1;
+	ssize_t ret = 0;
+	size_t done = 0;
+	mtp_char *path = NULL;
+	mtp_char *tmp_path = NULL;
+	mtp_bool result = FALSE;
+
+	if (mkdir(g_conf.store_index_dir, 0700) < 0 && errno != EEXIST) {
+		ERR_SECURE("mkdir(%s) Fail\n", g_conf.store_index_dir);
+		_util_print_error();
+		return FALSE;
+	}
+
+	path = __get_index_path(store_id);
+	tmp_path = g_strdup_printf("%s.tmp", path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ERR_SECURE("open(%s) Fail\n", tmp_path);
+		_util_print_error();
+		goto DONE;
+	}
+
+	while (done < len) {
+		ret = write(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	if (done < len || fsync(fd) < 0) {
+		ERR("index write Fail\n");
+		_util_print_error();
+		close(fd);
+		unlink(tmp_path);
+		goto DONE;
+	}
+	close(fd);
+
+	if (rename(tmp_path, path) < 0) {
+		ERR_SECURE("rename(%s) Fail\n", path);
+		_util_print_error();
+		unlink(tmp_path);
+		goto DONE;
+	}
+
+	DBG("index of store[0x%x] saved, %zu bytes\n", store_id, len);
+	result = TRUE;
+
+DONE:
+	g_free(tmp_path);
+	g_free(path);
+	return result;
+}
+
+static mtp_bool __is_store_index_valid(mtp_store_t *store,
+		const mtp_uchar *map, size_t len)
+{
+	mtp_uint32 i = 0;
+	mtp_bool ret = FALSE;
+	const mtp_char *names = NULL;
+	const mtp_char *name = NULL;
+	const store_index_hdr_t *hdr = (const store_index_hdr_t *)map;
+	const store_index_rec_t *rec = NULL;
+	GHashTable *handles = NULL;
+
+	retv_if(len < sizeof(store_index_hdr_t), FALSE);
+	retv_if(hdr->magic != MTP_STORE_INDEX_MAGIC ||
+			hdr->version != MTP_STORE_INDEX_VERSION ||
+			hdr->store_id != store->store_id, FALSE);
+	retv_if(len != sizeof(store_index_hdr_t) +
+			(mtp_uint64)hdr->num_objs * sizeof(store_index_rec_t) +
+			hdr->names_len, FALSE);
+
+	rec = (const store_index_rec_t *)(hdr + 1);
+	names = (const mtp_char *)(rec + hdr->num_objs);
+
+	/* The same mount point may now hold another file system */
+	retv_if(hdr->root_len > hdr->names_len ||
+			hdr->root_len != strlen(store->root_path) ||
+			memcmp(names, store->root_path, hdr->root_len) != 0,
+			FALSE);
+
+	handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < hdr->num_objs; i++, rec++) {
+		if (rec->obj_handle == PTP_OBJECTHANDLE_ROOT ||
+				rec->obj_handle == PTP_OBJECTHANDLE_ALL ||
+				rec->obj_handle >= hdr->next_handle)
+			goto DONE;
+
+		/* Parents come first, so a loop cannot be built */
+		if (rec->h_parent != PTP_OBJECTHANDLE_ROOT &&
+				!g_hash_table_contains(handles,
+					GUINT_TO_POINTER(rec->h_parent)))
+			goto DONE;
+
+		if (!g_hash_table_add(handles,
+					GUINT_TO_POINTER(rec->obj_handle)))
+			goto DONE;
+
+		if (rec->name_len == 0 ||
+				rec->name_len > MTP_MAX_FILENAME_SIZE ||
+				(mtp_uint64)rec->name_off + rec->name_len >
+				hdr->names_len)
+			goto DONE;
+
+		name = names + rec->name_off;
+		if (memchr(name, '/', rec->name_len) != NULL ||
+				memchr(name, '\0', rec->name_len) != NULL)
+			goto DONE;
+	}
+	ret = TRUE;
+
+DONE:
+	g_hash_table_destroy(handles);
+	return ret;
+}
+
+static GHashTable *__list_folder(mtp_char *folder_path)
+{
+	dir_scan_t *scan = NULL;
+	dir_entry_t entry = { { 0 }, 0 };
+	mtp_char file_name[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	index_disk_entry_t *disk = NULL;
+	GHashTable *listing = NULL;
+
+	listing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+
+	/* A folder which is gone lists nothing, so its objects are dropped */
+	scan = _util_dir_scan_open(folder_path, 0);
+	retv_if(scan == NULL, listing);
+
+	while (_util_dir_scan_next(scan, &entry)) {
+		_util_get_file_name(entry.filename, file_name);
+
+		disk = g_new0(index_disk_entry_t, 1);
+		disk->type = entry.type;
+		disk->fsize = entry.attrs.fsize;
+		g_hash_table_insert(listing, g_strdup(file_name), disk);
+	}
+
+	_util_dir_scan_close(scan);
+
+	return listing;
+}
+
+/*
+ * Handles of the objects of the other stores. The index of a store may
+ * hold some of them if it is stale, or if the store is mounted after the
+ * others handed out handles.
+ */
+static GHashTable *__get_used_handles(mtp_store_t *store)
+{
+	mtp_int32 i = 0;
+	mtp_uint32 ii = 0;
+	slist_node_t *node = NULL;
+	mtp_obj_t *obj = NULL;
+	mtp_store_t *other = NULL;
+	GHashTable *used = NULL;
+
+	used = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < g_device->num_stores; i++) {
+		other = &(g_device->store_list[i]);
+		if (other == store)
+			continue;
+
+		for (ii = 0, node = other->obj_list.start;
+				ii < other->obj_list.nnodes;
+				ii++, node = node->link) {
+			obj = (mtp_obj_t *)node->value;
+			if (obj == NULL)
+				continue;
+			g_hash_table_add(used,
+					GUINT_TO_POINTER(obj->obj_handle));
+		}
+	}
+
+	return used;
+}
+
+/*
+ * A file rewritten in place does not change the time of its folder, so the
+ * size of each file of an unchanged folder is read again. The files of a
+ * folder mostly come in a row, the folder is kept open between them.
+ * @return	the size on disk, saved_size if it cannot be read.
+ */
+static mtp_uint64 __get_index_file_size(index_dir_t *dir,
+		mtp_uint32 h_folder, const mtp_char *folder_path,
+		const mtp_char *path, mtp_uint64 saved_size)
+{
+	struct stat st;
+
+	if (dir->fd < 0 || dir->h_folder != h_folder) {
+		if (dir->fd >= 0)
+			close(dir->fd);
+		dir->fd = open(folder_path, O_RDONLY | O_DIRECTORY |
+				O_CLOEXEC);
+		dir->h_folder = h_folder;
+		retv_if(dir->fd < 0, saved_size);
+	}
+
+	retv_if(fstatat(dir->fd, path + strlen(folder_path) + 1, &st,
+				AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode),
+			saved_size);
+
+	return (mtp_uint64)st.st_size;
+}
+
+static mtp_obj_t *__alloc_index_obj(mtp_store_t *store,
+		const store_index_rec_t *rec, mtp_uint32 obj_handle,
+		mtp_uint32 h_parent, mtp_char *path, mtp_uint64 file_size)
+{
+	mtp_obj_t *obj = NULL;
+
+	obj = _entity_alloc_mtp_object();
+	retvm_if(obj == NULL, NULL, "Memory allocation Fail\n");
+
+	memset(obj, 0, sizeof(mtp_obj_t));
+	obj->child_array.type = UINT32_TYPE;
+	_util_init_list(&(obj->propval_list));
+
+	obj->obj_handle = obj_handle;
+	_entity_set_object_file_path(obj, path, CHAR_TYPE);
+
+	obj->obj_info = _entity_alloc_object_info();
+	if (obj->obj_info == NULL) {
+		/* LCOV_EXCL_START */
+		g_free(obj->file_path);
+		g_free(obj);
+		return NULL;
+		/* LCOV_EXCL_STOP */
+	}
+
+	_entity_init_object_info(obj->obj_info);
+	obj->obj_info->store_id = store->store_id;
+	obj->obj_info->h_parent = h_parent;
+	obj->obj_info->obj_fmt = rec->obj_fmt;
+	obj->obj_info->protcn_status = rec->protcn_status;
+	obj->obj_info->association_type = rec->association_type;
+	obj->obj_info->file_size = file_size;
+
+	return obj;
+}
+
+/*
+ * Objects of the folders changed since the index was saved are kept only
+ * if their name is still there with the same type; whatever is left in
+ * the listings is new and added like during an enumeration.
+ */
+static void __add_new_objs(mtp_store_t *store, GHashTable *objs,
+		GHashTable *listings)
+{
+	mtp_uint32 h_parent = 0;
+	mtp_char *folder_path = NULL;
+	mtp_char *name = NULL;
+	mtp_obj_t *pobj = NULL;
+	mtp_obj_t *obj = NULL;
+	index_disk_entry_t *disk = NULL;
+	GHashTable *listing = NULL;
+	GHashTableIter iter;
+	GHashTableIter name_iter;
+	dir_entry_t entry = { { 0 }, 0 };
+	gpointer key = NULL;
+
+	g_hash_table_iter_init(&iter, listings);
+	while (g_hash_table_iter_next(&iter, &key, (gpointer *)&listing)) {
+		h_parent = GPOINTER_TO_UINT(key);
+		if (h_parent == PTP_OBJECTHANDLE_ROOT) {
+			folder_path = store->root_path;
+		} else {
+			pobj = g_hash_table_lookup(objs, key);
+			if (pobj == NULL)
+				continue;
+			folder_path = pobj->file_path;
+		}
+
+		g_hash_table_iter_init(&name_iter, listing);
+		while (g_hash_table_iter_next(&name_iter, (gpointer *)&name,
+					(gpointer *)&disk)) {
+			g_snprintf(entry.filename, sizeof(entry.filename),
+					"%s/%s", folder_path, name);
+			entry.type = disk->type;
+			if (!_util_is_path_len_valid(entry.filename) ||
+					_entity_is_path_excluded(store,
+						entry.filename) ||
+					!_util_get_file_attrs(entry.filename,
+						&(entry.attrs)))
+				continue;
+
+			if (disk->type == MTP_FILE_TYPE) {
+				_entity_add_file_to_store(store, h_parent,
+						entry.filename, name, &entry);
+				continue;
+			}
+
+			obj = _entity_add_folder_to_store(store, h_parent,
+					entry.filename, name, &entry);
+			if (obj != NULL)
+				obj->is_unread = TRUE;
+		}
+	}
+}
+
+static void __build_store_from_index(mtp_store_t *store,
+		const store_index_hdr_t *hdr)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 dropped = 0;
+	mtp_uint32 renumbered = 0;
+	mtp_uint32 obj_handle = 0;
+	mtp_uint32 h_parent = 0;
+	mtp_uint64 file_size = 0;
+	mtp_bool is_dir = FALSE;
+	mtp_char path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	mtp_char *name = NULL;
+	const mtp_char *names = NULL;
+	const mtp_char *parent_path = NULL;
+	const store_index_rec_t *rec = NULL;
+	mtp_obj_t *pobj = NULL;
+	mtp_obj_t *obj = NULL;
+	index_disk_entry_t *disk = NULL;
+	GHashTable *objs = NULL;
+	GHashTable *listings = NULL;
+	GHashTable *listing = NULL;
+	GHashTable *used = NULL;
+	GHashTable *new_handles = NULL;
+	gpointer new_handle = NULL;
+	index_dir_t dir = { -1, 0 };
+
+	rec = (const store_index_rec_t *)(hdr + 1);
+	names = (const mtp_char *)(rec + hdr->num_objs);
+
+	/* Handles handed out before stay unused */
+	if (g_next_obj_handle < hdr->next_handle)
+		g_next_obj_handle = hdr->next_handle;
+
+	/* Saved handles another store uses are replaced by new ones */
+	used = __get_used_handles(store);
+	new_handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	objs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	listings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			(GDestroyNotify)g_hash_table_destroy);
+
+	if (hdr->root_mtime == 0 ||
+			__get_mtime_ns(store->root_path) != hdr->root_mtime)
+		g_hash_table_insert(listings,
+				GUINT_TO_POINTER(PTP_OBJECTHANDLE_ROOT),
+				__list_folder(store->root_path));
+
+#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
+	_inoti_add_watch_for_fs_events(store->root_path);
+#endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
+
+	for (i = 0; i < hdr->num_objs; i++, rec++) {
+		/* Parents come first, they are renumbered already */
+		h_parent = rec->h_parent;
+		if (g_hash_table_lookup_extended(new_handles,
+					GUINT_TO_POINTER(h_parent), NULL,
+					&new_handle))
+			h_parent = GPOINTER_TO_UINT(new_handle);
+
+		if (h_parent == PTP_OBJECTHANDLE_ROOT) {
+			pobj = NULL;
+			parent_path = store->root_path;
+		} else {
+			/* Its parent was dropped */
+			pobj = g_hash_table_lookup(objs,
+					GUINT_TO_POINTER(h_parent));
+			if (pobj == NULL) {
+				dropped++;
+				continue;
+			}
+			parent_path = pobj->file_path;
+		}
+
+		g_snprintf(path, sizeof(path), "%s/%.*s", parent_path,
+				(mtp_int32)rec->name_len, names + rec->name_off);
+		/* The exclude option may have changed since it was saved */
+		if (!_util_is_path_len_valid(path) ||
+				_entity_is_path_excluded(store, path)) {
+			dropped++;
+			continue;
+		}
+
+		is_dir = rec->obj_fmt == PTP_FMT_ASSOCIATION;
+		file_size = rec->file_size;
+
+		listing = g_hash_table_lookup(listings,
+				GUINT_TO_POINTER(h_parent));
+		if (listing != NULL) {
+			name = g_strndup(names + rec->name_off, rec->name_len);
+			disk = g_hash_table_lookup(listing, name);
+			if (disk == NULL ||
+					is_dir != (disk->type == MTP_DIR_TYPE)) {
+				g_free(name);
+				dropped++;
+				continue;
+			}
+			file_size = disk->fsize;
+			g_hash_table_remove(listing, name);
+			g_free(name);
+		} else if (!is_dir) {
+			file_size = __get_index_file_size(&dir, h_parent,
+					parent_path, path, file_size);
+		}
+
+		obj_handle = rec->obj_handle;
+		if (g_hash_table_contains(used, GUINT_TO_POINTER(obj_handle))) {
+			obj_handle = g_next_obj_handle++;
+			g_hash_table_insert(new_handles,
+					GUINT_TO_POINTER(rec->obj_handle),
+					GUINT_TO_POINTER(obj_handle));
+			renumbered++;
+		}
+
+		obj = __alloc_index_obj(store, rec, obj_handle, h_parent, path,
+				file_size);
+		if (obj == NULL) {
+			dropped++;
+			continue;
+		}
+
+		_util_add_node(&(store->obj_list), obj);
+		g_hash_table_insert(objs, GUINT_TO_POINTER(obj->obj_handle),
+				obj);
+		if (pobj != NULL)
+			_entity_add_reference_child_array(pobj,
+					obj->obj_handle);
+
+		/* Its children are read when the host lists it */
+		if (rec->flags & MTP_STORE_INDEX_UNREAD) {
+			obj->is_unread = TRUE;
+			continue;
+		}
+
+		if (!is_dir)
+			continue;
+
+		if (rec->mtime == 0 || __get_mtime_ns(path) != rec->mtime)
+			g_hash_table_insert(listings,
+					GUINT_TO_POINTER(obj->obj_handle),
+					__list_folder(path));
+
+#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
+		_inoti_add_watch_for_fs_events(path);
+#endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
+	}
+
+	DBG("store[0x%x] : %u objects from the index, %u dropped, %u folders read again\n",
+			store->store_id, hdr->num_objs - dropped, dropped,
+			g_hash_table_size(listings));
+	if (renumbered > 0)
+		DBG("store[0x%x] : %u handles in use elsewhere, renumbered\n",
+				store->store_id, renumbered);
+
+	if (dir.fd >= 0)
+		close(dir.fd);
+
+	__add_new_objs(store, objs, listings);
+	store->is_enumerated = TRUE;
+
+	g_hash_table_destroy(listings);
+	g_hash_table_destroy(objs);
+	g_hash_table_destroy(new_handles);
+	g_hash_table_destroy(used);
+}
+
+static void *__thread_index_saver(void *arg)
+{
+	mtp_uint32 saved = _entity_get_obj_change_count();
+	mtp_uint32 changes = 0;
+	struct timespec ts;
+
+	pthread_mutex_lock(&g_index_mutex);
+	while (!g_index_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += g_conf.store_index_interval;
+		pthread_cond_timedwait(&g_index_cond, &g_index_mutex, &ts);
+		if (g_index_stop)
+			break;
+
+		changes = _entity_get_obj_change_count();
+		if (changes == saved)
+			continue;
+
+		pthread_mutex_unlock(&g_index_mutex);
+		_entity_save_store_indexes();
+		saved = changes;
+		pthread_mutex_lock(&g_index_mutex);
+	}
+	pthread_mutex_unlock(&g_index_mutex);
+
+	return NULL;
+}
+
+/*
+ * mtp_bool _entity_load_store_index(mtp_store_t *store)
+ * Fills an empty store from its saved index. Folders modified since the
+ * index was saved are read again, the other ones are taken as they are.
+ * The caller holds the store lock exclusive.
+ *
+ * @param[in]	store	Store to fill.
+ * @return	TRUE if the index was used, otherwise FALSE and the store
+ *		is enumerated as usual.
+ */
+mtp_bool _entity_load_store_index(mtp_store_t *store)
+{
+	mtp_int32 fd = -1;
+	mtp_char *path = NULL;
+	mtp_uchar *map = NULL;
+	struct stat st;
+
+	retv_if(store == NULL || store->obj_list.nnodes != 0, FALSE);
+	retv_if(!__is_index_enabled(), FALSE);
+
+	path = __get_index_path(store->store_id);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		DBG_SECURE("No index [%s]\n", path);
+		g_free(path);
+		return FALSE;
+	}
+	g_free(path);
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(store_index_hdr_t)) {
+		close(fd);
+		return FALSE;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	retvm_if(map == MAP_FAILED, FALSE, "mmap() Fail [%d]\n", errno);
+
+	if (!__is_store_index_valid(store, map, st.st_size)) {
+		ERR("index of store[0x%x] is not valid\n", store->store_id);
+		munmap(map, st.st_size);
+		return FALSE;
+	}
+
+	__build_store_from_index(store, (const store_index_hdr_t *)map);
+	munmap(map, st.st_size);
+
+	return TRUE;
+}
+
+/* Called once the file system watches are set up */
+void _entity_load_store_indexes(void)
+{
+	mtp_uint32 i = 0;
+	mtp_store_t *store = NULL;
+
+	_entity_lock_stores_write();
+	for (i = 0; i < g_device->num_stores; i++) {
+		store = _device_get_store_at_index(i);
+		if (store != NULL)
+			_entity_load_store_index(store);
+	}
+	_entity_unlock_stores();
+}
+
+/*
+ * void _entity_save_store_indexes(void)
+ * Saves the index of every store which was enumerated. The stores are
+ * only locked while they are packed, not while the files are written.
+ *
+ * @return	None.
+ */
+void _entity_save_store_indexes(void)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 num = 0;
+	mtp_store_t *store = NULL;
+	mtp_uchar *bufs[MAX_NUM_DEVICE_STORES] = { NULL };
+	size_t lens[MAX_NUM_DEVICE_STORES] = { 0 };
+	mtp_uint32 store_ids[MAX_NUM_DEVICE_STORES] = { 0 };
+
+	ret_if(!__is_index_enabled());
+
+	_entity_lock_stores_read();
+	for (i = 0; i < g_device->num_stores; i++) {
+		store = _device_get_store_at_index(i);
+		if (store == NULL || !store->is_enumerated)
+			continue;
+
+		bufs[num] = __pack_store_index(store, &lens[num]);
+		store_ids[num] = store->store_id;
+		num++;
+	}
+	_entity_unlock_stores();
+
+	for (i = 0; i < num; i++) {
+		__write_store_index(store_ids[i], bufs[i], lens[i]);
+		g_free(bufs[i]);
+	}
+}
+
+mtp_bool _entity_start_store_index_saver(void)
+{
+	pthread_condattr_t attr;
+
+	retv_if(!__is_index_enabled(), FALSE);
+	retv_if(g_conf.store_index_interval <= 0, FALSE);
+	retv_if(g_index_saver_running, TRUE);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_index_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	g_index_stop = FALSE;
+	if (_util_thread_create(&g_index_thrd, "Index saver",
+				PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_BG,
+				__thread_index_saver, NULL) == FALSE) {
+		/* LCOV_EXCL_START */
+		ERR("_util_thread_create(Index saver) Fail\n");
+		pthread_cond_destroy(&g_index_cond);
+		return FALSE;
+		/* LCOV_EXCL_STOP */
+	}
+	g_index_saver_running = TRUE;
+
+	return TRUE;
+}
+
+void _entity_stop_store_index_saver(void)
+{
+	ret_if(!g_index_saver_running);
+
+	pthread_mutex_lock(&g_index_mutex);
+	g_index_stop = TRUE;
+	pthread_cond_signal(&g_index_cond);
+	pthread_mutex_unlock(&g_index_mutex);
+
+	_util_thread_join(g_index_thrd, NULL);
+	pthread_cond_destroy(&g_index_cond);
+	g_index_saver_running = FALSE;
+}
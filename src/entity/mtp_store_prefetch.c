@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glib.h>
+#include <pthread.h>
+#include "mtp_util.h"
+#include "mtp_device.h"
+#include "mtp_thread.h"
+#include "mtp_transport.h"
+#include "mtp_store_prefetch.h"
+#include "mtp_store_scan.h"
+#include "mtp_store_index.h"
+
+/*
+ * When the host lists a folder, its subfolders are read here in the
+ * background, so opening one of them is answered from the store. The
+ * folders listed last are read first. Stores just mounted are filled from
+ * their index here too, before any folder.
+ */
+typedef struct {
+	mtp_uint32 store_id;
+	mtp_uint32 obj_handle;
+} prefetch_req_t;
+
+static pthread_t g_prefetch_thrd;
+static pthread_mutex_t g_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static GQueue g_prefetch_queue = G_QUEUE_INIT;
+static GQueue g_prefetch_stores = G_QUEUE_INIT;	/* store ids */
+static mtp_bool g_prefetch_stop = FALSE;
+static mtp_bool g_prefetch_running = FALSE;
+
+static void __prefetch_folder(prefetch_req_t *req)
+{
+	ret_if(TRUE == g_status->is_usb_discon);
+
+	/*
+	 * Read at the BG I/O priority, so the store is only locked to add
+	 * the objects. A command never waits for the disk here.
+	 */
+	_entity_scan_folder_unlocked(req->store_id, req->obj_handle);
+}
+
+/*
+ * Commands wait for the store while it is filled, so this runs at the
+ * priority of commands instead of the BG one.
+ */
+static void __prefetch_store(mtp_uint32 store_id)
+{
+	mtp_store_t *store = NULL;
+
+	_util_thread_set_class(MTP_THREAD_CLASS_FILE);
+	_entity_lock_stores_write();
+
+	/* Not if the host listed it meanwhile, nor if it is gone */
+	store = _device_get_store(store_id);
+	if (store != NULL && !store->is_enumerated)
+		_entity_load_store_index(store);
+
+	_entity_unlock_stores();
+	_util_thread_set_class(MTP_THREAD_CLASS_BG);
+}
+
+static void *__thread_prefetch(void *arg)
+{
+	prefetch_req_t *req = NULL;
+	mtp_uint32 store_id = 0;
+
+	pthread_mutex_lock(&g_prefetch_mutex);
+	while (!g_prefetch_stop) {
+		if (!g_queue_is_empty(&g_prefetch_stores)) {
+			store_id = GPOINTER_TO_UINT(
+					g_queue_pop_head(&g_prefetch_stores));
+			pthread_mutex_unlock(&g_prefetch_mutex);
+
+			__prefetch_store(store_id);
+
+			pthread_mutex_lock(&g_prefetch_mutex);
+			continue;
+		}
+
+		req = g_queue_pop_head(&g_prefetch_queue);
+		if (req == NULL) {
+			pthread_cond_wait(&g_prefetch_cond, &g_prefetch_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&g_prefetch_mutex);
+
+		__prefetch_folder(req);
+		g_free(req);
+
+		pthread_mutex_lock(&g_prefetch_mutex);
+	}
+	pthread_mutex_unlock(&g_prefetch_mutex);
+
+	return NULL;
+}
+
+mtp_bool _entity_start_prefetch(void)
+{
+	retv_if(g_prefetch_running, TRUE);
+
+	g_prefetch_stop = FALSE;
+	if (_util_thread_create(&g_prefetch_thrd, "Folder prefetch",
+				PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_BG,
+				__thread_prefetch, NULL) == FALSE) {
+		/* LCOV_EXCL_START */
+		ERR("_util_thread_create(Folder prefetch) Fail\n");
+		return FALSE;
+		/* LCOV_EXCL_STOP */
+	}
+	g_prefetch_running = TRUE;
+
+	return TRUE;
+}
+
+void _entity_stop_prefetch(void)
+{
+	ret_if(!g_prefetch_running);
+
+	pthread_mutex_lock(&g_prefetch_mutex);
+	g_prefetch_stop = TRUE;
+	pthread_cond_signal(&g_prefetch_cond);
+	pthread_mutex_unlock(&g_prefetch_mutex);
+
+	_util_thread_join(g_prefetch_thrd, NULL);
+	g_prefetch_running = FALSE;
+
+	while (!g_queue_is_empty(&g_prefetch_queue))
+		g_free(g_queue_pop_head(&g_prefetch_queue));
+	g_queue_clear(&g_prefetch_stores);
+}
+
+/*
+ * void _entity_prefetch_store(mtp_uint32 store_id)
+ * Queues a store just mounted to be filled from its index, away from the
+ * thread which found it. Until then, or if prefetching is not running,
+ * the store is read when the host lists it.
+ *
+ * @param[in]	store_id	Store just added.
+ * @return	None.
+ */
+void _entity_prefetch_store(mtp_uint32 store_id)
+{
+	ret_if(!g_prefetch_running);
+
+	pthread_mutex_lock(&g_prefetch_mutex);
+	g_queue_push_tail(&g_prefetch_stores, GUINT_TO_POINTER(store_id));
+	pthread_cond_signal(&g_prefetch_cond);
+	pthread_mutex_unlock(&g_prefetch_mutex);
+}
+
+/*
+ * void _entity_prefetch_subfolders(mtp_store_t *store, mtp_uint32 h_parent)
+ * Queues the subfolders of a folder the host just listed, so that their
+ * children are read before the host opens them. The caller holds the
+ * store lock.
+ *
+ * @param[in]	store		Store holding the folder.
+ * @param[in]	h_parent	Folder just listed, PTP_OBJECTHANDLE_ROOT for
+ *				the root of the store.
+ * @return	None.
+ */
+void _entity_prefetch_subfolders(mtp_store_t *store, mtp_uint32 h_parent)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 *handles = NULL;
+	ptp_array_t child_arr = { 0 };
+	prefetch_req_t *req = NULL;
+
+	ret_if(store == NULL || !g_prefetch_running);
+
+	_prop_init_ptparray(&child_arr, UINT32_TYPE);
+	_entity_get_child_handles_with_same_format(store, h_parent,
+			PTP_FMT_ASSOCIATION, &child_arr);
+	handles = (mtp_uint32 *)child_arr.array_entry;
+
+	pthread_mutex_lock(&g_prefetch_mutex);
+	for (i = 0; i < child_arr.num_ele; i++) {
+		req = g_new0(prefetch_req_t, 1);
+		req->store_id = store->store_id;
+		req->obj_handle = handles[i];
+		g_queue_push_head(&g_prefetch_queue, req);
+	}
+
+	while (g_queue_get_length(&g_prefetch_queue) > MTP_PREFETCH_QUEUE_MAX)
+		g_free(g_queue_pop_tail(&g_prefetch_queue));
+
+	if (child_arr.num_ele > 0)
+		pthread_cond_signal(&g_prefetch_cond);
+	pthread_mutex_unlock(&g_prefetch_mutex);
+
+	_prop_deinit_ptparray(&child_arr);
+}
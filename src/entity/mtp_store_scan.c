@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mtp_util.h"
+#include "mtp_support.h"
+#include "mtp_device.h"
+#include "mtp_thread.h"
+#include "mtp_transport.h"
+#include "mtp_inoti_handler.h"
+#include "mtp_store_scan.h"
+#include "mtp_exclude.h"
+
+extern mtp_config_t g_conf;
+
+/*
+ * Folders are read in two steps. A job lists a folder on disk into its
+ * own entries, without touching the store. The entries are then merged
+ * into the store by the thread holding the store lock.
+ *
+ * To read a whole store, a pool of scanner threads runs the jobs. Each
+ * scanner keeps the subfolders it finds in its own deque and takes the
+ * newest one next; an idle scanner steals the oldest job of another one,
+ * which is usually the biggest tree left. The caller merges the jobs as
+ * they complete, in the order the folders were found, so the handles do
+ * not depend on the number of scanners or on timing.
+ */
+typedef struct scan_job scan_job_t;
+
+typedef struct {
+	mtp_char *path;
+	file_type_t type;
+	file_attr_t attrs;
+	scan_job_t *job;	/* folders : the job reading it */
+} scan_entry_t;
+
+struct scan_job {
+	scan_job_t *parent;
+	mtp_obj_t *pobj;	/* NULL for the root, set once it is merged */
+	mtp_char *path;
+	mtp_uint32 root_len;	/* of the root path of the store */
+	GArray *entries;	/* scan_entry_t */
+	mtp_bool is_done;
+	mtp_bool is_complete;	/* every entry was read */
+	mtp_bool is_dropped;	/* its folder is not added, nor its tree */
+};
+
+typedef struct scan_pool scan_pool_t;
+
+typedef struct {
+	scan_pool_t *pool;
+	mtp_uint32 index;
+	pthread_t thrd;
+	GQueue deque;	/* scan_job_t, the owner uses the head */
+} scan_worker_t;
+
+struct scan_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;	/* a job was queued, or stopping */
+	pthread_cond_t done_cond;	/* a job was read */
+	scan_worker_t workers[MTP_MAX_ENUM_THREADS];
+	mtp_uint32 num_workers;
+	GPtrArray *jobs;	/* all of them, freed at the end */
+	mtp_bool is_stopping;
+};
+
+static scan_job_t *__new_scan_job(scan_job_t *parent, mtp_obj_t *pobj,
+		const mtp_char *path, mtp_uint32 root_len)
+{
+	scan_job_t *job = g_new0(scan_job_t, 1);
+
+	job->parent = parent;
+	job->pobj = pobj;
+	job->path = g_strdup(path);
+	job->root_len = root_len;
+	job->entries = g_array_new(FALSE, FALSE, sizeof(scan_entry_t));
+
+	return job;
+}
+
+static void __clear_scan_entries(scan_job_t *job)
+{
+	guint i = 0;
+
+	for (i = 0; i < job->entries->len; i++)
+		g_free(g_array_index(job->entries, scan_entry_t, i).path);
+	g_array_set_size(job->entries, 0);
+}
+
+static void __free_scan_job(scan_job_t *job)
+{
+	__clear_scan_entries(job);
+	g_array_free(job->entries, TRUE);
+	g_free(job->path);
+	g_free(job);
+}
+
+static gint __cmp_scan_entry(gconstpointer a, gconstpointer b)
+{
+	return strcmp(((const scan_entry_t *)a)->path,
+			((const scan_entry_t *)b)->path);
+}
+
+/*
+ * Lists the folder of a job. With a pool, a job is also made for each
+ * subfolder and queued on the deque of the worker, if any. Nothing of
+ * the store is used, so no lock is needed.
+ */
+static void __run_scan_job(scan_job_t *job, scan_pool_t *pool,
+		scan_worker_t *worker)
+{
+	guint i = 0;
+	dir_scan_t *scan = NULL;
+	scan_entry_t *ent = NULL;
+	scan_entry_t new_ent = { 0 };
+	dir_entry_t entry = { { 0 }, 0 };
+	GPtrArray *children = NULL;
+
+	scan = _util_dir_scan_open(job->path, 0);
+	if (scan == NULL) {
+		/* A folder which is gone is read as empty */
+		job->is_complete = TRUE;
+		return;
+	}
+
+	job->is_complete = TRUE;
+	while (_util_dir_scan_next(scan, &entry)) {
+		if (TRUE == g_status->is_usb_discon) {
+			/* LCOV_EXCL_START */
+			/* Left unread, it is read when the host lists it */
+			job->is_complete = FALSE;
+			break;
+			/* LCOV_EXCL_STOP */
+		}
+
+		/* Neither added, read nor watched */
+		if (_util_is_excluded(entry.filename + job->root_len + 1))
+			continue;
+
+		new_ent.path = g_strdup(entry.filename);
+		new_ent.type = entry.type;
+		new_ent.attrs = entry.attrs;
+		g_array_append_val(job->entries, new_ent);
+	}
+	_util_dir_scan_close(scan);
+
+	ret_if(!job->is_complete);
+
+	/* Handles then only depend on the names */
+	if (g_conf.enum_deterministic)
+		g_array_sort(job->entries, __cmp_scan_entry);
+
+	ret_if(pool == NULL);
+
+	children = g_ptr_array_new();
+	for (i = 0; i < job->entries->len; i++) {
+		ent = &g_array_index(job->entries, scan_entry_t, i);
+		if (ent->type != MTP_DIR_TYPE)
+			continue;
+
+		ent->job = __new_scan_job(job, NULL, ent->path,
+				job->root_len);
+		g_ptr_array_add(children, ent->job);
+	}
+
+	if (children->len > 0) {
+		pthread_mutex_lock(&pool->mutex);
+		for (i = 0; i < children->len; i++) {
+			g_ptr_array_add(pool->jobs,
+					g_ptr_array_index(children, i));
+			if (worker != NULL)
+				g_queue_push_head(&worker->deque,
+						g_ptr_array_index(children, i));
+		}
+		pthread_cond_broadcast(&pool->work_cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	g_ptr_array_free(children, TRUE);
+}
+
+/* The caller holds pool->mutex */
+static scan_job_t *__get_scan_job(scan_worker_t *worker)
+{
+	mtp_uint32 i = 0;
+	scan_pool_t *pool = worker->pool;
+	scan_worker_t *victim = NULL;
+	scan_job_t *job = NULL;
+
+	job = g_queue_pop_head(&worker->deque);
+	for (i = 1; job == NULL && i < pool->num_workers; i++) {
+		victim = &pool->workers[(worker->index + i) %
+			pool->num_workers];
+		job = g_queue_pop_tail(&victim->deque);
+	}
+
+	return job;
+}
+
+static void *__thread_scan_folders(void *arg)
+{
+	scan_worker_t *worker = (scan_worker_t *)arg;
+	scan_pool_t *pool = worker->pool;
+	scan_job_t *job = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->is_stopping) {
+		job = __get_scan_job(worker);
+		if (job == NULL) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+
+		/* No need to read a tree which is not added */
+		if (job->parent != NULL && job->parent->is_dropped)
+			job->is_dropped = TRUE;
+
+		if (!job->is_dropped) {
+			pthread_mutex_unlock(&pool->mutex);
+			__run_scan_job(job, pool, worker);
+			pthread_mutex_lock(&pool->mutex);
+		}
+
+		job->is_done = TRUE;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/*
+ * Paths of the objects already below pobj, e.g. sent by the host before
+ * the folder was read. The child array of an unread folder is short.
+ */
+static GHashTable *__get_known_children(mtp_store_t *store, mtp_obj_t *pobj)
+{
+	mtp_uint32 ii = 0;
+	mtp_uint32 *handles = NULL;
+	slist_node_t *node = NULL;
+	mtp_obj_t *obj = NULL;
+	GHashTable *known = NULL;
+
+	known = g_hash_table_new(g_str_hash, g_str_equal);
+
+	if (pobj != NULL) {
+		handles = (mtp_uint32 *)pobj->child_array.array_entry;
+		for (ii = 0; ii < pobj->child_array.num_ele; ii++) {
+			obj = _entity_get_object_from_store(store, handles[ii]);
+			if (obj != NULL && obj->file_path != NULL)
+				g_hash_table_add(known, obj->file_path);
+		}
+		return known;
+	}
+
+	for (ii = 0, node = store->obj_list.start;
+			ii < store->obj_list.nnodes; ii++, node = node->link) {
+		obj = (mtp_obj_t *)node->value;
+		if (obj != NULL && obj->obj_info != NULL &&
+				obj->obj_info->h_parent == PTP_OBJECTHANDLE_ROOT)
+			g_hash_table_add(known, obj->file_path);
+	}
+
+	return known;
+}
+
+static void __drop_scan_job(scan_pool_t *pool, scan_job_t *job)
+{
+	ret_if(job == NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	job->is_dropped = TRUE;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Adds the entries of a job to the store, the caller holds the store
+ * lock. Jobs of the new subfolders are queued on merge_queue.
+ */
+static void __merge_scan_job(mtp_store_t *store, scan_job_t *job,
+		scan_pool_t *pool, GQueue *merge_queue)
+{
+	guint i = 0;
+	mtp_uint32 h_parent = PTP_OBJECTHANDLE_ROOT;
+	mtp_char file_name[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	dir_entry_t entry = { { 0 }, 0 };
+	scan_entry_t *ent = NULL;
+	mtp_obj_t *obj = NULL;
+	GHashTable *known = NULL;
+
+	if (job->pobj != NULL)
+		h_parent = job->pobj->obj_handle;
+
+	known = __get_known_children(store, job->pobj);
+
+	for (i = 0; i < job->entries->len; i++) {
+		ent = &g_array_index(job->entries, scan_entry_t, i);
+		if (g_hash_table_contains(known, ent->path)) {
+			__drop_scan_job(pool, ent->job);
+			continue;
+		}
+
+		g_strlcpy(entry.filename, ent->path, sizeof(entry.filename));
+		entry.type = ent->type;
+		entry.attrs = ent->attrs;
+		_util_get_file_name(entry.filename, file_name);
+
+		if (entry.type != MTP_DIR_TYPE) {
+			_entity_add_file_to_store(store, h_parent,
+					entry.filename, file_name, &entry);
+			continue;
+		}
+
+		obj = _entity_add_folder_to_store(store, h_parent,
+				entry.filename, file_name, &entry);
+		if (obj == NULL) {
+			__drop_scan_job(pool, ent->job);
+			continue;
+		}
+
+		obj->is_unread = TRUE;
+		if (ent->job != NULL) {
+			ent->job->pobj = obj;
+			g_queue_push_tail(merge_queue, ent->job);
+		}
+	}
+
+	g_hash_table_destroy(known);
+
+#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
+	_inoti_add_watch_for_fs_events(job->path);
+#endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
+
+	if (job->pobj == NULL)
+		store->is_enumerated = TRUE;
+	else
+		job->pobj->is_unread = FALSE;
+}
+
+/*
+ * void _entity_scan_folder(mtp_store_t *store, mtp_obj_t *pobj)
+ * Reads one folder level in the calling thread, which holds the store
+ * lock. The subfolders are only added.
+ *
+ * @param[in]	store	Store holding the folder.
+ * @param[in]	pobj	Folder to read, NULL for the root of the store.
+ * @return	None.
+ */
+void _entity_scan_folder(mtp_store_t *store, mtp_obj_t *pobj)
+{
+	scan_job_t *job = NULL;
+
+	ret_if(store == NULL);
+
+	job = __new_scan_job(NULL, pobj,
+			pobj ? pobj->file_path : store->root_path,
+			strlen(store->root_path));
+	__run_scan_job(job, NULL, NULL);
+	if (job->is_complete)
+		__merge_scan_job(store, job, NULL, NULL);
+	__free_scan_job(job);
+}
+
+/*
+ * void _entity_scan_folder_unlocked(mtp_uint32 store_id, mtp_uint32 obj_handle)
+ * Reads one folder level for a thread which does not hold the store lock.
+ * The folder is read without it, the write lock is only taken to merge.
+ * Nothing is merged if the folder was read or changed meanwhile.
+ *
+ * @param[in]	store_id	Store holding the folder.
+ * @param[in]	obj_handle	Folder to read.
+ * @return	None.
+ */
+void _entity_scan_folder_unlocked(mtp_uint32 store_id, mtp_uint32 obj_handle)
+{
+	mtp_store_t *store = NULL;
+	mtp_obj_t *pobj = NULL;
+	scan_job_t *job = NULL;
+
+	_entity_lock_stores_read();
+	store = _device_get_store(store_id);
+	if (store != NULL)
+		pobj = _entity_get_object_from_store(store, obj_handle);
+	if (pobj != NULL && pobj->is_unread && pobj->file_path != NULL)
+		job = __new_scan_job(NULL, NULL, pobj->file_path,
+				strlen(store->root_path));
+	_entity_unlock_stores();
+	ret_if(job == NULL);
+
+	__run_scan_job(job, NULL, NULL);
+
+	_entity_lock_stores_write();
+	/* Read by a command meanwhile, moved or deleted */
+	store = _device_get_store(store_id);
+	pobj = NULL;
+	if (store != NULL && job->is_complete)
+		pobj = _entity_get_object_from_store(store, obj_handle);
+	if (pobj != NULL && pobj->is_unread &&
+			g_strcmp0(pobj->file_path, job->path) == 0) {
+		job->pobj = pobj;
+		__merge_scan_job(store, job, NULL, NULL);
+	}
+	_entity_unlock_stores();
+
+	__free_scan_job(job);
+}
+
+/*
+ * void _entity_scan_unread_folders(mtp_store_t *store)
+ * Reads the trees of all the folders of the store which were not read
+ * yet, with enum_threads scanners, or in the calling thread if it is 0.
+ * The caller holds the store lock.
+ *
+ * @param[in]	store	Store to read.
+ * @return	None.
+ */
+void _entity_scan_unread_folders(mtp_store_t *store)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 ii = 0;
+	mtp_uint32 merged = 0;
+	mtp_uint32 num_workers = 0;
+	slist_node_t *node = NULL;
+	mtp_obj_t *obj = NULL;
+	scan_job_t *job = NULL;
+	scan_worker_t *worker = NULL;
+	scan_pool_t *pool = NULL;
+	GQueue merge_queue = G_QUEUE_INIT;
+
+	ret_if(store == NULL);
+
+	pool = g_new0(scan_pool_t, 1);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->jobs = g_ptr_array_new_with_free_func(
+			(GDestroyNotify)__free_scan_job);
+
+	/* The scanners start with the folders left unread so far */
+	if (!store->is_enumerated) {
+		job = __new_scan_job(NULL, NULL, store->root_path,
+				strlen(store->root_path));
+		g_ptr_array_add(pool->jobs, job);
+		g_queue_push_tail(&merge_queue, job);
+	}
+	for (ii = 0, node = store->obj_list.start;
+			ii < store->obj_list.nnodes; ii++, node = node->link) {
+		obj = (mtp_obj_t *)node->value;
+		if (obj == NULL || !obj->is_unread)
+			continue;
+
+		job = __new_scan_job(NULL, obj, obj->file_path,
+				strlen(store->root_path));
+		g_ptr_array_add(pool->jobs, job);
+		g_queue_push_tail(&merge_queue, job);
+	}
+
+	if (g_queue_is_empty(&merge_queue))
+		goto DONE;
+
+	/*
+	 * The scanners wait for the mutex until they are all started, only
+	 * those which are get jobs.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	num_workers = CLAMP(g_conf.enum_threads, 0, MTP_MAX_ENUM_THREADS);
+	for (i = 0; i < num_workers; i++) {
+		worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		g_queue_init(&worker->deque);
+		if (_util_thread_create(&worker->thrd, "Folder scanner",
+					PTHREAD_CREATE_JOINABLE,
+					MTP_THREAD_CLASS_BG, __thread_scan_folders,
+					worker) == FALSE) {
+			/* LCOV_EXCL_START */
+			ERR("_util_thread_create(Folder scanner) Fail\n");
+			break;
+			/* LCOV_EXCL_STOP */
+		}
+	}
+	pool->num_workers = i;
+
+	/* Spread the first jobs, the scanners balance the rest */
+	for (i = 0; pool->num_workers > 0 && i < merge_queue.length; i++)
+		g_queue_push_tail(&pool->workers[i % pool->num_workers].deque,
+				g_queue_peek_nth(&merge_queue, i));
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	while ((job = g_queue_pop_head(&merge_queue)) != NULL) {
+		if (pool->num_workers == 0) {
+			__run_scan_job(job, pool, NULL);
+			job->is_done = TRUE;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		while (!job->is_done)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (TRUE == g_status->is_usb_discon) {
+			/* LCOV_EXCL_START */
+			DBG("USB is disconnected\n");
+			break;
+			/* LCOV_EXCL_STOP */
+		}
+
+		if (job->is_dropped || !job->is_complete)
+			continue;
+
+		__merge_scan_job(store, job, pool, &merge_queue);
+		__clear_scan_entries(job);
+		merged++;
+	}
+
+	/* What is still queued is in trees which are not added */
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_stopping = TRUE;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_workers; i++) {
+		_util_thread_join(pool->workers[i].thrd, NULL);
+		g_queue_clear(&pool->workers[i].deque);
+	}
+
+	DBG("store[0x%x] : %u folders read by %u scanners\n",
+			store->store_id, merged, pool->num_workers);
+
+DONE:
+	g_queue_clear(&merge_queue);
+	g_ptr_array_free(pool->jobs, TRUE);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	g_free(pool);
+}
@@ -0,0 +1,1015 @@
+/*
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A USB host in a process. The responder is started with socket pairs in
+ * place of its FunctionFS endpoints, the way systemd hands it the real
+ * ones, and is driven through a session running the workloads given with
+ * -w. Each workload reports its throughput, the latency of its operations
+ * and the CPU time both sides used for it, so no UDC nor USB host is
+ * needed to measure the protocol, e.g. in CI with storage_backend=memory.
+ * Objects of 4 GiB or more (-s) do not fit in a memory file: they are
+ * written for real through storage_backend=posix, which needs that much
+ * free disk where the responder stores them.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/usb/functionfs.h>
+#include "mtp_datatype.h"
+#include "mtp_config.h"
+#include "ptp_container.h"
+#include "ptp_datacodes.h"
+
+#define SIM_LISTEN_FDS_START	3	/* SD_LISTEN_FDS_START */
+#define SIM_MSG_SIZE		(1024 * 1024)
+#define SIM_IO_TIMEOUT		10000	/* ms */
+#define SIM_EXIT_TIMEOUT	5	/* s */
+#define SIM_MAX_PARAMS		MAX_MTP_PARAMS
+#define SIM_STATUS_POLL		100	/* us, between GETSTATUS requests */
+#define SIM_DRAIN_TIMEOUT	10	/* ms, of silence once cancelled */
+
+/* Still Image class requests */
+#define SIM_PTPREQUEST_CANCELIO		0x64
+#define SIM_PTPREQUEST_GETSTATUS	0x67
+
+enum {
+	SIM_EP0,
+	SIM_EP_IN,	/* device to host */
+	SIM_EP_OUT,	/* host to device */
+	SIM_EP_STATUS,
+	SIM_NUM_EPS
+};
+
+typedef struct {
+	int ep[SIM_NUM_EPS];	/* the host ends */
+	pid_t pid;
+	uint32_t tid;
+	size_t pkt_size;
+
+	/* The current message from the bulk in endpoint */
+	uint8_t *msg;
+	size_t msg_len;
+	size_t msg_pos;
+
+	uint32_t store_id;
+	uint32_t *handles;
+	uint32_t num_handles;
+	uint32_t events;
+} sim_t;
+
+/* Data phase from the device; with buf NULL the bytes are only counted */
+typedef struct {
+	uint8_t *buf;
+	size_t cap;
+	uint64_t len;
+} sim_data_t;
+
+typedef struct {
+	const char *name;
+	uint32_t ops;
+	uint64_t bytes;
+	uint64_t *lat;		/* ns, one per op */
+	uint64_t wall;		/* ns */
+	uint64_t host_cpu;	/* us */
+	uint64_t dev_cpu;	/* us */
+	const char *note;
+} sim_stats_t;
+
+typedef int (*sim_workload_fn)(sim_t *sim, sim_stats_t *stats);
+
+static uint32_t g_num_objects = 16;
+static uint64_t g_object_size = 1024 * 1024;
+static uint32_t g_num_listings = 16;
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t __host_cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static uint64_t __dev_cpu_us(pid_t pid)
+{
+	char path[64];
+	char buf[1024];
+	char *p;
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p)
+		return 0;
+
+	/* Fields 14 and 15, counted from the end of the command name */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+				"%llu %llu", &utime, &stime) != 2)
+		return 0;
+
+	return (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void __put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void __put32(uint8_t *p, uint32_t v)
+{
+	__put16(p, v);
+	__put16(p + 2, v >> 16);
+}
+
+static uint16_t __get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t __get32(const uint8_t *p)
+{
+	return __get16(p) | (uint32_t)__get16(p + 2) << 16;
+}
+
+/* A PTP string: character count with the NUL, then UTF-16LE */
+static size_t __put_string(uint8_t *p, const char *str)
+{
+	size_t i;
+	size_t len = strlen(str);
+
+	if (!len) {
+		p[0] = 0;
+		return 1;
+	}
+
+	p[0] = len + 1;
+	for (i = 0; i <= len; i++)
+		__put16(p + 1 + i * 2, (uint8_t)str[i]);
+
+	return 1 + (len + 1) * 2;
+}
+
+static int __wait_fd(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, SIM_IO_TIMEOUT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		fprintf(stderr, "The responder did not answer in %d ms\n",
+				SIM_IO_TIMEOUT);
+		return -1;
+	}
+	if (ret < 0 || (pfd.revents & (POLLERR | POLLHUP)))
+		return -1;
+
+	return 0;
+}
+
+static int __send_msg(sim_t *sim, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (__wait_fd(sim->ep[SIM_EP_OUT], POLLOUT) < 0)
+		return -1;
+
+	ret = send(sim->ep[SIM_EP_OUT], buf, len, MSG_NOSIGNAL);
+	if (ret != (ssize_t)len) {
+		fprintf(stderr, "Could not write to the responder: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends a container as USB transfers of at most pkt_size bytes, the
+ * header sharing the first one with the data. With data NULL, len bytes
+ * of a pattern are sent, so large objects need no buffer.
+ */
+static int __send_container(sim_t *sim, uint16_t type, uint16_t code,
+		const uint32_t *params, int num_params,
+		const uint8_t *data, uint64_t len)
+{
+	uint8_t *pkt;
+	size_t hdr_len = MTP_USB_HEADER_LENGTH + num_params * 4;
+	size_t fill;
+	uint64_t total = hdr_len + len;
+	uint64_t sent = 0;
+	int i;
+	int ret = 0;
+
+	pkt = malloc(sim->pkt_size);
+	if (!pkt)
+		return -1;
+
+	__put32(pkt, total > UINT32_MAX ? UINT32_MAX : (uint32_t)total);
+	__put16(pkt + 4, type);
+	__put16(pkt + 6, code);
+	__put32(pkt + 8, sim->tid);
+	for (i = 0; i < num_params; i++)
+		__put32(pkt + MTP_USB_HEADER_LENGTH + i * 4, params[i]);
+
+	fill = hdr_len;
+	do {
+		size_t chunk = sim->pkt_size - fill;
+
+		if (chunk > len - sent)
+			chunk = len - sent;
+		if (data)
+			memcpy(pkt + fill, data + sent, chunk);
+		else
+			memset(pkt + fill, (uint8_t)(sent >> 12), chunk);
+		sent += chunk;
+
+		ret = __send_msg(sim, pkt, fill + chunk);
+		fill = 0;
+	} while (!ret && sent < len);
+
+	free(pkt);
+	return ret;
+}
+
+/* Copies n bytes of the bulk in stream to dst, or skips them */
+static int __recv_bytes(sim_t *sim, uint8_t *dst, size_t n)
+{
+	while (n) {
+		size_t chunk;
+
+		if (sim->msg_pos == sim->msg_len) {
+			ssize_t ret;
+
+			if (__wait_fd(sim->ep[SIM_EP_IN], POLLIN) < 0)
+				return -1;
+			ret = recv(sim->ep[SIM_EP_IN], sim->msg, SIM_MSG_SIZE,
+					0);
+			if (ret <= 0) {
+				fprintf(stderr, "The responder hung up\n");
+				return -1;
+			}
+			sim->msg_len = ret;
+			sim->msg_pos = 0;
+		}
+
+		chunk = sim->msg_len - sim->msg_pos;
+		if (chunk > n)
+			chunk = n;
+		if (dst) {
+			memcpy(dst, sim->msg + sim->msg_pos, chunk);
+			dst += chunk;
+		}
+		sim->msg_pos += chunk;
+		n -= chunk;
+	}
+
+	return 0;
+}
+
+/* Counts the events the responder queued, they are not interpreted */
+static void __drain_events(sim_t *sim)
+{
+	uint8_t buf[64];
+
+	while (recv(sim->ep[SIM_EP_STATUS], buf, sizeof(buf),
+				MSG_DONTWAIT) > 0)
+		sim->events++;
+}
+
+/*
+ * Runs one transaction: the command, the data phase to the device when
+ * out_len is not 0, then the data phase from the device if any and the
+ * response. Returns the response code, 0 when the transport failed.
+ */
+static uint16_t __transact(sim_t *sim, uint16_t code,
+		const uint32_t *params, int num_params,
+		const uint8_t *out, uint64_t out_len,
+		sim_data_t *in, uint32_t *resp_params)
+{
+	uint8_t hdr[MTP_USB_HEADER_LENGTH];
+	uint8_t buf[SIM_MAX_PARAMS * 4];
+	uint32_t len;
+	uint16_t type;
+	int i;
+
+	sim->tid++;
+	if (__send_container(sim, CONTAINER_CMD_BLK, code, params,
+				num_params, NULL, 0) < 0)
+		return 0;
+	if (out_len && __send_container(sim, CONTAINER_DATA_BLK, code, NULL,
+				0, out, out_len) < 0)
+		return 0;
+
+	do {
+		if (__recv_bytes(sim, hdr, sizeof(hdr)) < 0)
+			return 0;
+		len = __get32(hdr);
+		type = __get16(hdr + 4);
+		if (len < MTP_USB_HEADER_LENGTH) {
+			fprintf(stderr, "Bad container length %u\n", len);
+			return 0;
+		}
+		len -= MTP_USB_HEADER_LENGTH;
+
+		if (type == CONTAINER_DATA_BLK) {
+			size_t keep = 0;
+
+			if (in && in->buf)
+				keep = len < in->cap ? len : in->cap;
+			if (__recv_bytes(sim, in ? in->buf : NULL, keep) < 0 ||
+					__recv_bytes(sim, NULL, len - keep) < 0)
+				return 0;
+			if (in)
+				in->len = len;
+		}
+	} while (type == CONTAINER_DATA_BLK);
+
+	if (type != CONTAINER_RESP_BLK || len > sizeof(buf)) {
+		fprintf(stderr, "Unexpected container type %u\n", type);
+		return 0;
+	}
+	if (__recv_bytes(sim, buf, len) < 0)
+		return 0;
+	for (i = 0; resp_params && i < SIM_MAX_PARAMS; i++) {
+		resp_params[i] = (uint32_t)i * 4 < len ?
+			__get32(buf + i * 4) : 0;
+	}
+
+	__drain_events(sim);
+
+	return __get16(hdr + 6);
+}
+
+static int __check(uint16_t resp, const char *op)
+{
+	if (resp == PTP_RESPONSE_OK)
+		return 0;
+
+	fprintf(stderr, "%s failed : 0x%04x\n", op, resp);
+	return -1;
+}
+
+static void __send_ep0_event(sim_t *sim, uint8_t type)
+{
+	struct usb_functionfs_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	if (send(sim->ep[SIM_EP0], &event, sizeof(event), MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "Could not write to ep0: %m\n");
+}
+
+/* A class request on ep0, followed by its data stage to the device */
+static int __send_ctrl(sim_t *sim, uint8_t dir, uint8_t request,
+		const uint8_t *data, uint16_t length)
+{
+	struct usb_functionfs_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = FUNCTIONFS_SETUP;
+	event.u.setup.bRequestType = dir | USB_TYPE_CLASS |
+		USB_RECIP_INTERFACE;
+	event.u.setup.bRequest = request;
+	__put16((uint8_t *)&event.u.setup.wLength, length);
+
+	if (send(sim->ep[SIM_EP0], &event, sizeof(event), MSG_NOSIGNAL) < 0 ||
+			(data && send(sim->ep[SIM_EP0], data, length,
+				      MSG_NOSIGNAL) < 0)) {
+		fprintf(stderr, "Could not write to ep0: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __get_status(sim_t *sim, uint16_t *code)
+{
+	uint8_t buf[12];
+	ssize_t ret;
+
+	if (__send_ctrl(sim, USB_DIR_IN, SIM_PTPREQUEST_GETSTATUS, NULL,
+				sizeof(buf)) < 0 ||
+			__wait_fd(sim->ep[SIM_EP0], POLLIN) < 0)
+		return -1;
+
+	ret = recv(sim->ep[SIM_EP0], buf, sizeof(buf), 0);
+	if (ret < 4) {
+		fprintf(stderr, "Bad GETSTATUS reply\n");
+		return -1;
+	}
+	*code = __get16(buf + 2);
+
+	return 0;
+}
+
+/*
+ * The data written before the cancel is already in the socket, as it would
+ * be in the buffers of a host, and is dropped. Anything else left on the
+ * bulk in endpoint, a response of the cancelled transaction above all, is
+ * a failure.
+ */
+static int __check_bulk_in_after_cancel(sim_t *sim, uint32_t tid)
+{
+	struct pollfd pfd = { .fd = sim->ep[SIM_EP_IN], .events = POLLIN };
+	ssize_t ret;
+
+	sim->msg_len = 0;
+	sim->msg_pos = 0;
+
+	while (poll(&pfd, 1, SIM_DRAIN_TIMEOUT) > 0) {
+		ret = recv(sim->ep[SIM_EP_IN], sim->msg, SIM_MSG_SIZE,
+				MSG_DONTWAIT);
+		if (ret <= 0)
+			break;
+
+		/* Responses and headers are written as messages of their own */
+		if (ret < MTP_USB_HEADER_LENGTH ||
+				__get32(sim->msg) != (uint32_t)ret)
+			continue;
+		if (__get16(sim->msg + 4) == CONTAINER_DATA_BLK &&
+				__get32(sim->msg + 8) == tid)
+			continue;
+
+		fprintf(stderr, "Container 0x%04x (type %u, tid %u) left "
+				"after cancelling tid %u\n",
+				__get16(sim->msg + 6), __get16(sim->msg + 4),
+				__get32(sim->msg + 8), tid);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __launch(sim_t *sim, const char *responder, const char *conf)
+{
+	int dev[SIM_NUM_EPS];
+	int sv[2];
+	int i;
+
+	for (i = 0; i < SIM_NUM_EPS; i++) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+					sv) < 0) {
+			fprintf(stderr, "socketpair failed: %m\n");
+			return -1;
+		}
+		sim->ep[i] = sv[0];
+		dev[i] = sv[1];
+	}
+
+	sim->pid = fork();
+	if (sim->pid < 0) {
+		fprintf(stderr, "fork failed: %m\n");
+		return -1;
+	}
+
+	if (sim->pid == 0) {
+		char pid[16];
+
+		/* Out of the way of the listen fds first */
+		for (i = 0; i < SIM_NUM_EPS; i++)
+			dev[i] = fcntl(dev[i], F_DUPFD_CLOEXEC,
+					SIM_LISTEN_FDS_START + SIM_NUM_EPS);
+		for (i = 0; i < SIM_NUM_EPS; i++) {
+			if (dev[i] < 0 || dup2(dev[i],
+						SIM_LISTEN_FDS_START + i) < 0)
+				_exit(127);
+		}
+
+		snprintf(pid, sizeof(pid), "%d", (int)getpid());
+		setenv("LISTEN_PID", pid, 1);
+		setenv("LISTEN_FDS", "4", 1);
+		unsetenv("LISTEN_FDNAMES");
+
+		if (conf)
+			execlp(responder, responder, "-c", conf, (char *)NULL);
+		else
+			execlp(responder, responder, (char *)NULL);
+		fprintf(stderr, "Could not run %s: %m\n", responder);
+		_exit(127);
+	}
+
+	for (i = 0; i < SIM_NUM_EPS; i++)
+		close(dev[i]);
+
+	__send_ep0_event(sim, FUNCTIONFS_ENABLE);
+
+	return 0;
+}
+
+static int __terminate(sim_t *sim)
+{
+	int status = 0;
+	int i;
+
+	__send_ep0_event(sim, FUNCTIONFS_DISABLE);
+	__send_ep0_event(sim, FUNCTIONFS_UNBIND);
+
+	for (i = 0; i < SIM_EXIT_TIMEOUT * 10; i++) {
+		if (waitpid(sim->pid, &status, WNOHANG) == sim->pid)
+			break;
+		usleep(100000);
+	}
+	if (i == SIM_EXIT_TIMEOUT * 10) {
+		fprintf(stderr, "The responder did not exit, killing it\n");
+		kill(sim->pid, SIGTERM);
+		waitpid(sim->pid, &status, 0);
+		return -1;
+	}
+
+	for (i = 0; i < SIM_NUM_EPS; i++)
+		close(sim->ep[i]);
+
+	return WIFEXITED(status) ? 0 : -1;
+}
+
+static int __open_session(sim_t *sim)
+{
+	uint32_t param = 1;
+	uint8_t buf[64];
+	sim_data_t ids = { buf, sizeof(buf), 0 };
+
+	if (__check(__transact(sim, PTP_OPCODE_OPENSESSION, &param, 1, NULL,
+					0, NULL, NULL), "OpenSession") < 0)
+		return -1;
+	if (__check(__transact(sim, PTP_OPCODE_GETSTORAGEIDS, NULL, 0, NULL,
+					0, &ids, NULL), "GetStorageIDs") < 0)
+		return -1;
+	if (ids.len < 8 || !__get32(buf)) {
+		fprintf(stderr, "The responder has no store\n");
+		return -1;
+	}
+	sim->store_id = __get32(buf + 4);
+
+	return 0;
+}
+
+static int __send_object(sim_t *sim, sim_stats_t *stats)
+{
+	uint8_t info[256];
+	uint8_t *p;
+	uint32_t params[SIM_MAX_PARAMS] = { sim->store_id, 0 };
+	uint32_t resp[SIM_MAX_PARAMS];
+	uint32_t prop[2] = { 0, MTP_OBJ_PROPERTYCODE_OBJECTSIZE };
+	uint8_t size[8];
+	int is_large = g_object_size >= UINT32_MAX;
+	char name[32];
+	uint32_t i;
+	uint64_t start;
+
+	__put32(size, (uint32_t)g_object_size);
+	__put32(size + 4, (uint32_t)(g_object_size >> 32));
+
+	for (i = 0; i < g_num_objects; i++) {
+		/* ObjectInfo dataset, 0xFFFFFFFF : 4 GiB or more */
+		memset(info, 0, sizeof(info));
+		p = info;
+		__put32(p, sim->store_id);
+		__put16(p + 4, PTP_FMT_UNDEF);
+		__put32(p + 8, is_large ? UINT32_MAX : (uint32_t)g_object_size);
+		p += 52;	/* fixed size members, the others left 0 */
+		snprintf(name, sizeof(name), "sim%04u.bin", i);
+		p += __put_string(p, name);
+		p += __put_string(p, "");
+		p += __put_string(p, "");
+		p += __put_string(p, "");
+
+		start = __now_ns();
+		if (__check(__transact(sim, PTP_OPCODE_SENDOBJECTINFO, params,
+						2, info, p - info, NULL, resp),
+					"SendObjectInfo") < 0)
+			return -1;
+		/* The real size of a large object, before its data */
+		prop[0] = resp[2];
+		if (is_large && __check(__transact(sim,
+						MTP_OPCODE_SETOBJECTPROPVALUE,
+						prop, 2, size, sizeof(size),
+						NULL, NULL),
+					"SetObjectPropValue(ObjectSize)") < 0)
+			return -1;
+		if (__check(__transact(sim, PTP_OPCODE_SENDOBJECT, NULL, 0,
+						NULL, g_object_size, NULL,
+						NULL), "SendObject") < 0)
+			return -1;
+		stats->lat[stats->ops++] = __now_ns() - start;
+		stats->bytes += g_object_size;
+
+		sim->handles[sim->num_handles++] = resp[2];
+	}
+
+	return 0;
+}
+
+static int __get_object(sim_t *sim, sim_stats_t *stats)
+{
+	sim_data_t data = { NULL, 0, 0 };
+	uint32_t i;
+	uint64_t start;
+
+	/* Their data container has no length, which is not followed here */
+	if (g_object_size >= UINT32_MAX - MTP_USB_HEADER_LENGTH) {
+		stats->note = "skipped, objects of 4 GiB or more";
+		return 0;
+	}
+
+	for (i = 0; i < sim->num_handles; i++) {
+		start = __now_ns();
+		if (__check(__transact(sim, PTP_OPCODE_GETOBJECT,
+						&sim->handles[i], 1, NULL, 0,
+						&data, NULL), "GetObject") < 0)
+			return -1;
+		stats->lat[stats->ops++] = __now_ns() - start;
+		stats->bytes += data.len;
+
+		if (data.len != g_object_size) {
+			fprintf(stderr, "Object 0x%x has %llu bytes\n",
+					sim->handles[i],
+					(unsigned long long)data.len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Cancels each GetObject once its data started coming, then polls
+ * GETSTATUS as hosts do. The latency is from the cancel request to the
+ * OK status, when the responder is ready for the next transaction.
+ */
+static int __cancel_get_object(sim_t *sim, sim_stats_t *stats)
+{
+	uint8_t hdr[MTP_USB_HEADER_LENGTH];
+	uint8_t req[6];
+	uint16_t code = 0;
+	uint32_t i;
+	uint64_t start;
+	uint64_t lat;
+
+	if (!sim->num_handles ||
+			g_object_size >= UINT32_MAX - MTP_USB_HEADER_LENGTH) {
+		stats->note = "skipped, needs sendobject, under 4 GiB";
+		return 0;
+	}
+
+	for (i = 0; i < sim->num_handles; i++) {
+		sim->tid++;
+		if (__send_container(sim, CONTAINER_CMD_BLK,
+					PTP_OPCODE_GETOBJECT, &sim->handles[i],
+					1, NULL, 0) < 0 ||
+				__recv_bytes(sim, hdr, sizeof(hdr)) < 0)
+			return -1;
+
+		__put16(req, PTP_EVENTCODE_CANCELTRANSACTION);
+		__put32(req + 2, sim->tid);
+		start = __now_ns();
+		if (__send_ctrl(sim, USB_DIR_OUT, SIM_PTPREQUEST_CANCELIO,
+					req, sizeof(req)) < 0)
+			return -1;
+
+		do {
+			if (__get_status(sim, &code) < 0)
+				return -1;
+			lat = __now_ns() - start;
+			if (code == PTP_RESPONSE_OK ||
+					lat > SIM_IO_TIMEOUT * 1000000ULL)
+				break;
+			usleep(SIM_STATUS_POLL);
+		} while (code == PTP_RESPONSE_DEVICEBUSY ||
+				code == PTP_RESPONSE_TRANSACTIONCANCELLED);
+		if (__check(code, "GETSTATUS after cancel") < 0)
+			return -1;
+		stats->lat[stats->ops++] = lat;
+
+		if (__check_bulk_in_after_cancel(sim, sim->tid) < 0)
+			return -1;
+		__drain_events(sim);
+	}
+
+	return 0;
+}
+
+static int __get_object_handles(sim_t *sim, sim_stats_t *stats)
+{
+	/* Every object of the store */
+	uint32_t params[] = { sim->store_id, PTP_FORMATCODE_NOTUSED, 0 };
+	sim_data_t data = { NULL, 0, 0 };
+	uint32_t i;
+	uint64_t start;
+
+	for (i = 0; i < g_num_listings; i++) {
+		start = __now_ns();
+		if (__check(__transact(sim, PTP_OPCODE_GETOBJECTHANDLES,
+						params, 3, NULL, 0, &data,
+						NULL), "GetObjectHandles") < 0)
+			return -1;
+		stats->lat[stats->ops++] = __now_ns() - start;
+		stats->bytes += data.len;
+	}
+
+	return 0;
+}
+
+static int __get_object_prop_list(sim_t *sim, sim_stats_t *stats)
+{
+	static const uint16_t props[] = {
+		MTP_OBJ_PROPERTYCODE_OBJECTFILENAME,
+		MTP_OBJ_PROPERTYCODE_OBJECTSIZE,
+		MTP_OBJ_PROPERTYCODE_DATEMODIFIED,
+	};
+	uint32_t params[] = { 0, PTP_FORMATCODE_NOTUSED, PTP_PROPERTY_ALL,
+		0, 1 };
+	sim_data_t data = { NULL, 0, 0 };
+	uint32_t i;
+	uint32_t j;
+	uint16_t resp;
+	uint64_t start;
+
+	for (i = 0; i < g_num_listings; i++) {
+		start = __now_ns();
+		resp = __transact(sim, MTP_OPCODE_GETOBJECTPROPLIST, params,
+				5, NULL, 0, &data, NULL);
+		if (resp == PTP_RESPONSE_OP_NOT_SUPPORTED)
+			break;
+		if (__check(resp, "GetObjectPropList") < 0)
+			return -1;
+		stats->lat[stats->ops++] = __now_ns() - start;
+		stats->bytes += data.len;
+	}
+	if (i == g_num_listings)
+		return 0;
+
+	/* What a host does without it: one request per object and property */
+	stats->note = "GetObjectPropValue, GetObjectPropList not supported";
+	for (i = 0; i < g_num_listings; i++) {
+		start = __now_ns();
+		for (j = 0; j < sim->num_handles * 3; j++) {
+			params[0] = sim->handles[j / 3];
+			params[1] = props[j % 3];
+			resp = __transact(sim, MTP_OPCODE_GETOBJECTPROPVALUE,
+					params, 2, NULL, 0, &data, NULL);
+			if (__check(resp, "GetObjectPropValue") < 0)
+				return -1;
+			stats->bytes += data.len;
+		}
+		stats->lat[stats->ops++] = __now_ns() - start;
+	}
+
+	return 0;
+}
+
+static int __delete_object(sim_t *sim, sim_stats_t *stats)
+{
+	uint32_t params[] = { 0, PTP_FORMATCODE_NOTUSED };
+	uint64_t start;
+
+	while (sim->num_handles) {
+		params[0] = sim->handles[--sim->num_handles];
+		start = __now_ns();
+		if (__check(__transact(sim, PTP_OPCODE_DELETEOBJECT, params,
+						2, NULL, 0, NULL, NULL),
+					"DeleteObject") < 0)
+			return -1;
+		stats->lat[stats->ops++] = __now_ns() - start;
+	}
+
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	sim_workload_fn fn;
+} g_workloads[] = {
+	{ "sendobject", __send_object },
+	{ "getobject", __get_object },
+	{ "cancel", __cancel_get_object },
+	{ "handles", __get_object_handles },
+	{ "proplist", __get_object_prop_list },
+	{ "deleteobject", __delete_object },
+};
+
+static int __cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double __percentile_us(const sim_stats_t *stats, uint32_t pct)
+{
+	uint32_t idx;
+
+	if (!stats->ops)
+		return 0;
+
+	idx = (uint32_t)(((uint64_t)stats->ops * pct + 99) / 100);
+	return stats->lat[idx ? idx - 1 : 0] / 1000.0;
+}
+
+static void __report(sim_stats_t *stats)
+{
+	double secs = stats->wall / 1e9;
+
+	qsort(stats->lat, stats->ops, sizeof(uint64_t), __cmp_u64);
+	printf("%-13s %6u %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+			stats->name, stats->ops,
+			secs > 0 ? stats->bytes / secs / 1e6 : 0.0,
+			__percentile_us(stats, 50), __percentile_us(stats, 90),
+			__percentile_us(stats, 99), __percentile_us(stats, 100),
+			stats->host_cpu / 1000.0, stats->dev_cpu / 1000.0);
+	if (stats->note)
+		printf("%-13s (%s)\n", "", stats->note);
+}
+
+static int __run(sim_t *sim, const char *name)
+{
+	sim_stats_t stats = { 0 };
+	uint64_t host_cpu;
+	uint64_t dev_cpu;
+	uint64_t start;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < sizeof(g_workloads) / sizeof(g_workloads[0]); i++) {
+		if (!strcmp(g_workloads[i].name, name))
+			break;
+	}
+	if (i == sizeof(g_workloads) / sizeof(g_workloads[0])) {
+		fprintf(stderr, "Unknown workload %s\n", name);
+		return -1;
+	}
+
+	stats.name = name;
+	stats.lat = calloc(g_num_objects > g_num_listings ?
+			g_num_objects : g_num_listings, sizeof(uint64_t));
+	if (!stats.lat)
+		return -1;
+
+	host_cpu = __host_cpu_us();
+	dev_cpu = __dev_cpu_us(sim->pid);
+	start = __now_ns();
+	ret = g_workloads[i].fn(sim, &stats);
+	stats.wall = __now_ns() - start;
+	stats.host_cpu = __host_cpu_us() - host_cpu;
+	stats.dev_cpu = __dev_cpu_us(sim->pid) - dev_cpu;
+
+	if (!ret)
+		__report(&stats);
+	free(stats.lat);
+
+	return ret;
+}
+
+static void __usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -r path   responder to run (default cmtp-responder)\n"
+		"  -c file   its configuration file\n"
+		"  -p bytes  USB packet size from the host, up to the\n"
+		"            read_usb_size of the responder (default %d)\n"
+		"  -n count  objects to send (default %u)\n"
+		"  -s KiB    object size (default %llu), from 4 GiB on\n"
+		"            it is given with ObjectSize and the data\n"
+		"            container has no length; nothing is stored\n"
+		"            on the host, e.g. -s 6291456 for 6 GiB;\n"
+		"            the responder then needs storage_backend=posix\n"
+		"            and as much free disk, memory files stop at\n"
+		"            4 GiB\n"
+		"  -l count  object listings (default %u)\n"
+		"  -w list   workloads separated by ',' among sendobject,\n"
+		"            getobject, cancel, handles, proplist,\n"
+		"            deleteobject (default all of them, in this\n"
+		"            order); cancel reports the time from a cancel\n"
+		"            request during GetObject to the OK status\n",
+		prog, MTP_READ_USB_SIZE, g_num_objects,
+		(unsigned long long)g_object_size / 1024,
+		g_num_listings);
+}
+
+int main(int argc, char *argv[])
+{
+	sim_t sim = { .pkt_size = MTP_READ_USB_SIZE };
+	const char *responder = "cmtp-responder";
+	const char *conf = NULL;
+	char workloads[256] = "sendobject,getobject,cancel,handles,proplist,"
+		"deleteobject";
+	char *name;
+	char *save = NULL;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:c:p:n:s:l:w:")) != -1) {
+		switch (opt) {
+		case 'r':
+			responder = optarg;
+			break;
+		case 'c':
+			conf = optarg;
+			break;
+		case 'p':
+			sim.pkt_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			g_num_objects = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			g_object_size = strtoull(optarg, NULL, 0) * 1024;
+			break;
+		case 'l':
+			g_num_listings = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			snprintf(workloads, sizeof(workloads), "%s", optarg);
+			break;
+		default:
+			__usage(argv[0]);
+			return 1;
+		}
+	}
+	if (sim.pkt_size <= MTP_USB_HEADER_LENGTH + SIM_MAX_PARAMS * 4) {
+		__usage(argv[0]);
+		return 1;
+	}
+
+	sim.msg = malloc(SIM_MSG_SIZE);
+	sim.handles = calloc(g_num_objects ? g_num_objects : 1,
+			sizeof(uint32_t));
+	if (!sim.msg || !sim.handles)
+		return 1;
+
+	if (__launch(&sim, responder, conf) < 0)
+		return 1;
+
+	if (__open_session(&sim) < 0) {
+		ret = -1;
+	} else {
+		printf("%-13s %6s %9s %9s %9s %9s %9s %9s %9s\n", "workload",
+				"ops", "MB/s", "p50 us", "p90 us", "p99 us",
+				"max us", "host ms", "dev ms");
+		for (name = strtok_r(workloads, ",", &save); name && !ret;
+				name = strtok_r(NULL, ",", &save))
+			ret = __run(&sim, name);
+
+		/* The store is left as it was found */
+		if (sim.num_handles && !ret)
+			ret = __run(&sim, "deleteobject");
+		if (!ret)
+			ret = __check(__transact(&sim, PTP_OPCODE_CLOSESESSION,
+						NULL, 0, NULL, 0, NULL, NULL),
+					"CloseSession");
+		printf("%u events received\n", sim.events);
+	}
+
+	if (__terminate(&sim) < 0)
+		ret = -1;
+
+	free(sim.handles);
+	free(sim.msg);
+
+	return ret ? 1 : 0;
+}
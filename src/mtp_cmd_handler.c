@@ -37,7 +37,6 @@
  */
 extern mtp_mgr_t g_mtp_mgr;
 extern mtp_bool g_is_full_enum;
-extern pthread_mutex_t g_cmd_inoti_mutex;
 extern mtp_config_t g_conf;
 extern mtp_char g_copy_src_file[MTP_MAX_PATHNAME_SIZE + 1];
 extern mtp_char g_copy_dst_file[MTP_MAX_PATHNAME_SIZE + 1];
@@ -105,10 +104,9 @@ static void __get_object_prop_desc(mtp_handler_t *hdlr)
 {
 	mtp_uint32 prop_id = 0;
 	mtp_uint32 fmt = 0;
-	obj_prop_desc_t prop = { { 0 }, };
-	data_blk_t blk = { 0, };
-	mtp_uint32 num_bytes = 0;
-	mtp_uchar *ptr = NULL;
+	mtp_uint32 blk_len = 0;
+	mtp_uchar *blk = NULL;
+	mtp_err_t ret = MTP_ERROR_NONE;
 
 	if (_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 2)) {
 		_cmd_hdlr_send_response_code(hdlr,
@@ -119,31 +117,24 @@ static void __get_object_prop_desc(mtp_handler_t *hdlr)
 	prop_id = _hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 0);
 	fmt = _hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 1);
 
-	if (MTP_ERROR_NONE != _hutil_get_prop_desc(fmt, prop_id, &prop)) {
+	ret = _hutil_get_prop_desc_blk(fmt, prop_id, &blk, &blk_len);
+	if (ret == MTP_ERROR_INVALID_OBJ_PROP_CODE) {
 		_cmd_hdlr_send_response_code(hdlr,
 				PTP_RESPONSE_PROP_NOTSUPPORTED);
 		return;
-	}
-
-	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
-	num_bytes = _prop_size_obj_prop_desc(&prop);
-	ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
-
-	if (num_bytes == _prop_pack_obj_prop_desc(&prop, ptr, num_bytes)) {
-		_device_set_phase(DEVICE_PHASE_DATAIN);
-		if (_hdlr_send_data_container(&blk)) {
-			_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
-		} else {
-			/* Host Cancelled data-in transfer */
-			_device_set_phase(DEVICE_PHASE_NOTREADY);
-		}
-	} else {
+	} else if (ret != MTP_ERROR_NONE) {
 		_cmd_hdlr_send_response_code(hdlr,
 				PTP_RESPONSE_GEN_ERROR);
+		return;
 	}
 
-	g_free(blk.data);
-	return;
+	_device_set_phase(DEVICE_PHASE_DATAIN);
+	if (_hdlr_send_cached_data_container(blk, blk_len, hdlr->usb_cmd.tid)) {
+		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
+	} else {
+		/* Host Cancelled data-in transfer */
+		_device_set_phase(DEVICE_PHASE_NOTREADY);
+	}
 }
 
 static void __get_device_info(mtp_handler_t *hdlr)
@@ -171,28 +162,24 @@ static void __get_device_info(mtp_handler_t *hdlr)
 		return;
 	}
 
-	/*Build the data block for device info.*/
-	data_blk_t blk = { 0 };
-	mtp_uint32 num_bytes = 0;
-	mtp_uchar *buf_ptr = NULL;
+	/* The DeviceInfo dataset is static, send the packed copy */
+	mtp_uint32 blk_len = 0;
+	mtp_uchar *blk = NULL;
 
-	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
-	num_bytes = _get_device_info_size();
-	buf_ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
-	if (num_bytes == _pack_device_info(buf_ptr, num_bytes)) {
-		_device_set_phase(DEVICE_PHASE_DATAIN);
-		if (_hdlr_send_data_container(&blk)) {
-			_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
-		} else {
-			/* Host Cancelled data-in transfer */
-			_device_set_phase(DEVICE_PHASE_NOTREADY);
-			DBG("Device phase is set to DEVICE_PHASE_NOTREADY\n");
-		}
-	} else {
+	blk = _device_get_device_info_blk(&blk_len);
+	if (blk == NULL) {
 		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
+		return;
 	}
 
-	g_free(blk.data);
+	_device_set_phase(DEVICE_PHASE_DATAIN);
+	if (_hdlr_send_cached_data_container(blk, blk_len, hdlr->usb_cmd.tid)) {
+		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
+	} else {
+		/* Host Cancelled data-in transfer */
+		_device_set_phase(DEVICE_PHASE_NOTREADY);
+		DBG("Device phase is set to DEVICE_PHASE_NOTREADY\n");
+	}
 }
 
 static void __get_storage_ids(mtp_handler_t *hdlr)
@@ -241,10 +228,9 @@ static void __get_storage_ids(mtp_handler_t *hdlr)
 static void __get_storage_info(mtp_handler_t *hdlr)
 {
 	mtp_uint32 store_id = 0;
-	store_info_t store_info = { 0 };
-	mtp_uint32 pkt_sz = 0;
-	data_blk_t blk = { 0 };
-	mtp_uchar *ptr = NULL;
+	mtp_uint32 blk_len = 0;
+	mtp_uchar *blk = NULL;
+	mtp_err_t ret = MTP_ERROR_NONE;
 
 	if (_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 1) ||
 			_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 2)) {
@@ -256,31 +242,24 @@ static void __get_storage_info(mtp_handler_t *hdlr)
 
 	store_id = _hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 0);
 
-	if (_hutil_get_storage_entry(store_id, &store_info) != MTP_ERROR_NONE) {
+	ret = _hutil_get_storage_info_blk(store_id, &blk, &blk_len);
+	if (ret == MTP_ERROR_INVALID_STORE) {
 		_cmd_hdlr_send_response_code(hdlr,
 				PTP_RESPONSE_INVALID_STORE_ID);
 		return;
+	} else if (ret != MTP_ERROR_NONE) {
+		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
+		return;
 	}
 
-	/* Build the data block for StorageInfo Dataset.*/
-	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
-	pkt_sz = _hutil_get_storage_info_size(&store_info);
-	ptr = _hdlr_alloc_buf_data_container(&blk, pkt_sz, pkt_sz);
-
-	if (pkt_sz == _entity_pack_store_info(&store_info, ptr, pkt_sz)) {
-		_device_set_phase(DEVICE_PHASE_DATAIN);
-		if (_hdlr_send_data_container(&blk)) {
-			_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
-		} else {
-			/*Host Cancelled data-in transfer*/
-			_device_set_phase(DEVICE_PHASE_NOTREADY);
-			DBG("DEVICE_PHASE_NOTREADY!!\n");
-		}
+	_device_set_phase(DEVICE_PHASE_DATAIN);
+	if (_hdlr_send_cached_data_container(blk, blk_len, hdlr->usb_cmd.tid)) {
+		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
 	} else {
-		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
+		/*Host Cancelled data-in transfer*/
+		_device_set_phase(DEVICE_PHASE_NOTREADY);
+		DBG("DEVICE_PHASE_NOTREADY!!\n");
 	}
-
-	g_free(blk.data);
 }
 
 static void __get_object_handles(mtp_handler_t *hdlr)
@@ -354,13 +333,10 @@ static void __get_object_handles(mtp_handler_t *hdlr)
 static void __get_object_info(mtp_handler_t *hdlr)
 {
 	mtp_uint32 obj_handle = 0;
-	data_blk_t blk = { 0 };
-	mtp_uint32 num_bytes = 0;
-	mtp_uchar *ptr = NULL;
+	mtp_uint32 blk_len = 0;
+	mtp_uchar *blk = NULL;
+	mtp_uchar *packed = NULL;
 	mtp_obj_t *obj = NULL;
-	mtp_char f_name[MTP_MAX_FILENAME_SIZE + 1] = { 0 };
-	mtp_wchar wf_name[MTP_MAX_FILENAME_SIZE + 1] = { 0 };
-	ptp_string_t ptp_string = { 0 };
 
 	if (_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 1) ||
 			_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 2)) {
@@ -376,18 +352,17 @@ static void __get_object_info(mtp_handler_t *hdlr)
 		return;
 	}
 
-	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
-
-	_util_get_file_name(obj->file_path, f_name);
-	_util_utf8_to_utf16(wf_name, sizeof(wf_name) / WCHAR_SIZ, f_name);
-	_prop_copy_char_to_ptpstring(&ptp_string, wf_name, WCHAR_TYPE);
+	blk = _entity_get_obj_info_blk(obj, &blk_len);
+	if (blk == NULL) {
+		/* Cache disabled, pack a private copy */
+		packed = _entity_pack_obj_info_blk(obj, &blk_len);
+		blk = packed;
+	}
 
-	num_bytes = _entity_get_object_info_size(obj, &ptp_string);
-	ptr = _hdlr_alloc_buf_data_container(&blk, num_bytes, num_bytes);
-	if (num_bytes == _entity_pack_obj_info(obj, &ptp_string, ptr,
-				num_bytes)) {
+	if (blk != NULL) {
 		_device_set_phase(DEVICE_PHASE_DATAIN);
-		if (_hdlr_send_data_container(&blk)) {
+		if (_hdlr_send_cached_data_container(blk, blk_len,
+					hdlr->usb_cmd.tid)) {
 			_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
 		} else {
 			/* Host Cancelled data-in transfer*/
@@ -398,7 +373,7 @@ static void __get_object_info(mtp_handler_t *hdlr)
 		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
 	}
 
-	g_free(blk.data);
+	g_free(packed);
 }
 
 static void __get_object(mtp_handler_t *hdlr)
@@ -409,6 +384,7 @@ static void __get_object(mtp_handler_t *hdlr)
 	data_blk_t blk;
 	mtp_char *path;
 	mtp_uint64 num_bytes;
+	mtp_uint64 file_size = 0;
 	mtp_uint64 total_len;
 	mtp_uint64 sent = 0;
 	mtp_uint16 resp = PTP_RESPONSE_OK;
@@ -442,20 +418,7 @@ static void __get_object(mtp_handler_t *hdlr)
 	}
 #endif /* MTP_SUPPORT_SET_PROTECTION */
 
-	path = obj->file_path;
-	num_bytes = obj->obj_info->file_size;
-	total_len = num_bytes + sizeof(header_container_t);
-	packet_len = total_len < g_conf.read_file_size ? num_bytes :
-		(g_conf.read_file_size - sizeof(header_container_t));
-
-	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
-	ptr = _hdlr_alloc_buf_data_container(&blk, packet_len, num_bytes);
-	if (NULL == ptr) {
-		ERR("_hdlr_alloc_buf_data_container() Fail\n");
-		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
-		g_free(blk.data);
-		return;
-	}
+	path = g_strdup(obj->file_path);
 
 	_device_set_phase(DEVICE_PHASE_DATAIN);
 	h_file = _util_file_open(path, MTP_FILE_READ, &error);
@@ -465,14 +428,49 @@ static void __get_object(mtp_handler_t *hdlr)
 		if (EACCES == error) {
 			_cmd_hdlr_send_response_code(hdlr,
 					PTP_RESPONSE_ACCESSDENIED);
-			g_free(blk.data);
+			g_free(path);
 			return;
 		}
 		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
+		g_free(path);
+		return;
+	}
+
+	/*
+	 * The file may change after the object was last updated, the open
+	 * file tells how much is sent. The store is only read here.
+	 */
+	num_bytes = obj->obj_info->file_size;
+	if (_util_file_get_size(h_file, path, &file_size) &&
+			file_size != num_bytes) {
+		DBG("object[0x%x] size %llu, file %llu\n", obj_handle,
+				(unsigned long long)num_bytes,
+				(unsigned long long)file_size);
+		num_bytes = file_size;
+	}
+
+	total_len = num_bytes + sizeof(header_container_t);
+	packet_len = total_len < g_conf.read_file_size ? num_bytes :
+		(g_conf.read_file_size - sizeof(header_container_t));
+
+	_hdlr_init_data_container(&blk, hdlr->usb_cmd.code, hdlr->usb_cmd.tid);
+	ptr = _hdlr_alloc_buf_data_container(&blk, packet_len, num_bytes);
+	if (NULL == ptr) {
+		ERR("_hdlr_alloc_buf_data_container() Fail\n");
+		_device_set_phase(DEVICE_PHASE_NOTREADY);
+		_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_GEN_ERROR);
+		_util_file_close(h_file);
 		g_free(blk.data);
+		g_free(path);
 		return;
 	}
 
+	/*
+	 * The open file keeps the data reachable, so file system events may
+	 * change the store while the object is streaming.
+	 */
+	_entity_unlock_stores();
+
 	_util_file_read(h_file, ptr, packet_len, &read_len);
 	if (0 == read_len) {
 		ERR("_util_file_read() Fail\n");
@@ -482,8 +480,11 @@ static void __get_object(mtp_handler_t *hdlr)
 		goto Done;
 	}
 
-	/* First Packet with Header */
-	if (PTP_EVENTCODE_CANCELTRANSACTION == _transport_get_control_event() ||
+	/*
+	 * First Packet with Header. The cancel code is left set, so that no
+	 * response is sent, until the next command comes.
+	 */
+	if (PTP_EVENTCODE_CANCELTRANSACTION == g_status->ctrl_event_code ||
 			FALSE == _hdlr_send_bulk_data(blk.data, blk.len)) {
 		_device_set_phase(DEVICE_PHASE_NOTREADY);
 		resp = PTP_RESPONSE_INCOMPLETETRANSFER;
@@ -505,7 +506,7 @@ static void __get_object(mtp_handler_t *hdlr)
 			goto Done;
 		}
 
-		if (PTP_EVENTCODE_CANCELTRANSACTION == _transport_get_control_event() ||
+		if (PTP_EVENTCODE_CANCELTRANSACTION == g_status->ctrl_event_code ||
 				FALSE == _hdlr_send_bulk_data(ptr, read_len)) {
 			_device_set_phase(DEVICE_PHASE_NOTREADY);
 			resp = PTP_RESPONSE_INCOMPLETETRANSFER;
@@ -524,11 +525,45 @@ static void __get_object(mtp_handler_t *hdlr)
 
 Done:
 	_util_file_close(h_file);
+	_entity_lock_stores_read();
 
+	g_free(path);
 	g_free(blk.data);
 	_cmd_hdlr_send_response_code(hdlr, resp);
 }
 
+/*
+ * ObjectSize of the object announced by SendObjectInfo, which could only
+ * give 0xFFFFFFFF for 4 GB or more. Its reserved space follows.
+ */
+static mtp_err_t __set_send_object_size(mtp_handler_t *hdlr, void *buf,
+		mtp_uint32 buf_sz)
+{
+	data_4send_object_t *send_obj = &hdlr->data4_send_obj;
+	mtp_store_t *store = NULL;
+	mtp_uint64 size = 0;
+
+	retv_if(buf_sz != sizeof(mtp_uint64), MTP_ERROR_INVALID_PARAM);
+
+	memcpy(&size, buf, sizeof(mtp_uint64));
+#ifdef __BIG_ENDIAN__
+	_util_conv_byte_order(&size, sizeof(size));
+#endif /* __BIG_ENDIAN__ */
+
+	store = _device_get_store(send_obj->store_id);
+	retvm_if(!store, MTP_ERROR_GENERAL, "Store not found\n");
+	retvm_if(store->store_info.free_space + send_obj->file_size < size,
+			MTP_ERROR_STORE_FULL, "free space is not enough\n");
+
+	store->store_info.free_space += send_obj->file_size;
+	store->store_info.free_space -= size;
+	send_obj->file_size = size;
+	send_obj->obj->obj_info->file_size = size;
+	DBG("SendObject of [%llu] bytes\n", size);
+
+	return MTP_ERROR_NONE;
+}
+
 static void __set_object_prop_value(mtp_handler_t *hdlr)
 {
        mtp_uint32 h_obj = 0;
@@ -560,9 +595,17 @@ static void __set_object_prop_value(mtp_handler_t *hdlr)
                return;
        }
 
-       ret = _hutil_update_object_property(h_obj, prop_id, NULL,
-                              _hdlr_get_payload_data(&blk),
-                              _hdlr_get_payload_size(&blk), NULL);
+       if (prop_id == MTP_OBJ_PROPERTYCODE_OBJECTSIZE &&
+                       hdlr->data4_send_obj.is_valid &&
+                       h_obj == hdlr->data4_send_obj.obj_handle) {
+               ret = __set_send_object_size(hdlr,
+                               _hdlr_get_payload_data(&blk),
+                               _hdlr_get_payload_size(&blk));
+       } else {
+               ret = _hutil_update_object_property(h_obj, prop_id, NULL,
+                               _hdlr_get_payload_data(&blk),
+                               _hdlr_get_payload_size(&blk), NULL);
+       }
        switch (ret) {
        case MTP_ERROR_ACCESS_DENIED:
                resp = PTP_RESPONSE_ACCESSDENIED;
@@ -576,6 +619,9 @@ static void __set_object_prop_value(mtp_handler_t *hdlr)
        case MTP_ERROR_GENERAL:
                resp = PTP_RESPONSE_GEN_ERROR;
                break;
+       case MTP_ERROR_STORE_FULL:
+               resp = PTP_RESPONSE_STOREFULL;
+               break;
        case MTP_ERROR_NONE:
                resp = PTP_RESPONSE_OK;
                break;
@@ -876,6 +922,7 @@ static void __get_partial_object(mtp_handler_t *hdlr)
 	mtp_uint16 resp = 0;
 	mtp_uint64 f_size = 0;
 	mtp_uint64 total_sz = 0;
+	mtp_bool sent = FALSE;
 
 	offset = _hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 1);
 	data_sz = _hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 2);
@@ -923,12 +970,19 @@ static void __get_partial_object(mtp_handler_t *hdlr)
 
 	if (PTP_RESPONSE_OK == resp) {
 		_device_set_phase(DEVICE_PHASE_DATAIN);
-		if (_hdlr_send_data_container(&blk)) {
+		/* The data is already in blk, the store is not needed */
+		_entity_unlock_stores();
+		sent = _hdlr_send_data_container(&blk);
+		if (sent) {
 			total_sz = send_bytes + sizeof(header_container_t);
 #ifdef MTP_SEND_ZLP_FROM_GET_PARTIAL_OBJECT
 			if (total_sz % _transport_get_usb_packet_len() == 0)
 				_transport_send_zlp();
 #endif
+		}
+		_entity_lock_stores_read();
+
+		if (sent) {
 			_cmd_hdlr_send_response(hdlr, resp, 1, &send_bytes);
 			g_free(blk.data);
 			return;
@@ -995,6 +1049,12 @@ static void __set_object_protection(mtp_handler_t *hdlr)
 
 static void __begin_end_edit_object(mtp_handler_t *hdlr)
 {
+	/* Size and modification time may have changed while editing */
+	if (hdlr->usb_cmd.code == PTP_OC_ANDROID_ENDEDITOBJECT) {
+		_entity_invalidate_obj_info_blk(
+				_hdlr_get_param_cmd_container(&(hdlr->usb_cmd), 0));
+	}
+
 	_cmd_hdlr_send_response_code(hdlr, PTP_RESPONSE_OK);
 }
 
@@ -1175,6 +1235,28 @@ static void __print_command(mtp_uint16 code)
 #endif /*MTP_SUPPORT_PRINT_COMMAND*/
 
 /* LCOV_EXCL_START */
+/*
+ * Commands that only read the store can share it. GetObjectHandles is not
+ * one of them: it may enumerate or resync folders on the way.
+ */
+static mtp_bool __is_store_read_only_cmd(mtp_uint16 code)
+{
+	switch (code) {
+	case PTP_OPCODE_GETDEVICEINFO:
+	case PTP_OPCODE_GETSTORAGEIDS:
+	case PTP_OPCODE_GETSTORAGEINFO:
+	case PTP_OPCODE_GETOBJECTINFO:
+	case PTP_OPCODE_GETOBJECT:
+	case PTP_OPCODE_GETPARTIALOBJECT:
+	case PTP_OC_ANDROID_GETPARTIALOBJECT:
+	case MTP_OPCODE_GETOBJECTPROPDESC:
+	case MTP_OPCODE_GETINTERDEPPROPDESC:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
 static void __process_commands(mtp_handler_t *hdlr, cmd_blk_t *cmd)
 {
 	mtp_store_t *store = NULL;
@@ -1361,6 +1443,20 @@ DONE:
 		}
 	}
 	hdlr->last_opcode = hdlr->usb_cmd.code;	/* Last operation code*/
+
+	/* A cancelled transaction is over once its handler returned */
+	_transport_finish_cancel();
+}
+
+static void __process_commands_locked(mtp_handler_t *hdlr, cmd_blk_t *cmd)
+{
+	if (__is_store_read_only_cmd(cmd->code))
+		_entity_lock_stores_read();
+	else
+		_entity_lock_stores_write();
+
+	__process_commands(hdlr, cmd);
+	_entity_unlock_stores();
 }
 
 mtp_bool _cmd_hdlr_send_response(mtp_handler_t *hdlr, mtp_uint16 resp,
@@ -1372,6 +1468,14 @@ mtp_bool _cmd_hdlr_send_response(mtp_handler_t *hdlr, mtp_uint16 resp,
 	if (hdlr == NULL)
 		return FALSE;
 	/* LCOV_EXCL_START */
+	/* A cancelled transaction ends without a response phase */
+	if (g_status->ctrl_event_code == PTP_EVENTCODE_CANCELTRANSACTION) {
+		ERR("Transaction [%u] is cancelled, no response [0x%4x]\n",
+				hdlr->usb_cmd.tid, resp);
+		_device_set_phase(DEVICE_PHASE_IDLE);
+		return FALSE;
+	}
+
 	_hdlr_resp_container_init(&blk, resp, hdlr->usb_cmd.tid);
 
 	ret = _hdlr_add_param_resp_container(&blk, num_param, params);
@@ -1424,9 +1528,7 @@ static void __finish_receiving_file_packets(mtp_char *data, mtp_int32 data_len)
 	_hdlr_conv_cmd_container_byte_order(&cmd);
 #endif /* __BIG_ENDIAN__ */
 
-	UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-	__process_commands(&g_mtp_mgr.hdlr, &cmd);
-	UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+	__process_commands_locked(&g_mtp_mgr.hdlr, &cmd);
 
 	DBG("MTP device phase[%d], processing Command is complete\n",
 			g_device->phase);
@@ -1435,7 +1537,9 @@ static mtp_bool __receive_temp_file_first_packet(mtp_char *data,
 		mtp_int32 data_len)
 {
 	temp_file_struct_t *t = &g_mtp_mgr.ftemp_st;
+	data_4send_object_t *send_obj = &g_mtp_mgr.hdlr.data4_send_obj;
 	mtp_int32 error = 0;
+	mtp_uint32 len = 0;
 	mtp_uint32 *data_sz = &g_mtp_mgr.ftemp_st.data_size;
 	mtp_char *buffer = g_mtp_mgr.ftemp_st.temp_buff;
 	mtp_char buff[LEN], *ptr;
@@ -1469,12 +1573,12 @@ static mtp_bool __receive_temp_file_first_packet(mtp_char *data,
 
 	DBG("t->filepath :%s\n", t->filepath);
 
-	if (access(t->filepath, F_OK) == 0) {
+	if (_util_file_exists(t->filepath)) {
 		if (g_mtp_mgr.ftemp_st.fhandle != NULL) {
 			_util_file_close(g_mtp_mgr.ftemp_st.fhandle);
 			g_mtp_mgr.ftemp_st.fhandle = NULL;	/* initialize */
 		}
-		if (remove(t->filepath) < 0) {
+		if (_util_file_remove(t->filepath) < 0) {
 			ERR_SECURE("remove(%s) Fail\n", t->filepath);
 			__finish_receiving_file_packets(data, data_len);
 			return FALSE;
@@ -1490,12 +1594,25 @@ static mtp_bool __receive_temp_file_first_packet(mtp_char *data,
 	/* consider header size */
 	memcpy(&g_mtp_mgr.ftemp_st.header_buf, data, sizeof(header_container_t));
 
-	g_mtp_mgr.ftemp_st.file_size = ((header_container_t *)data)->len -
-		sizeof(header_container_t);
+	len = ((header_container_t *)data)->len;
+	if (len != MTP_CONTAINER_LEN_UNKNOWN) {
+		t->file_size = len - sizeof(header_container_t);
+	} else if (send_obj->is_valid &&
+			send_obj->file_size != MTP_CONTAINER_LEN_UNKNOWN) {
+		/* 4 GB or more, as given by ObjectInfo or ObjectSize */
+		t->file_size = send_obj->file_size;
+	} else {
+		t->file_size = 0;
+	}
+	DBG("Receiving [%llu] bytes, 0 : until a short packet\n",
+			t->file_size);
+
 	*data_sz = data_len - sizeof(header_container_t);
+	t->size_received = *data_sz;
 
 	/* check whether last data packet */
-	if (*data_sz == g_mtp_mgr.ftemp_st.file_size) {
+	if (t->file_size != 0 ? t->size_received >= t->file_size :
+			(mtp_uint32)data_len < g_conf.read_usb_size) {
 		if (_util_file_write(g_mtp_mgr.ftemp_st.fhandle, &data[sizeof(header_container_t)],
 					data_len - sizeof(header_container_t)) !=
 				data_len - sizeof(header_container_t)) {
@@ -1507,7 +1624,6 @@ static mtp_bool __receive_temp_file_first_packet(mtp_char *data,
 		__finish_receiving_file_packets(data, data_len);
 	} else {
 		g_mtp_mgr.ftemp_st.data_count++;
-		g_mtp_mgr.ftemp_st.size_remaining = *data_sz;
 
 		memcpy(buffer, data + sizeof(header_container_t), *data_sz);
 	}
@@ -1517,12 +1633,13 @@ static mtp_bool __receive_temp_file_first_packet(mtp_char *data,
 static mtp_bool __receive_temp_file_next_packets(mtp_char *data,
 		mtp_int32 data_len)
 {
+	temp_file_struct_t *t = &g_mtp_mgr.ftemp_st;
 	mtp_uint32 rx_size = g_conf.read_usb_size;
 	mtp_uint32 *data_sz = &g_mtp_mgr.ftemp_st.data_size;
 	mtp_char *buffer = g_mtp_mgr.ftemp_st.temp_buff;
 
 	g_mtp_mgr.ftemp_st.data_count++;
-	g_mtp_mgr.ftemp_st.size_remaining += data_len;
+	g_mtp_mgr.ftemp_st.size_received += data_len;
 
 	if ((*data_sz + (mtp_uint32)data_len) > g_conf.write_file_size) {
 		/* copy oversized packet to temp file */
@@ -1537,7 +1654,7 @@ static mtp_bool __receive_temp_file_next_packets(mtp_char *data,
 
 	/*Complete file is recieved, so close the file*/
 	if (data_len < rx_size ||
-			g_mtp_mgr.ftemp_st.size_remaining == g_mtp_mgr.ftemp_st.file_size) {
+			(t->file_size != 0 && t->size_received >= t->file_size)) {
 
 		if (_util_file_write(g_mtp_mgr.ftemp_st.fhandle, buffer, *data_sz) != *data_sz)
 			ERR("fwrite error write size=[%u]\n", *data_sz);
@@ -1625,7 +1742,7 @@ void _receive_mq_data_cb(mtp_char *buffer, mtp_int32 buf_len)
 			_util_file_close(g_mtp_mgr.ftemp_st.fhandle);
 			g_mtp_mgr.ftemp_st.fhandle = NULL;
 			DBG("In Cancel Transaction, remove\n");
-			if (remove(g_mtp_mgr.ftemp_st.filepath) < 0)
+			if (_util_file_remove(g_mtp_mgr.ftemp_st.filepath) < 0)
 				ERR_SECURE("remove(%s) Fail\n", g_mtp_mgr.ftemp_st.filepath);
 		} else {
 			DBG("g_mtp_mgr.ftemp_st.fhandle is not valid, return\n");
@@ -1648,6 +1765,11 @@ void _receive_mq_data_cb(mtp_char *buffer, mtp_int32 buf_len)
 	}
 #endif/* MTP_SUPPORT_CONTROL_REQUEST */
 
+	/* A ZLP only ends data which is being received */
+	if (buf_len == 0 && (g_device->phase != DEVICE_PHASE_DATAOUT ||
+				g_mtp_mgr.ftemp_st.data_count == 0))
+		return;
+
 	/* main processing */
 	if (g_device->phase == DEVICE_PHASE_IDLE) {
 		if (_hdlr_validate_cmd_container((mtp_uchar *)buffer, buf_len)
@@ -1664,9 +1786,7 @@ void _receive_mq_data_cb(mtp_char *buffer, mtp_int32 buf_len)
 		_hdlr_conv_cmd_container_byte_order(&cmd);
 #endif /* __BIG_ENDIAN__ */
 
-		UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-		__process_commands(&g_mtp_mgr.hdlr, &cmd);
-		UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+		__process_commands_locked(&g_mtp_mgr.hdlr, &cmd);
 	} else if (g_device->phase == DEVICE_PHASE_DATAOUT) {
 		if (g_mtp_mgr.ftemp_st.data_count == 0)
 			__receive_temp_file_first_packet(buffer, buf_len);
@@ -22,6 +22,8 @@
 #include "mtp_cmd_handler_util.h"
 #include "mtp_support.h"
 #include "mtp_transport.h"
+#include "mtp_inoti_handler.h"
+#include "mtp_store_prefetch.h"
 
 /*
  * GLOBAL AND EXTERN VARIABLES
@@ -29,10 +31,6 @@
 mtp_bool g_is_full_enum = FALSE;
 extern mtp_mgr_t g_mtp_mgr;
 extern obj_interdep_proplist_t interdep_proplist;
-extern mtp_char g_last_created_dir[MTP_MAX_PATHNAME_SIZE + 1];
-extern mtp_char g_last_moved[MTP_MAX_PATHNAME_SIZE + 1];
-extern mtp_char g_last_copied[MTP_MAX_PATHNAME_SIZE + 1];
-extern mtp_char g_last_deleted[MTP_MAX_PATHNAME_SIZE + 1];
 extern mtp_char g_copy_src_file[MTP_MAX_PATHNAME_SIZE + 1];
 extern mtp_uint32 g_next_obj_handle;
 extern phone_state_t *g_ph_status;
@@ -76,6 +74,22 @@ mtp_err_t _hutil_get_storage_entry(mtp_uint32 store_id, store_info_t *info)
 	/* LCOV_EXCL_STOP */
 }
 
+mtp_err_t _hutil_get_storage_info_blk(mtp_uint32 store_id, mtp_uchar **blk,
+		mtp_uint32 *blk_len)
+{
+	mtp_store_t *store = NULL;
+
+	store = _device_get_store(store_id);
+	retvm_if(!store, MTP_ERROR_INVALID_STORE, "Not able to retrieve store\n");
+
+	/* LCOV_EXCL_START */
+	*blk = _entity_get_store_info_blk(store, blk_len);
+	retvm_if(!*blk, MTP_ERROR_GENERAL, "StorageInfo packing Fail\n");
+
+	return MTP_ERROR_NONE;
+	/* LCOV_EXCL_STOP */
+}
+
 mtp_err_t _hutil_get_storage_ids(ptp_array_t *store_ids)
 {
 	mtp_uint32 num_elem = 0;
@@ -297,13 +311,13 @@ mtp_err_t _hutil_add_object_entry(obj_info_t *obj_info, mtp_char *file_name,
 			}
 			_util_file_close(h_abs_file);
 		} else {
-			g_snprintf(g_last_created_dir,
-					MTP_MAX_PATHNAME_SIZE + 1, "%s", new_f_path);
+			_inoti_record_self_change(new_f_path,
+					INOTI_SELF_CREATE_DIR);
 			if (_util_dir_create(new_f_path, &error) == FALSE) {
 				/* We failed to create the folder */
 				ERR("create directory Fail\n");
-				memset(g_last_created_dir, 0,
-						sizeof(g_last_created_dir));
+				_inoti_forget_self_change(new_f_path,
+						INOTI_SELF_CREATE_DIR);
 				_entity_dealloc_mtp_obj(obj);
 				return MTP_ERROR_GENERAL;
 			}
@@ -485,11 +499,11 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 
 	if (new_obj->obj_info->obj_fmt != PTP_FMT_ASSOCIATION) {
 		DBG("Non-association type!!\n");
-		g_snprintf(g_last_copied, MTP_MAX_PATHNAME_SIZE + 1, "%s",
-				new_obj->file_path);
+		_inoti_record_self_change(new_obj->file_path, INOTI_SELF_COPY);
 		if (_util_file_copy(obj->file_path, new_obj->file_path,
 					&error) == FALSE) {
-			memset(g_last_copied, 0, MTP_MAX_PATHNAME_SIZE + 1);
+			_inoti_forget_self_change(new_obj->file_path,
+					INOTI_SELF_COPY);
 			ERR("Copy file Fail\n");
 			_entity_dealloc_mtp_obj(new_obj);
 			if (EACCES == error)
@@ -499,6 +513,12 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 			return MTP_ERROR_GENERAL;
 
 		}
+		/*
+		 * The IN_MODIFY events of the copy are read once the store is
+		 * released, so the entry counts from the end of the copy.
+		 */
+		_inoti_record_self_change(new_obj->file_path,
+				INOTI_SELF_MODIFY);
 #ifdef MTP_SUPPORT_SET_PROTECTION
 		file_attr_t attr = { 0 };
 		attr.attribute = MTP_FILE_ATTR_MODE_REG;
@@ -528,7 +548,7 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 	}
 
 	DBG("Association type!!\n");
-	if (access(new_obj->file_path, F_OK) == 0) {
+	if (_util_file_exists(new_obj->file_path)) {
 		if (TRUE == keep_handle) {
 			/*generate unique_path*/
 			mtp_char unique_fpath[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
@@ -538,11 +558,11 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 				return MTP_ERROR_GENERAL;
 			}
 			_entity_set_object_file_path(new_obj, unique_fpath, CHAR_TYPE);
-			g_snprintf(g_last_created_dir, MTP_MAX_PATHNAME_SIZE + 1,
-					"%s", new_obj->file_path);
+			_inoti_record_self_change(new_obj->file_path,
+					INOTI_SELF_CREATE_DIR);
 			if (_util_dir_create(new_obj->file_path, &error) == FALSE) {
-				memset(g_last_created_dir, 0,
-						MTP_MAX_PATHNAME_SIZE + 1);
+				_inoti_forget_self_change(new_obj->file_path,
+						INOTI_SELF_CREATE_DIR);
 				ERR("Creating folder Fail!!\n");
 				_entity_dealloc_mtp_obj(new_obj);
 				if (ENOSPC == error)
@@ -559,11 +579,11 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 			retvm_if(!new_obj, MTP_ERROR_GENERAL, "But object is not registered!!\n");
 		}
 	} else {
-		g_snprintf(g_last_created_dir, MTP_MAX_PATHNAME_SIZE + 1,
-				"%s", new_obj->file_path);
+		_inoti_record_self_change(new_obj->file_path,
+				INOTI_SELF_CREATE_DIR);
 		if (_util_dir_create(new_obj->file_path, &error) == FALSE) {
-			memset(g_last_created_dir, 0,
-					MTP_MAX_PATHNAME_SIZE + 1);
+			_inoti_forget_self_change(new_obj->file_path,
+					INOTI_SELF_CREATE_DIR);
 			ERR("Creating folder Fail!!\n");
 			_entity_dealloc_mtp_obj(new_obj);
 			if (ENOSPC == error)
@@ -591,12 +611,11 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 			if (_util_remove_dir_children_recursive(new_obj->file_path,
 						&num_of_deleted_file, &num_of_file,
 						FALSE) == MTP_ERROR_NONE) {
-				g_snprintf(g_last_deleted,
-						MTP_MAX_PATHNAME_SIZE + 1,
-						"%s", new_obj->file_path);
-				if (rmdir(new_obj->file_path) < 0) {
-					memset(g_last_deleted, 0,
-							MTP_MAX_PATHNAME_SIZE + 1);
+				_inoti_record_self_change(new_obj->file_path,
+						INOTI_SELF_DELETE);
+				if (_util_dir_remove(new_obj->file_path) < 0) {
+					_inoti_forget_self_change(new_obj->file_path,
+							INOTI_SELF_DELETE);
 				}
 			}
 			return ret;
@@ -642,11 +661,11 @@ mtp_err_t _hutil_copy_object_entries(mtp_uint32 dst_store_id,
 		if (_util_remove_dir_children_recursive(new_obj->file_path,
 					&num_of_deleted_file, &num_of_file, FALSE) ==
 				MTP_ERROR_NONE) {
-			g_snprintf(g_last_deleted, MTP_MAX_PATHNAME_SIZE + 1,
-					"%s", new_obj->file_path);
-			if (rmdir(new_obj->file_path) < 0) {
-				memset(g_last_deleted, 0,
-						MTP_MAX_PATHNAME_SIZE + 1);
+			_inoti_record_self_change(new_obj->file_path,
+					INOTI_SELF_DELETE);
+			if (_util_dir_remove(new_obj->file_path) < 0) {
+				_inoti_forget_self_change(new_obj->file_path,
+						INOTI_SELF_DELETE);
 			}
 		}
 		if (error == ENOSPC)
@@ -713,6 +732,7 @@ mtp_err_t _hutil_write_file_data(mtp_uint32 store_id, mtp_obj_t *obj,
 	mtp_store_t *store;
 	mtp_char fname[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
 	mtp_int32 error = 0;
+	file_attr_t attrs = { 0 };
 
 	retv_if(obj == NULL, MTP_ERROR_INVALID_PARAM);
 	retv_if(obj->obj_info == NULL, MTP_ERROR_INVALID_PARAM);
@@ -721,11 +741,25 @@ mtp_err_t _hutil_write_file_data(mtp_uint32 store_id, mtp_obj_t *obj,
 	retvm_if(!store, MTP_ERROR_INVALID_OBJECT_INFO, "destination store is not valid\n");
 
 	g_strlcpy(fname, obj->file_path, MTP_MAX_PATHNAME_SIZE + 1);
-	retvm_if(access(fpath, F_OK) < 0, MTP_ERROR_GENERAL, "temp file does not exist\n");
+	retvm_if(!_util_get_file_attrs(fpath, &attrs), MTP_ERROR_GENERAL,
+			"temp file does not exist\n");
+
+	/*
+	 * The space reserved for the declared size, 0xFFFFFFFF if it was 4 GB
+	 * or more, is swapped for the size received.
+	 */
+	if (attrs.fsize != obj->obj_info->file_size) {
+		store->store_info.free_space += obj->obj_info->file_size;
+		store->store_info.free_space -= MIN(attrs.fsize,
+				store->store_info.free_space);
+		obj->obj_info->file_size = attrs.fsize;
+	}
 
-	g_snprintf(g_last_moved, MTP_MAX_PATHNAME_SIZE + 1, "%s", fpath);
+	_inoti_record_self_change(fpath, INOTI_SELF_MOVE);
+	_inoti_record_self_change(fname, INOTI_SELF_MOVE);
 	if (FALSE == _util_file_move(fpath, fname, &error)) {
-		memset(g_last_moved, 0, MTP_MAX_PATHNAME_SIZE + 1);
+		_inoti_forget_self_change(fpath, INOTI_SELF_MOVE);
+		_inoti_forget_self_change(fname, INOTI_SELF_MOVE);
 		ERR("move to real file fail [%s]->[%s] \n", fpath, fname);
 		_entity_dealloc_mtp_obj(obj);
 
@@ -742,6 +776,7 @@ mtp_err_t _hutil_write_file_data(mtp_uint32 store_id, mtp_obj_t *obj,
 			_entity_dealloc_mtp_obj(obj);
 			return MTP_ERROR_GENERAL;
 		}
+		_inoti_record_self_change(fname, INOTI_SELF_MODIFY);
 		_util_set_file_attrs(fname, attrs.attribute |
 				MTP_FILE_ATTR_MODE_READ_ONLY);
 	}
@@ -789,6 +824,7 @@ mtp_err_t _hutil_set_protection(mtp_uint32 obj_handle, mtp_uint16 prot_status)
 
 	g_strlcpy(fname, obj->file_path, MTP_MAX_PATHNAME_SIZE + 1);
 	obj->obj_info->protcn_status = prot_status;
+	_entity_invalidate_obj_info_blk(obj_handle);
 
 	retvm_if(!_util_get_file_attrs(fname, &attrs), MTP_ERROR_GENERAL,
 		"Failed to get file[%s] attrs\n", fname);
@@ -801,8 +837,12 @@ mtp_err_t _hutil_set_protection(mtp_uint32 obj_handle, mtp_uint16 prot_status)
 	else
 		attrs.attribute &= ~MTP_FILE_ATTR_MODE_READ_ONLY;
 
-	retvm_if(!_util_set_file_attrs(fname, attrs.attribute), MTP_ERROR_GENERAL,
-		"Failed to set file[%s] attrs\n", fname);
+	_inoti_record_self_change(fname, INOTI_SELF_MODIFY);
+	if (!_util_set_file_attrs(fname, attrs.attribute)) {
+		_inoti_forget_self_change(fname, INOTI_SELF_MODIFY);
+		ERR("Failed to set file[%s] attrs\n", fname);
+		return MTP_ERROR_GENERAL;
+	}
 
 	return MTP_ERROR_NONE;
 }
@@ -812,15 +852,46 @@ mtp_err_t _hutil_get_object_handles(mtp_uint32 store_id, mtp_uint32 format,
 		mtp_uint32 h_parent, ptp_array_t *handle_arr)
 {
 	mtp_store_t *store = NULL;
+	mtp_obj_t *pobj = NULL;
 	mtp_int32 i = 0;
 
+	/*
+	 * Only the folder which is listed is read, its subfolders are read
+	 * in the background. Asking for every object reads the whole store.
+	 */
 	if (h_parent == PTP_OBJECTHANDLE_ALL || h_parent == PTP_OBJECTHANDLE_ROOT) {
 		for (i = 0; i < g_device->num_stores; i++) {
 			store = _device_get_store_at_index(i);
-			if (store && store->obj_list.nnodes == 0)
-				_entity_store_recursive_enum_folder_objects(store, NULL);
+			if (store == NULL || (store_id != PTP_STORAGEID_ALL &&
+						store->store_id != store_id))
+				continue;
+
+			if (h_parent == PTP_OBJECTHANDLE_ROOT) {
+				_entity_store_read_all_folders(store);
+				continue;
+			}
+
+			_entity_store_read_folder(store, NULL);
+			_entity_prefetch_subfolders(store,
+					PTP_OBJECTHANDLE_ROOT);
 		}
-		g_is_full_enum = TRUE;
+		if (h_parent == PTP_OBJECTHANDLE_ROOT)
+			g_is_full_enum = TRUE;
+	} else {
+		store = _device_get_store_containing_obj(h_parent);
+		pobj = _entity_get_object_from_store(store, h_parent);
+		if (pobj != NULL) {
+			_entity_store_read_folder(store, pobj);
+			_entity_prefetch_subfolders(store, h_parent);
+		}
+	}
+
+	/* Folders which changed too fast to follow are read again */
+	for (i = 0; i < g_device->num_stores; i++) {
+		store = _device_get_store_at_index(i);
+		if (store && (store_id == PTP_STORAGEID_ALL ||
+					store->store_id == store_id))
+			_entity_sync_dirty_folders(store, h_parent);
 	}
 
 	if (store_id == PTP_STORAGEID_ALL && h_parent == PTP_OBJECTHANDLE_ROOT) {
@@ -1309,10 +1380,14 @@ mtp_err_t _hutil_update_object_property(mtp_uint32 obj_handle,
 				dest_fpath), MTP_ERROR_GENERAL,
 				"_entity_check_child_obj_path FALSE.\n");
 
-			g_snprintf(g_last_moved, MTP_MAX_PATHNAME_SIZE + 1,
-					"%s", orig_fpath);
+			_inoti_record_self_change(orig_fpath, INOTI_SELF_MOVE);
+			_inoti_record_self_change(dest_fpath, INOTI_SELF_MOVE);
 			if (FALSE == _util_file_move(orig_fpath, dest_fpath,
 						&error)) {
+				_inoti_forget_self_change(orig_fpath,
+						INOTI_SELF_MOVE);
+				_inoti_forget_self_change(dest_fpath,
+						INOTI_SELF_MOVE);
 				if (EACCES == error)
 					return MTP_ERROR_ACCESS_DENIED;
 				return MTP_ERROR_GENERAL;
@@ -1358,6 +1433,18 @@ mtp_err_t _hutil_get_prop_desc(mtp_uint32 format, mtp_uint32 prop_code,
 	return MTP_ERROR_NONE;
 }
 
+mtp_err_t _hutil_get_prop_desc_blk(mtp_uint32 format, mtp_uint32 prop_code,
+		mtp_uchar **blk, mtp_uint32 *blk_len)
+{
+	retvm_if(!_prop_get_obj_prop_desc(format, prop_code),
+			MTP_ERROR_INVALID_OBJ_PROP_CODE, "pProperty is NULL\n");
+
+	*blk = _prop_get_obj_prop_desc_blk(format, prop_code, blk_len);
+	retvm_if(!*blk, MTP_ERROR_GENERAL, "ObjectPropDesc packing Fail\n");
+
+	return MTP_ERROR_NONE;
+}
+
 mtp_err_t _hutil_get_object_prop_supported(mtp_uint32 format,
 		ptp_array_t	*prop_arr)
 {
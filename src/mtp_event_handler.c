@@ -23,6 +23,7 @@
 #include "mtp_cmd_handler.h"
 #include "mtp_util.h"
 #include "mtp_thread.h"
+#include "mtp_loop.h"
 #include "mtp_init.h"
 #include "mtp_usb_driver.h"
 #include "mtp_transport.h"
@@ -31,7 +32,6 @@
  * GLOBAL AND EXTERN VARIABLES
  */
 extern mtp_mgr_t g_mtp_mgr;
-pthread_t g_eh_thrd;	/* event handler thread */
 mtp_int32 g_pipefd[2];
 
 /*
@@ -43,6 +43,9 @@ static mtp_bool __send_events_from_device_to_pc(mtp_dword store_id,
 {
 	cmd_container_t event = { 0, };
 
+	/* The host reads everything again in its next session */
+	retv_if(g_status->is_usb_discon, FALSE);
+
 	memset(&event, 0, sizeof(cmd_container_t));
 
 	switch (ptp_event) {
@@ -60,6 +63,34 @@ static mtp_bool __send_events_from_device_to_pc(mtp_dword store_id,
 				0, param1 , 0);
 		break;
 
+	case PTP_EVENTCODE_OBJECTINFOCHANGED:
+		DBG("case PTP_EVENTCODE_OBJECTINFOCHANGED\n");
+		DBG("param1 [0x%x]\n", param1);
+		_hdlr_init_event_container(&event,
+				PTP_EVENTCODE_OBJECTINFOCHANGED, 0, param1, 0);
+		break;
+
+	case PTP_EVENTCODE_STORAGEINFOCHANGED:
+		DBG("case PTP_EVENTCODE_STORAGEINFOCHANGED\n");
+		DBG("store_id [0x%x]\n", store_id);
+		_hdlr_init_event_container(&event,
+				PTP_EVENTCODE_STORAGEINFOCHANGED, 0, store_id, 0);
+		break;
+
+	case PTP_EVENTCODE_STOREADDED:
+		DBG("case PTP_EVENTCODE_STOREADDED\n");
+		DBG("store_id [0x%x]\n", store_id);
+		_hdlr_init_event_container(&event,
+				PTP_EVENTCODE_STOREADDED, 0, store_id, 0);
+		break;
+
+	case PTP_EVENTCODE_STOREREMOVED:
+		DBG("case PTP_EVENTCODE_STOREREMOVED\n");
+		DBG("store_id [0x%x]\n", store_id);
+		_hdlr_init_event_container(&event,
+				PTP_EVENTCODE_STOREREMOVED, 0, store_id, 0);
+		break;
+
 	default:
 		DBG("Event not supported\n");
 		return FALSE;
@@ -99,6 +130,14 @@ static mtp_bool __process_event_request(mtp_event_t *evt)
 		_eh_handle_usb_events(USB_REMOVED);
 		break;
 
+	case EVENT_USB_CONNECTED:
+		_eh_handle_usb_events(USB_CONNECTED);
+		break;
+
+	case EVENT_USB_DISCONNECTED:
+		_eh_handle_usb_events(USB_DISCONNECTED);
+		break;
+
 	case EVENT_OBJECT_ADDED:
 		__send_events_from_device_to_pc(0, PTP_EVENTCODE_OBJECTADDED,
 				evt->param1, 0);
@@ -109,6 +148,26 @@ static mtp_bool __process_event_request(mtp_event_t *evt)
 				PTP_EVENTCODE_OBJECTREMOVED, evt->param1, 0);
 		break;
 
+	case EVENT_OBJECT_INFO_CHANGED:
+		__send_events_from_device_to_pc(0,
+				PTP_EVENTCODE_OBJECTINFOCHANGED, evt->param1, 0);
+		break;
+
+	case EVENT_STORAGE_INFO_CHANGED:
+		__send_events_from_device_to_pc(evt->param1,
+				PTP_EVENTCODE_STORAGEINFOCHANGED, 0, 0);
+		break;
+
+	case EVENT_STORE_ADDED:
+		__send_events_from_device_to_pc(evt->param1,
+				PTP_EVENTCODE_STOREADDED, 0, 0);
+		break;
+
+	case EVENT_STORE_REMOVED:
+		__send_events_from_device_to_pc(evt->param1,
+				PTP_EVENTCODE_STOREREMOVED, 0, 0);
+		break;
+
 	case EVENT_CLOSE:
 		break;
 
@@ -119,36 +178,31 @@ static mtp_bool __process_event_request(mtp_event_t *evt)
 	return TRUE;
 }
 
-static void *__thread_event_handler(void *arg)
+/*
+ * Runs on the event loop, one request per wake up. The pipe stays readable
+ * while more requests are queued.
+ */
+static void __handle_event_request(mtp_int32 fd, void *data)
 {
-	DBG("__thread_event_handler is started\n");
-
-	mtp_int32 flag = 1;
+	mtp_int32 status = 0;
 	mtp_event_t evt;
 
-	while (flag) {
-		mtp_int32 status = 0;
-		status = read(g_pipefd[0], &evt, sizeof(mtp_event_t));
-		if ((status == -1) && errno == EINTR) {
-			ERR("read() Fail\n");
-			continue;
-		}
-
-		__process_event_request(&evt);
-
-		if (evt.action == EVENT_CLOSE) {
-			/* USB removed, terminate the thread */
-			flag = 0;
-		}
+	status = read(fd, &evt, sizeof(mtp_event_t));
+	if (status != sizeof(mtp_event_t)) {
+		ERR("read() Fail, status [%d], errno [%d]\n", status, errno);
+		return;
 	}
 
-	DBG("Event handler terminated\n");
-	close(g_pipefd[0]);
-	close(g_pipefd[1]);
-	mtp_end_event();
+	__process_event_request(&evt);
 
-	_util_thread_exit("__thread_event_handler thread is over.");
-	return NULL;
+	if (evt.action == EVENT_CLOSE) {
+		/* USB removed, stop serving requests */
+		DBG("Event handler terminated\n");
+		_util_loop_remove_fd(g_pipefd[0]);
+		close(g_pipefd[0]);
+		close(g_pipefd[1]);
+		mtp_end_event();
+	}
 }
 
 static mtp_bool __send_start_event_to_eh_thread(void)
@@ -191,6 +245,33 @@ void _eh_send_event_req_to_eh_thread(event_code_t action, mtp_ulong param1,
 	}
 }
 
+/*
+ * Temp file should be deleted after usb read/write threads are
+ * terminated. Because data receive thread tries to write the temp file
+ * until sink thread is terminated.
+ */
+static void __remove_temp_file(void)
+{
+	ret_if(g_mtp_mgr.ftemp_st.filepath == NULL);
+
+	if (_util_file_exists(g_mtp_mgr.ftemp_st.filepath)) {
+		DBG("USB disconnected but temp file is remaind.\
+				It will be deleted.\n");
+
+		if (g_mtp_mgr.ftemp_st.fhandle != NULL) {
+			DBG("handle is found. At first close file\n");
+			_util_file_close(g_mtp_mgr.ftemp_st.fhandle);
+			g_mtp_mgr.ftemp_st.fhandle = NULL;
+		}
+		if (_util_file_remove(g_mtp_mgr.ftemp_st.filepath) < 0) {
+			ERR_SECURE("remove(%s) Fail\n", g_mtp_mgr.ftemp_st.filepath);
+			_util_print_error();
+		}
+	}
+	g_free(g_mtp_mgr.ftemp_st.filepath);
+	g_mtp_mgr.ftemp_st.filepath = NULL;
+}
+
 mtp_bool _eh_handle_usb_events(mtp_uint32 type)
 {
 	mtp_state_t state;
@@ -223,10 +304,14 @@ mtp_bool _eh_handle_usb_events(mtp_uint32 type)
 			return FALSE;
 		}
 
-		res = _util_thread_create(&g_eh_thrd,
-				"Mtp Event Request Handler", PTHREAD_CREATE_JOINABLE,
-				__thread_event_handler, NULL);
-		retvm_if(!res, FALSE, "_util_thread_create() Fail\n");
+		res = _util_loop_add_fd(g_pipefd[0], __handle_event_request,
+				NULL);
+		if (!res) {
+			ERR("_util_loop_add_fd() Fail\n");
+			close(g_pipefd[0]);
+			close(g_pipefd[1]);
+			return FALSE;
+		}
 
 		__send_start_event_to_eh_thread();
 
@@ -243,38 +328,56 @@ mtp_bool _eh_handle_usb_events(mtp_uint32 type)
 
 		/* cancel all transaction */
 		g_status->ctrl_event_code = PTP_EVENTCODE_CANCELTRANSACTION;
+		_transport_finish_cancel();
 
 		_transport_usb_finalize();
 		g_status->mtp_op_state = MTP_STATE_STOPPED;
 
-		/*
-		 * Temp file should be deleted after usb usb read/write threads
-		 * are terminated. Because data receive thread tries to
-		 * write the temp file until sink thread is terminated.
-		 */
-		if (g_mtp_mgr.ftemp_st.filepath != NULL &&
-				(access(g_mtp_mgr.ftemp_st.filepath, F_OK) == 0)) {
-			DBG("USB disconnected but temp file is remaind.\
-					It will be deleted.\n");
-
-			if (g_mtp_mgr.ftemp_st.fhandle != NULL) {
-				DBG("handle is found. At first close file\n");
-				_util_file_close(g_mtp_mgr.ftemp_st.fhandle);
-				g_mtp_mgr.ftemp_st.fhandle = NULL;
-			}
-			if (remove(g_mtp_mgr.ftemp_st.filepath) < 0) {
-				ERR_SECURE("remove(%s) Fail\n", g_mtp_mgr.ftemp_st.filepath);
-				_util_print_error();
-			}
-			g_free(g_mtp_mgr.ftemp_st.filepath);
-			g_mtp_mgr.ftemp_st.filepath = NULL;
-		}
+		__remove_temp_file();
 
 		_mtp_deinit();
 		_device_uninstall_storage();
 		_eh_send_event_req_to_eh_thread(EVENT_CLOSE, 1, 0, NULL);
 		break;
 
+	case USB_DISCONNECTED:
+		retvm_if(g_status->is_usb_discon, TRUE,
+				"USB is already disconnected\n");
+
+		/*
+		 * Only the session ends. The store and the file system
+		 * watches stay, so the next session does not enumerate the
+		 * card again.
+		 */
+		DBG("USB is disconnected, keep the store\n");
+		g_status->is_usb_discon = TRUE;
+		g_status->ctrl_event_code = PTP_EVENTCODE_CANCELTRANSACTION;
+		_transport_finish_cancel();
+
+		_transport_usb_suspend();
+		__remove_temp_file();
+
+		/* Session id, transaction state, pending SendObjectInfo */
+		_cmd_hdlr_reset_cmd(&g_mtp_mgr.hdlr);
+		g_mtp_mgr.ftemp_st.data_count = 0;
+		g_mtp_mgr.ftemp_st.data_size = 0;
+		g_mtp_mgr.ftemp_st.size_received = 0;
+		g_status->mtp_op_state = MTP_STATE_READY_SERVICE;
+		break;
+
+	case USB_CONNECTED:
+		retvm_if(!g_status->is_usb_discon, TRUE,
+				"USB is already connected\n");
+
+		DBG("USB is connected again\n");
+		_reset_mtp_device();
+		g_status->is_usb_discon = FALSE;
+		if (!_transport_usb_resume()) {
+			ERR("_transport_usb_resume() Fail\n");
+			kill(getpid(), SIGTERM);
+		}
+		break;
+
 	default:
 		ERR("can be ignored notify [0x%x]\n", type);
 		break;
@@ -24,20 +24,24 @@
 #include "mtp_init.h"
 #include "mtp_config.h"
 #include "mtp_thread.h"
+#include "mtp_loop.h"
 #include "mtp_support.h"
 #include "mtp_device.h"
 #include "mtp_event_handler.h"
 #include "mtp_cmd_handler.h"
 #include "mtp_inoti_handler.h"
+#include "mtp_mount_handler.h"
+#include "mtp_store_index.h"
+#include "mtp_store_prefetch.h"
 #include "mtp_transport.h"
 #include "mtp_util.h"
+#include "mtp_exclude.h"
+#include "mtp_storage.h"
 #include "mtp_usb_driver.h"
 
 /*
  * GLOBAL AND EXTERN VARIABLES
  */
-extern pthread_t g_eh_thrd;
-extern pthread_mutex_t g_cmd_inoti_mutex;
 extern mtp_bool g_is_sync_estab;
 extern phone_state_t *g_ph_status;
 
@@ -47,8 +51,8 @@ mtp_config_t g_conf;
 /*
  * STATIC VARIABLES
  */
-static GMainLoop *g_mainloop = NULL;
 static mtp_mgr_t *g_mgr = &g_mtp_mgr;
+static const mtp_char *g_conf_file = MTP_CONFIG_FILE_PATH;
 /*
  * FUNCTIONS
  */
@@ -73,7 +77,30 @@ static void __print_mtp_conf(void)
 	DBG("INHERITSCHED : %c\n", g_conf.inheritsched);
 	DBG("SCHEDPOLICY : %c\n", g_conf.schedpolicy);
 	DBG("FILE_SCHEDPARAM: %d\n", g_conf.file_schedparam);
-	DBG("USB_SCHEDPARAM: %d\n\n", g_conf.usb_schedparam);
+	DBG("USB_SCHEDPARAM: %d\n", g_conf.usb_schedparam);
+	DBG("USB_CPUS : %s\n", g_conf.usb_cpus);
+	DBG("FILE_CPUS : %s\n", g_conf.file_cpus);
+	DBG("BG_CPUS : %s\n", g_conf.bg_cpus);
+	DBG("USB_IOPRIO : %s\n", g_conf.usb_ioprio);
+	DBG("FILE_IOPRIO : %s\n", g_conf.file_ioprio);
+	DBG("BG_IOPRIO : %s\n\n", g_conf.bg_ioprio);
+
+	DBG("OBJ_INFO_CACHE_SIZE : %d\n", g_conf.obj_info_cache_size);
+	DBG("USE_FANOTIFY : %s\n", g_conf.use_fanotify ? "Yes" : "No");
+	DBG("INOTI_STORM_THRESHOLD : %d\n", g_conf.inoti_storm_threshold);
+	DBG("STORE_INDEX_DIR : %s\n", g_conf.store_index_dir);
+	DBG("STORE_INDEX_INTERVAL : %d\n", g_conf.store_index_interval);
+	DBG("ENUM_THREADS : %d\n", g_conf.enum_threads);
+	DBG("ENUM_DETERMINISTIC : %d\n", g_conf.enum_deterministic);
+	DBG("EXCLUDE : %s\n", g_conf.exclude);
+	DBG("STORAGE_BACKEND : %s\n", g_conf.storage_backend);
+	DBG("MEM_STORAGE_SIZE : %d\n", g_conf.mem_storage_size);
+	DBG("MEM_STORAGE_LATENCY : %d\n", g_conf.mem_storage_latency);
+	DBG("MEM_STORAGE_BANDWIDTH : %d\n", g_conf.mem_storage_bandwidth);
+	DBG("STORAGES : %s\n", g_conf.storages);
+	DBG("REMOVABLE_STORAGES : %s\n\n", g_conf.removable_storages);
+
+	DBG("LOG_LEVEL : %d\n\n", g_conf.log_level);
 }
 
 static void __read_mtp_conf(void)
@@ -100,15 +127,38 @@ static void __read_mtp_conf(void)
 	g_conf.max_io_buf_size = MTP_MAX_IO_BUF_SIZE;
 	g_conf.read_file_delay = MTP_READ_FILE_DELAY;
 
-	if (MTP_SUPPORT_PTHREAD_SCHED) {
-		g_conf.support_pthread_sched = MTP_SUPPORT_PTHREAD_SCHED;
-		g_conf.inheritsched = MTP_INHERITSCHED;
-		g_conf.schedpolicy = MTP_SCHEDPOLICY;
-		g_conf.file_schedparam = MTP_FILE_SCHEDPARAM;
-		g_conf.usb_schedparam = MTP_USB_SCHEDPARAM;
-	}
-
-	fp = fopen(MTP_CONFIG_FILE_PATH, "r");
+	g_conf.support_pthread_sched = MTP_SUPPORT_PTHREAD_SCHED;
+	g_conf.inheritsched = MTP_INHERITSCHED;
+	g_conf.schedpolicy = MTP_SCHEDPOLICY;
+	g_conf.file_schedparam = MTP_FILE_SCHEDPARAM;
+	g_conf.usb_schedparam = MTP_USB_SCHEDPARAM;
+	g_conf.usb_cpus[0] = '\0';
+	g_conf.file_cpus[0] = '\0';
+	g_conf.bg_cpus[0] = '\0';
+	g_conf.usb_ioprio[0] = '\0';
+	g_conf.file_ioprio[0] = '\0';
+	g_conf.bg_ioprio[0] = '\0';
+
+	g_conf.obj_info_cache_size = MTP_OBJ_INFO_CACHE_SIZE;
+	g_conf.use_fanotify = MTP_USE_FANOTIFY;
+	g_conf.inoti_storm_threshold = MTP_INOTI_STORM_THRESHOLD;
+	g_strlcpy(g_conf.store_index_dir, MTP_STORE_INDEX_DIR,
+			sizeof(g_conf.store_index_dir));
+	g_conf.store_index_interval = MTP_STORE_INDEX_INTERVAL;
+	g_conf.enum_threads = MTP_ENUM_THREADS;
+	g_conf.enum_deterministic = MTP_ENUM_DETERMINISTIC;
+	g_strlcpy(g_conf.exclude, MTP_EXCLUDE, sizeof(g_conf.exclude));
+	g_strlcpy(g_conf.storage_backend, MTP_STORAGE_BACKEND,
+			sizeof(g_conf.storage_backend));
+	g_conf.mem_storage_size = MTP_MEM_STORAGE_SIZE;
+	g_conf.mem_storage_latency = MTP_MEM_STORAGE_LATENCY;
+	g_conf.mem_storage_bandwidth = MTP_MEM_STORAGE_BANDWIDTH;
+	g_strlcpy(g_conf.storages, MTP_STORAGES, sizeof(g_conf.storages));
+	g_strlcpy(g_conf.removable_storages, MTP_REMOVABLE_STORAGES,
+			sizeof(g_conf.removable_storages));
+	g_conf.log_level = MTP_LOG_LEVEL;
+
+	fp = fopen(g_conf_file, "r");
 	if (fp == NULL) {
 		/* LCOV_EXCL_START */
 		DBG("Default configuration is used\n");
@@ -247,7 +297,150 @@ static void __read_mtp_conf(void)
 				continue;	//	LCOV_EXCL_LINE
 
 			g_conf.usb_schedparam = atoi(token);
+
+		} else if (strcasecmp(token, "usb_cpus") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.usb_cpus, token, sizeof(g_conf.usb_cpus));
+
+		} else if (strcasecmp(token, "file_cpus") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.file_cpus, token, sizeof(g_conf.file_cpus));
+
+		} else if (strcasecmp(token, "bg_cpus") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.bg_cpus, token, sizeof(g_conf.bg_cpus));
+
+		} else if (strcasecmp(token, "usb_ioprio") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.usb_ioprio, token, sizeof(g_conf.usb_ioprio));
+
+		} else if (strcasecmp(token, "file_ioprio") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.file_ioprio, token, sizeof(g_conf.file_ioprio));
+
+		} else if (strcasecmp(token, "bg_ioprio") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.bg_ioprio, token, sizeof(g_conf.bg_ioprio));
 		/* LCOV_EXCL_STOP */
+		} else if (strcasecmp(token, "obj_info_cache_size") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.obj_info_cache_size = atoi(token);
+
+		} else if (strcasecmp(token, "use_fanotify") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.use_fanotify = atoi(token) ? true : false;
+
+		} else if (strcasecmp(token, "inoti_storm_threshold") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.inoti_storm_threshold = atoi(token);
+
+		} else if (strcasecmp(token, "store_index_dir") == 0) {
+			/* An empty value disables the index */
+			token = strtok_r(NULL, "=", &saveptr);
+			g_strlcpy(g_conf.store_index_dir, token ? token : "",
+					sizeof(g_conf.store_index_dir));
+
+		} else if (strcasecmp(token, "store_index_interval") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.store_index_interval = atoi(token);
+
+		} else if (strcasecmp(token, "enum_threads") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.enum_threads = atoi(token);
+
+		} else if (strcasecmp(token, "enum_deterministic") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.enum_deterministic = atoi(token) ? true : false;
+
+		} else if (strcasecmp(token, "exclude") == 0) {
+			/* An empty value excludes nothing */
+			token = strtok_r(NULL, "=", &saveptr);
+			g_strlcpy(g_conf.exclude, token ? token : "",
+					sizeof(g_conf.exclude));
+
+		} else if (strcasecmp(token, "storage_backend") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_strlcpy(g_conf.storage_backend, token,
+					sizeof(g_conf.storage_backend));
+
+		} else if (strcasecmp(token, "mem_storage_size") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.mem_storage_size = atoi(token);
+
+		} else if (strcasecmp(token, "mem_storage_latency") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.mem_storage_latency = atoi(token);
+
+		} else if (strcasecmp(token, "mem_storage_bandwidth") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.mem_storage_bandwidth = atoi(token);
+
+		} else if (strcasecmp(token, "storages") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			g_strlcpy(g_conf.storages, token ? token : "",
+					sizeof(g_conf.storages));
+
+		} else if (strcasecmp(token, "removable_storages") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			g_strlcpy(g_conf.removable_storages, token ? token : "",
+					sizeof(g_conf.removable_storages));
+
+		} else if (strcasecmp(token, "log_level") == 0) {
+			token = strtok_r(NULL, "=", &saveptr);
+			if (token == NULL)
+				continue;	//	LCOV_EXCL_LINE
+
+			g_conf.log_level = atoi(token);
+			_util_log_set_level(g_conf.log_level);
+
 		} else {
 			ERR("Unknown option : %s\n", buf);
 		}
@@ -260,28 +453,16 @@ static void __read_mtp_conf(void)
 
 /*
  * static void __mtp_exit(void)
- * This function send MTP stopped state to event handler thread and MTP UI
+ * This function stops the event loop, main() then returns
  * @param[in]		None.
  * @param[out]		None.
  * @return		None.
  */
 static void __mtp_exit(void)
 {
-	DBG("## Terminate all threads\n");
-	if (g_eh_thrd && g_eh_thrd != pthread_self()) {
-		_eh_send_event_req_to_eh_thread(EVENT_USB_REMOVED, 0, 0, NULL);
-		if (_util_thread_join(g_eh_thrd, NULL) == FALSE)
-			ERR("_util_thread_join() Fail\n");
-
-		g_eh_thrd = 0;
-	}
-
 	DBG("## Terminate main loop\n");
 
-	g_main_loop_quit(g_mainloop);
-
-	if (g_eh_thrd == pthread_self())
-		_util_thread_exit("Event handler stopped itself");
+	_util_loop_quit();
 }
 
 /* LCOV_EXCL_STOP */
@@ -323,11 +504,13 @@ void __init_mtp_info(void)
 
 void _mtp_init(void)
 {
-	mtp_int32 error = 0;
-
 	DBG("Initialization start!\n");
 
 	__read_mtp_conf();
+	_util_log_apply_thread_class();
+	_util_exclude_compile(g_conf.exclude);
+	if (!_util_storage_select(g_conf.storage_backend))
+		ERR("Storage backend [%s] is not used\n", g_conf.storage_backend);
 
 	if (g_conf.mmap_threshold) {
 		if (!mallopt(M_MMAP_THRESHOLD, g_conf.mmap_threshold))
@@ -351,21 +534,6 @@ void _mtp_init(void)
 		}
 	}
 
-	/* External Storage */
-	{
-	/* LCOV_EXCL_START */
-		char ext_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-		_util_get_external_path(ext_path);
-		if (access(ext_path, F_OK) < 0) {
-			if (FALSE == _util_dir_create((const mtp_char *)ext_path, &error)) {
-				ERR("Cannot make directory!! [%s]\n",
-						ext_path);
-				goto MTP_INIT_FAIL;
-			}
-		}
-	/* LCOV_EXCL_STOP */
-	}
-
 	/* Set mtpdeviceinfo */
 	_init_mtp_device();
 
@@ -378,6 +546,14 @@ void _mtp_init(void)
 	_inoti_init_filesystem_evnts();
 #endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
 
+	/* Objects saved by the last run, checked against the disk */
+	_entity_load_store_indexes();
+	_entity_start_store_index_saver();
+	_entity_start_prefetch();
+
+	/* Removable stores come and go from now on */
+	_mount_init_storage_events();
+
 	return;
 
 MTP_INIT_FAIL:
@@ -390,6 +566,11 @@ void _mtp_deinit(void)
 {
 	_cmd_hdlr_reset_cmd(&g_mgr->hdlr);
 
+	_mount_deinit_storage_events();
+	_entity_stop_prefetch();
+	_entity_stop_store_index_saver();
+	_entity_save_store_indexes();
+
 	/* initialize MTP_USE_FILE_BUFFER*/
 	g_free(g_mgr->ftemp_st.temp_buff);
 	g_mgr->ftemp_st.temp_buff = NULL;
@@ -402,8 +583,7 @@ void _mtp_deinit(void)
 /*
  * void mtp_end_event(void)
  * This function terminates mtp.
- * It must not be called in gthr_mtp_event thread.
- * It makes dead lock state if it is called in gthr_mtp_event thread.
+ * It may be called from any thread.
  */
 /* LCOV_EXCL_START */
 void mtp_end_event(void)
@@ -414,23 +594,17 @@ void mtp_end_event(void)
 
 static inline int _main_init()
 {
-	pthread_mutexattr_t mutex_attr;
-
-	pthread_mutexattr_init(&mutex_attr);
-	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
-	if (0 != pthread_mutex_init(&g_cmd_inoti_mutex, &mutex_attr)) {
-		ERR("pthread_mutex_init() Fail\n");
-		_util_print_error();
-		pthread_mutexattr_destroy(&mutex_attr);
-		return MTP_ERROR_GENERAL;
-	}
-	pthread_mutexattr_destroy(&mutex_attr);
+	retvm_if(!_entity_init_store_lock(), MTP_ERROR_GENERAL,
+		"_entity_init_store_lock() Fail\n");
 
-	retvm_if(!_eh_handle_usb_events(USB_INSERTED), MTP_ERROR_GENERAL,
-		"_eh_handle_usb_events() Fail\n");
+	retvm_if(!_util_loop_init(), MTP_ERROR_GENERAL,
+		"_util_loop_init() Fail\n");
 
-	g_mainloop = g_main_loop_new(NULL, FALSE);
-	retvm_if(!g_mainloop, MTP_ERROR_GENERAL, "g_mainloop is NULL\n");
+	if (!_eh_handle_usb_events(USB_INSERTED)) {
+		ERR("_eh_handle_usb_events() Fail\n");
+		_util_loop_deinit();
+		return MTP_ERROR_GENERAL;
+	}
 
 	return MTP_ERROR_NONE;
 }
@@ -438,6 +612,19 @@ static inline int _main_init()
 int main(int argc, char *argv[])
 {
 	mtp_int32 ret;
+	mtp_int32 opt;
+
+	/* -c : configuration file, e.g. of a host simulator run */
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		if (opt != 'c') {
+			fprintf(stderr, "Usage: %s [-c config file]\n", argv[0]);
+			return MTP_ERROR_GENERAL;
+		}
+		g_conf_file = optarg;
+	}
+
+	if (_util_log_init() == FALSE)
+		fprintf(stderr, "Cannot open %s, logging disabled\n", MTP_LOG_FILE);
 
 	DBG("Using FFS transport, assuming established connection\n");
 	g_ph_status->usb_state = MTP_PHONE_USB_DISCONNECTED;
@@ -451,9 +638,13 @@ int main(int argc, char *argv[])
 
 	DBG("MTP UID = [%u] and GID = [%u]\n", getuid(), getgid());
 
-	g_main_loop_run(g_mainloop);
+	_util_loop_run();
+	_util_loop_deinit();
+	_util_storage_release();
 
 	DBG("######### MTP TERMINATED #########\n");
 
+	_util_log_deinit();
+
 	return MTP_ERROR_NONE;
 }
@@ -14,86 +14,223 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include "mtp_thread.h"
+#include "mtp_loop.h"
 #include "mtp_inoti_handler.h"
 #include "mtp_event_handler.h"
 #include "mtp_support.h"
 #include "mtp_device.h"
 #include "mtp_util.h"
+#include "mtp_storage.h"
+
+#ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
+#include <sys/fanotify.h>
+#ifdef FAN_REPORT_DFID_NAME
+#define INOTI_SUPPORT_FANOTIFY
+#define FANOTI_EVENT_MASK	(FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+		FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+#endif /* FAN_REPORT_DFID_NAME */
+#endif /* MTP_SUPPORT_OBJECTADDDELETE_EVENT */
+
+extern mtp_config_t g_conf;
 
 /*
  * GLOBAL AND STATIC VARIABLES
  */
-pthread_mutex_t g_cmd_inoti_mutex;
 
 #ifdef MTP_SUPPORT_OBJECTADDDELETE_EVENT
-mtp_char g_last_created_dir[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-mtp_char g_last_deleted[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-mtp_char g_last_moved[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-mtp_char g_last_copied[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+typedef struct {
+	GList link;		/* In g_self_changes_lru, newest first */
+	mtp_char *key;		/* op and path */
+	mtp_int64 expiry;	/* Monotonic time, us */
+} self_change_t;
+
 mtp_char g_copy_src_file[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
 mtp_char g_copy_dst_file[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
 mtp_bool g_is_send_partial_object = FALSE;
 
-static pthread_t g_inoti_thrd;
-static mtp_int32 g_cnt_watch_folder = 0;
 static mtp_int32 g_inoti_fd;
+static mtp_int32 g_inoti_timer = -1;	/* debounce, storm end, lock retry */
+static mtp_bool g_inoti_fd_parked = FALSE;
 static open_files_info_t *g_open_files_list;
-static inoti_watches_t g_inoti_watches[INOTI_FOLDER_COUNT_MAX];
+static GHashTable *g_inoti_watches = NULL;	/* wd -> inoti_watches_t */
+static GHashTable *g_inoti_watch_paths = NULL;	/* folder name -> inoti_watches_t */
+static mtp_int32 g_inoti_max_watches = INOTI_MAX_USER_WATCHES_DEFAULT;
+static mtp_bool g_inoti_limit_reported = FALSE;
+static GHashTable *g_self_changes = NULL;	/* key -> self_change_t */
+static GQueue g_self_changes_lru = G_QUEUE_INIT;
+static pthread_mutex_t g_self_changes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *g_inoti_modified = NULL;	/* path -> modified_info_t */
+static GHashTable *g_inoti_storms = NULL;	/* folder -> storm_info_t */
+static GHashTable *g_inoti_created = NULL;	/* path -> IN_CREATE event */
+static GPtrArray *g_fs_events = NULL;	/* fs_event_t of the current batch */
+static mtp_bool g_use_fanoti = FALSE;
+
+#ifdef INOTI_SUPPORT_FANOTIFY
+static mtp_int32 g_fanoti_mount_fd = -1;
+static mtp_char g_fanoti_root[MTP_MAX_PATHNAME_SIZE + 1];
+static mtp_uchar g_fanoti_last_fh[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+static mtp_uint32 g_fanoti_last_fh_len = 0;
+static mtp_char g_fanoti_last_path[MTP_MAX_PATHNAME_SIZE + 1];
+#endif /* INOTI_SUPPORT_FANOTIFY */
+
+static void __free_self_change(gpointer data)
+{
+	self_change_t *change = (self_change_t *)data;
 
-static mtp_int32 __get_inoti_watch_id(mtp_int32 iwd)
+	g_queue_unlink(&g_self_changes_lru, &change->link);
+	g_free(change->key);
+	g_free(change);
+}
+
+static mtp_char *__get_self_change_key(const mtp_char *path,
+		inoti_self_op_t op)
 {
-	mtp_int32 i = 0;
+	return g_strdup_printf("%d:%s", op, path);
+}
 
-	for (i = 0; i < INOTI_FOLDER_COUNT_MAX; i++) {
-		if (iwd == g_inoti_watches[i].wd)
-			break;
+/*
+ * Returns TRUE and forgets the entry if MTP itself recently did op on path.
+ * Must be called with g_self_changes_mutex held.
+ */
+static mtp_bool __take_self_change(const mtp_char *path, inoti_self_op_t op)
+{
+	mtp_char *key = NULL;
+	self_change_t *change = NULL;
+	mtp_bool found = FALSE;
+
+	retv_if(g_self_changes == NULL, FALSE);
+
+	key = __get_self_change_key(path, op);
+	change = g_hash_table_lookup(g_self_changes, key);
+	if (change != NULL) {
+		found = change->expiry > g_get_monotonic_time();
+		g_hash_table_remove(g_self_changes, key);
+	}
+	g_free(key);
+
+	return found;
+}
+
+static mtp_bool __is_self_change(const mtp_char *path, inoti_self_op_t op)
+{
+	mtp_bool found = FALSE;
+
+	pthread_mutex_lock(&g_self_changes_mutex);
+	found = __take_self_change(path, op);
+	pthread_mutex_unlock(&g_self_changes_mutex);
+
+	return found;
+}
+
+/*
+ * Like __is_self_change(), but the entry is only dropped once expired: one
+ * write gives many IN_MODIFY events, and the IN_CREATE of a copy leaves
+ * the entry for its IN_CLOSE_WRITE.
+ */
+static mtp_bool __has_self_change(const mtp_char *path, inoti_self_op_t op)
+{
+	mtp_char *key = NULL;
+	self_change_t *change = NULL;
+	mtp_bool found = FALSE;
+
+	pthread_mutex_lock(&g_self_changes_mutex);
+	if (g_self_changes != NULL) {
+		key = __get_self_change_key(path, op);
+		change = g_hash_table_lookup(g_self_changes, key);
+		if (change != NULL) {
+			found = change->expiry > g_get_monotonic_time();
+			if (!found)
+				g_hash_table_remove(g_self_changes, key);
+		}
+		g_free(key);
 	}
+	pthread_mutex_unlock(&g_self_changes_mutex);
 
-	retvm_if(i >= INOTI_FOLDER_COUNT_MAX, -1, "inoti_folder is not found\n");
+	return found;
+}
+
+static void __free_inoti_watch(gpointer data)
+{
+	inoti_watches_t *watch = (inoti_watches_t *)data;
 
-	return i;
+	g_free(watch->forlder_name);
+	g_free(watch);
 }
 
-static mtp_bool __get_inoti_event_full_path(mtp_int32 wd, mtp_char *event_name,
-		mtp_char *path, mtp_int32 path_len, mtp_char *parent_path)
+static mtp_int32 __read_inoti_max_watches(void)
 {
-	mtp_int32 inoti_id = 0;
+	FILE *fp = NULL;
+	mtp_int32 max_watches = 0;
 
-	retv_if(wd == 0, FALSE);
-	retv_if(path == NULL, FALSE);
-	retv_if(event_name == NULL, FALSE);
+	fp = fopen(INOTI_MAX_USER_WATCHES_PATH, "r");
+	retvm_if(fp == NULL, INOTI_MAX_USER_WATCHES_DEFAULT,
+			"Cannot read %s\n", INOTI_MAX_USER_WATCHES_PATH);
 
-	inoti_id = __get_inoti_watch_id(wd);
-	retvm_if(inoti_id < 0, FALSE, "FAIL to find last_inoti_id : %d\n", inoti_id);
+	if (fscanf(fp, "%d", &max_watches) != 1 || max_watches <= 0)
+		max_watches = INOTI_MAX_USER_WATCHES_DEFAULT;
+	fclose(fp);
 
-	/* 2 is for / and null character */
-	if (path_len < (strlen(g_inoti_watches[inoti_id].forlder_name) +
-				strlen(event_name) + 2))
-		return FALSE;
+	return max_watches;
+}
 
-	g_snprintf(path, path_len, "%s/%s",
-			g_inoti_watches[inoti_id].forlder_name, event_name);
-	g_snprintf(parent_path, path_len, "%s",
-			g_inoti_watches[inoti_id].forlder_name);
+static void __init_inoti_watches(void)
+{
+	ret_if(g_inoti_watches != NULL);
+
+	g_inoti_watches = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, __free_inoti_watch);
+	g_inoti_watch_paths = g_hash_table_new(g_str_hash, g_str_equal);
+	g_inoti_max_watches = __read_inoti_max_watches();
+	g_inoti_limit_reported = FALSE;
+	DBG("inotify watches are limited to %d\n", g_inoti_max_watches);
+}
 
-	return TRUE;
+static void __deinit_inoti_watches(void)
+{
+	ret_if(g_inoti_watches == NULL);
+
+	g_hash_table_destroy(g_inoti_watch_paths);
+	g_inoti_watch_paths = NULL;
+	g_hash_table_destroy(g_inoti_watches);
+	g_inoti_watches = NULL;
+}
+
+static inoti_watches_t *__get_inoti_watch(mtp_int32 wd)
+{
+	inoti_watches_t *watch = NULL;
+
+	retv_if(g_inoti_watches == NULL, NULL);
+
+	watch = g_hash_table_lookup(g_inoti_watches, GINT_TO_POINTER(wd));
+	retvm_if(watch == NULL, NULL, "inoti_folder is not found\n");
+
+	return watch;
 }
 
-static open_files_info_t *__find_file_in_inoti_open_files_list(mtp_int32 wd,
-		mtp_char *event_name)
+static void __del_inoti_watch(inoti_watches_t *watch)
+{
+	inotify_rm_watch(g_inoti_fd, watch->wd);
+	g_hash_table_remove(g_inoti_watch_paths, watch->forlder_name);
+	/* Frees watch */
+	g_hash_table_remove(g_inoti_watches, GINT_TO_POINTER(watch->wd));
+	g_inoti_limit_reported = FALSE;
+}
+
+static open_files_info_t *__find_file_in_inoti_open_files_list(mtp_char *path)
 {
 	open_files_info_t *current_node = g_open_files_list;
 
 	while (NULL != current_node) {
-		if ((current_node->wd == wd) &&
-				(g_strcmp0(current_node->name, event_name) == 0)) {
+		if (g_strcmp0(current_node->name, path) == 0) {
 			return current_node;
 		}
 
@@ -104,16 +241,14 @@ static open_files_info_t *__find_file_in_inoti_open_files_list(mtp_int32 wd,
 	return NULL;
 }
 
-static mtp_bool __add_file_to_inoti_open_files_list(mtp_int32 wd,
-		mtp_char *event_name)
+static mtp_bool __add_file_to_inoti_open_files_list(mtp_char *path)
 {
 	open_files_info_t *new_node = NULL;
 
 	new_node = (open_files_info_t *)g_malloc(sizeof(open_files_info_t));
 	retvm_if(!new_node, FALSE, "new_node is null malloc fail\n");
 
-	new_node->name = g_strdup(event_name);
-	new_node->wd = wd;
+	new_node->name = g_strdup(path);
 
 	/* First created file */
 	if (NULL == g_open_files_list) {
@@ -161,13 +296,12 @@ static void __process_object_added_event(mtp_char *fullpath,
 	store_id = _entity_get_store_id_by_path(fullpath);
 	store = _device_get_store(store_id);
 	retm_if(!store, "store is NULL so return\n");
+	retm_if(_entity_is_path_excluded(store, fullpath),
+			"Excluded [%s]\n", file_name);
 
 	parent_obj = _entity_get_object_from_store_by_path(store, parent_path);
 	if (NULL == parent_obj) {
-		char ext_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-		_util_get_external_path(ext_path);
-
-		if (!g_strcmp0(parent_path, ext_path)) {
+		if (!g_strcmp0(parent_path, store->root_path)) {
 			DBG("parent is the root folder\n");
 			h_parent = 0;
 		} else {
@@ -178,6 +312,10 @@ static void __process_object_added_event(mtp_char *fullpath,
 		h_parent = parent_obj->obj_handle;
 	}
 
+	/* It is found when the folder is read */
+	retm_if(parent_obj ? parent_obj->is_unread : !store->is_enumerated,
+			"Parent folder is not read yet\n");
+
 	ret = stat(fullpath, &stat_buf);
 	if (ret < 0) {
 		ERR("stat() Fail\n");
@@ -220,32 +358,263 @@ static void __process_object_added_event(mtp_char *fullpath,
 		return;
 	}
 
+	/* The host reads the final ObjectInfo anyway */
+	g_hash_table_remove(g_inoti_modified, fullpath);
+
 	_eh_send_event_req_to_eh_thread(EVENT_OBJECT_ADDED,
 			obj->obj_handle, 0, NULL);
 }
 
-/* LCOV_EXCL_START */
-static void __remove_inoti_watch(mtp_char *path)
+/*
+ * A file which is already part of the store was rewritten, so its packed
+ * ObjectInfo (size, modification time) is stale.
+ */
+static void __invalidate_object_info(mtp_char *fullpath)
 {
-	mtp_int32 i = 0;
+	mtp_obj_t *obj = NULL;
+
+	obj = _device_get_object_with_path(fullpath);
+	if (obj != NULL)
+		_entity_invalidate_obj_info_blk(obj->obj_handle);
+}
 
-	for (i = 0; i < g_cnt_watch_folder; i++) {
-		if (g_inoti_watches[i].forlder_name == NULL)
+/*
+ * Apps append to or truncate files in many small steps, so changes are
+ * coalesced per object and reported once things are quiet for
+ * INOTI_MODIFY_DEBOUNCE, or at the latest after INOTI_MODIFY_MAX_DELAY.
+ */
+static void __defer_object_info_changed(fs_event_t *ev)
+{
+	modified_info_t *info = NULL;
+	mtp_int64 now = g_get_monotonic_time();
+
+	ret_if(g_strrstr(ev->name, MTP_TEMP_FILE));
+	ret_if(ev->name[0] == '.');
+	/* Written or protected by CopyObject, SendObject or SetProtection */
+	ret_if(__has_self_change(ev->path, INOTI_SELF_MODIFY));
+
+	info = g_hash_table_lookup(g_inoti_modified, ev->path);
+	if (info == NULL) {
+		info = (modified_info_t *)g_malloc(sizeof(modified_info_t));
+		info->first = now;
+		g_hash_table_insert(g_inoti_modified, g_strdup(ev->path), info);
+	}
+
+	info->deadline = MIN(now + INOTI_MODIFY_DEBOUNCE,
+			info->first + INOTI_MODIFY_MAX_DELAY);
+}
+
+static void __process_object_info_changed(mtp_char *fullpath)
+{
+	mtp_obj_t *obj = NULL;
+	struct stat stat_buf = { 0 };
+
+	obj = _device_get_object_with_path(fullpath);
+	ret_if(obj == NULL || obj->obj_info == NULL);
+
+	retm_if(stat(fullpath, &stat_buf) < 0, "stat() Fail\n");
+
+	if (S_ISREG(stat_buf.st_mode))
+		obj->obj_info->file_size = (mtp_uint64)stat_buf.st_size;
+
+	/* Times are read from the file when these are built again */
+	_entity_invalidate_obj_info_blk(obj->obj_handle);
+	_entity_invalidate_obj_propvals(obj);
+
+	_eh_send_event_req_to_eh_thread(EVENT_OBJECT_INFO_CHANGED,
+			obj->obj_handle, 0, NULL);
+}
+
+/*
+ * Reports the objects whose trailing edge has passed.
+ * @return	ms until the next pending one, -1 if there is none.
+ */
+static mtp_int32 __flush_object_info_changed(void)
+{
+	GHashTableIter iter;
+	mtp_char *path = NULL;
+	modified_info_t *info = NULL;
+	mtp_int64 now = g_get_monotonic_time();
+	mtp_int64 next = -1;
+
+	g_hash_table_iter_init(&iter, g_inoti_modified);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&path,
+				(gpointer *)&info)) {
+		if (info->deadline > now) {
+			if (next < 0 || info->deadline < next)
+				next = info->deadline;
 			continue;
+		}
+
+		__process_object_info_changed(path);
+		g_hash_table_iter_remove(&iter);
+	}
 
-		if (g_strcmp0(g_inoti_watches[i].forlder_name, path) != 0)
+	if (next < 0)
+		return -1;
+
+	/* Round up, the timer must not fire before the deadline */
+	return (mtp_int32)((next - now + 999) / 1000);
+}
+
+/*
+ * Bulk copies (a backup being restored, a sync tool) spread over many sub
+ * folders, so events are counted per top level folder of the store.
+ * @return	newly allocated folder path, NULL if path is not in store.
+ */
+static mtp_char *__get_storm_folder(mtp_store_t *store, const mtp_char *path)
+{
+	size_t len = strlen(store->root_path);
+	const mtp_char *end = NULL;
+
+	retv_if(strncmp(path, store->root_path, len) != 0, NULL);
+
+	if (path[len] == '\0')
+		return g_strdup(path);
+	retv_if(path[len] != '/', NULL);
+
+	end = strchr(path + len + 1, '/');
+	if (end == NULL)
+		return g_strdup(path);
+
+	return g_strndup(path, end - path);
+}
+
+/*
+ * Once a folder tree sees more than inoti_storm_threshold events within
+ * INOTI_STORM_WINDOW, its events are dropped until it is quiet for
+ * INOTI_STORM_SETTLE. The host then gets one StorageInfoChanged instead of
+ * thousands of object events, and the tree is scanned again when listed.
+ * @return	TRUE if ev must not be processed on its own.
+ */
+static mtp_bool __is_in_fs_event_storm(fs_event_t *ev)
+{
+	mtp_store_t *store = NULL;
+	mtp_char *folder = NULL;
+	storm_info_t *storm = NULL;
+	mtp_int64 now = 0;
+
+	retv_if(g_conf.inoti_storm_threshold <= 0, FALSE);
+
+	store = _device_get_store(_entity_get_store_id_by_path(ev->parent));
+	retv_if(store == NULL, FALSE);
+
+	folder = __get_storm_folder(store, ev->parent);
+	retv_if(folder == NULL, FALSE);
+
+	now = g_get_monotonic_time();
+	storm = g_hash_table_lookup(g_inoti_storms, folder);
+	if (storm == NULL) {
+		storm = (storm_info_t *)g_malloc0(sizeof(storm_info_t));
+		storm->window_start = now;
+		g_hash_table_insert(g_inoti_storms, folder, storm);
+	} else {
+		g_free(folder);
+	}
+
+	if (storm->is_storm) {
+		storm->last = now;
+		return TRUE;
+	}
+
+	/* A single big file being written is not a storm */
+	retv_if(!(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+					IN_MOVED_TO | IN_CLOSE_WRITE)), FALSE);
+
+	if (now - storm->window_start >= INOTI_STORM_WINDOW) {
+		storm->window_start = now;
+		storm->count = 0;
+	}
+
+	if (++storm->count <= (mtp_uint32)g_conf.inoti_storm_threshold)
+		return FALSE;
+
+	DBG_SECURE("Too many changes in [%s], suspend its events\n",
+			ev->parent);
+	storm->is_storm = TRUE;
+	storm->last = now;
+
+	return TRUE;
+}
+
+static void __end_fs_event_storm(mtp_char *folder)
+{
+	mtp_store_t *store = NULL;
+
+	store = _device_get_store(_entity_get_store_id_by_path(folder));
+	ret_if(store == NULL);
+
+	DBG_SECURE("[%s] is quiet again\n", folder);
+	_entity_mark_folder_dirty(store, folder);
+	_entity_invalidate_store_info_blk(store);
+
+	_eh_send_event_req_to_eh_thread(EVENT_STORAGE_INFO_CHANGED,
+			store->store_id, 0, NULL);
+}
+
+/*
+ * Ends the storms which settled and forgets folders which went idle.
+ * @return	ms until the next storm may end, -1 if there is none.
+ */
+static mtp_int32 __flush_fs_event_storms(void)
+{
+	GHashTableIter iter;
+	mtp_char *folder = NULL;
+	storm_info_t *storm = NULL;
+	mtp_int64 now = g_get_monotonic_time();
+	mtp_int64 next = -1;
+	mtp_int64 deadline = 0;
+
+	g_hash_table_iter_init(&iter, g_inoti_storms);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&folder,
+				(gpointer *)&storm)) {
+		if (!storm->is_storm) {
+			if (now - storm->window_start >= INOTI_STORM_WINDOW)
+				g_hash_table_iter_remove(&iter);
 			continue;
+		}
 
-		g_free(g_inoti_watches[i].forlder_name);
-		g_inoti_watches[i].forlder_name = NULL;
-		inotify_rm_watch(g_inoti_fd, g_inoti_watches[i].wd);
-		g_inoti_watches[i].wd = 0;
+		deadline = storm->last + INOTI_STORM_SETTLE;
+		if (deadline > now) {
+			if (next < 0 || deadline < next)
+				next = deadline;
+			continue;
+		}
 
-		break;
+		__end_fs_event_storm(folder);
+		g_hash_table_iter_remove(&iter);
 	}
 
-	if (i == g_cnt_watch_folder)
-		ERR("Path not found in g_noti_watches\n");
+	if (next < 0)
+		return -1;
+
+	return (mtp_int32)((next - now + 999) / 1000);
+}
+
+static mtp_int32 __flush_pending_events(void)
+{
+	mtp_int32 info_timeout = __flush_object_info_changed();
+	mtp_int32 storm_timeout = __flush_fs_event_storms();
+
+	if (info_timeout < 0)
+		return storm_timeout;
+	if (storm_timeout < 0)
+		return info_timeout;
+
+	return MIN(info_timeout, storm_timeout);
+}
+
+/* LCOV_EXCL_START */
+static void __remove_inoti_watch(mtp_char *path)
+{
+	inoti_watches_t *watch = NULL;
+
+	ret_if(g_inoti_watch_paths == NULL);
+
+	watch = g_hash_table_lookup(g_inoti_watch_paths, path);
+	retm_if(watch == NULL, "Path not found in g_noti_watches\n");
+
+	__del_inoti_watch(watch);
 }
 
 /* LCOV_EXCL_STOP */
@@ -293,6 +662,8 @@ static void __process_object_deleted_event(mtp_char *fullpath,
 	mtp_uint32 obj_handle = 0;
 	slist_node_t *node = NULL;
 
+	g_hash_table_remove(g_inoti_modified, fullpath);
+
 	retm_if(strstr(fullpath, MTP_TEMP_FILE), "File is a temp file, need to ignore\n");
 	retm_if(file_name[0] == '.', "Hidden file filename=[%s], Ignore\n", file_name);
 
@@ -324,135 +695,372 @@ static void __process_object_deleted_event(mtp_char *fullpath,
 			0, NULL);
 }
 
-static mtp_bool __process_inoti_event(struct inotify_event *event)
+static void __free_fs_event(gpointer data)
+{
+	fs_event_t *ev = (fs_event_t *)data;
+
+	g_free(ev->path);
+	g_free(ev->parent);
+	g_free(ev);
+}
+
+static void __add_fs_event(mtp_uint32 mask, mtp_char *parent,
+		mtp_char *name)
+{
+	fs_event_t *ev = NULL;
+	mtp_char *path = NULL;
+
+	path = g_strdup_printf("%s/%s", parent, name);
+	if (!_util_is_path_len_valid(path)) {
+		ERR("path len is invalid\n");
+		g_free(path);
+		return;
+	}
+
+	ev = (fs_event_t *)g_malloc0(sizeof(fs_event_t));
+	ev->mask = mask;
+	ev->path = path;
+	ev->parent = g_strdup(parent);
+	ev->name = path + strlen(parent) + 1;
+	g_ptr_array_add(g_fs_events, ev);
+}
+
+static void __collect_inoti_events(mtp_char *buffer, mtp_int32 length)
+{
+	mtp_int32 i = 0;
+	inoti_watches_t *watch = NULL;
+	struct inotify_event *event = NULL;
+
+	while (i + (mtp_int32)INOTI_EVENT_SIZE <= length) {
+		event = (struct inotify_event *)(&buffer[i]);
+		if (i + INOTI_EVENT_SIZE + event->len > length)
+			break;
+		i += INOTI_EVENT_SIZE + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			ERR("inotify queue overflow, events are lost\n");
+			continue;
+		}
+
+		if (event->len == 0 || event->len > MTP_MAX_FILENAME_SIZE) {
+			ERR_SECURE("Event len is invalid[%d], event->name[%s]\n",
+					event->len, event->name);
+			continue;
+		} else if (event->wd < 1) {
+			ERR("invalid wd : %d\n", event->wd);
+			continue;
+		}
+
+		watch = __get_inoti_watch(event->wd);
+		if (watch == NULL)
+			continue;
+
+		__add_fs_event(event->mask, watch->forlder_name, event->name);
+	}
+}
+
+#ifdef INOTI_SUPPORT_FANOTIFY
+/*
+ * Events of one batch mostly come from a few folders, so remember the
+ * last resolved folder handle instead of opening it for every event.
+ */
+static mtp_bool __get_fanoti_dir_path(struct file_handle *fh, mtp_char *path,
+		mtp_int32 path_len)
 {
-	static mtp_int32 last_moved_cookie = -1;
+	mtp_int32 fd = -1;
+	mtp_int32 len = 0;
+	mtp_uint32 fh_len = sizeof(struct file_handle) + fh->handle_bytes;
+	mtp_char proc_path[64] = { 0 };
+
+	if (fh_len == g_fanoti_last_fh_len &&
+			memcmp(g_fanoti_last_fh, fh, fh_len) == 0) {
+		g_strlcpy(path, g_fanoti_last_path, path_len);
+		return TRUE;
+	}
 
-	mtp_bool res = FALSE;
-	mtp_char full_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-	mtp_char parentpath[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	fd = open_by_handle_at(g_fanoti_mount_fd, fh, O_PATH);
+	/* The folder may already be gone */
+	retv_if(fd < 0, FALSE);
+
+	g_snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	len = readlink(proc_path, path, path_len - 1);
+	close(fd);
+	retv_if(len <= 0, FALSE);
+	path[len] = '\0';
+
+	if (fh_len <= sizeof(g_fanoti_last_fh)) {
+		memcpy(g_fanoti_last_fh, fh, fh_len);
+		g_fanoti_last_fh_len = fh_len;
+		g_strlcpy(g_fanoti_last_path, path, sizeof(g_fanoti_last_path));
+	}
+
+	return TRUE;
+}
+
+static mtp_bool __is_fanoti_path_watched(mtp_char *path)
+{
+	size_t len = strlen(g_fanoti_root);
 
-	if (event->len == 0 || event->len > MTP_MAX_FILENAME_SIZE) {
-		ERR_SECURE("Event len is invalid[%d], event->name[%s]\n", event->len,
-				event->name);
+	if (strncmp(path, g_fanoti_root, len) != 0)
 		return FALSE;
-	} else if (event->wd < 1) {
-		ERR("invalid wd : %d\n", event->wd);
+
+	return path[len] == '\0' || path[len] == '/';
+}
+
+static void __collect_fanoti_events(mtp_char *buffer, mtp_int32 length)
+{
+	struct fanotify_event_metadata *meta = NULL;
+	struct fanotify_event_info_fid *fid = NULL;
+	struct file_handle *fh = NULL;
+	mtp_char dir_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	mtp_char *name = NULL;
+	mtp_uint32 mask = 0;
+
+	/* Folders may have been renamed since the last batch */
+	g_fanoti_last_fh_len = 0;
+
+	for (meta = (struct fanotify_event_metadata *)buffer;
+			FAN_EVENT_OK(meta, length);
+			meta = FAN_EVENT_NEXT(meta, length)) {
+		if (meta->vers != FANOTIFY_METADATA_VERSION) {
+			ERR("fanotify metadata version mismatch\n");
+			break;
+		}
+
+		if (meta->fd >= 0)
+			close(meta->fd);
+
+		if (meta->mask & FAN_Q_OVERFLOW) {
+			ERR("fanotify queue overflow, events are lost\n");
+			continue;
+		}
+
+		fid = (struct fanotify_event_info_fid *)(meta + 1);
+		if (meta->event_len < sizeof(*meta) + sizeof(*fid) ||
+				fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			continue;
+
+		fh = (struct file_handle *)fid->handle;
+		name = (mtp_char *)fh->f_handle + fh->handle_bytes;
+		if (strlen(name) > MTP_MAX_FILENAME_SIZE)
+			continue;
+
+		if (!__get_fanoti_dir_path(fh, dir_path, sizeof(dir_path)))
+			continue;
+
+		if (!__is_fanoti_path_watched(dir_path))
+			continue;
+
+		/* Same meaning as the IN_* bits, but not guaranteed same values */
+		mask = 0;
+		if (meta->mask & FAN_CREATE)
+			mask |= IN_CREATE;
+		if (meta->mask & FAN_DELETE)
+			mask |= IN_DELETE;
+		if (meta->mask & FAN_MOVED_FROM)
+			mask |= IN_MOVED_FROM;
+		if (meta->mask & FAN_MOVED_TO)
+			mask |= IN_MOVED_TO;
+		/* FAN_MODIFY is not marked, the close reports the rewrite */
+		if (meta->mask & FAN_CLOSE_WRITE)
+			mask |= IN_CLOSE_WRITE | IN_MODIFY;
+		if (meta->mask & FAN_ATTRIB)
+			mask |= IN_ATTRIB;
+		if (meta->mask & FAN_ONDIR)
+			mask |= IN_ISDIR;
+
+		__add_fs_event(mask, dir_path, name);
+	}
+}
+
+/*
+ * Marks the whole file system holding the external storage once, instead
+ * of adding an inotify watch per folder. Only when it is the one store.
+ */
+static mtp_bool __init_fanoti(void)
+{
+	mtp_int32 fd = -1;
+	mtp_store_t *store = NULL;
+
+	retvm_if(_device_get_num_storage_slots() != 1 ||
+			_device_has_removable_storage(), FALSE,
+			"fanotify watches one store, use inotify\n");
+
+	store = _device_get_store(MTP_STORE_ID(0));
+	retvm_if(store == NULL, FALSE, "No store, use inotify\n");
+	g_strlcpy(g_fanoti_root, store->root_path, sizeof(g_fanoti_root));
+
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC,
+			O_RDONLY | O_LARGEFILE);
+	retvm_if(fd < 0, FALSE, "fanotify_init() Fail, use inotify\n");
+
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				FANOTI_EVENT_MASK, AT_FDCWD, g_fanoti_root) < 0) {
+		ERR("fanotify_mark() Fail, use inotify\n");
+		_util_print_error();
+		close(fd);
 		return FALSE;
 	}
 
-	/* start of one event */
-	res = __get_inoti_event_full_path(event->wd, event->name, full_path,
-			sizeof(full_path), parentpath);
-	retvm_if(!res, FALSE, "__get_inoti_event_full_path() Fail\n");
+	g_fanoti_mount_fd = open(g_fanoti_root, O_RDONLY | O_DIRECTORY |
+			O_CLOEXEC);
+	if (g_fanoti_mount_fd < 0) {
+		ERR("open() Fail, use inotify\n");
+		_util_print_error();
+		close(fd);
+		return FALSE;
+	}
+
+	g_inoti_fd = fd;
+	g_use_fanoti = TRUE;
+	DBG("fanotify is used for [%s]\n", g_fanoti_root);
+
+	return TRUE;
+}
+#endif /* INOTI_SUPPORT_FANOTIFY */
+
+/*
+ * A file copied onto the card shows up as IN_CREATE followed by
+ * IN_CLOSE_WRITE. When both are in the same batch, mark them so the pair
+ * adds the object once instead of going through the open files list.
+ */
+static void __pair_fs_events(void)
+{
+	mtp_uint32 i = 0;
+	fs_event_t *ev = NULL;
+	fs_event_t *create_ev = NULL;
+
+	for (i = 0; i < g_fs_events->len; i++) {
+		ev = g_ptr_array_index(g_fs_events, i);
 
-	retvm_if(!_util_is_path_len_valid(full_path), FALSE, "path len is invalid\n");
+		if (ev->mask & IN_ISDIR)
+			continue;
+
+		if (!(ev->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE |
+						IN_MOVED_FROM)))
+			continue;
+
+		if (ev->mask & IN_CREATE) {
+			g_hash_table_replace(g_inoti_created, ev->path, ev);
+			continue;
+		}
+
+		create_ev = g_hash_table_lookup(g_inoti_created, ev->path);
+		if (create_ev != NULL && (ev->mask & IN_CLOSE_WRITE)) {
+			create_ev->is_paired = TRUE;
+			ev->is_paired = TRUE;
+		}
+		g_hash_table_remove(g_inoti_created, ev->path);
+	}
+
+	g_hash_table_remove_all(g_inoti_created);
+}
+
+/*
+ * Events of changes made by MTP itself, or of its temp file, are dropped
+ * before storms are counted: a CopyObject of a folder tree must not look
+ * like a bulk copy. The matching journal entry is taken on the way.
+ */
+static mtp_bool __is_mtp_fs_event(fs_event_t *ev)
+{
+	mtp_bool found = FALSE;
+
+	if (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO))
+		found = __is_self_change(ev->path, INOTI_SELF_MOVE);
+	else if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR))
+		found = __is_self_change(ev->path, INOTI_SELF_CREATE_DIR);
+	else if (ev->mask & IN_CREATE)
+		/* Left for the IN_CLOSE_WRITE of the copy */
+		found = __has_self_change(ev->path, INOTI_SELF_COPY);
+	else if (ev->mask & IN_DELETE)
+		found = __is_self_change(ev->path, INOTI_SELF_DELETE);
+	else if (ev->mask & IN_CLOSE_WRITE)
+		found = __is_self_change(ev->path, INOTI_SELF_COPY);
+	else if (ev->mask & (IN_MODIFY | IN_ATTRIB))
+		found = __has_self_change(ev->path, INOTI_SELF_MODIFY);
+
+	return found || g_strrstr(ev->name, MTP_TEMP_FILE) != NULL;
+}
+
+static mtp_bool __process_fs_event(fs_event_t *ev)
+{
+	DBG_SECURE("Event full path = %s\n", ev->path);
+	if (__is_mtp_fs_event(ev)) {
+		/* Ignore this case as this is generated due to MTP*/
+		DBG("[%s] is changed by MTP\n", ev->path);
+		if (ev->mask & IN_CLOSE_WRITE)
+			__invalidate_object_info(ev->path);
+		return FALSE;
+	}
+
+	if (__is_in_fs_event_storm(ev))
+		return FALSE;
 
-	DBG_SECURE("Event full path = %s\n", full_path);
         memset(g_copy_dst_file, 0, MTP_MAX_PATHNAME_SIZE + 1);
-        g_snprintf(g_copy_dst_file, MTP_MAX_PATHNAME_SIZE + 1, "%s", full_path);
-
-	if (event->mask & IN_MOVED_FROM) {
-		if (!g_strcmp0(g_last_moved, full_path)) {
-			/* Ignore this case as this is generated due to MTP*/
-			DBG("[%s] is moved_from by MTP\n", full_path);
-			memset(g_last_moved, 0,
-					MTP_MAX_PATHNAME_SIZE + 1);
-			last_moved_cookie = event->cookie;
-		} else if (event->mask & IN_ISDIR) {
+        g_snprintf(g_copy_dst_file, MTP_MAX_PATHNAME_SIZE + 1, "%s", ev->path);
+
+	if (ev->mask & IN_MOVED_FROM) {
+		if (ev->mask & IN_ISDIR) {
 			DBG("IN_MOVED_FROM --> IN_ISDIR\n");
-			UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-			__process_object_deleted_event(full_path,
-					event->name, TRUE);
-			UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+			__process_object_deleted_event(ev->path,
+					ev->name, TRUE);
 		} else {
 			DBG("IN_MOVED_FROM --> NOT IN_ISDIR\n");
-			UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-			__process_object_deleted_event(full_path,
-					event->name, FALSE);
-			UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
-		}
-	} else if (event->mask & IN_MOVED_TO) {
-		DBG("Moved To event, path = [%s]\n", full_path);
-		if (last_moved_cookie == event->cookie) {
-			/* Ignore this case as this is generated due to MTP*/
-			DBG("%s  is moved_to by MTP\n", full_path);
-			last_moved_cookie = -1;
-		} else {
-			UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-			__process_object_added_event(full_path,
-					event->name, parentpath);
-			UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+			__process_object_deleted_event(ev->path,
+					ev->name, FALSE);
 		}
-	} else if (event->mask & IN_CREATE) {
-		if (event->mask & IN_ISDIR) {
+	} else if (ev->mask & IN_MOVED_TO) {
+		DBG("Moved To event, path = [%s]\n", ev->path);
+		__process_object_added_event(ev->path, ev->name, ev->parent);
+	} else if (ev->mask & IN_CREATE) {
+		if (ev->mask & IN_ISDIR) {
 			DBG("IN_CREATE --> IN_ISDIR\n");
-			if (!g_strcmp0(g_last_created_dir, full_path)) {
-				/* Ignore this case as this is generated due to MTP*/
-				DBG("%s folder is generated by MTP\n",
-						full_path);
-				memset(g_last_created_dir, 0,
-						MTP_MAX_PATHNAME_SIZE + 1);
-			} else {
-				UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-				__process_object_added_event(full_path,
-						event->name, parentpath);
-				UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
-			}
+			__process_object_added_event(ev->path,
+					ev->name, ev->parent);
+		} else if (ev->is_paired) {
+			DBG("IN_CREATE --> NOT IN_ISDIR, closed in this batch\n");
 		} else {
-			if (FALSE == __add_file_to_inoti_open_files_list(event->wd,
-						event->name)) {
+			if (FALSE == __add_file_to_inoti_open_files_list(ev->path)) {
 				DBG_SECURE("__add_file_to_inoti_open_files_list fail\
-						%s\n", event->name);
+						%s\n", ev->name);
 			}
 			DBG("IN_CREATE --> NOT IN_ISDIR\n");
 		}
-	} else if (event->mask &  IN_DELETE) {
-		if (!g_strcmp0(g_last_deleted, full_path)) {
-			/* Ignore this case as this is generated due to MTP*/
-			DBG("%s  is deleted by MTP\n", full_path);
-			memset(g_last_deleted, 0,
-					MTP_MAX_PATHNAME_SIZE + 1);
-		} else if (event->mask & IN_ISDIR) {
+	} else if (ev->mask &  IN_DELETE) {
+		if (ev->mask & IN_ISDIR) {
 			DBG("IN_DELETE --> IN_ISDIR\n");
-			UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-			__process_object_deleted_event(full_path,
-					event->name, TRUE);
-			UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+			__process_object_deleted_event(ev->path,
+					ev->name, TRUE);
 		} else {
 			DBG("IN_DELETE --> NOT IN_ISDIR\n");
-			UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-			__process_object_deleted_event(full_path,
-					event->name, FALSE);
-			UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+			__process_object_deleted_event(ev->path,
+					ev->name, FALSE);
 		}
-	} else if (event->mask & IN_CLOSE_WRITE) {
-		DBG_SECURE("IN_CLOSE_WRITE %d, %s\n", event->wd, event->name);
-		if (!g_strcmp0(g_last_copied, full_path)) {
-			/* Ignore this case as this is generated due to MTP*/
-			DBG("[%s] is copied by MTP\n", full_path);
-			memset(g_last_copied, 0,
-					MTP_MAX_PATHNAME_SIZE + 1);
-                } else if (g_is_send_partial_object) {
-                        UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-                        __process_object_added_event(full_path, event->name, parentpath);
-                        UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+	} else if (ev->mask & IN_CLOSE_WRITE) {
+		DBG_SECURE("IN_CLOSE_WRITE %s\n", ev->path);
+		__invalidate_object_info(ev->path);
+		if (g_is_send_partial_object) {
+                        __process_object_added_event(ev->path, ev->name, ev->parent);
 
                         g_is_send_partial_object = false;
                         memset(g_copy_dst_file, 0, MTP_MAX_PATHNAME_SIZE + 1);
+		} else if (ev->is_paired) {
+			__process_object_added_event(ev->path,
+					ev->name, ev->parent);
                 } else {
 			open_files_info_t *node = NULL;
-			node = __find_file_in_inoti_open_files_list(event->wd,
-					event->name);
+			node = __find_file_in_inoti_open_files_list(ev->path);
 
 			if (node != NULL) {
-				UTIL_LOCK_MUTEX(&g_cmd_inoti_mutex);
-				__process_object_added_event(full_path,
-						event->name, parentpath);
-				UTIL_UNLOCK_MUTEX(&g_cmd_inoti_mutex);
+				__process_object_added_event(ev->path,
+						ev->name, ev->parent);
 				__remove_file_from_inoti_open_files_list(node);
+			} else if (ev->mask & IN_MODIFY) {
+				__defer_object_info_changed(ev);
 			}
 		}
+	} else if (ev->mask & (IN_MODIFY | IN_ATTRIB)) {
+		__defer_object_info_changed(ev);
 	} else {
 		DBG("This case is ignored\n");
 		return FALSE;
@@ -476,7 +1084,6 @@ static void __destroy_inoti_open_files_list()
 			g_open_files_list->next = NULL;
 
 		g_free(current->name);
-		current->wd = 0;
 		current->previous = NULL;
 		current->next = NULL;
 		g_free(current);
@@ -486,139 +1093,314 @@ static void __destroy_inoti_open_files_list()
 	/* LCOV_EXCL_STOP */
 }
 
+/* Removes the watches of path and its sub folders, all of them for NULL */
 static void __remove_recursive_inoti_watch(mtp_char *path)
 {
-	mtp_int32 i = 0;
-	mtp_char *res = NULL;
+	GHashTableIter iter;
+	inoti_watches_t *watch = NULL;
+	size_t len = path != NULL ? strlen(path) : 0;
 
-	for (i = 0; i < g_cnt_watch_folder; i++) {
-		if (g_inoti_watches[i].forlder_name == NULL)
-			continue;
+	ret_if(g_inoti_watches == NULL);
 
-		res = strstr(g_inoti_watches[i].forlder_name, path);
-		if (res == NULL)
+	g_hash_table_iter_init(&iter, g_inoti_watches);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&watch)) {
+		if (path != NULL && (strncmp(watch->forlder_name, path, len) ||
+					(watch->forlder_name[len] != '\0' &&
+					 watch->forlder_name[len] != '/')))
 			continue;
 
-		g_free(g_inoti_watches[i].forlder_name);
-		g_inoti_watches[i].forlder_name = NULL;
-		inotify_rm_watch(g_inoti_fd, g_inoti_watches[i].wd);
-		g_inoti_watches[i].wd = 0;
+		inotify_rm_watch(g_inoti_fd, watch->wd);
+		g_hash_table_remove(g_inoti_watch_paths, watch->forlder_name);
+		/* Frees watch */
+		g_hash_table_iter_remove(&iter);
 	}
 }
 
 static void __clean_up_inoti(void *data)
 {
-	char ext_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-	_util_get_external_path(ext_path);
-
-	__remove_recursive_inoti_watch((mtp_char *)ext_path);
+	__remove_recursive_inoti_watch(NULL);
+	__deinit_inoti_watches();
 	__destroy_inoti_open_files_list();
 
+	g_ptr_array_free(g_fs_events, TRUE);
+	g_fs_events = NULL;
+	g_hash_table_destroy(g_inoti_created);
+	g_inoti_created = NULL;
+	g_hash_table_destroy(g_inoti_modified);
+	g_inoti_modified = NULL;
+	g_hash_table_destroy(g_inoti_storms);
+	g_inoti_storms = NULL;
+
+#ifdef INOTI_SUPPORT_FANOTIFY
+	if (g_fanoti_mount_fd >= 0) {
+		close(g_fanoti_mount_fd);
+		g_fanoti_mount_fd = -1;
+	}
+	g_use_fanoti = FALSE;
+#endif /* INOTI_SUPPORT_FANOTIFY */
+
 	close(g_inoti_fd);
 	g_inoti_fd = 0;
 }
 
-void *_thread_inoti(void *arg)
+/*
+ * The loop thread also serves ep0, so it never waits for the store. While
+ * a command holds it, the notification fd is parked and the batch is
+ * retried from the timer.
+ */
+static mtp_bool __lock_stores_or_retry(void)
+{
+	if (_entity_trylock_stores_write())
+		return TRUE;
+
+	if (!g_inoti_fd_parked) {
+		_util_loop_enable_fd(g_inoti_fd, FALSE);
+		g_inoti_fd_parked = TRUE;
+	}
+	_util_loop_set_timer(g_inoti_timer, INOTI_LOCK_RETRY);
+
+	return FALSE;
+}
+
+/* Reads one batch of events into g_fs_events */
+static mtp_bool __read_fs_events(mtp_int32 fd)
 {
-	mtp_int32 i = 0;
 	mtp_int32 length = 0;
-	mtp_int64 temp_idx;
-	mtp_char buffer[INOTI_BUF_LEN] = { 0 };
-	struct inotify_event *event = NULL;
+	static mtp_char buffer[INOTI_BUF_LEN] __attribute__((aligned(8)));
 
-	pthread_cleanup_push(__clean_up_inoti, NULL);
+	length = read(fd, buffer, sizeof(buffer));
+	/* LCOV_EXCL_START */
+	if (length < 0) {
+		ERR("read() Fail\n");
+		_util_print_error();
+		if (errno != EINTR && errno != EAGAIN)
+			_util_loop_remove_fd(fd);
+		return FALSE;
+	}
+	/* LCOV_EXCL_STOP */
 
-	DBG("START INOTIFY SYSTEM\n");
+#ifdef INOTI_SUPPORT_FANOTIFY
+	if (g_use_fanoti)
+		__collect_fanoti_events(buffer, length);
+	else
+#endif /* INOTI_SUPPORT_FANOTIFY */
+		__collect_inoti_events(buffer, length);
 
-	while (1) {
-		pthread_testcancel();
-		errno = 0;
-		i = 0;
-		length = read(g_inoti_fd, buffer, sizeof(buffer));
-		/* LCOV_EXCL_START */
-		if (length < 0) {
-			ERR("read() Fail\n");
-			_util_print_error();
-			break;
-		}
+	return TRUE;
+}
 
-		while (i < length) {
-			event = (struct inotify_event *)(&buffer[i]);
-			__process_inoti_event(event);
-			temp_idx = i + event->len + INOTI_EVENT_SIZE;
-			if (temp_idx > length)
-				break;
-			else
-				i = temp_idx;
+/* Called with the store write lock held */
+static void __process_fs_events(void)
+{
+	mtp_uint32 i = 0;
+
+	/* One lock round trip for the whole batch */
+	__pair_fs_events();
+	for (i = 0; i < g_fs_events->len; i++)
+		__process_fs_event(g_ptr_array_index(g_fs_events, i));
+
+	g_ptr_array_set_size(g_fs_events, 0);
+}
+
+static void __handle_inoti_events(mtp_int32 fd, void *data)
+{
+	if (g_use_fanoti) {
+		/*
+		 * fanotify reports every change of the file system, so events
+		 * are filtered before the store is locked. A batch which has to
+		 * wait for the store stays in g_fs_events for the timer.
+		 */
+		ret_if(!__read_fs_events(fd) || g_fs_events->len == 0);
+		ret_if(!__lock_stores_or_retry());
+	} else {
+		/* inotify watches only the store, resolving them needs it */
+		ret_if(!__lock_stores_or_retry());
+		if (!__read_fs_events(fd)) {
+			_entity_unlock_stores();
+			return;
 		}
 	}
 
-	DBG("Inoti thread exited\n");
-	pthread_cleanup_pop(1);
+	__process_fs_events();
 
-	return NULL;
-	/* LCOV_EXCL_STOP */
+	/* Wake up for the next ObjectInfoChanged or storm end */
+	_util_loop_set_timer(g_inoti_timer, __flush_pending_events());
+	_entity_unlock_stores();
+}
+
+static void __handle_inoti_timer(mtp_int32 fd, void *data)
+{
+	ret_if(!__lock_stores_or_retry());
+
+	if (g_fs_events->len > 0)
+		__process_fs_events();
+	_util_loop_set_timer(g_inoti_timer, __flush_pending_events());
+	_entity_unlock_stores();
+
+	if (g_inoti_fd_parked) {
+		_util_loop_enable_fd(g_inoti_fd, TRUE);
+		g_inoti_fd_parked = FALSE;
+	}
+}
+
+/*
+ * void _inoti_record_self_change(const mtp_char *path, inoti_self_op_t op)
+ * Records that MTP is about to do op on path, so the resulting file system
+ * event is ignored. The oldest entry is dropped once the journal is full.
+ */
+void _inoti_record_self_change(const mtp_char *path, inoti_self_op_t op)
+{
+	self_change_t *change = NULL;
+	GList *oldest = NULL;
+
+	ret_if(path == NULL);
+
+	pthread_mutex_lock(&g_self_changes_mutex);
+
+	if (g_self_changes == NULL) {
+		g_self_changes = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, __free_self_change);
+	}
+
+	change = (self_change_t *)g_malloc0(sizeof(self_change_t));
+	change->link.data = change;
+	change->key = __get_self_change_key(path, op);
+	change->expiry = g_get_monotonic_time() + INOTI_SELF_CHANGE_TTL;
+
+	/* Frees a previous entry for the same key */
+	g_hash_table_replace(g_self_changes, change->key, change);
+	g_queue_push_head_link(&g_self_changes_lru, &change->link);
+
+	while (g_queue_get_length(&g_self_changes_lru) > INOTI_SELF_CHANGES_MAX) {
+		oldest = g_queue_peek_tail_link(&g_self_changes_lru);
+		g_hash_table_remove(g_self_changes,
+				((self_change_t *)oldest->data)->key);
+	}
+
+	pthread_mutex_unlock(&g_self_changes_mutex);
+}
+
+/*
+ * void _inoti_forget_self_change(const mtp_char *path, inoti_self_op_t op)
+ * Drops a recorded change whose operation failed.
+ */
+void _inoti_forget_self_change(const mtp_char *path, inoti_self_op_t op)
+{
+	ret_if(path == NULL);
+
+	pthread_mutex_lock(&g_self_changes_mutex);
+	__take_self_change(path, op);
+	pthread_mutex_unlock(&g_self_changes_mutex);
 }
 
 void _inoti_add_watch_for_fs_events(mtp_char *path)
 {
-	mtp_int32 i = 0;
+	mtp_int32 wd = 0;
+	inoti_watches_t *watch = NULL;
 
 	ret_if(path == NULL);
+	/* The whole file system is already marked */
+	ret_if(g_use_fanoti);
+	ret_if(!_util_storage_get_ops()->has_fs_events);
 
-	if (g_cnt_watch_folder == INOTI_FOLDER_COUNT_MAX) {
-		/* find empty cell */
+	__init_inoti_watches();
+
+	if ((mtp_int32)g_hash_table_size(g_inoti_watches) >= g_inoti_max_watches) {
 		/* LCOV_EXCL_START */
-		for (i = 0; i < INOTI_FOLDER_COUNT_MAX; i++) {
-			/* If not empty */
-			if (g_inoti_watches[i].wd != 0)
-				continue;
-			else
-				break;
+		if (!g_inoti_limit_reported) {
+			ERR("inotify watch limit (%d) reached, raise %s\n",
+					g_inoti_max_watches,
+					INOTI_MAX_USER_WATCHES_PATH);
+			g_inoti_limit_reported = TRUE;
 		}
+		ERR_SECURE("[%s] is not watched\n", path);
+		return;
+		/* LCOV_EXCL_STOP */
+	}
 
-		retm_if(i == INOTI_FOLDER_COUNT_MAX,
-			"no empty space for a new inotify watch.\n");
-
-		DBG("g_watch_folders[%d] add watch : %s\n", i, path);
-		g_inoti_watches[i].forlder_name = g_strdup(path);
-		g_inoti_watches[i].wd = inotify_add_watch(g_inoti_fd,
-				g_inoti_watches[i].forlder_name,
-				IN_CLOSE_WRITE | IN_CREATE |
-				IN_DELETE | IN_MOVED_FROM |
-				IN_MOVED_TO);
+	wd = inotify_add_watch(g_inoti_fd, path, INOTI_EVENT_MASK);
+	if (wd < 0) {
+		/* LCOV_EXCL_START */
+		if (errno == ENOSPC && !g_inoti_limit_reported) {
+			ERR("inotify watch limit reached after %u watches, raise %s\n",
+					g_hash_table_size(g_inoti_watches),
+					INOTI_MAX_USER_WATCHES_PATH);
+			g_inoti_limit_reported = TRUE;
+		}
+		ERR_SECURE("inotify_add_watch(%s) Fail\n", path);
+		_util_print_error();
 		return;
 		/* LCOV_EXCL_STOP */
 	}
 
-	DBG("g_watch_folders[%d] add watch : %s\n", g_cnt_watch_folder, path);
-	g_inoti_watches[g_cnt_watch_folder].forlder_name = g_strdup(path);
-	g_inoti_watches[g_cnt_watch_folder].wd = inotify_add_watch(g_inoti_fd,
-			g_inoti_watches[g_cnt_watch_folder].forlder_name,
-			IN_CLOSE_WRITE |
-			IN_CREATE | IN_DELETE |
-			IN_MOVED_FROM |
-			IN_MOVED_TO);
-	g_cnt_watch_folder++;
+	/* The same inode returns the same wd, drop the stale name */
+	watch = g_hash_table_lookup(g_inoti_watches, GINT_TO_POINTER(wd));
+	if (watch != NULL)
+		g_hash_table_remove(g_inoti_watch_paths, watch->forlder_name);
+
+	watch = g_hash_table_lookup(g_inoti_watch_paths, path);
+	if (watch != NULL)
+		__del_inoti_watch(watch);
+
+	watch = (inoti_watches_t *)g_malloc(sizeof(inoti_watches_t));
+	watch->wd = wd;
+	watch->forlder_name = g_strdup(path);
+	/* Frees the previous watch with this wd, if any */
+	g_hash_table_replace(g_inoti_watches, GINT_TO_POINTER(wd), watch);
+	g_hash_table_replace(g_inoti_watch_paths, watch->forlder_name, watch);
+
+	DBG("add watch [%d] : %s\n", wd, path);
 }
 
+/* LCOV_EXCL_START */
+void _inoti_remove_watch_for_fs_events(mtp_char *path)
+{
+	ret_if(path == NULL);
+
+	__remove_recursive_inoti_watch(path);
+}
+/* LCOV_EXCL_STOP */
+
 mtp_bool _inoti_init_filesystem_evnts()
 {
 	mtp_bool ret = FALSE;
 
-	g_inoti_fd = inotify_init();
-	retvm_if(g_inoti_fd < 0, FALSE, "inotify_init() Fail : g_inoti_fd = %d\n", g_inoti_fd);
+	/* Only MTP changes the stores */
+	retvm_if(!_util_storage_get_ops()->has_fs_events, FALSE,
+			"Storage backend has no file system events\n");
+
+#ifdef INOTI_SUPPORT_FANOTIFY
+	if (!g_conf.use_fanotify || !__init_fanoti())
+#endif /* INOTI_SUPPORT_FANOTIFY */
+	{
+		g_inoti_fd = inotify_init();
+		retvm_if(g_inoti_fd < 0, FALSE, "inotify_init() Fail : g_inoti_fd = %d\n", g_inoti_fd);
+	}
+
+	__init_inoti_watches();
 
-	ret = _util_thread_create(&g_inoti_thrd, "File system inotify thread\n",
-			PTHREAD_CREATE_JOINABLE, _thread_inoti, NULL);
+	g_inoti_created = g_hash_table_new(g_str_hash, g_str_equal);
+	g_inoti_modified = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+	g_inoti_storms = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+	g_fs_events = g_ptr_array_new_with_free_func(__free_fs_event);
+	g_inoti_fd_parked = FALSE;
+
+	g_inoti_timer = _util_loop_add_timer(__handle_inoti_timer, NULL);
+	ret = g_inoti_timer >= 0 &&
+		_util_loop_add_fd(g_inoti_fd, __handle_inoti_events, NULL);
 	if (FALSE == ret) {
 		/* LCOV_EXCL_START */
-		ERR("_util_thread_create() Fail\n");
-		_util_print_error();
-		close(g_inoti_fd);
+		ERR("Cannot watch the file system events\n");
+		_util_loop_remove_timer(g_inoti_timer);
+		g_inoti_timer = -1;
+		__clean_up_inoti(NULL);
 		return FALSE;
 	}
 
+	DBG("START INOTIFY SYSTEM\n");
+
 	return TRUE;
 }
 
@@ -626,10 +1408,14 @@ mtp_bool _inoti_init_filesystem_evnts()
 
 void _inoti_deinit_filesystem_events()
 {
-	retm_if(!_util_thread_cancel(g_inoti_thrd), "thread cancel fail.\n");
+	ret_if(g_fs_events == NULL);
+
+	_util_loop_remove_fd(g_inoti_fd);
+	_util_loop_remove_timer(g_inoti_timer);
+	g_inoti_timer = -1;
 
-	if (_util_thread_join(g_inoti_thrd, 0) == FALSE)
-		ERR("_util_thread_join() Fail\n");
+	__clean_up_inoti(NULL);
+	DBG("Inoti events are no longer watched\n");
 }
 
 #endif /*MTP_SUPPORT_OBJECTADDDELETE_EVENT*/
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <glib.h>
+#include "mtp_loop.h"
+#include "mtp_mount_handler.h"
+#include "mtp_event_handler.h"
+#include "mtp_device.h"
+#include "mtp_util.h"
+
+/*
+ * The kernel flags /proc/self/mountinfo with EPOLLPRI whenever a file
+ * system is mounted or unmounted. The removable stores are then looked up
+ * again, and the host is told of the ones which came and went.
+ */
+
+/*
+ * STATIC VARIABLES
+ */
+static mtp_int32 g_mount_fd = -1;
+static mtp_int32 g_mount_timer = -1;
+
+/*
+ * FUNCTIONS
+ */
+/* LCOV_EXCL_START */
+static void __update_stores(void)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 *ids = NULL;
+	ptp_array_t added = { 0 };
+	ptp_array_t removed = { 0 };
+
+	/* Like inotify, the loop thread never waits for the store */
+	if (!_entity_trylock_stores_write()) {
+		_util_loop_set_timer(g_mount_timer, MOUNT_LOCK_RETRY);
+		return;
+	}
+
+	_prop_init_ptparray(&added, UINT32_TYPE);
+	_prop_init_ptparray(&removed, UINT32_TYPE);
+
+	_device_update_removable_storage(&added, &removed);
+	_entity_unlock_stores();
+
+	ids = removed.array_entry;
+	for (i = 0; i < removed.num_ele; i++)
+		_eh_send_event_req_to_eh_thread(EVENT_STORE_REMOVED, ids[i], 0,
+				NULL);
+	ids = added.array_entry;
+	for (i = 0; i < added.num_ele; i++)
+		_eh_send_event_req_to_eh_thread(EVENT_STORE_ADDED, ids[i], 0,
+				NULL);
+
+	_prop_deinit_ptparray(&added);
+	_prop_deinit_ptparray(&removed);
+}
+
+static void __handle_mount_events(mtp_int32 fd, void *data)
+{
+	/* Polling mountinfo consumed the change, there is nothing to read */
+	__update_stores();
+}
+
+static void __handle_mount_timer(mtp_int32 fd, void *data)
+{
+	__update_stores();
+}
+
+mtp_bool _mount_init_storage_events(void)
+{
+	retv_if(!_device_has_removable_storage(), FALSE);
+	retv_if(g_mount_fd >= 0, TRUE);
+
+	g_mount_fd = open(MTP_MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+	retvm_if(g_mount_fd < 0, FALSE, "Cannot open %s\n",
+			MTP_MOUNTINFO_PATH);
+
+	g_mount_timer = _util_loop_add_timer(__handle_mount_timer, NULL);
+	if (g_mount_timer < 0 || !_util_loop_add_fd_events(g_mount_fd,
+				EPOLLPRI, __handle_mount_events, NULL)) {
+		ERR("Cannot watch the mounts\n");
+		_mount_deinit_storage_events();
+		return FALSE;
+	}
+
+	/* Whatever was mounted since the stores were installed */
+	__update_stores();
+
+	DBG("Removable stores are followed\n");
+	return TRUE;
+}
+
+void _mount_deinit_storage_events(void)
+{
+	ret_if(g_mount_fd < 0);
+
+	if (g_mount_timer >= 0) {
+		_util_loop_remove_timer(g_mount_timer);
+		g_mount_timer = -1;
+	}
+	_util_loop_remove_fd(g_mount_fd);
+	close(g_mount_fd);
+	g_mount_fd = -1;
+}
+/* LCOV_EXCL_STOP */
@@ -170,6 +170,34 @@ mtp_bool _hdlr_send_data_container(data_container_t *dst)
 	return TRUE;
 }
 
+/*
+ * Sends a data container which was packed once and kept around, header
+ * included. Only the transaction id differs between requests, so it is
+ * patched in place before the block is queued.
+ */
+mtp_bool _hdlr_send_cached_data_container(mtp_uchar *blk, mtp_uint32 len,
+		mtp_uint32 tid)
+{
+	mtp_uint32 sent;
+	header_container_t *header = NULL;
+
+	retv_if(blk == NULL, FALSE);
+	retv_if(len < sizeof(header_container_t), FALSE);
+
+	header = (header_container_t *)blk;
+	header->tid = tid;
+#ifdef __BIG_ENDIAN__
+	_util_conv_byte_order(&(header->tid), sizeof(header->tid));
+#endif /* __BIG_ENDIAN__ */
+
+	sent = _transport_send_pkt_to_tx_mq(blk, len);
+
+	if (sent != len)
+		return FALSE;
+
+	return TRUE;
+}
+
 mtp_bool _hdlr_send_bulk_data(mtp_uchar *dst, mtp_uint32 len)
 {
 	mtp_uint32 sent = 0;
@@ -271,7 +299,9 @@ mtp_bool _hdlr_rcv_file_in_data_container(data_container_t *dst,
 	dst->code = header->code;
 	dst->tid = header->tid;
 
-	if ((dst->len != bytes_rcvd && bytes_rcvd < MTP_FILESIZE_4GB) ||
+	/* Data of unknown length was read until a short packet */
+	if ((dst->len != MTP_CONTAINER_LEN_UNKNOWN &&
+				dst->len != bytes_rcvd) ||
 			dst->type != CONTAINER_DATA_BLK ||
 			dst->code != exp_code || dst->tid != exp_tid) {
 		ERR("HEADER FAILURE");
@@ -40,13 +40,19 @@ extern mtp_mgr_t g_mtp_mgr;
 static mtp_bool g_usb_threads_created = FALSE;
 static pthread_t g_tx_thrd = 0;
 static pthread_t g_rx_thrd = 0;
-static pthread_t g_ctrl_thrd = 0;
+static pthread_t g_event_thrd = 0;
 static pthread_t g_data_rcv = 0;
+static _cmd_handler_cb g_cmd_handler_func = NULL;
 static msgq_id_t mtp_to_usb_mqid;
 static msgq_id_t g_usb_to_mtp_mqid;
 static status_info_t _g_status;
 status_info_t *g_status = &_g_status;
 
+static inline mtp_bool __is_tx_cancelled(void)
+{
+	return __atomic_load_n(&g_status->is_cancelling, __ATOMIC_ACQUIRE);
+}
+
 /*
  * FUNCTIONS
  */
@@ -95,7 +101,7 @@ mtp_err_t _transport_rcv_temp_file_data(mtp_byte *buffer, mtp_uint32 size,
 
 	/* delete temp file, it have to be called in receive_data fn */
 	if (g_mtp_mgr.ftemp_st.filepath != NULL) {
-		if (remove(g_mtp_mgr.ftemp_st.filepath) < 0) {
+		if (_util_file_remove(g_mtp_mgr.ftemp_st.filepath) < 0) {
 			ERR_SECURE("remove(%s) Fail\n", g_mtp_mgr.ftemp_st.filepath);
 			_util_print_error();
 		}
@@ -141,24 +147,13 @@ mtp_err_t _transport_rcv_temp_file_info(mtp_byte *buf, char *filepath,
 mtp_err_t _transport_send_event(mtp_byte *buf, mtp_uint32 size,
 		mtp_uint32 *count)
 {
-	mtp_bool resp = FALSE;
-	msgq_ptr_t pkt = { 0 };
-
 	retv_if(buf == NULL, MTP_ERROR_INVALID_PARAM);
 	retvm_if(size > g_conf.write_usb_size, MTP_ERROR_INVALID_PARAM,
 			"size = %d, tx pkt size = (%d)\n", size, g_conf.write_usb_size);
 
-	pkt.mtype = MTP_EVENT_PACKET;
-	pkt.signal = 0x0000;
-	pkt.length = size;
-
-	pkt.buffer = (mtp_uchar *)g_malloc(size);
-	retvm_if(!pkt.buffer, MTP_ERROR_GENERAL, "g_malloc() Fail\n");
-
-	memcpy(pkt.buffer, buf, size);
-	resp = _util_msgq_send(mtp_to_usb_mqid, (void *)&pkt,
-			sizeof(msgq_ptr_t) - sizeof(long), 0);
-	retvm_if(!resp, MTP_ERROR_GENERAL, "_util_msgq_send() Fail\n");
+	/* Not behind the bulk data waiting in the TX queue */
+	retvm_if(!_transport_queue_usb_event(buf, size), MTP_ERROR_GENERAL,
+			"_transport_queue_usb_event() Fail\n");
 
 	*count = size;
 	return MTP_ERROR_NONE;
@@ -183,6 +178,8 @@ mtp_uint32 _transport_send_pkt_to_tx_mq(const mtp_byte *buf,
 
 	retv_if(buf == NULL, 0);
 	retv_if(pkt_len == 0, 0);
+	/* The host cancelled the transaction this belongs to */
+	retv_if(__is_tx_cancelled(), 0);
 
 	pkt.mtype = MTP_DATA_PACKET;
 	pkt.signal = 0x0000;
@@ -222,6 +219,8 @@ mtp_uint32 _transport_send_bulk_pkt_to_tx_mq(const mtp_byte *buf,
 
 	retv_if(buf == NULL, 0);
 	retv_if(pkt_len == 0, 0);
+	/* The host cancelled the transaction this belongs to */
+	retv_if(__is_tx_cancelled(), 0);
 
 	pkt.length = tx_size;
 	while (pkt_len > tx_size) {
@@ -263,6 +262,8 @@ void _transport_send_zlp(void)
 	msgq_ptr_t pkt = { 0 };
 	mtp_bool resp = FALSE;
 
+	ret_if(__is_tx_cancelled());
+
 	pkt.mtype = MTP_ZLP_PACKET;
 	pkt.signal = 0x0000;
 	pkt.length = 0;
@@ -274,15 +275,25 @@ void _transport_send_zlp(void)
 		ERR("_util_msgq_send() Fail\n");
 }
 
+/*
+ * Ends a host cancel request: GETSTATUS reports OK again and data queued
+ * for the host is no longer dropped.
+ */
+void _transport_finish_cancel(void)
+{
+	__atomic_store_n(&g_status->is_cancelling, FALSE, __ATOMIC_RELEASE);
+}
+
 static mtp_err_t __transport_init_io()
 {
 	mtp_int32 res = 0;
 	thread_func_t usb_write_thread = _transport_thread_usb_write;
 	thread_func_t usb_read_thread = _transport_thread_usb_read;
-	thread_func_t usb_control_thread = _transport_thread_usb_control;
+	thread_func_t usb_event_thread = _transport_thread_usb_event;
 
 	res = _util_thread_create(&g_tx_thrd, "usb write thread",
-			PTHREAD_CREATE_JOINABLE, usb_write_thread,
+			PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_USB,
+			usb_write_thread,
 			(void *)&mtp_to_usb_mqid);
 	if (FALSE == res) {
 		ERR("_util_thread_create(TX) Fail\n");
@@ -290,19 +301,19 @@ static mtp_err_t __transport_init_io()
 	}
 
 	res = _util_thread_create(&g_rx_thrd, "usb read thread",
-			PTHREAD_CREATE_JOINABLE, usb_read_thread,
+			PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_USB,
+			usb_read_thread,
 			(void *)&g_usb_to_mtp_mqid);
 	if (FALSE == res) {
 		ERR("_util_thread_create(RX) Fail\n");
 		goto cleanup;
 	}
 
-	res = _util_thread_create(&g_ctrl_thrd, "usb control thread",
-				  PTHREAD_CREATE_JOINABLE,
-				  usb_control_thread,
-				  NULL);
+	res = _util_thread_create(&g_event_thrd, "usb event thread",
+			PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_USB,
+			usb_event_thread, NULL);
 	if (FALSE == res) {
-		ERR("CTRL thread creation failed\n");
+		ERR("_util_thread_create(EVENT) Fail\n");
 		goto cleanup;
 	}
 
@@ -313,11 +324,12 @@ static mtp_err_t __transport_init_io()
 cleanup:
 	_util_print_error();
 
-	if (g_ctrl_thrd) {
-		res = _util_thread_cancel(g_ctrl_thrd);
+	if (g_event_thrd) {
+		res = _util_thread_cancel(g_event_thrd);
 		DBG("pthread_cancel [%d]\n", res);
-		g_ctrl_thrd = 0;
+		g_event_thrd = 0;
 	}
+
 	if (g_rx_thrd) {
 		res = _util_thread_cancel(g_rx_thrd);
 		DBG("pthread_cancel [%d]\n", res);
@@ -339,17 +351,6 @@ static void __transport_deinit_io()
 
 	errno = 0;
 
-	if (FALSE == _util_thread_cancel(g_ctrl_thrd)) {
-		ERR("Fail to cancel pthread of g_ctrl_thrd\n");
-	} else {
-		DBG("Succeed to cancel pthread of g_ctrl_thrd\n");
-	}
-
-	if (_util_thread_join(g_ctrl_thrd, 0) == FALSE)
-		ERR("pthread_join of g_ctrl_thrd failed\n");
-
-	g_ctrl_thrd = 0;
-
 	if (FALSE == _util_thread_cancel(g_rx_thrd))
 		ERR("_util_thread_cancel(rx) Fail\n");
 
@@ -366,6 +367,14 @@ static void __transport_deinit_io()
 
 	g_tx_thrd = 0;
 
+	if (FALSE == _util_thread_cancel(g_event_thrd))
+		ERR("_util_thread_cancel(event) Fail\n");
+
+	if (_util_thread_join(g_event_thrd, 0) == FALSE)
+		ERR("_util_thread_join(event) Fail\n");
+
+	g_event_thrd = 0;
+
 	g_usb_threads_created = FALSE;
 }
 
@@ -411,49 +420,49 @@ static void *__transport_thread_data_rcv(void *func)
 	return NULL;
 }
 
-mtp_bool _transport_init_interfaces(_cmd_handler_cb func)
+/*
+ * Bulk and interrupt endpoint threads, their message queues and the data
+ * receive thread. They only live while the host has the function enabled.
+ */
+static mtp_bool __transport_start_io(_cmd_handler_cb func)
 {
 	mtp_int32 res = 0;
-	mtp_bool ret = FALSE;
-
-	ret = _transport_init_usb_device();
-	/* mtp driver open failed */
-	retvm_if(!ret, FALSE, "_transport_init_usb_device() Fail\n");
 
 	if (_transport_mq_init(&g_usb_to_mtp_mqid, &mtp_to_usb_mqid) == FALSE) {
 		ERR("_transport_mq_init() Fail\n");
-		_transport_deinit_usb_device();
 		return FALSE;
 	}
 
 	if (__transport_init_io() != MTP_ERROR_NONE) {
 		ERR("__transport_init_io() Fail\n");
 		_transport_mq_deinit(&g_usb_to_mtp_mqid, &mtp_to_usb_mqid);
-		_transport_deinit_usb_device();
 		return FALSE;
 	}
 
 	res = _util_thread_create(&g_data_rcv, "Data Receive thread",
-			PTHREAD_CREATE_JOINABLE, __transport_thread_data_rcv,
+			PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_FILE,
+			__transport_thread_data_rcv,
 			(void *)func);
 	if (res == FALSE) {
 		ERR("_util_thread_create(data_rcv) Fail\n");
 		__transport_deinit_io();
 		_transport_mq_deinit(&g_usb_to_mtp_mqid, &mtp_to_usb_mqid);
-		_transport_deinit_usb_device();
+		g_data_rcv = 0;
 		return FALSE;
 	}
 
 	return TRUE;
 }
 
-void _transport_usb_finalize(void)
+static void __transport_stop_io(void)
 {
 	mtp_int32 res = 0;
 	void *th_result = NULL;
 	msgq_ptr_t pkt;
 	mtp_uint32 rx_size = g_conf.read_usb_size;
 
+	retm_if(!g_usb_threads_created, "io threads are not created.\n");
+
 	__transport_deinit_io();
 
 	if (g_data_rcv != 0) {
@@ -473,10 +482,63 @@ void _transport_usb_finalize(void)
 		res = _util_thread_join(g_data_rcv, &th_result);
 		if (res == FALSE)
 			ERR("_util_thread_join(data_rcv) Fail\n");
+		g_data_rcv = 0;
 	}
 
 	if (_transport_mq_deinit(&g_usb_to_mtp_mqid, &mtp_to_usb_mqid) == FALSE)
 		ERR("_transport_mq_deinit() Fail\n");
+}
+
+mtp_bool _transport_init_interfaces(_cmd_handler_cb func)
+{
+	mtp_bool ret = FALSE;
+
+	ret = _transport_init_usb_device();
+	/* mtp driver open failed */
+	retvm_if(!ret, FALSE, "_transport_init_usb_device() Fail\n");
+
+	/* ep0 is served by the event loop */
+	if (_transport_watch_usb_control() == FALSE) {
+		ERR("_transport_watch_usb_control() Fail\n");
+		_transport_deinit_usb_device();
+		return FALSE;
+	}
+
+	if (__transport_start_io(func) == FALSE) {
+		_transport_unwatch_usb_control();
+		_transport_deinit_usb_device();
+		return FALSE;
+	}
+	g_cmd_handler_func = func;
+
+	return TRUE;
+}
+
+void _transport_usb_finalize(void)
+{
+	_transport_unwatch_usb_control();
+
+	if (g_usb_threads_created)
+		__transport_stop_io();
 
 	_transport_deinit_usb_device();
 }
+
+/*
+ * The host disabled the function, e.g. the cable was pulled. Stops the
+ * endpoint I/O but keeps ep0 watched for the next FUNCTIONFS_ENABLE.
+ */
+void _transport_usb_suspend(void)
+{
+	retm_if(!g_usb_threads_created, "USB I/O is already stopped\n");
+
+	__transport_stop_io();
+}
+
+mtp_bool _transport_usb_resume(void)
+{
+	retvm_if(g_usb_threads_created, TRUE, "USB I/O is already running\n");
+	retvm_if(g_cmd_handler_func == NULL, FALSE, "USB is not initialized\n");
+
+	return __transport_start_io(g_cmd_handler_func);
+}
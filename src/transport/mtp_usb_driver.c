@@ -18,9 +18,13 @@
 
 #define _GNU_SOURCE
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 #include <glib.h>
 #include "mtp_usb_driver.h"
 #include "mtp_device.h"
@@ -30,6 +34,7 @@
 #include "ptp_container.h"
 #include "mtp_msgq.h"
 #include "mtp_thread.h"
+#include "mtp_loop.h"
 #include "mtp_transport.h"
 #include "mtp_event_handler.h"
 #include "mtp_init.h"
@@ -59,12 +64,44 @@ static mtp_int32 g_usb_ep_in = -1;     /* write (g_usb_ep_in, ...) */
 static mtp_int32 g_usb_ep_out = -1;    /* read (g_usb_ep_out, ...) */
 static mtp_int32 g_usb_ep_status = -1; /* write (g_usb_ep_status, ...) */
 
+/*
+ * The endpoints are sockets of a host simulator instead of FunctionFS
+ * files: one message per transfer, no ZLP, stall nor FIFO to flush.
+ */
+static mtp_bool g_usb_loopback = FALSE;
+
 static mtp_uint32 rx_mq_sz;
 static mtp_uint32 tx_mq_sz;
+
+/*
+ * Events do not go through the TX message queue, where they would wait
+ * behind all queued bulk data. Slots are filled by any thread and written
+ * out by the event thread only.
+ */
+static struct {
+	mtp_uchar buf[MTP_USB_EVENT_QUEUE_LEN][sizeof(cmd_container_t)];
+	mtp_uint32 len[MTP_USB_EVENT_QUEUE_LEN];
+	mtp_uint32 head;
+	mtp_uint32 tail;
+} g_usb_events;
+static pthread_mutex_t g_usb_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_usb_events_cond = PTHREAD_COND_INITIALIZER;
+static aio_context_t g_usb_event_aio = 0;
+
+/*
+ * Written on cancel requests, it aborts the write in progress on ep_in.
+ * The write thread owns it, the mutex keeps it open while it is written.
+ */
+static pthread_mutex_t g_usb_cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mtp_int32 g_usb_cancel_fd = -1;
+/* Writes on ep_in are asynchronous so that they can be cancelled */
+static aio_context_t g_usb_write_aio = 0;
+static mtp_int32 g_usb_write_done_fd = -1;
+static msgq_id_t *g_usb_tx_mqid = NULL;
 static mtp_int32 __handle_usb_read_err(mtp_int32 err,
 		mtp_uchar *buf, mtp_int32 buf_len);
 static void __clean_up_msg_queue(void *param);
-static void __handle_control_request(mtp_int32 request);
+static void __handle_control_request(mtp_int32 request, mtp_uint16 length);
 
 /*
  * FUNCTIONS
@@ -92,6 +129,10 @@ mtp_bool _transport_init_usb_device(void)
 	g_usb_ep_out = SD_LISTEN_FDS_START + 2;
 	g_usb_ep_status = SD_LISTEN_FDS_START + 3;
 
+	g_usb_loopback = sd_is_socket(g_usb_ep0, AF_UNIX, SOCK_SEQPACKET, -1) > 0;
+	if (g_usb_loopback)
+		DBG("Loopback transport, the host is a simulator\n");
+
 	DBG("Final : Tx pkt size:[%u], Rx pkt size:[%u]\n", g_conf.write_usb_size, g_conf.read_usb_size);
 
 	msg_size = sizeof(msgq_ptr_t) - sizeof(long);
@@ -152,6 +193,130 @@ mtp_int32 _transport_mq_init(msgq_id_t *rx_mqid, msgq_id_t *tx_mqid)
 	return TRUE;
 }
 
+static void __init_usb_write(void)
+{
+	pthread_mutex_lock(&g_usb_cancel_mutex);
+	g_usb_cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_unlock(&g_usb_cancel_mutex);
+	if (g_usb_cancel_fd < 0)
+		ERR("eventfd() Fail, writes cannot be cancelled : %d\n", errno);
+
+	/* A socket write is not cancelled, a cancel has to come before it */
+	g_usb_write_aio = 0;
+	if (g_usb_loopback)
+		return;
+
+	g_usb_write_done_fd = eventfd(0, EFD_CLOEXEC);
+	if (g_usb_write_done_fd < 0 ||
+			syscall(__NR_io_setup, MTP_USB_AIO_MAX_REQS,
+				&g_usb_write_aio) < 0) {
+		ERR("io_setup() Fail, writes cannot be cancelled\n");
+		g_usb_write_aio = 0;
+	}
+}
+
+static void __clean_up_usb_write(void *arg)
+{
+	pthread_mutex_lock(&g_usb_cancel_mutex);
+	if (g_usb_cancel_fd >= 0)
+		close(g_usb_cancel_fd);
+	g_usb_cancel_fd = -1;
+	pthread_mutex_unlock(&g_usb_cancel_mutex);
+
+	if (g_usb_write_aio != 0) {
+		/* Cancels a write still in flight */
+		syscall(__NR_io_destroy, g_usb_write_aio);
+		g_usb_write_aio = 0;
+	}
+	if (g_usb_write_done_fd >= 0)
+		close(g_usb_write_done_fd);
+	g_usb_write_done_fd = -1;
+}
+
+/*
+ * Writes to ep_in until it is done or a cancel request comes. The cancel
+ * eventfd stays readable, so a request coming just before the write
+ * starts aborts it too. FunctionFS dequeues a cancelled write.
+ */
+static mtp_int32 __write_usb_data(void *buf, mtp_uint32 len)
+{
+	static mtp_uint64 seq = 0;
+	static struct iocb cb;
+	struct iocb *cbs[1] = { &cb };
+	struct io_event ev = { 0 };
+	struct pollfd fds[2];
+	eventfd_t count = 0;
+	mtp_bool is_cancelled = FALSE;
+
+	fds[1].fd = g_usb_cancel_fd;
+	fds[1].events = POLLIN;
+
+	if (g_usb_write_aio == 0) {
+		fds[0].fd = g_usb_ep_in;
+		fds[0].events = POLLOUT;
+		while (poll(fds, 2, -1) < 0 && errno == EINTR)
+			;
+		if (fds[1].revents & POLLIN) {
+			errno = ECANCELED;
+			return -1;
+		}
+		return write(g_usb_ep_in, buf, len);
+	}
+
+	memset(&cb, 0, sizeof(cb));
+	cb.aio_data = ++seq;
+	cb.aio_fildes = g_usb_ep_in;
+	cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb.aio_buf = (__u64)(unsigned long)buf;
+	cb.aio_nbytes = len;
+	cb.aio_flags = IOCB_FLAG_RESFD;
+	cb.aio_resfd = g_usb_write_done_fd;
+
+	retvm_if(syscall(__NR_io_submit, g_usb_write_aio, 1, cbs) != 1, -1,
+			"io_submit() Fail : %d\n", errno);
+
+	fds[0].fd = g_usb_write_done_fd;
+	fds[0].events = POLLIN;
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* LCOV_EXCL_START */
+			ERR("poll() Fail : %d\n", errno);
+			break;
+			/* LCOV_EXCL_STOP */
+		}
+
+		if (fds[0].revents & POLLIN)
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			/* The completion still comes, unless reported here */
+			is_cancelled = TRUE;
+			fds[1].fd = -1;
+			if (syscall(__NR_io_cancel, g_usb_write_aio, &cb,
+						&ev) == 0)
+				goto DONE;
+		}
+	}
+
+	/* Blocks until the write is complete, if it is not yet */
+	eventfd_read(g_usb_write_done_fd, &count);
+	do {
+		/* A late completion of a cancelled write is skipped */
+		retvm_if(syscall(__NR_io_getevents, g_usb_write_aio, 1, 1,
+					&ev, NULL) != 1, -1,
+				"io_getevents() Fail : %d\n", errno);
+	} while (ev.data != seq);
+
+DONE:
+	if (ev.res >= 0)
+		return (mtp_int32)ev.res;
+
+	errno = is_cancelled ? ECANCELED : (mtp_int32)-ev.res;
+	return -1;
+}
+
 void *_transport_thread_usb_write(void *arg)
 {
 	mtp_int32 status = 0;
@@ -159,8 +324,13 @@ void *_transport_thread_usb_write(void *arg)
 	unsigned char *mtp_buf = NULL;
 	msg_type_t mtype = MTP_UNDEFINED_PACKET;
 	msgq_id_t *mqid = (msgq_id_t *)arg;
+	eventfd_t count = 0;
+
+	g_usb_tx_mqid = mqid;
+	__init_usb_write();
 
 	pthread_cleanup_push(__clean_up_msg_queue, mqid);
+	pthread_cleanup_push(__clean_up_usb_write, NULL);
 
 	do {
 		/* original LinuxThreads cancelation didn't work right
@@ -168,29 +338,44 @@ void *_transport_thread_usb_write(void *arg)
 		 */
 		pthread_testcancel();
 
-		_util_rcv_msg_from_mq(*mqid, &mtp_buf, &len, &mtype);
+		if (!_util_rcv_msg_from_mq(*mqid, &mtp_buf, &len, &mtype))
+			continue;
+
+		/* Cancel requests done with, is_cancelling tells the others */
+		if (g_usb_cancel_fd >= 0)
+			eventfd_read(g_usb_cancel_fd, &count);
+
+		if (__atomic_load_n(&g_status->is_cancelling,
+					__ATOMIC_ACQUIRE) &&
+				(mtype == MTP_BULK_PACKET ||
+				 mtype == MTP_DATA_PACKET ||
+				 mtype == MTP_ZLP_PACKET)) {
+			/* Queued by the cancelled transaction */
+			g_free(mtp_buf);
+			mtp_buf = NULL;
+			continue;
+		}
 
 		if (mtype == MTP_BULK_PACKET || mtype == MTP_DATA_PACKET) {
-			status = write(g_usb_ep_in, mtp_buf, len);
+			status = __write_usb_data(mtp_buf, len);
 			if (status < 0) {
 				ERR("USB write fail : %d\n", errno);
-				if (errno == ENOMEM || errno == ECANCELED) {
+				if (errno == ENOMEM || errno == ECANCELED ||
+						errno == EINTR) {
 					status = 0;
 					__clean_up_msg_queue(mqid);
 				}
 			}
 			g_free(mtp_buf);
 			mtp_buf = NULL;
-		} else if (MTP_EVENT_PACKET == mtype) {
-			/* Handling the MTP Asynchronous Events */
-			DBG("Send Interrupt data to kernel via g_usb_ep_status\n");
-			status = write(g_usb_ep_status, mtp_buf, len);
-			g_free(mtp_buf);
-			mtp_buf = NULL;
 		} else if (MTP_ZLP_PACKET == mtype) {
 			char dummy_buf;
 			DBG("Send ZLP data to kerne via g_usb_ep_in\n");
-			status = write(g_usb_ep_in, &dummy_buf, 0);
+			/* An empty message would read as end of file */
+			status = g_usb_loopback ? 0 :
+				__write_usb_data(&dummy_buf, 0);
+			if (status < 0 && errno == ECANCELED)
+				status = 0;
 		} else {
 			DBG("mtype = %d is not valid\n", mtype);
 			status = -1;
@@ -205,11 +390,154 @@ void *_transport_thread_usb_write(void *arg)
 
 	DBG("exited Source thread with status %d\n", status);
 	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 	g_free(mtp_buf);
 
 	return NULL;
 }
 
+/*
+ * mtp_bool _transport_queue_usb_event(const mtp_uchar *buf, mtp_uint32 len)
+ * Queues an event container for the interrupt endpoint. Never blocks, the
+ * event is dropped if the host has stopped reading events.
+ *
+ * @param[in]	buf	Event container.
+ * @param[in]	len	Container length in bytes.
+ * @return	TRUE if the event was queued.
+ */
+mtp_bool _transport_queue_usb_event(const mtp_uchar *buf, mtp_uint32 len)
+{
+	mtp_uint32 slot = 0;
+
+	retv_if(buf == NULL || len > sizeof(g_usb_events.buf[0]), FALSE);
+
+	pthread_mutex_lock(&g_usb_events_mutex);
+	if (g_usb_events.head - g_usb_events.tail >= MTP_USB_EVENT_QUEUE_LEN) {
+		pthread_mutex_unlock(&g_usb_events_mutex);
+		ERR("Event queue is full, host is not reading events\n");
+		return FALSE;
+	}
+
+	slot = g_usb_events.head % MTP_USB_EVENT_QUEUE_LEN;
+	memcpy(g_usb_events.buf[slot], buf, len);
+	g_usb_events.len[slot] = len;
+	g_usb_events.head++;
+	pthread_cond_signal(&g_usb_events_cond);
+	pthread_mutex_unlock(&g_usb_events_mutex);
+
+	return TRUE;
+}
+
+/*
+ * A write() on ep_status only returns once the host polled the interrupt
+ * endpoint, so it is submitted asynchronously and cancelled if the host
+ * does not read it within MTP_USB_EVENT_TIMEOUT.
+ */
+static mtp_bool __write_usb_event(mtp_uchar *buf, mtp_uint32 len)
+{
+	static mtp_uint64 seq = 0;
+	static struct iocb cb;
+	struct iocb *cbs[1] = { &cb };
+	struct io_event ev = { 0 };
+	struct timespec slice = { 0, MTP_USB_EVENT_WAIT_SLICE * 1000000L };
+	mtp_int32 waited = 0;
+	long ret = 0;
+
+	if (g_usb_event_aio == 0)
+		return write(g_usb_ep_status, buf, len) == (ssize_t)len;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.aio_data = ++seq;
+	cb.aio_fildes = g_usb_ep_status;
+	cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb.aio_buf = (__u64)(unsigned long)buf;
+	cb.aio_nbytes = len;
+
+	retvm_if(syscall(__NR_io_submit, g_usb_event_aio, 1, cbs) != 1, FALSE,
+			"io_submit() Fail : %d\n", errno);
+
+	while (waited < MTP_USB_EVENT_TIMEOUT) {
+		ret = syscall(__NR_io_getevents, g_usb_event_aio, 1, 1, &ev,
+				&slice);
+		if (ret == 1 && ev.data == seq)
+			return ev.res == (__s64)len;
+
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret == 0) {
+			waited += MTP_USB_EVENT_WAIT_SLICE;
+			pthread_testcancel();
+		}
+	}
+
+	ERR("Host did not read the event, drop it\n");
+	syscall(__NR_io_cancel, g_usb_event_aio, &cb, &ev);
+	/* A late completion is skipped by its aio_data */
+	syscall(__NR_io_getevents, g_usb_event_aio, 1, 1, &ev, &slice);
+
+	return FALSE;
+}
+
+static void __clean_up_usb_events(void *arg)
+{
+	pthread_mutex_lock(&g_usb_events_mutex);
+	g_usb_events.head = 0;
+	g_usb_events.tail = 0;
+	pthread_mutex_unlock(&g_usb_events_mutex);
+
+	if (g_usb_event_aio != 0) {
+		/* Cancels a write still in flight */
+		syscall(__NR_io_destroy, g_usb_event_aio);
+		g_usb_event_aio = 0;
+	}
+}
+
+static void __unlock_usb_events(void *arg)
+{
+	pthread_mutex_unlock(&g_usb_events_mutex);
+}
+
+void *_transport_thread_usb_event(void *arg)
+{
+	mtp_uint32 slot = 0;
+
+	/* A socket buffers the event, its write needs no time out */
+	if (g_usb_loopback) {
+		g_usb_event_aio = 0;
+	} else if (syscall(__NR_io_setup, MTP_USB_AIO_MAX_REQS,
+				&g_usb_event_aio) < 0) {
+		ERR("io_setup() Fail, event writes cannot time out\n");
+		g_usb_event_aio = 0;
+	}
+
+	pthread_cleanup_push(__clean_up_usb_events, NULL);
+
+	while (1) {
+		pthread_mutex_lock(&g_usb_events_mutex);
+		pthread_cleanup_push(__unlock_usb_events, NULL);
+		while (g_usb_events.head == g_usb_events.tail)
+			pthread_cond_wait(&g_usb_events_cond,
+					&g_usb_events_mutex);
+		pthread_cleanup_pop(1);
+
+		/* Only this thread moves tail, the slot stays valid */
+		slot = g_usb_events.tail % MTP_USB_EVENT_QUEUE_LEN;
+		DBG("Send Interrupt data to kernel via g_usb_ep_status\n");
+		if (!__write_usb_event(g_usb_events.buf[slot],
+					g_usb_events.len[slot]))
+			ERR("Event write Fail\n");
+
+		pthread_mutex_lock(&g_usb_events_mutex);
+		g_usb_events.tail++;
+		pthread_mutex_unlock(&g_usb_events_mutex);
+	}
+
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
 static int __setup(int ep0, struct usb_ctrlrequest *ctrl)
 {
 	const char* requests[] = {
@@ -240,7 +568,7 @@ static int __setup(int ep0, struct usb_ctrlrequest *ctrl)
 			rc = -EINVAL;
 			goto stall;
 		}
-		__handle_control_request(ctrl->bRequest);
+		__handle_control_request(ctrl->bRequest, wLength);
 		break;
 
 	case ((USB_DIR_IN << 8) | USB_PTPREQUEST_GETSTATUS):
@@ -248,7 +576,7 @@ static int __setup(int ep0, struct usb_ctrlrequest *ctrl)
 
 		DBG(__FILE__ "(%s):%d: USB_PTPREQUEST_%s\n",
 		    __func__, __LINE__, requests[ctrl->bRequest-0x64]);
-		__handle_control_request(ctrl->bRequest);
+		__handle_control_request(ctrl->bRequest, wLength);
 		break;
 
 	case ((USB_DIR_IN << 8) | USB_PTPREQUEST_GETEVENT):
@@ -271,6 +599,9 @@ stall:
 
 	DBG(__FILE__"(%s):%d:stall %0x2x.%02x\n",
 	    __func__, __LINE__, ctrl->bRequestType, ctrl->bRequest);
+	if (g_usb_loopback)
+		return rc;
+
 	if ((ctrl->bRequestType & 0x80) == USB_DIR_IN)
 		status = read(g_usb_ep0, NULL, 0);
 	else
@@ -303,7 +634,12 @@ void *_transport_thread_usb_read(void *arg)
 		}
 
 		status = read(g_usb_ep_out, pkt.buffer, rx_size);
-		if (status <= 0) {
+		/*
+		 * A ZLP ends data of unknown length whose size is a multiple
+		 * of rx_size. Over loopback every message is a whole transfer
+		 * and 0 is the end of the socket.
+		 */
+		if (status < 0 || (status == 0 && g_usb_loopback)) {
 			status = __handle_usb_read_err(status, pkt.buffer, rx_size);
 			if (status <= 0) {
 				ERR("__handle_usb_read_err is failed\n");
@@ -318,7 +654,7 @@ void *_transport_thread_usb_read(void *arg)
 			ERR("msgsnd Fail\n");
 			g_free(pkt.buffer);
 		}
-	} while (status > 0);
+	} while (status >= 0);
 
 	DBG("status[%d] errno[%d]\n", status, errno);
 	pthread_cleanup_pop(1);
@@ -326,52 +662,69 @@ void *_transport_thread_usb_read(void *arg)
 	return NULL;
 }
 
-void *_transport_thread_usb_control(void *arg)
+/*
+ * Called from the event loop whenever ep0 has a FunctionFS event queued,
+ * one event per call.
+ */
+static void __handle_usb_control(mtp_int32 fd, void *data)
 {
 	mtp_int32 status = 0;
 	struct usb_functionfs_event event;
-	msgq_id_t *mqid = (msgq_id_t *)arg;
 
-	pthread_cleanup_push(__clean_up_msg_queue, mqid);
+	status = read(fd, &event, sizeof(event));
+	if (status < 0) {
+		char error[256];
+		ERR("read from ep0 failed: %s\n",
+		    strerror_r(errno, error, sizeof(error)));
+		/* Do not spin on an ep0 that keeps failing */
+		if (errno != EINTR && errno != EAGAIN)
+			_util_loop_remove_fd(fd);
+		return;
+	}
+	DBG("FUNCTIONFS event received: %d\n", event.type);
+
+	switch (event.type) {
+	case FUNCTIONFS_SETUP:
+		DBG("SETUP: bmRequestType:%d bRequest:%d wValue:%d wIndex:%d wLength:%d\n",
+		    event.u.setup.bRequestType,
+		    event.u.setup.bRequest,
+		    event.u.setup.wValue,
+		    event.u.setup.wIndex,
+		    event.u.setup.wLength);
+		__setup(fd, &event.u.setup);
+		break;
+	case FUNCTIONFS_ENABLE:
+		DBG("ENABLE\n");
+		g_ph_status->usb_state = MTP_PHONE_USB_CONNECTED;
+		_eh_send_event_req_to_eh_thread(EVENT_USB_CONNECTED, 0, 0, NULL);
+		break;
+	case FUNCTIONFS_DISABLE:
+		/* Only the session ends, the store is kept for the next one */
+		DBG("DISABLE\n");
+		g_ph_status->usb_state = MTP_PHONE_USB_DISCONNECTED;
+		_eh_send_event_req_to_eh_thread(EVENT_USB_DISCONNECTED, 0, 0,
+				NULL);
+		break;
+	case FUNCTIONFS_UNBIND:
+		DBG("UNBIND\n");
+		g_ph_status->usb_state = MTP_PHONE_USB_DISCONNECTED;
+		_eh_send_event_req_to_eh_thread(EVENT_USB_REMOVED, 0, 0, NULL);
+		break;
+	}
+}
 
-	do {
-		pthread_testcancel();
+mtp_bool _transport_watch_usb_control(void)
+{
+	retvm_if(g_usb_ep0 < 0, FALSE, "ep0 is not open\n");
 
-		status = read(g_usb_ep0, &event, sizeof(event));
-		if (status < 0) {
-			char error[256];
-			ERR("read from ep0 failed: %s\n",
-			    strerror_r(errno, error, sizeof(error)));
-			continue;
-		}
-		DBG("FUNCTIONFS event received: %d\n", event.type);
-
-		switch (event.type) {
-		case FUNCTIONFS_SETUP:
-			DBG("SETUP: bmRequestType:%d bRequest:%d wValue:%d wIndex:%d wLength:%d\n",
-			    event.u.setup.bRequestType,
-			    event.u.setup.bRequest,
-			    event.u.setup.wValue,
-			    event.u.setup.wIndex,
-			    event.u.setup.wLength);
-			__setup(g_usb_ep0, &event.u.setup);
-			break;
-		case FUNCTIONFS_ENABLE:
-			DBG("ENABLE\n");
-			g_ph_status->usb_state = MTP_PHONE_USB_CONNECTED;
-			break;
-		case FUNCTIONFS_DISABLE:
-			DBG("DISABLE\n");
-			g_ph_status->usb_state = MTP_PHONE_USB_DISCONNECTED;
-			_eh_send_event_req_to_eh_thread(EVENT_USB_REMOVED, 0, 0, NULL);
-			break;
-		}
-	} while (status > 0);
+	return _util_loop_add_fd(g_usb_ep0, __handle_usb_control, NULL);
+}
 
-	DBG("status[%d] errno[%d]\n", status, errno);
-	pthread_cleanup_pop(1);
+void _transport_unwatch_usb_control(void)
+{
+	ret_if(g_usb_ep0 < 0);
 
-	return NULL;
+	_util_loop_remove_fd(g_usb_ep0);
 }
 
 static mtp_int32 __handle_usb_read_err(mtp_int32 err,
@@ -437,37 +790,68 @@ static void __clean_up_msg_queue(void *mq_id)
 	return;
 }
 
-static void __handle_control_request(mtp_int32 request)
+/*
+ * Still Image class cancellation: whatever the cancelled transaction still
+ * has queued or in flight towards the host must not reach it, and the host
+ * polls GETSTATUS until the device reports it is ready again.
+ */
+static void __cancel_usb_io(void)
+{
+	__atomic_store_n(&g_status->is_cancelling, TRUE, __ATOMIC_RELEASE);
+
+	/* Also sets ctrl_event_code, which stops the data phase loops */
+	__clean_up_msg_queue(g_usb_tx_mqid);
+
+	/* Aborts the write on ep_in, even one about to start */
+	pthread_mutex_lock(&g_usb_cancel_mutex);
+	if (g_usb_cancel_fd >= 0 && eventfd_write(g_usb_cancel_fd, 1) < 0)
+		ERR("eventfd_write() Fail : %d\n", errno);
+	pthread_mutex_unlock(&g_usb_cancel_mutex);
+
+	if (!g_usb_loopback &&
+			ioctl(g_usb_ep_in, FUNCTIONFS_FIFO_FLUSH) < 0 &&
+			errno != ENODEV)
+		ERR("FUNCTIONFS_FIFO_FLUSH Fail : %d\n", errno);
+
+	/*
+	 * A DATAIN handler finishes the cancel when it returns. In any other
+	 * phase nothing is left to abort, and the next host data only comes
+	 * after GETSTATUS reported OK.
+	 */
+	if (g_device->phase != DEVICE_PHASE_DATAIN)
+		_transport_finish_cancel();
+}
+
+static void __handle_control_request(mtp_int32 request, mtp_uint16 length)
 {
-	static mtp_bool kernel_reset = FALSE;
-	static mtp_bool host_cancel = FALSE;
 	mtp_int32 status = 0;
+	cancel_req_t cancelreq_data = { 0 };
+	usb_status_req_t statusreq_data = { 0 };
 
 	switch (request) {
 	case USB_PTPREQUEST_CANCELIO:
 		// XXX: Convert cancel request data from little-endian
 		// before use:  le32_to_cpu(x), le16_to_cpu(x).
 		DBG("USB_PTPREQUEST_CANCELIO\n");
-		cancel_req_t cancelreq_data;
 
-		host_cancel = TRUE;
-		g_status->ctrl_event_code = PTP_EVENTCODE_CANCELTRANSACTION;
-		status = read(g_usb_ep0, &cancelreq_data, sizeof(cancelreq_data));
+		status = read(g_usb_ep0, &cancelreq_data,
+				USB_PTPREQUEST_CANCELIO_SIZE);
 		if (status < 0) {
 			char error[256];
 			ERR("Failed to read data for CANCELIO request\n: %s",
 					strerror_r(errno, error, sizeof(error)));
 		}
+
+		__cancel_usb_io();
 		break;
 
 	case USB_PTPREQUEST_RESET:
 
 		DBG("USB_PTPREQUEST_RESET\n");
 		_reset_mtp_device();
-		if (kernel_reset == FALSE) {
-			kernel_reset = TRUE;
-		}
 
+		if (g_usb_loopback)
+			break;
 		status = read(g_usb_ep0, NULL, 0);
 		if (status < 0) {
 			ERR("IOCTL MTP_SEND_RESET_ACK Failed [%d]\n",
@@ -478,51 +862,30 @@ static void __handle_control_request(mtp_int32 request)
 
 		DBG("USB_PTPREQUEST_GETSTATUS\n");
 
-		/* Send busy status response just once. This flag is also for
-		 * the case that mtp misses the cancel request packet.
-		 */
-		static mtp_bool sent_busy = FALSE;
-		usb_status_req_t statusreq_data = { 0 };
-		mtp_dword num_param = 0;
-
-		memset(&statusreq_data, 0x00, sizeof(usb_status_req_t));
-		if (host_cancel == TRUE || (sent_busy == FALSE &&
-					    kernel_reset == FALSE)) {
-			DBG("Send busy response, set host_cancel to FALSE\n");
-			statusreq_data.len = 0x08;
+		statusreq_data.len = 0x08;
+		if (__atomic_load_n(&g_status->is_cancelling,
+					__ATOMIC_ACQUIRE)) {
+			DBG("Cancel in progress, PTP_RESPONSE_DEVICEBUSY\n");
 			statusreq_data.code = PTP_RESPONSE_DEVICEBUSY;
-			host_cancel = FALSE;
 		} else if (g_device->phase == DEVICE_PHASE_NOTREADY) {
+			DBG("PTP_RESPONSE_TRANSACTIONCANCELLED\n");
 			statusreq_data.code =
 				PTP_RESPONSE_TRANSACTIONCANCELLED;
-			DBG("PTP_RESPONSE_TRANSACTIONCANCELLED\n");
-			statusreq_data.len = (mtp_word)(sizeof(usb_status_req_t) +
-							(num_param - 2) * sizeof(mtp_dword));
 		} else if (g_device->status == DEVICE_STATUSOK) {
 			DBG("PTP_RESPONSE_OK\n");
-			statusreq_data.len = 0x08;
 			statusreq_data.code = PTP_RESPONSE_OK;
-
-			if (kernel_reset == TRUE)
-				kernel_reset = FALSE;
 		} else {
 			DBG("PTP_RESPONSE_GEN_ERROR\n");
-			statusreq_data.len = 0x08;
 			statusreq_data.code = PTP_RESPONSE_GEN_ERROR;
 		}
 
-		if (statusreq_data.code == PTP_RESPONSE_DEVICEBUSY) {
-			sent_busy = TRUE;
-		} else {
-			sent_busy = FALSE;
-		}
-
-		/* status = ioctl(g_usb_fd, MTP_SET_SETUP_DATA, &statusreq_data);
+		/* Data stage of the control transfer */
+		status = write(g_usb_ep0, &statusreq_data,
+				MIN(length, statusreq_data.len));
 		if (status < 0) {
-			DBG("IOCTL MTP_SET_SETUP_DATA Fail [%d]\n",
-					status);
+			ERR("GETSTATUS response write Fail [%d]\n", errno);
 			return;
-		} */
+		}
 
 		break;
 
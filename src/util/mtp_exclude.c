@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "mtp_util.h"
+#include "mtp_exclude.h"
+
+/*
+ * Paths the host never sees, from the exclude option. A rule with a slash
+ * is a path from the root of a store and excludes its whole tree; those
+ * are kept in a trie of path components. A rule without one is a glob
+ * (*, ? and [...]) on the name of an entry at any depth, run as a small
+ * NFA whose active states are the bits of one integer.
+ *
+ * The rules are compiled before the stores are read and only read after
+ * that, so no lock is needed.
+ */
+typedef enum {
+	GLOB_CHAR = 0,
+	GLOB_ANY,	/* ? */
+	GLOB_STAR,	/* * */
+	GLOB_SET	/* [...] */
+} glob_tok_type_t;
+
+typedef struct {
+	glob_tok_type_t type;
+	mtp_uchar ch;
+	mtp_uchar set[32];	/* GLOB_SET : bit per byte value */
+} glob_tok_t;
+
+typedef struct {
+	mtp_uint32 num_toks;
+	mtp_uint64 stars;	/* states which are a * */
+	glob_tok_t toks[MTP_EXCLUDE_MAX_GLOB_LEN];
+} glob_nfa_t;
+
+typedef struct {
+	GHashTable *children;	/* component -> exclude_node_t */
+	mtp_bool is_excluded;
+} exclude_node_t;
+
+static exclude_node_t *g_exclude_trie;
+static GPtrArray *g_exclude_globs;
+
+static void __free_exclude_node(exclude_node_t *node)
+{
+	ret_if(node == NULL);
+
+	if (node->children != NULL)
+		g_hash_table_destroy(node->children);
+	g_free(node);
+}
+
+static void __add_prefix_rule(const mtp_char *rule)
+{
+	mtp_uint32 i = 0;
+	mtp_char **comps = NULL;
+	exclude_node_t *node = NULL;
+	exclude_node_t *child = NULL;
+
+	if (g_exclude_trie == NULL)
+		g_exclude_trie = g_new0(exclude_node_t, 1);
+
+	node = g_exclude_trie;
+	comps = g_strsplit(rule, "/", -1);
+	for (i = 0; comps[i] != NULL; i++) {
+		if (comps[i][0] == '\0')
+			continue;
+
+		if (node->children == NULL)
+			node->children = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free,
+					(GDestroyNotify)__free_exclude_node);
+
+		child = g_hash_table_lookup(node->children, comps[i]);
+		if (child == NULL) {
+			child = g_new0(exclude_node_t, 1);
+			g_hash_table_insert(node->children,
+					g_strdup(comps[i]), child);
+		}
+		node = child;
+	}
+	g_strfreev(comps);
+
+	if (node != g_exclude_trie)
+		node->is_excluded = TRUE;
+}
+
+/* Parses the [...] at *pp, leaving *pp on the ]. FALSE if it is not closed */
+static mtp_bool __parse_glob_set(const mtp_uchar **pp, glob_tok_t *tok)
+{
+	const mtp_uchar *p = *pp + 1;
+	mtp_bool negate = FALSE;
+	mtp_uint32 lo = 0;
+	mtp_uint32 hi = 0;
+	mtp_uint32 c = 0;
+
+	memset(tok->set, 0, sizeof(tok->set));
+
+	negate = (*p == '!' || *p == '^');
+	if (negate)
+		p++;
+
+	/* A ] right after [ is part of the set */
+	do {
+		retv_if(*p == '\0', FALSE);
+
+		lo = hi = *p;
+		if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+			hi = p[2];
+			p += 2;
+		}
+		for (c = lo; c <= hi; c++)
+			tok->set[c / 8] |= 1 << (c % 8);
+		p++;
+	} while (*p != ']');
+
+	if (negate) {
+		for (c = 0; c < sizeof(tok->set); c++)
+			tok->set[c] = ~tok->set[c];
+	}
+
+	tok->type = GLOB_SET;
+	*pp = p;
+	return TRUE;
+}
+
+static mtp_bool __add_glob_rule(const mtp_char *rule)
+{
+	const mtp_uchar *p = (const mtp_uchar *)rule;
+	glob_tok_t *tok = NULL;
+	glob_nfa_t *nfa = NULL;
+
+	nfa = g_new0(glob_nfa_t, 1);
+
+	for (; *p != '\0'; p++) {
+		if (nfa->num_toks == MTP_EXCLUDE_MAX_GLOB_LEN) {
+			ERR("Exclude rule [%s] is too long\n", rule);
+			g_free(nfa);
+			return FALSE;
+		}
+		tok = &nfa->toks[nfa->num_toks];
+
+		if (*p == '*') {
+			/* ** is the same as * */
+			if (nfa->num_toks > 0 &&
+					(tok - 1)->type == GLOB_STAR)
+				continue;
+			tok->type = GLOB_STAR;
+			nfa->stars |= 1ULL << nfa->num_toks;
+		} else if (*p == '?') {
+			tok->type = GLOB_ANY;
+		} else if (*p == '[' && __parse_glob_set(&p, tok)) {
+			/* p is on the ] */
+		} else {
+			tok->type = GLOB_CHAR;
+			tok->ch = *p;
+		}
+		nfa->num_toks++;
+	}
+
+	g_ptr_array_add(g_exclude_globs, nfa);
+	return TRUE;
+}
+
+/* A * also matches nothing, so its state passes on to the next one */
+static inline mtp_uint64 __glob_closure(const glob_nfa_t *nfa,
+		mtp_uint64 states)
+{
+	return states | ((states & nfa->stars) << 1);
+}
+
+static mtp_bool __is_glob_match(const glob_nfa_t *nfa, const mtp_char *name)
+{
+	const mtp_uchar *p = (const mtp_uchar *)name;
+	const glob_tok_t *tok = NULL;
+	mtp_uint64 states = 0;
+	mtp_uint64 next = 0;
+	mtp_uint64 live = 0;
+	mtp_uint32 i = 0;
+
+	/* Consecutive stars were merged, one pass of the closure is enough */
+	states = __glob_closure(nfa, 1);
+	for (; *p != '\0' && states != 0; p++) {
+		next = 0;
+		live = states;
+		while (live != 0) {
+			i = __builtin_ctzll(live);
+			live &= live - 1;
+			if (i == nfa->num_toks)
+				continue;
+
+			tok = &nfa->toks[i];
+			switch (tok->type) {
+			case GLOB_STAR:
+				next |= 1ULL << i;
+				break;
+			case GLOB_ANY:
+				next |= 1ULL << (i + 1);
+				break;
+			case GLOB_SET:
+				if (tok->set[*p / 8] & (1 << (*p % 8)))
+					next |= 1ULL << (i + 1);
+				break;
+			default:
+				if (tok->ch == *p)
+					next |= 1ULL << (i + 1);
+				break;
+			}
+		}
+		states = __glob_closure(nfa, next);
+	}
+
+	return (states & (1ULL << nfa->num_toks)) ? TRUE : FALSE;
+}
+
+/*
+ * void _util_exclude_compile(const mtp_char *rules)
+ * Replaces the exclusion rules by the ones of a list, separated by
+ * MTP_EXCLUDE_SEPARATOR.
+ *
+ * @param[in]	rules	Rule list, NULL or empty to exclude nothing.
+ * @return	None.
+ */
+void _util_exclude_compile(const mtp_char *rules)
+{
+	mtp_uint32 i = 0;
+	mtp_char *rule = NULL;
+	mtp_char **list = NULL;
+
+	_util_exclude_free();
+	ret_if(rules == NULL || rules[0] == '\0');
+
+	g_exclude_globs = g_ptr_array_new_with_free_func(g_free);
+
+	list = g_strsplit(rules, MTP_EXCLUDE_SEPARATOR, -1);
+	for (i = 0; list[i] != NULL; i++) {
+		rule = g_strstrip(list[i]);
+		if (rule[0] == '\0')
+			continue;
+
+		if (strchr(rule, '/') != NULL)
+			__add_prefix_rule(rule);
+		else
+			__add_glob_rule(rule);
+	}
+	g_strfreev(list);
+
+	DBG("Exclude : %u name rules, path rules [%s]\n",
+			g_exclude_globs->len,
+			g_exclude_trie != NULL ? "yes" : "no");
+}
+
+void _util_exclude_free(void)
+{
+	__free_exclude_node(g_exclude_trie);
+	g_exclude_trie = NULL;
+
+	if (g_exclude_globs != NULL)
+		g_ptr_array_free(g_exclude_globs, TRUE);
+	g_exclude_globs = NULL;
+}
+
+/*
+ * mtp_bool _util_is_excluded(const mtp_char *rel_path)
+ * Checks a path from the root of its store against the rules. It is
+ * meant to be called before an entry is added or read, so only the path
+ * rules look at the parent folders.
+ *
+ * @param[in]	rel_path	Path from the root of the store, e.g.
+ *				"DCIM/.thumbnails".
+ * @return	TRUE if the host must not see it, otherwise FALSE.
+ */
+mtp_bool _util_is_excluded(const mtp_char *rel_path)
+{
+	mtp_uint32 i = 0;
+	mtp_uint32 len = 0;
+	const mtp_char *name = NULL;
+	const mtp_char *comp = NULL;
+	mtp_char buf[MTP_MAX_PATHNAME_SIZE + 1];
+	exclude_node_t *node = NULL;
+
+	retv_if(rel_path == NULL, FALSE);
+
+	name = strrchr(rel_path, '/');
+	name = name ? name + 1 : rel_path;
+
+	for (i = 0; g_exclude_globs != NULL && i < g_exclude_globs->len;
+			i++) {
+		if (__is_glob_match(g_ptr_array_index(g_exclude_globs, i),
+					name))
+			return TRUE;
+	}
+
+	for (node = g_exclude_trie, comp = rel_path;
+			node != NULL && node->children != NULL; ) {
+		while (*comp == '/')
+			comp++;
+		len = strcspn(comp, "/");
+		if (len == 0 || len >= sizeof(buf))
+			break;
+
+		memcpy(buf, comp, len);
+		buf[len] = '\0';
+		node = g_hash_table_lookup(node->children, buf);
+		if (node != NULL && node->is_excluded)
+			return TRUE;
+		comp += len;
+	}
+
+	return FALSE;
+}
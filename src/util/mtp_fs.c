@@ -17,16 +17,12 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/vfs.h>
-#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include "mtp_fs.h"
+#include "mtp_storage.h"
 #include "mtp_util.h"
 #include "mtp_support.h"
 #include "ptp_datacodes.h"
@@ -34,10 +30,55 @@
 
 extern mtp_uint32 g_next_obj_handle;
 
+static const mtp_storage_ops_t *g_storage = &g_posix_storage_ops;
+
 /*
  * FUNCTIONS
  */
 
+/*
+ * mtp_bool _util_storage_select(const mtp_char *name)
+ * This function selects the backend holding the stores, before they are
+ * installed. It is released by _util_storage_release() when MTP exits.
+ *
+ * @param[in]	name	MTP_STORAGE_POSIX or MTP_STORAGE_MEMORY.
+ * @return	TRUE on success, FALSE when name is unknown or the backend
+ *		cannot start, the POSIX backend is then kept.
+ */
+mtp_bool _util_storage_select(const mtp_char *name)
+{
+	const mtp_storage_ops_t *ops = NULL;
+
+	if (!g_strcmp0(name, MTP_STORAGE_POSIX))
+		ops = &g_posix_storage_ops;
+	else if (!g_strcmp0(name, MTP_STORAGE_MEMORY))
+		ops = &g_mem_storage_ops;
+
+	retvm_if(ops == NULL, FALSE, "Unknown storage backend [%s]\n", name);
+	/* Kept from one USB session to the next */
+	retv_if(ops == g_storage, TRUE);
+
+	_util_storage_release();
+	retvm_if(ops->init != NULL && !ops->init(), FALSE,
+			"Storage backend [%s] init Fail\n", name);
+	g_storage = ops;
+	DBG("Storage backend : %s\n", g_storage->name);
+
+	return TRUE;
+}
+
+void _util_storage_release(void)
+{
+	if (g_storage->deinit != NULL)
+		g_storage->deinit();
+	g_storage = &g_posix_storage_ops;
+}
+
+const mtp_storage_ops_t *_util_storage_get_ops(void)
+{
+	return g_storage;
+}
+
 /*
  * mtp_uint32 _util_file_open(const mtp_char *filename,
  *	file_mode_t mode, mtp_int32 *error)
@@ -53,24 +94,14 @@ FILE* _util_file_open(const mtp_char *filename, file_mode_t mode,
 		mtp_int32 *error)
 {
 	FILE *fhandle = NULL;
-	char *fmode = NULL;
-
-	switch ((int)mode) {
-	case MTP_FILE_READ:
-		fmode = "rm";
-		break;
 
-	case MTP_FILE_WRITE:
-		fmode = "w";
-		break;
-
-	default:
+	if (mode != MTP_FILE_READ && mode != MTP_FILE_WRITE) {
 		ERR("Invalid mode : %d\n", mode);
 		*error = EINVAL;
 		return NULL;
 	}
 
-	fhandle = fopen(filename, fmode);
+	fhandle = g_storage->open(filename, mode);
 	if (fhandle == NULL) {
 		ERR("File open Fail:mode[0x%x], errno [%d]\n", mode, errno);
 		ERR_SECURE("filename[%s]\n", filename);
@@ -78,8 +109,6 @@ FILE* _util_file_open(const mtp_char *filename, file_mode_t mode,
 		return NULL;
 	}
 
-	fcntl(fileno(fhandle), F_SETFL, O_NOATIME);
-
 	return fhandle;
 }
 
@@ -155,13 +184,13 @@ mtp_bool _util_file_copy(const mtp_char *origpath, const mtp_char *newpath,
 	mtp_int32 ret = 0;
 	mtp_char buf[BUFSIZ] = { 0 };
 
-	if ((fold = fopen(origpath, "rb")) == NULL) {
+	if ((fold = g_storage->open(origpath, MTP_FILE_READ)) == NULL) {
 		ERR("In-file open Fail errno [%d]\n", errno);
 		*error = errno;
 		return FALSE;
 	}
 
-	if ((fnew = fopen(newpath, "wb")) == NULL) {
+	if ((fnew = g_storage->open(newpath, MTP_FILE_WRITE)) == NULL) {
 		ERR("Out-file open Fail errno [%d]\n", errno);
 		*error = errno;
 		fclose(fold);
@@ -175,7 +204,7 @@ mtp_bool _util_file_copy(const mtp_char *origpath, const mtp_char *newpath,
 			*error = errno;
 			fclose(fnew);
 			fclose(fold);
-			if (remove(newpath) < 0)
+			if (g_storage->remove(newpath) < 0)
 				ERR("Remove Fail\n");
 			return FALSE;
 		}
@@ -186,7 +215,7 @@ mtp_bool _util_file_copy(const mtp_char *origpath, const mtp_char *newpath,
 			*error = errno;
 			fclose(fnew);
 			fclose(fold);
-			if (remove(newpath) < 0)
+			if (g_storage->remove(newpath) < 0)
 				ERR("Remove Fail\n");
 			return FALSE;
 		}
@@ -198,83 +227,53 @@ mtp_bool _util_file_copy(const mtp_char *origpath, const mtp_char *newpath,
 	return TRUE;
 }
 
-/*
- * A temporary wrapper to localize the warning about readdir_r usage.
- * To be replaced by readdir_r emulated with readdir.
- */
-static inline int do_readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result)
-{
-	return readdir_r(dirp, entry, result);
-}
-
 mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 		const mtp_char *newpath, mtp_uint32 store_id, mtp_int32 *error)
 {
-	DIR *dir = NULL;
-	struct dirent entry = { 0 };
-	struct dirent *entryptr = NULL;
-	mtp_int32 retval = 0;
-	mtp_char old_pathname[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
+	dir_scan_t *scan = NULL;
+	dir_entry_t entry;
+	mtp_uint32 orig_len = 0;
+	mtp_char *old_pathname = entry.filename;
 	mtp_char new_pathname[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-	struct stat entryinfo;
 
 	retv_if(origpath == NULL, FALSE);
 	retv_if(newpath == NULL, FALSE);
 
 	/* Open the given directory */
-	dir = opendir(origpath);
-	if (dir == NULL) {
-		ERR("opendir(%s) Fail\n", origpath);
-		_util_print_error();
-		return FALSE;
-	}
-
-	retval = do_readdir_r(dir, &entry, &entryptr);
+	scan = _util_dir_scan_open(origpath, MTP_DIR_SCAN_ALL);
+	retv_if(scan == NULL, FALSE);
+	orig_len = strlen(origpath);
 
-	while (retval == 0 && entryptr != NULL) {
-		/* Skip the names "." and ".." as we don't want to recurse on them. */
-		if (!g_strcmp0(entry.d_name, ".") ||
-				!g_strcmp0(entry.d_name, "..")) {
-			retval = do_readdir_r(dir, &entry, &entryptr);
-			continue;
-		}
-		g_snprintf(old_pathname, MTP_MAX_PATHNAME_SIZE + 1,
-				"%s/%s", origpath, entry.d_name);
+	while (_util_dir_scan_next(scan, &entry)) {
 		g_snprintf(new_pathname, MTP_MAX_PATHNAME_SIZE + 1,
-				"%s/%s", newpath, entry.d_name);
-
-		if (stat(old_pathname, &entryinfo) != 0) {
-			ERR("Error statting [%s] errno [%d]\n", old_pathname, errno);
-			closedir(dir);
-			return FALSE;
-		}
+				"%s/%s", newpath, entry.filename + orig_len + 1);
 
 		/* Create new mtp object */
 		mtp_store_t *store = _device_get_store(store_id);
 		if (store == NULL) {
 			ERR("store is NULL\n");
-			closedir(dir);
+			_util_dir_scan_close(scan);
 			return FALSE;
 		}
 
 		mtp_obj_t *orig_obj = _entity_get_object_from_store_by_path(store, old_pathname);
 		if (orig_obj == NULL) {
 			ERR("orig_obj is NULL\n");
-			closedir(dir);
+			_util_dir_scan_close(scan);
 			return FALSE;
 		}
 
 		mtp_obj_t *parent_obj = _entity_get_object_from_store_by_path(store, newpath);
 		if (parent_obj == NULL) {
 			ERR("orig_obj is NULL\n");
-			closedir(dir);
+			_util_dir_scan_close(scan);
 			return FALSE;
 		}
 
 		mtp_obj_t *new_obj = _entity_alloc_mtp_object();
 		if (new_obj == NULL) {
 			ERR("_entity_alloc_mtp_object Fail\n");
-			closedir(dir);
+			_util_dir_scan_close(scan);
 			return FALSE;
 		}
 
@@ -284,7 +283,7 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 		_entity_copy_mtp_object(new_obj, orig_obj);
 		if (new_obj->obj_info == NULL) {
 			_entity_dealloc_mtp_obj(new_obj);
-			closedir(dir);
+			_util_dir_scan_close(scan);
 			return FALSE;
 		}
 
@@ -292,14 +291,14 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 		new_obj->obj_handle = g_next_obj_handle++;
 		new_obj->obj_info->h_parent = parent_obj->obj_handle;
 
-		if (S_ISDIR(entryinfo.st_mode)) {
+		if (entry.type == MTP_DIR_TYPE) {
 			if (FALSE == _util_dir_create(new_pathname, error)) {
 				/* dir already exists
 				   merge the contents */
 				if (EEXIST != *error) {
 					ERR("directory[%s] create Fail errno [%d]\n", new_pathname, errno);
 					_entity_dealloc_mtp_obj(new_obj);
-					closedir(dir);
+					_util_dir_scan_close(scan);
 					return FALSE;
 				}
 			}
@@ -311,7 +310,7 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 						new_pathname, store_id, error)) {
 				ERR("Recursive Copy of Children Fail\
 						[%s]->[%s], errno [%d]\n", old_pathname, new_pathname, errno);
-				closedir(dir);
+				_util_dir_scan_close(scan);
 				return FALSE;
 			}
 		} else {
@@ -321,25 +320,25 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 				/* Cannot overwrite a read-only file,
 				   Skip copy and retain the read-only file
 				   on destination */
-				if (EACCES == *error)
-					goto DONE;
+				if (EACCES == *error) {
+					_entity_dealloc_mtp_obj(new_obj);
+					continue;
+				}
 				_entity_dealloc_mtp_obj(new_obj);
-				closedir(dir);
+				_util_dir_scan_close(scan);
 				return FALSE;
 			}
 #ifdef MTP_SUPPORT_SET_PROTECTION
 			mtp_bool ret = FALSE;
 
-			if (!((S_IWUSR & entryInfo.st_mode) ||
-						(S_IWGRP & entryInfo.st_mode) ||
-						(S_IWOTH & entryInfo.st_mode))) {
-				ret = _util_set_file_attrs(newPathName,
+			if (entry.attrs.attribute & MTP_FILE_ATTR_MODE_READ_ONLY) {
+				ret = _util_set_file_attrs(new_pathname,
 						MTP_FILE_ATTR_MODE_REG |
 						MTP_FILE_ATTR_MODE_READ_ONLY);
 				if (!ret) {
 					ERR("Failed to set directory attributes errno [%d]\n", errno);
 					_entity_dealloc_mtp_obj(new_obj);
-					closedir(dir);
+					_util_dir_scan_close(scan);
 					return FALSE;
 				}
 			}
@@ -347,12 +346,10 @@ mtp_bool _util_copy_dir_children_recursive(const mtp_char *origpath,
 			/* The file is created. Add object to mtp store */
 			_entity_add_object_to_store(store, new_obj);
 		}
-DONE:
-		retval = do_readdir_r(dir, &entry, &entryptr);
 	}
 
-	closedir(dir);
-	return (retval == 0) ? TRUE : FALSE;
+	_util_dir_scan_close(scan);
+	return TRUE;
 }
 
 mtp_bool _util_file_move(const mtp_char *origpath, const mtp_char *newpath,
@@ -360,7 +357,7 @@ mtp_bool _util_file_move(const mtp_char *origpath, const mtp_char *newpath,
 {
 	mtp_int32 ret = 0;
 
-	ret = rename(origpath, newpath);
+	ret = g_storage->rename(origpath, newpath);
 	if (ret < 0) {
 		if (errno == EXDEV) {
 			DBG("oldpath  and  newpath  are not on the same\
@@ -369,7 +366,7 @@ mtp_bool _util_file_move(const mtp_char *origpath, const mtp_char *newpath,
 				ERR("_util_file_copy Fail errno [%d]\n", errno);
 				return FALSE;
 			}
-			if (remove(origpath) < 0) {
+			if (g_storage->remove(origpath) < 0) {
 				ERR("remove Fail : %d\n", errno);
 				return FALSE;
 			}
@@ -383,19 +380,37 @@ mtp_bool _util_file_move(const mtp_char *origpath, const mtp_char *newpath,
 	return TRUE;
 }
 
-mtp_bool _util_is_file_opened(const mtp_char *fullpath)
+/*
+ * The file and folder counterparts of remove(), rmdir() and access(F_OK)
+ * in the storage backend. The first two return 0 on success and -1 with
+ * errno set on failure.
+ */
+mtp_int32 _util_file_remove(const mtp_char *fullpath)
 {
-	mtp_int32 ret = 0;
+	return g_storage->remove(fullpath);
+}
 
-	ret = rename(fullpath, fullpath);
-	return (ret != 0);
+mtp_int32 _util_dir_remove(const mtp_char *dirname)
+{
+	return g_storage->rmdir(dirname);
+}
+
+mtp_bool _util_file_exists(const mtp_char *fullpath)
+{
+	file_attr_t attrs;
+
+	return g_storage->stat(fullpath, &attrs) == 0;
+}
+
+mtp_bool _util_is_file_opened(const mtp_char *fullpath)
+{
+	return g_storage->is_opened(fullpath);
 }
 
 mtp_bool _util_dir_create(const mtp_char *dirname, mtp_int32 *error)
 {
 
-	if (mkdir(dirname, S_IRWXU | S_IRGRP |
-				S_IXGRP | S_IROTH | S_IXOTH) < 0) {
+	if (g_storage->mkdir(dirname) < 0) {
 		*error = errno;
 		return FALSE;
 	}
@@ -407,56 +422,37 @@ mtp_int32 _util_remove_dir_children_recursive(const mtp_char *dirname,
 {
 	retv_if(dirname == NULL, FALSE);
 
-	DIR *dir = NULL;
-	struct dirent entry = { 0 };
-	struct dirent *entryptr = NULL;
-	mtp_int32 retval = 0;
-	mtp_char pathname[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-	struct stat entryinfo;
+	dir_scan_t *scan = NULL;
+	dir_entry_t entry;
+	mtp_char *pathname = entry.filename;
 	mtp_int32 ret = MTP_ERROR_NONE;
 
 	/* Open the given directory */
-	dir = opendir(dirname);
-	if (dir == NULL) {
+	scan = _util_dir_scan_open(dirname, MTP_DIR_SCAN_ALL);
+	if (scan == NULL) {
 		ERR("Open directory Fail[%s], errno [%d]\n", dirname, errno);
 		return MTP_ERROR_GENERAL;
 	}
 
-	retval = do_readdir_r(dir, &entry, &entryptr);
-
-	while (retval == 0 && entryptr != NULL) {
-		/* Skip the names "." and ".."
-		   as we don't want to recurse on them. */
-		if (!g_strcmp0(entry.d_name, ".") ||
-				!g_strcmp0(entry.d_name, "..")) {
-			retval = do_readdir_r(dir, &entry, &entryptr);
-			continue;
-		}
-		g_snprintf(pathname, MTP_MAX_PATHNAME_SIZE + 1,
-				"%s/%s", dirname, entry.d_name);
-		if (stat(pathname, &entryinfo) != 0) {
-			ERR("Error statting %s errno [%d]\n", pathname, errno);
-			closedir(dir);
-			return MTP_ERROR_GENERAL;
-		}
+	while (_util_dir_scan_next(scan, &entry)) {
 		*num_of_file += 1;
-		if (S_ISDIR(entryinfo.st_mode)) {
+		if (entry.type == MTP_DIR_TYPE) {
 			ret = _util_remove_dir_children_recursive(pathname,
 					num_of_deleted_file, num_of_file, breadonly);
 			if (MTP_ERROR_GENERAL == ret || MTP_ERROR_ACCESS_DENIED == ret) {
 				ERR("deletion fail [%s]\n", pathname);
-				closedir(dir);
+				_util_dir_scan_close(scan);
 				return ret;
 			}
 			if (MTP_ERROR_OBJECT_WRITE_PROTECTED == ret) {
 				DBG("Folder[%s] contains read-only files,hence\
 						folder is not deleted\n", pathname);
 				/* Read the next entry */
-				goto DONE;
+				continue;
 			}
-			if (rmdir(pathname) < 0) {
+			if (g_storage->rmdir(pathname) < 0) {
 				ERR("deletion fail [%s], errno [%d]\n", pathname, errno);
-				closedir(dir);
+				_util_dir_scan_close(scan);
 				if (EACCES == errno)
 					return MTP_ERROR_ACCESS_DENIED;
 				return MTP_ERROR_GENERAL;
@@ -466,35 +462,25 @@ mtp_int32 _util_remove_dir_children_recursive(const mtp_char *dirname,
 			/* Only during Deleteobject, bReadOnly(TRUE)
 			   do not delete read-only files */
 #ifdef MTP_SUPPORT_SET_PROTECTION
-			if (breadonly) {
-				/* check for file attributes */
-				if (!((S_IWUSR & entryinfo.st_mode) ||
-							(S_IWGRP & entryinfo.st_mode) ||
-							(S_IWOTH & entryinfo.st_mode))) {
-					ret = MTP_ERROR_OBJECT_WRITE_PROTECTED;
-					DBG("File [%s] is readOnly:Deletion Fail\n", pathname);
-					goto DONE;
-				}
+			if (breadonly && (entry.attrs.attribute &
+						MTP_FILE_ATTR_MODE_READ_ONLY)) {
+				ret = MTP_ERROR_OBJECT_WRITE_PROTECTED;
+				DBG("File [%s] is readOnly:Deletion Fail\n", pathname);
+				continue;
 			}
 #endif /* MTP_SUPPORT_SET_PROTECTION */
-			if (unlink(pathname) < 0) {
+			if (g_storage->remove(pathname) < 0) {
 				ERR("deletion fail [%s], errno [%d]\n", pathname, errno);
-				closedir(dir);
+				_util_dir_scan_close(scan);
 				if (EACCES == errno)
 					return MTP_ERROR_ACCESS_DENIED;
 				return MTP_ERROR_GENERAL;
 			}
 			*num_of_deleted_file += 1;
 		}
-DONE:
-		retval = do_readdir_r(dir, &entry, &entryptr);
-		if (retval != 0) {
-			closedir(dir);
-			return MTP_ERROR_GENERAL;
-		}
 	}
 
-	closedir(dir);
+	_util_dir_scan_close(scan);
 	return ret;
 }
 /* LCOV_EXCL_STOP */
@@ -510,32 +496,37 @@ DONE:
  */
 mtp_bool _util_get_file_attrs(const mtp_char *filename, file_attr_t *attrs)
 {
-	struct stat fileinfo = { 0 };
-
-	retvm_if(stat(filename, &fileinfo) < 0, FALSE,
+	retvm_if(g_storage->stat(filename, attrs) < 0, FALSE,
 		"%s : stat Fail errno [%d]\n", filename, errno);
 
-	memset(attrs, 0, sizeof(file_attr_t));
-	attrs->fsize = (mtp_uint64)fileinfo.st_size;
-	attrs->ctime = fileinfo.st_ctime;
-	attrs->mtime = fileinfo.st_mtime;
+	return TRUE;
+}
 
-	/*Reset attribute mode */
-	attrs->attribute = MTP_FILE_ATTR_MODE_NONE;
-	if (S_ISREG(fileinfo.st_mode)) {
-		/* LCOV_EXCL_START */
-		attrs->attribute |= MTP_FILE_ATTR_MODE_REG;
-		if (!((S_IWUSR & fileinfo.st_mode) ||
-					(S_IWGRP & fileinfo.st_mode) ||
-					(S_IWOTH & fileinfo.st_mode))) {
-			attrs->attribute |= MTP_FILE_ATTR_MODE_READ_ONLY;
-		}
-	} else if (S_ISDIR(fileinfo.st_mode)) {
-		attrs->attribute |= MTP_FILE_ATTR_MODE_DIR;
-	} else if (S_ISBLK(fileinfo.st_mode) || S_ISCHR(fileinfo.st_mode) ||
-			S_ISLNK(fileinfo.st_mode) || S_ISSOCK(fileinfo.st_mode)) {
-		attrs->attribute |= MTP_FILE_ATTR_MODE_SYSTEM;
+/*
+ * mtp_bool _util_file_get_size(FILE *fhandle, const mtp_char *filename,
+ *		mtp_uint64 *size)
+ * This function gets the size of an open file. A stream without a file
+ * descriptor, from another storage backend, is looked up by its name.
+ *
+ * @param[in]		fhandle		File opened with _util_file_open().
+ * @param[in]		filename	Name it was opened with.
+ * @param[out]		size		Size in bytes.
+ * @return		This function returns TRUE on success, otherwise FALSE.
+ */
+mtp_bool _util_file_get_size(FILE *fhandle, const mtp_char *filename,
+		mtp_uint64 *size)
+{
+	struct stat st;
+	file_attr_t attrs = { 0 };
+
+	if (fileno(fhandle) >= 0 && fstat(fileno(fhandle), &st) == 0) {
+		*size = (mtp_uint64)st.st_size;
+		return TRUE;
 	}
+
+	retv_if(!_util_get_file_attrs(filename, &attrs), FALSE);
+	*size = attrs.fsize;
+
 	return TRUE;
 }
 
@@ -555,7 +546,7 @@ mtp_bool _util_set_file_attrs(const mtp_char *filename, mtp_dword attrib)
 		return FALSE;
 	}
 
-	if (0 != chmod(filename, attrs)) {
+	if (0 != g_storage->chmod(filename, attrs)) {
 		if (EPERM == errno)
 			return TRUE;
 		ERR_SECURE("Change mode of [File : %s] Fail\n", filename);
@@ -567,183 +558,64 @@ mtp_bool _util_set_file_attrs(const mtp_char *filename, mtp_dword attrib)
 /* LCOV_EXCL_STOP */
 
 /*
- * mtp_bool _util_ifind_first(mtp_char *dirname, DIR **dirp,
- *	dir_entry_t *dir_info)
- * This function finds the first file in the directory stream.
+ * dir_scan_t *_util_dir_scan_open(const mtp_char *dir_name, mtp_uint32 flags)
+ * This function opens a folder for _util_dir_scan_next().
  *
- * @param[in]		dirname		specifies the name of directory.
- * @param[out]		dirp		pointer to the directory stream.
- * @param[in]		dir_info	pointer to the file information.
- * @return		This function returns TRUE on success, otherwise FALSE.
+ * @param[in]		dir_name	name of the folder.
+ * @param[in]		flags		MTP_DIR_SCAN_ALL or 0.
+ * @return		The scanner, to be closed by _util_dir_scan_close(),
+ *			NULL on failure.
  */
-mtp_bool _util_ifind_first(mtp_char *dirname, DIR **dirp, dir_entry_t *dir_info)
+dir_scan_t *_util_dir_scan_open(const mtp_char *dir_name, mtp_uint32 flags)
 {
-	DIR *dir;
+	dir_scan_t *scan = NULL;
 
-	retv_if(dirp == NULL, FALSE);
-	retv_if(dirname == NULL, FALSE);
-	retv_if(dir_info == NULL, FALSE);
+	retv_if(dir_name == NULL, NULL);
 
-	dir = opendir(dirname);
-	if (NULL == dir) {
+	scan = g_storage->scan_open(dir_name, flags);
+	if (scan == NULL) {
 		/* LCOV_EXCL_START */
-		ERR("opendir(%s) Fail\n", dirname);
+		ERR_SECURE("open(%s) Fail\n", dir_name);
 		_util_print_error();
-
-		return FALSE;
-	}
-
-	if (_util_ifind_next(dirname, dir, dir_info) == FALSE) {
-		DBG("Stop enumeration\n");
-		_util_print_error();
-		closedir(dir);
-		return FALSE;
 		/* LCOV_EXCL_STOP */
 	}
 
-	*dirp = dir;
-
-	return TRUE;
+	return scan;
 }
 
 /*
- * mtp_bool _util_ifind_next(mtp_char *dirname, DIR *dirp, dir_entry_t *dir_info)
- * This function finds the next successive file in the directory stream.
+ * mtp_bool _util_dir_scan_next(dir_scan_t *scan, dir_entry_t *dir_info)
+ * This function gets the next file or folder of the folder. Unless the
+ * scanner was opened with MTP_DIR_SCAN_ALL, hidden entries and anything
+ * else than files and folders are skipped; with it, the others are
+ * returned as files with MTP_FILE_ATTR_MODE_SYSTEM. The size and the
+ * modification time of folders may not be filled in.
  *
- * @param[in]		dirname		name of the directory.
- * @param[in]		dirp		pointer to the directory stream.
+ * @param[in]		scan		scanner from _util_dir_scan_open().
  * @param[out]		dir_info	Points the file information.
- * @return		This function returns TRUE on success, otherwise FALSE.
+ * @return		This function returns TRUE on success, FALSE when
+ *			there is no more entry.
  */
-mtp_bool _util_ifind_next(mtp_char *dir_name, DIR *dirp, dir_entry_t *dir_info)
+mtp_bool _util_dir_scan_next(dir_scan_t *scan, dir_entry_t *dir_info)
 {
-	mtp_int32 ret = 0;
-	struct dirent entry = {0};
-	struct stat stat_buf = {0};
-	struct dirent *result = NULL;
-	mtp_char path_name[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-
-	retv_if(dir_name == NULL, FALSE);
+	retv_if(scan == NULL, FALSE);
 	retv_if(dir_info == NULL, FALSE);
 
-	do {
-		ret = do_readdir_r(dirp, &entry, &result);
-		if (ret != 0) {
-			ERR("do_readdir_r Fail : %d\n", ret);
-			return FALSE;
-		} else if (result == NULL) {
-			DBG("There is no more entry\n");
-			return FALSE;
-		}
-
-		if (_util_create_path(path_name, sizeof(path_name),
-					dir_name, entry.d_name) == FALSE) {
-			continue;
-		}
-
-		if (stat(path_name, &stat_buf) < 0) {
-			ERR_SECURE("stat Fail, skip [%s]\n", path_name);
-			continue;
-		}
-		break;
-	} while (1);
-
-	g_strlcpy(dir_info->filename, path_name, sizeof(dir_info->filename));
-	dir_info->attrs.attribute = MTP_FILE_ATTR_MODE_NONE;
-
-	switch (stat_buf.st_mode & S_IFMT) {
-	case S_IFREG:
-		dir_info->type = MTP_FILE_TYPE;
-		if (!(stat_buf.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
-			dir_info->attrs.attribute |= MTP_FILE_ATTR_MODE_READ_ONLY;
-		break;
-
-	case S_IFDIR:
-		dir_info->type = MTP_DIR_TYPE;
-		dir_info->attrs.attribute = MTP_FILE_ATTR_MODE_DIR;
-		break;
-
-	case S_IFBLK:
-	case S_IFCHR:
-	case S_IFIFO:
-	case S_IFLNK:
-	case S_IFSOCK:
-	/* LCOV_EXCL_START */
-		dir_info->attrs.attribute |= MTP_FILE_ATTR_MODE_SYSTEM;
-		break;
-
-	default:
-		dir_info->attrs.attribute |= MTP_FILE_ATTR_MODE_SYSTEM;
-		ERR_SECURE("%s has unknown type. mode[0x%x]\n",
-				dir_info->filename, stat_buf.st_mode);
-		break;
-		/* LCOV_EXCL_STOP */
-	}
-
-	/* Directory Information */
-	dir_info->attrs.mtime = stat_buf.st_mtime;
-	dir_info->attrs.fsize = (mtp_uint64)stat_buf.st_size;
-
-	return TRUE;
+	return g_storage->scan_next(scan, dir_info);
 }
 
-mtp_bool _util_get_filesystem_info(mtp_char *storepath,
-	fs_info_t *fs_info)
+void _util_dir_scan_close(dir_scan_t *scan)
 {
-	if (!g_strcmp0(storepath, MTP_EXTERNAL_PATH_CHAR)) {
-		struct statfs buf = { 0 };
-		mtp_uint64 avail_size = 0;
-		mtp_uint64 capacity = 0;
-		mtp_uint64 used_size = 0;
-
-		retvm_if(statfs(storepath, &buf) != 0, FALSE, "statfs is failed\n");
+	ret_if(scan == NULL);
 
-		capacity = used_size = avail_size = (mtp_uint64)buf.f_bsize;
-		DBG("Block size : %lu\n", (unsigned long)buf.f_bsize);
-		capacity *= buf.f_blocks;
-		used_size *= (buf.f_blocks - buf.f_bavail);
-		avail_size *= buf.f_bavail;
-
-		fs_info->disk_size = capacity;
-		fs_info->reserved_size = used_size;
-		fs_info->avail_size = avail_size;
-
-		return TRUE;
-	}
-
-	return FALSE;
+	g_storage->scan_close(scan);
 }
 
-/* LCOV_EXCL_START */
-/*
- * void _FLOGD(const char *fmt, ...)
- * This function writes MTP debug message to MTP log file
- *
- * @param[in]		fmt Formatted debug message.
- * @param[out]		None.
- * @return		None.
- */
-void _FLOGD(const char *file, const char *fmt, ...)
+mtp_bool _util_get_filesystem_info(mtp_char *storepath,
+	fs_info_t *fs_info)
 {
-	static mtp_int64 written_bytes = 0;
-	FILE *fp = NULL;
-	va_list ap;
+	retvm_if(g_storage->statfs(storepath, fs_info) != 0, FALSE,
+			"statfs is failed\n");
 
-	if (written_bytes == 0 || written_bytes > MTP_LOG_MAX_SIZE) {
-		fp = fopen(MTP_LOG_FILE, "w");
-		written_bytes = 0;
-	} else {
-		fp = fopen(MTP_LOG_FILE, "a+");
-	}
-
-	if (fp == NULL)
-		return;
-
-	written_bytes += fprintf(fp, "%s ", file + SRC_PATH_LEN) - SRC_PATH_LEN;
-	va_start(ap, fmt);
-	written_bytes += vfprintf(fp, fmt, ap);
-	va_end(ap);
-
-	fclose(fp);
+	return TRUE;
 }
-/* LCOV_EXCL_STOP */
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <glib.h>
+#include "mtp_log.h"
+#include "mtp_thread.h"
+
+#define MTP_LOG_RING_MASK	(MTP_LOG_RING_RECORDS - 1)
+#define MTP_LOG_IOV_MAX		64
+
+/*
+ * Every thread formats its records into its own single producer, single
+ * consumer ring. head is only advanced by the owning thread and tail only
+ * by the log writer, so neither side needs a lock.
+ */
+typedef struct _log_ring {
+	mtp_uint32 head;
+	mtp_uint32 tail;
+	mtp_uint32 dropped;	/* records lost because the ring was full */
+	mtp_uint32 reported;	/* dropped count already written to the log */
+	mtp_bool is_dead;	/* owning thread exited */
+	long tid;
+	struct _log_ring *next;
+	mtp_uint32 len[MTP_LOG_RING_RECORDS];
+	mtp_char rec[MTP_LOG_RING_RECORDS][MTP_LOG_RECORD_SIZE];
+} log_ring_t;
+
+/*
+ * The writer sleeps while there is nothing to write. The first record
+ * wakes it, then it gathers records for MTP_LOG_FLUSH_INTERVAL, or until
+ * a ring is half full, and writes them at once.
+ */
+typedef enum {
+	LOG_WRITER_BUSY = 0,	/* draining the rings */
+	LOG_WRITER_IDLE,	/* waiting for a record */
+	LOG_WRITER_BATCH	/* woken, gathering records */
+} log_writer_state_t;
+
+/*
+ * GLOBAL AND STATIC VARIABLES
+ */
+mtp_int32 g_log_level = MTP_LOG_LEVEL_DEBUG;
+
+static __thread log_ring_t *g_log_ring = NULL;
+static log_ring_t *g_log_rings = NULL;
+static pthread_mutex_t g_log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_log_ring_key;
+static pthread_once_t g_log_ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t g_log_thrd;
+static mtp_int32 g_log_fd = -1;
+static mtp_bool g_log_stop = FALSE;
+static mtp_int64 g_log_written = 0;
+static mtp_int32 g_log_wake_fd = -1;
+static mtp_int32 g_log_state = LOG_WRITER_BUSY;
+static mtp_bool g_log_class_pending = FALSE;
+
+/*
+ * STATIC FUNCTIONS
+ */
+static void __release_log_ring(void *data)
+{
+	log_ring_t *ring = (log_ring_t *)data;
+
+	/* The writer frees the ring once everything in it was written */
+	__atomic_store_n(&ring->is_dead, TRUE, __ATOMIC_RELEASE);
+}
+
+static void __create_log_ring_key(void)
+{
+	pthread_key_create(&g_log_ring_key, __release_log_ring);
+}
+
+static log_ring_t *__get_log_ring(void)
+{
+	log_ring_t *ring = g_log_ring;
+
+	if (ring != NULL)
+		return ring;
+
+	ring = (log_ring_t *)g_malloc0(sizeof(log_ring_t));
+	if (ring == NULL)
+		return NULL;
+
+	ring->tid = syscall(__NR_gettid);
+
+	pthread_once(&g_log_ring_key_once, __create_log_ring_key);
+	pthread_setspecific(g_log_ring_key, ring);
+
+	pthread_mutex_lock(&g_log_rings_mutex);
+	ring->next = g_log_rings;
+	g_log_rings = ring;
+	pthread_mutex_unlock(&g_log_rings_mutex);
+
+	g_log_ring = ring;
+	return ring;
+}
+
+static void __write_log_fd(const struct iovec *iov, mtp_int32 cnt)
+{
+	ssize_t ret;
+
+	ret = writev(g_log_fd, iov, cnt);
+	if (ret <= 0)
+		return;
+
+	g_log_written += ret;
+	if (g_log_written > MTP_LOG_MAX_SIZE) {
+		/* Same policy as before: start over with an empty file */
+		if (ftruncate(g_log_fd, 0) == 0)
+			g_log_written = 0;
+	}
+}
+
+/*
+ * Writes out every pending record of ring.
+ * @return	number of records written.
+ */
+static mtp_uint32 __drain_log_ring(log_ring_t *ring)
+{
+	struct iovec iov[MTP_LOG_IOV_MAX];
+	mtp_char drop_msg[64];
+	mtp_int32 cnt = 0;
+	mtp_uint32 dropped;
+	mtp_uint32 head;
+	mtp_uint32 tail;
+	mtp_uint32 idx;
+	mtp_uint32 done = 0;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		for (cnt = 0; cnt < MTP_LOG_IOV_MAX && tail + cnt != head; cnt++) {
+			idx = (tail + cnt) & MTP_LOG_RING_MASK;
+			iov[cnt].iov_base = ring->rec[idx];
+			iov[cnt].iov_len = ring->len[idx];
+		}
+
+		__write_log_fd(iov, cnt);
+		tail += cnt;
+		done += cnt;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+		iov[0].iov_base = drop_msg;
+		iov[0].iov_len = g_snprintf(drop_msg, sizeof(drop_msg),
+				"mtp_log: thread [%ld] dropped %u records\n",
+				ring->tid, dropped - ring->reported);
+		__write_log_fd(iov, 1);
+		ring->reported = dropped;
+	}
+
+	return done;
+}
+
+/*
+ * The rings are taken off the list while they are written, so a thread
+ * logging for the first time does not wait for the file.
+ */
+static mtp_uint32 __drain_log_rings(void)
+{
+	log_ring_t *rings = NULL;
+	log_ring_t *last = NULL;
+	log_ring_t **prev = NULL;
+	log_ring_t *ring = NULL;
+	mtp_uint32 done = 0;
+
+	pthread_mutex_lock(&g_log_rings_mutex);
+	rings = g_log_rings;
+	g_log_rings = NULL;
+	pthread_mutex_unlock(&g_log_rings_mutex);
+
+	prev = &rings;
+	while ((ring = *prev) != NULL) {
+		done += __drain_log_ring(ring);
+
+		if (__atomic_load_n(&ring->is_dead, __ATOMIC_ACQUIRE) &&
+				ring->tail == __atomic_load_n(&ring->head,
+					__ATOMIC_ACQUIRE)) {
+			*prev = ring->next;
+			g_free(ring);
+			continue;
+		}
+		last = ring;
+		prev = &ring->next;
+	}
+
+	/* Behind the rings added meanwhile */
+	if (last != NULL) {
+		pthread_mutex_lock(&g_log_rings_mutex);
+		last->next = g_log_rings;
+		g_log_rings = rings;
+		pthread_mutex_unlock(&g_log_rings_mutex);
+	}
+
+	return done;
+}
+
+static void __wait_log_writer_wake(mtp_int32 timeout)
+{
+	struct pollfd pfd = { .fd = g_log_wake_fd, .events = POLLIN };
+	eventfd_t count = 0;
+
+	if (poll(&pfd, 1, timeout) > 0)
+		eventfd_read(g_log_wake_fd, &count);
+}
+
+/*
+ * Called once a record is queued, with the records pending in its ring.
+ * Only the first record of a batch, or of a ring half full, costs a
+ * syscall.
+ */
+static void __wake_log_writer(mtp_uint32 pending)
+{
+	mtp_int32 state = 0;
+
+	/* Pairs with the fence of the writer going to sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	state = __atomic_load_n(&g_log_state, __ATOMIC_RELAXED);
+
+	if (state == LOG_WRITER_IDLE) {
+		if (!__atomic_compare_exchange_n(&g_log_state, &state,
+					LOG_WRITER_BATCH, FALSE,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return;
+	} else if (state != LOG_WRITER_BATCH ||
+			pending < MTP_LOG_RING_RECORDS / 2 ||
+			!__atomic_compare_exchange_n(&g_log_state, &state,
+				LOG_WRITER_BUSY, FALSE, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED)) {
+		return;
+	}
+
+	eventfd_write(g_log_wake_fd, 1);
+}
+
+static void *__thread_log_writer(void *arg)
+{
+	while (!__atomic_load_n(&g_log_stop, __ATOMIC_ACQUIRE)) {
+		if (__atomic_exchange_n(&g_log_class_pending, FALSE,
+					__ATOMIC_ACQUIRE))
+			_util_thread_set_class(MTP_THREAD_CLASS_BG);
+
+		if (__drain_log_rings() > 0)
+			continue;
+
+		/* A record queued before the fence is drained here */
+		__atomic_store_n(&g_log_state, LOG_WRITER_IDLE,
+				__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__drain_log_rings() == 0 &&
+				!__atomic_load_n(&g_log_stop, __ATOMIC_ACQUIRE))
+			__wait_log_writer_wake(-1);
+
+		if (__atomic_load_n(&g_log_state, __ATOMIC_ACQUIRE) ==
+				LOG_WRITER_BATCH)
+			__wait_log_writer_wake(MTP_LOG_FLUSH_INTERVAL / 1000);
+
+		__atomic_store_n(&g_log_state, LOG_WRITER_BUSY,
+				__ATOMIC_RELAXED);
+	}
+
+	__drain_log_rings();
+	return NULL;
+}
+
+/*
+ * FUNCTIONS
+ */
+/* LCOV_EXCL_START */
+/*
+ * void _util_log_write(mtp_int32 level, const char *file, const char *fmt, ...)
+ * This function queues MTP debug message for the log writer thread.
+ * Use MTP_LOG() or DBG()/ERR() so the level is checked first.
+ *
+ * @param[in]		level	Log level of the message.
+ * @param[in]		file	Source file name.
+ * @param[in]		fmt	Formatted debug message.
+ * @return		None.
+ */
+void _util_log_write(mtp_int32 level, const char *file, const char *fmt, ...)
+{
+	log_ring_t *ring = NULL;
+	mtp_char *rec = NULL;
+	mtp_uint32 head;
+	mtp_uint32 tail;
+	mtp_int32 len;
+	mtp_int32 ret;
+	va_list ap;
+
+	ring = __get_log_ring();
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= MTP_LOG_RING_RECORDS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = ring->rec[head & MTP_LOG_RING_MASK];
+	len = snprintf(rec, MTP_LOG_RECORD_SIZE, "%s ", file + SRC_PATH_LEN);
+	if (len < 0 || len >= MTP_LOG_RECORD_SIZE)
+		return;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(rec + len, MTP_LOG_RECORD_SIZE - len, fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		return;
+
+	len += ret;
+	if (len >= MTP_LOG_RECORD_SIZE) {
+		/* Truncated, keep the line terminated */
+		len = MTP_LOG_RECORD_SIZE - 1;
+		rec[len - 1] = '\n';
+	}
+
+	ring->len[head & MTP_LOG_RING_MASK] = len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	__wake_log_writer(head + 1 - tail);
+}
+/* LCOV_EXCL_STOP */
+
+void _util_log_set_level(mtp_int32 level)
+{
+	/* Nothing would drain the rings, do not bother formatting */
+	if (g_log_fd < 0)
+		level = MTP_LOG_LEVEL_NONE;
+
+	__atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+}
+
+mtp_bool _util_log_init(void)
+{
+	retv_if(g_log_fd >= 0, TRUE);
+
+	g_log_fd = open(MTP_LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			O_CLOEXEC, 0644);
+	if (g_log_fd < 0) {
+		_util_log_set_level(MTP_LOG_LEVEL_NONE);
+		return FALSE;
+	}
+
+	g_log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_log_wake_fd < 0) {
+		/* LCOV_EXCL_START */
+		close(g_log_fd);
+		g_log_fd = -1;
+		_util_log_set_level(MTP_LOG_LEVEL_NONE);
+		return FALSE;
+		/* LCOV_EXCL_STOP */
+	}
+
+	g_log_written = 0;
+	g_log_stop = FALSE;
+	g_log_state = LOG_WRITER_BUSY;
+	if (_util_thread_create(&g_log_thrd, "Log writer",
+				PTHREAD_CREATE_JOINABLE, MTP_THREAD_CLASS_BG,
+				__thread_log_writer,
+				NULL) == FALSE) {
+		/* LCOV_EXCL_START */
+		close(g_log_wake_fd);
+		g_log_wake_fd = -1;
+		close(g_log_fd);
+		g_log_fd = -1;
+		_util_log_set_level(MTP_LOG_LEVEL_NONE);
+		return FALSE;
+		/* LCOV_EXCL_STOP */
+	}
+
+	return TRUE;
+}
+
+/*
+ * The writer is started before the configuration is read, so it only gets
+ * the BG cpus and I/O priority once this is called.
+ */
+void _util_log_apply_thread_class(void)
+{
+	ret_if(g_log_fd < 0);
+
+	__atomic_store_n(&g_log_class_pending, TRUE, __ATOMIC_RELEASE);
+	eventfd_write(g_log_wake_fd, 1);
+}
+
+void _util_log_deinit(void)
+{
+	ret_if(g_log_fd < 0);
+
+	__atomic_store_n(&g_log_stop, TRUE, __ATOMIC_RELEASE);
+	eventfd_write(g_log_wake_fd, 1);
+	_util_thread_join(g_log_thrd, NULL);
+
+	close(g_log_wake_fd);
+	g_log_wake_fd = -1;
+	close(g_log_fd);
+	g_log_fd = -1;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+#include "mtp_loop.h"
+
+/*
+ * Control plane event loop. ep0, the file system notifications, the event
+ * request pipe and the debounce timers are all served by the thread that
+ * calls _util_loop_run(), so none of them needs its own blocking thread.
+ * Callbacks must not block; bulk data keeps its own threads.
+ */
+typedef struct {
+	mtp_int32 fd;
+	loop_fd_cb_t cb;
+	void *data;
+	mtp_uint32 events;	/* EPOLL* the callback waits for */
+	mtp_bool is_timer;
+	mtp_bool is_removed;
+} loop_source_t;
+
+static mtp_int32 g_loop_epfd = -1;
+static mtp_int32 g_loop_wakefd = -1;
+static mtp_bool g_loop_quit = FALSE;
+static GHashTable *g_loop_sources = NULL;	/* fd -> loop_source_t */
+static GPtrArray *g_loop_removed = NULL;	/* freed after each dispatch */
+
+/*
+ * FUNCTIONS
+ */
+mtp_bool _util_loop_init(void)
+{
+	struct epoll_event ev = { 0 };
+
+	g_loop_epfd = epoll_create1(EPOLL_CLOEXEC);
+	retvm_if(g_loop_epfd < 0, FALSE, "epoll_create1() Fail [%d]\n", errno);
+
+	/* Lets _util_loop_quit() work from any thread */
+	g_loop_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_loop_wakefd < 0) {
+		ERR("eventfd() Fail [%d]\n", errno);
+		close(g_loop_epfd);
+		g_loop_epfd = -1;
+		return FALSE;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(g_loop_epfd, EPOLL_CTL_ADD, g_loop_wakefd, &ev) < 0) {
+		ERR("epoll_ctl() Fail [%d]\n", errno);
+		_util_loop_deinit();
+		return FALSE;
+	}
+
+	g_loop_sources = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	g_loop_removed = g_ptr_array_new_with_free_func(g_free);
+	g_loop_quit = FALSE;
+
+	return TRUE;
+}
+
+void _util_loop_deinit(void)
+{
+	if (g_loop_sources != NULL) {
+		g_hash_table_destroy(g_loop_sources);
+		g_loop_sources = NULL;
+	}
+
+	if (g_loop_removed != NULL) {
+		g_ptr_array_free(g_loop_removed, TRUE);
+		g_loop_removed = NULL;
+	}
+
+	if (g_loop_wakefd >= 0) {
+		close(g_loop_wakefd);
+		g_loop_wakefd = -1;
+	}
+
+	if (g_loop_epfd >= 0) {
+		close(g_loop_epfd);
+		g_loop_epfd = -1;
+	}
+}
+
+void _util_loop_run(void)
+{
+	struct epoll_event events[MTP_LOOP_MAX_EVENTS];
+	loop_source_t *src = NULL;
+	mtp_int32 n = 0;
+	mtp_int32 i = 0;
+	uint64_t count = 0;
+
+	ret_if(g_loop_epfd < 0);
+
+	while (!__atomic_load_n(&g_loop_quit, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(g_loop_epfd, events, MTP_LOOP_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("epoll_wait() Fail [%d]\n", errno);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			src = (loop_source_t *)events[i].data.ptr;
+			if (src == NULL) {
+				if (read(g_loop_wakefd, &count, sizeof(count)) < 0)
+					DBG("wake up read() Fail [%d]\n", errno);
+				continue;
+			}
+
+			/* An earlier callback of this batch removed it */
+			if (src->is_removed)
+				continue;
+
+			if (src->is_timer &&
+					read(src->fd, &count, sizeof(count)) < 0)
+				continue;
+
+			src->cb(src->fd, src->data);
+		}
+
+		g_ptr_array_set_size(g_loop_removed, 0);
+	}
+
+	DBG("event loop is over\n");
+}
+
+void _util_loop_quit(void)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&g_loop_quit, TRUE, __ATOMIC_RELEASE);
+	if (g_loop_wakefd >= 0 &&
+			write(g_loop_wakefd, &one, sizeof(one)) < 0)
+		ERR("wake up write() Fail [%d]\n", errno);
+}
+
+static mtp_bool __add_source(mtp_int32 fd, mtp_uint32 events,
+		loop_fd_cb_t cb, void *data, mtp_bool is_timer)
+{
+	struct epoll_event ev = { 0 };
+	loop_source_t *src = NULL;
+
+	retv_if(g_loop_sources == NULL || fd < 0 || cb == NULL, FALSE);
+
+	src = g_new0(loop_source_t, 1);
+	src->fd = fd;
+	src->cb = cb;
+	src->data = data;
+	src->events = events;
+	src->is_timer = is_timer;
+
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(g_loop_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ERR("epoll_ctl(ADD, %d) Fail [%d]\n", fd, errno);
+		g_free(src);
+		return FALSE;
+	}
+
+	g_hash_table_replace(g_loop_sources, GINT_TO_POINTER(fd), src);
+
+	return TRUE;
+}
+
+mtp_bool _util_loop_add_fd(mtp_int32 fd, loop_fd_cb_t cb, void *data)
+{
+	return __add_source(fd, EPOLLIN, cb, data, FALSE);
+}
+
+/*
+ * For files which are always readable and signal changes otherwise, e.g.
+ * EPOLLPRI for /proc/self/mountinfo.
+ */
+mtp_bool _util_loop_add_fd_events(mtp_int32 fd, mtp_uint32 events,
+		loop_fd_cb_t cb, void *data)
+{
+	return __add_source(fd, events, cb, data, FALSE);
+}
+
+/* A disabled fd stays registered but its callback is not called */
+mtp_bool _util_loop_enable_fd(mtp_int32 fd, mtp_bool enable)
+{
+	struct epoll_event ev = { 0 };
+	loop_source_t *src = NULL;
+
+	retv_if(g_loop_sources == NULL, FALSE);
+
+	src = g_hash_table_lookup(g_loop_sources, GINT_TO_POINTER(fd));
+	retvm_if(src == NULL, FALSE, "fd [%d] is not in the loop\n", fd);
+
+	ev.events = enable ? src->events : 0;
+	ev.data.ptr = src;
+	retvm_if(epoll_ctl(g_loop_epfd, EPOLL_CTL_MOD, fd, &ev) < 0, FALSE,
+			"epoll_ctl(MOD, %d) Fail [%d]\n", fd, errno);
+
+	return TRUE;
+}
+
+/*
+ * The caller still owns fd. Removal is safe from a callback, the source is
+ * only freed once the current batch is dispatched.
+ */
+void _util_loop_remove_fd(mtp_int32 fd)
+{
+	loop_source_t *src = NULL;
+
+	ret_if(g_loop_sources == NULL);
+
+	src = g_hash_table_lookup(g_loop_sources, GINT_TO_POINTER(fd));
+	ret_if(src == NULL);
+
+	if (epoll_ctl(g_loop_epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		ERR("epoll_ctl(DEL, %d) Fail [%d]\n", fd, errno);
+
+	src->is_removed = TRUE;
+	g_hash_table_steal(g_loop_sources, GINT_TO_POINTER(fd));
+	g_ptr_array_add(g_loop_removed, src);
+}
+
+/* Returns a disarmed one-shot timer, or -1 */
+mtp_int32 _util_loop_add_timer(loop_fd_cb_t cb, void *data)
+{
+	mtp_int32 tfd = -1;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	retvm_if(tfd < 0, -1, "timerfd_create() Fail [%d]\n", errno);
+
+	if (!__add_source(tfd, EPOLLIN, cb, data, TRUE)) {
+		close(tfd);
+		return -1;
+	}
+
+	return tfd;
+}
+
+/* timeout is in ms, a negative one disarms the timer */
+mtp_bool _util_loop_set_timer(mtp_int32 tfd, mtp_int32 timeout)
+{
+	struct itimerspec spec = { { 0 } };
+
+	retv_if(tfd < 0, FALSE);
+
+	if (timeout >= 0) {
+		/* An all zero it_value would disarm it */
+		if (timeout == 0)
+			spec.it_value.tv_nsec = 1;
+		else {
+			spec.it_value.tv_sec = timeout / 1000;
+			spec.it_value.tv_nsec = (timeout % 1000) * 1000000L;
+		}
+	}
+
+	retvm_if(timerfd_settime(tfd, 0, &spec, NULL) < 0, FALSE,
+			"timerfd_settime() Fail [%d]\n", errno);
+
+	return TRUE;
+}
+
+void _util_loop_remove_timer(mtp_int32 tfd)
+{
+	ret_if(tfd < 0);
+
+	_util_loop_remove_fd(tfd);
+	close(tfd);
+}
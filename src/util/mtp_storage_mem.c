@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "mtp_util.h"
+#include "mtp_storage.h"
+
+/*
+ * The stores live in the memory of the process and are lost when it stops.
+ * Every operation waits mem_storage_latency, and reads and writes also
+ * wait for their bytes to go through at mem_storage_bandwidth, so the
+ * protocol layer can be measured against a storage of known speed.
+ * Folders are listed in name order.
+ */
+
+typedef struct mem_node mem_node_t;
+struct mem_node {
+	mem_node_t *parent;	/* NULL once removed */
+	mtp_char *name;
+	mtp_bool is_dir;
+	mtp_bool read_only;
+	mtp_uint32 open_count;
+	time_t ctime;
+	time_t mtime;
+	GByteArray *data;	/* Files */
+	GTree *children;	/* Folders, mem_node_t by name */
+};
+
+typedef struct {
+	mem_node_t *node;
+	off64_t pos;
+} mem_file_t;
+
+typedef struct {
+	mtp_char *name;
+	file_type_t type;
+	file_attr_t attrs;
+} mem_entry_t;
+
+typedef struct {
+	GArray *entries;	/* mem_entry_t, copied when opened */
+	mtp_uint32 next;
+	mtp_uint32 flags;
+	mtp_uint32 path_len;	/* of the folder, with the trailing slash */
+	mtp_char path[MTP_MAX_PATHNAME_SIZE + 1];
+} mem_scan_t;
+
+extern mtp_config_t g_conf;
+
+static pthread_mutex_t g_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mem_node_t *g_mem_root;
+static mtp_uint64 g_mem_used;
+
+static void __wait_io(mtp_uint64 bytes)
+{
+	mtp_uint64 usecs = 0;
+
+	if (g_conf.mem_storage_latency > 0)
+		usecs = g_conf.mem_storage_latency;
+	if (g_conf.mem_storage_bandwidth > 0)
+		usecs += bytes * G_USEC_PER_SEC /
+			((mtp_uint64)g_conf.mem_storage_bandwidth * 1024);
+
+	if (usecs > 0)
+		g_usleep(usecs);
+}
+
+static mem_node_t *__new_node(mem_node_t *parent, const mtp_char *name,
+		mtp_bool is_dir)
+{
+	mem_node_t *node = g_new0(mem_node_t, 1);
+
+	node->name = g_strdup(name);
+	node->is_dir = is_dir;
+	node->ctime = node->mtime = time(NULL);
+	if (is_dir)
+		node->children = g_tree_new((GCompareFunc)strcmp);
+	else
+		node->data = g_byte_array_new();
+
+	if (parent != NULL) {
+		node->parent = parent;
+		g_tree_insert(parent->children, node->name, node);
+		parent->mtime = node->mtime;
+	}
+
+	return node;
+}
+
+static void __free_node(mem_node_t *node)
+{
+	if (node->data != NULL) {
+		g_mem_used -= node->data->len;
+		g_byte_array_free(node->data, TRUE);
+	}
+	if (node->children != NULL)
+		g_tree_destroy(node->children);
+	g_free(node->name);
+	g_free(node);
+}
+
+static gboolean __drop_child(gpointer key, gpointer value, gpointer data);
+
+/* Removes node from its folder. Open files go when they are closed */
+static void __drop_node(mem_node_t *node)
+{
+	if (node->parent != NULL) {
+		g_tree_remove(node->parent->children, node->name);
+		node->parent->mtime = time(NULL);
+		node->parent = NULL;
+	}
+
+	if (node->children != NULL) {
+		g_tree_foreach(node->children, __drop_child, NULL);
+		g_tree_destroy(node->children);
+		node->children = NULL;
+	}
+
+	if (node->open_count == 0)
+		__free_node(node);
+}
+
+static gboolean __drop_child(gpointer key, gpointer value, gpointer data)
+{
+	mem_node_t *node = (mem_node_t *)value;
+
+	/* The tree is destroyed by the caller, not walked again */
+	node->parent = NULL;
+	__drop_node(node);
+
+	return FALSE;
+}
+
+/* Finds the node of an absolute path, sets errno when there is none */
+static mem_node_t *__lookup(const mtp_char *path)
+{
+	const mtp_char *name = path;
+	const mtp_char *end = NULL;
+	mtp_char comp[MTP_MAX_FILENAME_SIZE + 1];
+	mem_node_t *node = g_mem_root;
+
+	while (node != NULL && *name != '\0') {
+		while (*name == '/')
+			name++;
+		if (*name == '\0')
+			break;
+
+		if (!node->is_dir) {
+			errno = ENOTDIR;
+			return NULL;
+		}
+
+		end = strchrnul(name, '/');
+		if (end - name > MTP_MAX_FILENAME_SIZE) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		memcpy(comp, name, end - name);
+		comp[end - name] = '\0';
+
+		node = g_tree_lookup(node->children, comp);
+		name = end;
+	}
+
+	if (node == NULL)
+		errno = ENOENT;
+	return node;
+}
+
+/*
+ * Finds the folder path would be created in. name is set to the last
+ * component of path, which has no trailing slash.
+ */
+static mem_node_t *__lookup_parent(const mtp_char *path,
+		const mtp_char **name)
+{
+	mtp_char parent_path[MTP_MAX_PATHNAME_SIZE + 1];
+	const mtp_char *slash = strrchr(path, '/');
+	mem_node_t *parent = NULL;
+
+	if (slash == NULL || slash[1] == '\0' ||
+			slash - path > MTP_MAX_PATHNAME_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	memcpy(parent_path, path, slash - path);
+	parent_path[slash - path] = '\0';
+
+	parent = __lookup(parent_path);
+	if (parent != NULL && !parent->is_dir) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	*name = slash + 1;
+	return parent;
+}
+
+static void __get_attrs(mem_node_t *node, file_attr_t *attrs)
+{
+	memset(attrs, 0, sizeof(file_attr_t));
+	attrs->ctime = node->ctime;
+	attrs->mtime = node->mtime;
+
+	if (node->is_dir) {
+		attrs->attribute = MTP_FILE_ATTR_MODE_DIR;
+		return;
+	}
+
+	attrs->attribute = MTP_FILE_ATTR_MODE_REG;
+	if (node->read_only)
+		attrs->attribute |= MTP_FILE_ATTR_MODE_READ_ONLY;
+	attrs->fsize = node->data->len;
+}
+
+static ssize_t __file_read(void *cookie, char *buf, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)cookie;
+	GByteArray *data = file->node->data;
+	size_t count = 0;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	if (file->pos < data->len) {
+		count = MIN(size, data->len - file->pos);
+		memcpy(buf, data->data + file->pos, count);
+		file->pos += count;
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	__wait_io(count);
+	return count;
+}
+
+static ssize_t __file_write(void *cookie, const char *buf, size_t size)
+{
+	mem_file_t *file = (mem_file_t *)cookie;
+	GByteArray *data = file->node->data;
+	mtp_uint64 capacity = (mtp_uint64)g_conf.mem_storage_size << 20;
+	mtp_uint64 end = file->pos + size;
+	mtp_uint32 old_len = 0;
+
+	/* A GByteArray holds up to 4 GiB */
+	if (end > G_MAXUINT) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	pthread_mutex_lock(&g_mem_mutex);
+	if (end > data->len) {
+		if (g_mem_used + end - data->len > capacity) {
+			pthread_mutex_unlock(&g_mem_mutex);
+			errno = ENOSPC;
+			return 0;
+		}
+
+		old_len = data->len;
+		g_byte_array_set_size(data, end);
+		g_mem_used += end - old_len;
+		/* A seek past the end leaves a hole */
+		if (file->pos > old_len)
+			memset(data->data + old_len, 0, file->pos - old_len);
+	}
+	memcpy(data->data + file->pos, buf, size);
+	file->pos = end;
+	file->node->mtime = time(NULL);
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	__wait_io(size);
+	return size;
+}
+
+static int __file_seek(void *cookie, off64_t *offset, int whence)
+{
+	mem_file_t *file = (mem_file_t *)cookie;
+	off64_t pos = *offset;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	if (whence == SEEK_CUR)
+		pos += file->pos;
+	else if (whence == SEEK_END)
+		pos += file->node->data->len;
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	file->pos = *offset = pos;
+	return 0;
+}
+
+static int __file_close(void *cookie)
+{
+	mem_file_t *file = (mem_file_t *)cookie;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	file->node->open_count--;
+	if (file->node->open_count == 0 && file->node->parent == NULL &&
+			file->node != g_mem_root)
+		__free_node(file->node);
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	g_free(file);
+	return 0;
+}
+
+static const cookie_io_functions_t g_mem_file_funcs = {
+	.read = __file_read,
+	.write = __file_write,
+	.seek = __file_seek,
+	.close = __file_close,
+};
+
+static mtp_bool __mem_init(void)
+{
+	retvm_if(g_conf.mem_storage_size <= 0, FALSE,
+			"mem_storage_size must be positive\n");
+
+	pthread_mutex_lock(&g_mem_mutex);
+	/* The stores start empty, their folders are made by the device */
+	if (g_mem_root == NULL)
+		g_mem_root = __new_node(NULL, "", TRUE);
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	DBG("Memory storage of %d MiB\n", g_conf.mem_storage_size);
+	return TRUE;
+}
+
+static void __mem_deinit(void)
+{
+	pthread_mutex_lock(&g_mem_mutex);
+	if (g_mem_root != NULL) {
+		__drop_node(g_mem_root);
+		g_mem_root = NULL;
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+}
+
+static FILE *__mem_open(const mtp_char *path, file_mode_t mode)
+{
+	mem_node_t *node = NULL;
+	mem_node_t *parent = NULL;
+	const mtp_char *name = NULL;
+	mem_file_t *file = NULL;
+	FILE *fhandle = NULL;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node == NULL && mode == MTP_FILE_WRITE && errno == ENOENT) {
+		parent = __lookup_parent(path, &name);
+		if (parent != NULL)
+			node = __new_node(parent, name, FALSE);
+	} else if (node != NULL && node->is_dir) {
+		errno = EISDIR;
+		node = NULL;
+	} else if (node != NULL && mode == MTP_FILE_WRITE) {
+		if (node->read_only) {
+			errno = EACCES;
+			node = NULL;
+		} else {
+			g_mem_used -= node->data->len;
+			g_byte_array_set_size(node->data, 0);
+			node->mtime = time(NULL);
+		}
+	}
+
+	if (node != NULL) {
+		file = g_new0(mem_file_t, 1);
+		file->node = node;
+		fhandle = fopencookie(file, mode == MTP_FILE_READ ? "r" : "w",
+				g_mem_file_funcs);
+		if (fhandle != NULL)
+			node->open_count++;
+		else
+			g_free(file);
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return fhandle;
+}
+
+static mtp_int32 __mem_remove(const mtp_char *path)
+{
+	mem_node_t *node = NULL;
+	mtp_int32 ret = -1;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node == g_mem_root) {
+		errno = EBUSY;
+	} else if (node != NULL && node->is_dir &&
+			g_tree_nnodes(node->children) > 0) {
+		errno = ENOTEMPTY;
+	} else if (node != NULL) {
+		__drop_node(node);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return ret;
+}
+
+static mtp_int32 __mem_rmdir(const mtp_char *path)
+{
+	mem_node_t *node = NULL;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node != NULL && !node->is_dir) {
+		pthread_mutex_unlock(&g_mem_mutex);
+		errno = ENOTDIR;
+		return -1;
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return __mem_remove(path);
+}
+
+static mtp_int32 __mem_mkdir(const mtp_char *path)
+{
+	mem_node_t *parent = NULL;
+	const mtp_char *name = NULL;
+	mtp_int32 ret = -1;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	parent = __lookup_parent(path, &name);
+	if (parent != NULL && g_tree_lookup(parent->children, name) != NULL) {
+		errno = EEXIST;
+	} else if (parent != NULL) {
+		__new_node(parent, name, TRUE);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return ret;
+}
+
+static mtp_int32 __rename_node(mem_node_t *node, mem_node_t *parent,
+		const mtp_char *name)
+{
+	mem_node_t *target = g_tree_lookup(parent->children, name);
+	mem_node_t *ancestor = NULL;
+	time_t now = time(NULL);
+
+	if (target == node)
+		return 0;
+
+	/* A folder cannot go into its own subtree */
+	for (ancestor = parent; ancestor != NULL; ancestor = ancestor->parent) {
+		if (ancestor == node) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (target != NULL) {
+		if (node->is_dir && !target->is_dir) {
+			errno = ENOTDIR;
+			return -1;
+		}
+		if (!node->is_dir && target->is_dir) {
+			errno = EISDIR;
+			return -1;
+		}
+		if (target->is_dir && g_tree_nnodes(target->children) > 0) {
+			errno = ENOTEMPTY;
+			return -1;
+		}
+		__drop_node(target);
+	}
+
+	g_tree_remove(node->parent->children, node->name);
+	node->parent->mtime = now;
+	g_free(node->name);
+	node->name = g_strdup(name);
+	node->parent = parent;
+	g_tree_insert(parent->children, node->name, node);
+	parent->mtime = now;
+
+	return 0;
+}
+
+static mtp_int32 __mem_rename(const mtp_char *from, const mtp_char *to)
+{
+	mem_node_t *node = NULL;
+	mem_node_t *parent = NULL;
+	const mtp_char *name = NULL;
+	mtp_int32 ret = -1;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(from);
+	if (node == g_mem_root) {
+		errno = EBUSY;
+	} else if (node != NULL) {
+		parent = __lookup_parent(to, &name);
+		if (parent != NULL)
+			ret = __rename_node(node, parent, name);
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return ret;
+}
+
+static mtp_int32 __mem_chmod(const mtp_char *path, mtp_uint32 mode)
+{
+	mem_node_t *node = NULL;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node != NULL)
+		node->read_only = !(mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return node != NULL ? 0 : -1;
+}
+
+static mtp_int32 __mem_stat(const mtp_char *path, file_attr_t *attrs)
+{
+	mem_node_t *node = NULL;
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node != NULL)
+		__get_attrs(node, attrs);
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return node != NULL ? 0 : -1;
+}
+
+static mtp_int32 __mem_statfs(const mtp_char *path, fs_info_t *fs_info)
+{
+	mtp_uint64 capacity = (mtp_uint64)g_conf.mem_storage_size << 20;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	fs_info->disk_size = capacity;
+	fs_info->reserved_size = g_mem_used;
+	fs_info->avail_size = capacity > g_mem_used ? capacity - g_mem_used : 0;
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return 0;
+}
+
+static mtp_bool __mem_is_opened(const mtp_char *path)
+{
+	mem_node_t *node = NULL;
+	mtp_bool opened = FALSE;
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node != NULL)
+		opened = node->open_count > 0;
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	return opened;
+}
+
+static gboolean __add_scan_entry(gpointer key, gpointer value, gpointer data)
+{
+	mem_node_t *node = (mem_node_t *)value;
+	GArray *entries = (GArray *)data;
+	mem_entry_t entry;
+
+	entry.name = g_strdup(node->name);
+	entry.type = node->is_dir ? MTP_DIR_TYPE : MTP_FILE_TYPE;
+	__get_attrs(node, &entry.attrs);
+	/* Like the POSIX scanner, a file is not flagged as regular */
+	entry.attrs.attribute &= ~MTP_FILE_ATTR_MODE_REG;
+	g_array_append_vals(entries, &entry, 1);
+
+	return FALSE;
+}
+
+static dir_scan_t *__mem_scan_open(const mtp_char *path, mtp_uint32 flags)
+{
+	mtp_uint32 len = strlen(path);
+	mem_node_t *node = NULL;
+	mem_scan_t *scan = NULL;
+
+	if (len + 1 >= MTP_MAX_PATHNAME_SIZE) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	__wait_io(0);
+
+	pthread_mutex_lock(&g_mem_mutex);
+	node = __lookup(path);
+	if (node != NULL && !node->is_dir) {
+		errno = ENOTDIR;
+		node = NULL;
+	}
+	if (node != NULL) {
+		scan = g_new0(mem_scan_t, 1);
+		scan->entries = g_array_new(FALSE, FALSE, sizeof(mem_entry_t));
+		g_tree_foreach(node->children, __add_scan_entry,
+				scan->entries);
+	}
+	pthread_mutex_unlock(&g_mem_mutex);
+
+	if (scan == NULL)
+		return NULL;
+
+	scan->flags = flags;
+	memcpy(scan->path, path, len);
+	scan->path[len++] = '/';
+	scan->path_len = len;
+
+	return (dir_scan_t *)scan;
+}
+
+static mtp_bool __mem_scan_next(dir_scan_t *dir_scan, dir_entry_t *dir_info)
+{
+	mem_scan_t *scan = (mem_scan_t *)dir_scan;
+	mem_entry_t *entry = NULL;
+	mtp_uint32 name_len = 0;
+
+	while (scan->next < scan->entries->len) {
+		entry = &g_array_index(scan->entries, mem_entry_t, scan->next++);
+
+		/* Every entry is a file or a folder, only hidden ones go */
+		if (entry->name[0] == '.' && !(scan->flags & MTP_DIR_SCAN_ALL))
+			continue;
+
+		name_len = strlen(entry->name);
+		if (scan->path_len + name_len > MTP_MAX_PATHNAME_SIZE) {
+			ERR_SECURE("Path is too long, skip [%s]\n",
+					entry->name);
+			continue;
+		}
+
+		memcpy(dir_info->filename, scan->path, scan->path_len);
+		memcpy(dir_info->filename + scan->path_len, entry->name,
+				name_len + 1);
+		dir_info->type = entry->type;
+		dir_info->attrs = entry->attrs;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void __mem_scan_close(dir_scan_t *dir_scan)
+{
+	mem_scan_t *scan = (mem_scan_t *)dir_scan;
+	mtp_uint32 i = 0;
+
+	for (i = 0; i < scan->entries->len; i++)
+		g_free(g_array_index(scan->entries, mem_entry_t, i).name);
+	g_array_free(scan->entries, TRUE);
+	g_free(scan);
+}
+
+const mtp_storage_ops_t g_mem_storage_ops = {
+	.name = MTP_STORAGE_MEMORY,
+	.has_fs_events = FALSE,
+	.is_persistent = FALSE,
+	.init = __mem_init,
+	.deinit = __mem_deinit,
+	.open = __mem_open,
+	.remove = __mem_remove,
+	.rmdir = __mem_rmdir,
+	.mkdir = __mem_mkdir,
+	.rename = __mem_rename,
+	.chmod = __mem_chmod,
+	.stat = __mem_stat,
+	.statfs = __mem_statfs,
+	.is_opened = __mem_is_opened,
+	.scan_open = __mem_scan_open,
+	.scan_next = __mem_scan_next,
+	.scan_close = __mem_scan_close,
+};
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2012, 2013 Samsung Electronics Co., Ltd.
+ * Copyright (c) 2019 Collabora Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glib.h>
+#include "mtp_util.h"
+#include "mtp_storage.h"
+
+/*
+ * The stores are folders of the local file systems.
+ */
+
+/*
+ * Reads folders in large getdents64() batches. Folders are told apart by
+ * d_type alone; only files, and entries d_type says nothing about, are
+ * looked up, relative to the open folder and for the fields used.
+ */
+typedef struct {
+	mtp_int32 fd;
+	mtp_uint32 flags;
+	mtp_int32 buf_len;
+	mtp_int32 buf_pos;
+	mtp_uint32 path_len;	/* of the folder, with the trailing slash */
+	mtp_char path[MTP_MAX_PATHNAME_SIZE + 1];
+	mtp_uchar buf[MTP_DIR_SCAN_BUF_SIZE];
+} posix_scan_t;
+
+static void __fill_attrs(mtp_uint32 mode, file_attr_t *attrs)
+{
+	if (S_ISDIR(mode)) {
+		attrs->attribute = MTP_FILE_ATTR_MODE_DIR;
+		attrs->fsize = 0;
+	} else if (S_ISREG(mode)) {
+		attrs->attribute = MTP_FILE_ATTR_MODE_REG;
+		if (!(mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
+			attrs->attribute |= MTP_FILE_ATTR_MODE_READ_ONLY;
+	} else if (S_ISBLK(mode) || S_ISCHR(mode) || S_ISLNK(mode) ||
+			S_ISSOCK(mode)) {
+		attrs->attribute = MTP_FILE_ATTR_MODE_SYSTEM;
+	} else {
+		attrs->attribute = MTP_FILE_ATTR_MODE_NONE;
+	}
+}
+
+static FILE *__posix_open(const mtp_char *path, file_mode_t mode)
+{
+	FILE *fhandle = NULL;
+
+	/* Read streams are mmap'ed */
+	fhandle = fopen(path, mode == MTP_FILE_READ ? "rm" : "w");
+	if (fhandle != NULL)
+		fcntl(fileno(fhandle), F_SETFL, O_NOATIME);
+
+	return fhandle;
+}
+
+static mtp_int32 __posix_remove(const mtp_char *path)
+{
+	return remove(path);
+}
+
+static mtp_int32 __posix_rmdir(const mtp_char *path)
+{
+	return rmdir(path);
+}
+
+static mtp_int32 __posix_mkdir(const mtp_char *path)
+{
+	return mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+}
+
+static mtp_int32 __posix_rename(const mtp_char *from, const mtp_char *to)
+{
+	return rename(from, to);
+}
+
+static mtp_int32 __posix_chmod(const mtp_char *path, mtp_uint32 mode)
+{
+	return chmod(path, mode);
+}
+
+static mtp_int32 __posix_stat(const mtp_char *path, file_attr_t *attrs)
+{
+	struct stat fileinfo = { 0 };
+
+	if (stat(path, &fileinfo) < 0)
+		return -1;
+
+	memset(attrs, 0, sizeof(file_attr_t));
+	attrs->fsize = (mtp_uint64)fileinfo.st_size;
+	attrs->ctime = fileinfo.st_ctime;
+	attrs->mtime = fileinfo.st_mtime;
+	__fill_attrs(fileinfo.st_mode, attrs);
+
+	return 0;
+}
+
+static mtp_int32 __posix_statfs(const mtp_char *path, fs_info_t *fs_info)
+{
+	struct statfs buf = { 0 };
+	mtp_uint64 avail_size = 0;
+	mtp_uint64 capacity = 0;
+	mtp_uint64 used_size = 0;
+
+	if (statfs(path, &buf) != 0)
+		return -1;
+
+	capacity = used_size = avail_size = (mtp_uint64)buf.f_bsize;
+	DBG("Block size : %lu\n", (unsigned long)buf.f_bsize);
+	capacity *= buf.f_blocks;
+	used_size *= (buf.f_blocks - buf.f_bavail);
+	avail_size *= buf.f_bavail;
+
+	fs_info->disk_size = capacity;
+	fs_info->reserved_size = used_size;
+	fs_info->avail_size = avail_size;
+
+	return 0;
+}
+
+static mtp_bool __posix_is_opened(const mtp_char *path)
+{
+	/* Fails while another process holds the file */
+	return rename(path, path) != 0;
+}
+
+static mtp_bool __scan_stat(posix_scan_t *scan, const mtp_char *name,
+		dir_entry_t *dir_info)
+{
+	mtp_uint32 mode = 0;
+#ifdef STATX_SIZE
+	struct statx stx;
+
+	if (statx(scan->fd, name, AT_NO_AUTOMOUNT,
+				STATX_TYPE | STATX_MODE | STATX_SIZE |
+				STATX_MTIME, &stx) < 0)
+		return FALSE;
+
+	mode = stx.stx_mode;
+	dir_info->attrs.fsize = stx.stx_size;
+	dir_info->attrs.mtime = stx.stx_mtime.tv_sec;
+#else /* STATX_SIZE */
+	struct stat stat_buf;
+
+	if (fstatat(scan->fd, name, &stat_buf, 0) < 0)
+		return FALSE;
+
+	mode = stat_buf.st_mode;
+	dir_info->attrs.fsize = (mtp_uint64)stat_buf.st_size;
+	dir_info->attrs.mtime = stat_buf.st_mtime;
+#endif /* STATX_SIZE */
+
+	__fill_attrs(mode, &dir_info->attrs);
+	if (S_ISDIR(mode)) {
+		dir_info->type = MTP_DIR_TYPE;
+	} else if (S_ISREG(mode) || (scan->flags & MTP_DIR_SCAN_ALL)) {
+		dir_info->type = MTP_FILE_TYPE;
+		dir_info->attrs.attribute &= ~MTP_FILE_ATTR_MODE_REG;
+	} else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static dir_scan_t *__posix_scan_open(const mtp_char *path, mtp_uint32 flags)
+{
+	mtp_int32 fd = -1;
+	mtp_uint32 len = strlen(path);
+	posix_scan_t *scan = NULL;
+
+	if (len + 1 >= MTP_MAX_PATHNAME_SIZE) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	scan = g_new(posix_scan_t, 1);
+	scan->fd = fd;
+	scan->flags = flags;
+	scan->buf_len = 0;
+	scan->buf_pos = 0;
+	memcpy(scan->path, path, len);
+	scan->path[len++] = '/';
+	scan->path_len = len;
+
+	return (dir_scan_t *)scan;
+}
+
+static mtp_bool __posix_scan_next(dir_scan_t *dir_scan, dir_entry_t *dir_info)
+{
+	mtp_int64 ret = 0;
+	mtp_uint32 name_len = 0;
+	struct dirent64 *dent = NULL;
+	posix_scan_t *scan = (posix_scan_t *)dir_scan;
+
+	do {
+		if (scan->buf_pos >= scan->buf_len) {
+			ret = syscall(SYS_getdents64, scan->fd, scan->buf,
+					sizeof(scan->buf));
+			if (ret < 0) {
+				/* LCOV_EXCL_START */
+				ERR("getdents64 Fail\n");
+				_util_print_error();
+				/* LCOV_EXCL_STOP */
+			}
+			if (ret <= 0)
+				return FALSE;
+
+			scan->buf_len = (mtp_int32)ret;
+			scan->buf_pos = 0;
+		}
+
+		dent = (struct dirent64 *)(scan->buf + scan->buf_pos);
+		scan->buf_pos += dent->d_reclen;
+
+		if (!g_strcmp0(dent->d_name, ".") ||
+				!g_strcmp0(dent->d_name, ".."))
+			continue;
+		if (dent->d_name[0] == '.' && !(scan->flags & MTP_DIR_SCAN_ALL))
+			continue;
+
+		name_len = strlen(dent->d_name);
+		if (scan->path_len + name_len > MTP_MAX_PATHNAME_SIZE) {
+			ERR_SECURE("Path is too long, skip [%s]\n",
+					dent->d_name);
+			continue;
+		}
+
+		switch (dent->d_type) {
+		case DT_DIR:
+			dir_info->type = MTP_DIR_TYPE;
+			dir_info->attrs.attribute = MTP_FILE_ATTR_MODE_DIR;
+			dir_info->attrs.fsize = 0;
+			dir_info->attrs.mtime = 0;
+			break;
+
+		case DT_REG:
+		case DT_LNK:
+		case DT_UNKNOWN:
+			if (!__scan_stat(scan, dent->d_name, dir_info))
+				continue;
+			break;
+
+		default:
+			if (!(scan->flags & MTP_DIR_SCAN_ALL) ||
+					!__scan_stat(scan, dent->d_name, dir_info))
+				continue;
+			break;
+		}
+		break;
+	} while (1);
+
+	memcpy(dir_info->filename, scan->path, scan->path_len);
+	memcpy(dir_info->filename + scan->path_len, dent->d_name,
+			name_len + 1);
+
+	return TRUE;
+}
+
+static void __posix_scan_close(dir_scan_t *dir_scan)
+{
+	posix_scan_t *scan = (posix_scan_t *)dir_scan;
+
+	if (close(scan->fd) < 0)
+		ERR("close directory fail\n");
+	g_free(scan);
+}
+
+const mtp_storage_ops_t g_posix_storage_ops = {
+	.name = MTP_STORAGE_POSIX,
+	.has_fs_events = TRUE,
+	.is_persistent = TRUE,
+	.open = __posix_open,
+	.remove = __posix_remove,
+	.rmdir = __posix_rmdir,
+	.mkdir = __posix_mkdir,
+	.rename = __posix_rename,
+	.chmod = __posix_chmod,
+	.stat = __posix_stat,
+	.statfs = __posix_statfs,
+	.is_opened = __posix_is_opened,
+	.scan_open = __posix_scan_open,
+	.scan_next = __posix_scan_next,
+	.scan_close = __posix_scan_close,
+};
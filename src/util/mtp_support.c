@@ -17,11 +17,20 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include "mtp_support.h"
 #include "ptp_datacodes.h"
 #include "mtp_util.h"
 
+extern mtp_config_t g_conf;
+
+/*
+ * STATIC VARIABLES
+ */
+static mtp_char **g_store_roots = NULL;
+static mtp_uint32 g_max_store_len = 0;
+
 /*
  * STATIC FUNCTIONS
  */
@@ -334,16 +343,143 @@ mtp_err_t _util_wchar_swprintf(mtp_wchar *mtp_wstr, mtp_int32 size,
 }
 /* LCOV_EXCL_STOP */
 
-mtp_uint16 _util_get_fmtcode(const mtp_char *extn)
+/* Extension of up to 5 characters, packed like __pack_extn() does */
+#define EXTN(c0, c1, c2, c3, c4) \
+	((mtp_uint64)(c0) | (mtp_uint64)(c1) << 8 | \
+	 (mtp_uint64)(c2) << 16 | (mtp_uint64)(c3) << 24 | \
+	 (mtp_uint64)(c4) << 32)
+
+/* Lowercase extension of up to 8 ASCII characters in one integer, else 0 */
+static inline mtp_uint64 __pack_extn(const mtp_char *extn)
 {
-	static fmt_code_t fmt_code_table[] = {
-		{"", PTP_FMT_UNDEF}
-	};
+	mtp_uint32 i = 0;
+	mtp_uint64 key = 0;
+	mtp_uchar ch = 0;
+
+	for (i = 0; extn[i] != '\0'; i++) {
+		ch = (mtp_uchar)extn[i];
+		if (i == sizeof(key) || ch >= 0x80)
+			return 0;
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+		key |= (mtp_uint64)ch << (i * 8);
+	}
 
-	fmt_code_t *p = NULL;
-	p = fmt_code_table;
+	return key;
+}
 
-	return p->fmt_code;
+/*
+ * mtp_uint16 _util_get_fmtcode(const mtp_char *extn)
+ * Maps a file extension, in any case and without the dot, to its object
+ * format code. The switch is on the packed extension, so no string is
+ * compared.
+ *
+ * @param[in]	extn	File extension.
+ * @return	The format code, PTP_FMT_UNDEF if it is not known.
+ */
+mtp_uint16 _util_get_fmtcode(const mtp_char *extn)
+{
+	retv_if(extn == NULL, PTP_FMT_UNDEF);
+
+	switch (__pack_extn(extn)) {
+	/* Audio */
+	case EXTN('m', 'p', '3', 0, 0):
+		return PTP_FMT_MP3;
+	case EXTN('w', 'a', 'v', 0, 0):
+		return PTP_FMT_WAVE;
+	case EXTN('a', 'i', 'f', 0, 0):
+	case EXTN('a', 'i', 'f', 'f', 0):
+		return PTP_FMT_AIFF;
+	case EXTN('w', 'm', 'a', 0, 0):
+		return MTP_FMT_WMA;
+	case EXTN('o', 'g', 'g', 0, 0):
+	case EXTN('o', 'g', 'a', 0, 0):
+		return MTP_FMT_OGG;
+	case EXTN('a', 'a', 'c', 0, 0):
+	case EXTN('m', '4', 'a', 0, 0):
+		return MTP_FMT_AAC;
+	case EXTN('a', 'a', 0, 0, 0):
+	case EXTN('a', 'a', 'x', 0, 0):
+		return MTP_FMT_AUDIBLE;
+	case EXTN('f', 'l', 'a', 'c', 0):
+		return MTP_FMT_FLAC;
+	case EXTN('m', 'p', '2', 0, 0):
+		return MTP_FMT_MP2;
+
+	/* Video */
+	case EXTN('a', 'v', 'i', 0, 0):
+		return PTP_FMT_AVI;
+	case EXTN('m', 'p', 'g', 0, 0):
+	case EXTN('m', 'p', 'e', 'g', 0):
+		return PTP_FMT_MPEG;
+	case EXTN('a', 's', 'f', 0, 0):
+		return PTP_FMT_ASF;
+	case EXTN('w', 'm', 'v', 0, 0):
+		return MTP_FMT_WMV;
+	case EXTN('m', 'p', '4', 0, 0):
+	case EXTN('m', '4', 'v', 0, 0):
+		return MTP_FMT_MP4_CONTAINER;
+	case EXTN('3', 'g', 'p', 0, 0):
+	case EXTN('3', 'g', 'p', 'p', 0):
+	case EXTN('3', 'g', '2', 0, 0):
+		return MTP_FMT_3GP_CONTAINER;
+
+	/* Images */
+	case EXTN('j', 'p', 'g', 0, 0):
+	case EXTN('j', 'p', 'e', 'g', 0):
+	case EXTN('j', 'p', 'e', 0, 0):
+		return PTP_FMT_IMG_EXIF;
+	case EXTN('b', 'm', 'p', 0, 0):
+		return PTP_FMT_IMG_BMP;
+	case EXTN('g', 'i', 'f', 0, 0):
+		return PTP_FMT_IMG_GIF;
+	case EXTN('p', 'n', 'g', 0, 0):
+		return PTP_FMT_IMG_PNG;
+	case EXTN('t', 'i', 'f', 0, 0):
+	case EXTN('t', 'i', 'f', 'f', 0):
+		return PTP_FMT_IMG_TIFF;
+	case EXTN('j', 'p', '2', 0, 0):
+		return PTP_FMT_IMG_JP2;
+	case EXTN('j', 'p', 'x', 0, 0):
+		return PTP_FMT_IMG_JPX;
+
+	/* Playlists */
+	case EXTN('w', 'p', 'l', 0, 0):
+		return MTP_FMT_WPL_PLAYLIST;
+	case EXTN('m', '3', 'u', 0, 0):
+	case EXTN('m', '3', 'u', '8', 0):
+		return MTP_FMT_M3U_PLAYLIST;
+	case EXTN('m', 'p', 'l', 0, 0):
+		return MTP_FMT_MPL_PLAYLIST;
+	case EXTN('a', 's', 'x', 0, 0):
+		return MTP_FMT_ASX_PLAYLIST;
+	case EXTN('p', 'l', 's', 0, 0):
+		return MTP_FMT_PLS_PLAYLIST;
+
+	/* Documents */
+	case EXTN('t', 'x', 't', 0, 0):
+		return PTP_FMT_TEXT;
+	case EXTN('h', 't', 'm', 0, 0):
+	case EXTN('h', 't', 'm', 'l', 0):
+		return PTP_FMT_HTML;
+	case EXTN('x', 'm', 'l', 0, 0):
+		return MTP_FMT_XML_DOC;
+	case EXTN('d', 'o', 'c', 0, 0):
+	case EXTN('d', 'o', 'c', 'x', 0):
+		return MTP_FMT_MS_WORD_DOC;
+	case EXTN('m', 'h', 't', 0, 0):
+	case EXTN('m', 'h', 't', 'm', 'l'):
+		return MTP_FMT_MHT_HTML_DOC;
+	case EXTN('x', 'l', 's', 0, 0):
+	case EXTN('x', 'l', 's', 'x', 0):
+		return MTP_FMT_MS_EXCEL_SPREADSHEET;
+	case EXTN('p', 'p', 't', 0, 0):
+	case EXTN('p', 'p', 't', 'x', 0):
+		return MTP_FMT_MS_POWERPOINT_PRESENTATION;
+
+	default:
+		return PTP_FMT_UNDEF;
+	}
 }
 
 /*
@@ -423,34 +559,52 @@ mtp_bool _util_get_file_name_wo_extn(const mtp_char *fullpath, mtp_char *f_name)
 }
 /* LCOV_EXCL_STOP */
 
+/* The roots of all the stores configured, mounted or not */
+static void __init_store_roots(void)
+{
+	mtp_char *paths = NULL;
+	mtp_uint32 ii = 0;
+	mtp_uint32 len = 0;
+
+	paths = g_strdup_printf("%s:%s", g_conf.storages,
+			g_conf.removable_storages);
+	g_store_roots = g_strsplit(paths, ":", -1);
+	g_free(paths);
+
+	for (ii = 0; g_store_roots[ii] != NULL; ii++) {
+		len = strlen(g_store_roots[ii]);
+		while (len > 1 && g_store_roots[ii][len - 1] == '/')
+			g_store_roots[ii][--len] = '\0';
+
+		if (len > g_max_store_len)
+			g_max_store_len = len;
+	}
+	DBG("max store len : [%u]\n", g_max_store_len);
+}
+
 mtp_bool _util_is_path_len_valid(const mtp_char *path)
 {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	mtp_uint32 ii = 0;
+	mtp_uint32 len = 0;
 	mtp_uint32 limit = 0;
 	mtp_uint32 mtp_path_len = 0;
 	mtp_uint32 root_path_len = 0;
 
-	static mtp_uint32 max_store_len = 0;
-	static mtp_bool is_initialized = FALSE;
-	static mtp_uint32 external_store_len = 0;
-
-	char ext_path[MTP_MAX_PATHNAME_SIZE + 1] = { 0 };
-
 	retv_if(path == NULL, FALSE);
 
-	_util_get_external_path(ext_path);
-
-	if (!is_initialized) {
-		is_initialized = TRUE;
-		external_store_len = strlen(ext_path);
-
-		max_store_len = external_store_len;
+	pthread_once(&once, __init_store_roots);
 
-		DBG("max store len : [%u]\n", max_store_len);
+	/* Stores are not nested, the path is in one root at most */
+	for (ii = 0; g_store_roots[ii] != NULL; ii++) {
+		len = strlen(g_store_roots[ii]);
+		if (len > 0 && !strncmp(path, g_store_roots[ii], len) &&
+				(path[len] == '\0' || path[len] == '/')) {
+			root_path_len = len;
+			break;
+		}
 	}
-
-	if (!strncmp(path, ext_path, external_store_len)) {
-		root_path_len = external_store_len;
-	} else {
+	if (g_store_roots[ii] == NULL) {
 		ERR("Unknown store's path : %s\n", path);
 		return FALSE;
 	}
@@ -459,7 +613,7 @@ mtp_bool _util_is_path_len_valid(const mtp_char *path)
 	mtp_path_len = strlen(path) - root_path_len;
 
 	/* MTP_MAX_PATHNAME_SIZE includes maximum length of root path */
-	limit = MTP_MAX_PATHNAME_SIZE - max_store_len;
+	limit = MTP_MAX_PATHNAME_SIZE - g_max_store_len;
 
 	retvm_if(mtp_path_len > limit, FALSE,
 		"Too long path : [%u] > [%u]\n", mtp_path_len, limit);
@@ -572,7 +726,7 @@ mtp_bool _util_get_unique_dir_path(const mtp_char *exist_path,
 	while (val < max_value) {
 		/* Including NUL and '_' */
 		g_snprintf(&buf[len], num_bytes + 2, "_%u", val++);
-		if (access(buf, F_OK) < 0)
+		if (!_util_file_exists(buf))
 			goto SUCCESS;
 	}
 
@@ -14,16 +14,186 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <glib.h>
 #include <mtp_thread.h>
 
+/* Not exported by glibc, see linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+typedef struct {
+	thread_func_t func;
+	void *arg;
+	mtp_thread_class_t tclass;
+} thread_start_t;
+
+extern mtp_config_t g_conf;
+
 /*
  * FUNCTIONS
  */
+
+/* "0-3,6" style list, as in /sys/devices/system/cpu/online */
+static mtp_bool __parse_cpu_list(const mtp_char *list, cpu_set_t *set)
+{
+	mtp_char *end = NULL;
+	long first = 0;
+	long last = 0;
+
+	CPU_ZERO(set);
+	while (*list != '\0') {
+		first = strtol(list, &end, 10);
+		retv_if(end == list || first < 0, FALSE);
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			retv_if(end == list || last < first, FALSE);
+		}
+		retv_if(last >= CPU_SETSIZE, FALSE);
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return FALSE;
+		list = end;
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+/* "rt:<0-7>", "be:<0-7>" or "idle" */
+static mtp_int32 __parse_ioprio(const mtp_char *str)
+{
+	mtp_int32 class = 0;
+	mtp_int32 level = 0;
+
+	if (strcasecmp(str, "idle") == 0)
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+	if (strncasecmp(str, "rt:", 3) == 0)
+		class = IOPRIO_CLASS_RT;
+	else if (strncasecmp(str, "be:", 3) == 0)
+		class = IOPRIO_CLASS_BE;
+	else
+		return -1;
+
+	level = atoi(str + 3);
+	retv_if(level < 0 || level > 7, -1);
+
+	return IOPRIO_PRIO_VALUE(class, level);
+}
+
+static void __set_thread_sched(mtp_thread_class_t tclass)
+{
+	struct sched_param param = { 0 };
+	mtp_int32 policy = SCHED_OTHER;
+	mtp_int32 error = 0;
+
+	if (!g_conf.support_pthread_sched || g_conf.inheritsched != 'e')
+		return;
+
+	/* Background work never runs with a real-time policy */
+	if (tclass != MTP_THREAD_CLASS_BG) {
+		if (g_conf.schedpolicy == 'f')
+			policy = SCHED_FIFO;
+		else if (g_conf.schedpolicy == 'r')
+			policy = SCHED_RR;
+	}
+
+	if (policy != SCHED_OTHER) {
+		param.sched_priority = tclass == MTP_THREAD_CLASS_USB ?
+			g_conf.usb_schedparam : g_conf.file_schedparam;
+	}
+
+	error = pthread_setschedparam(pthread_self(), policy, &param);
+	if (error != 0)
+		ERR("pthread_setschedparam Fail [%d]\n", error);
+}
+
+void _util_thread_set_class(mtp_thread_class_t tclass)
+{
+	const mtp_char *cpus = NULL;
+	const mtp_char *ioprio = NULL;
+	cpu_set_t set;
+	mtp_int32 value = 0;
+	mtp_int32 error = 0;
+
+	/* Threads started before the configuration is read keep defaults */
+	ret_if(tclass == MTP_THREAD_CLASS_NONE || !g_conf.is_init);
+
+	__set_thread_sched(tclass);
+
+	switch (tclass) {
+	case MTP_THREAD_CLASS_USB:
+		cpus = g_conf.usb_cpus;
+		ioprio = g_conf.usb_ioprio;
+		break;
+	case MTP_THREAD_CLASS_FILE:
+		cpus = g_conf.file_cpus;
+		ioprio = g_conf.file_ioprio;
+		break;
+	default:
+		cpus = g_conf.bg_cpus;
+		ioprio = g_conf.bg_ioprio;
+		break;
+	}
+
+	if (cpus[0] != '\0') {
+		if (!__parse_cpu_list(cpus, &set)) {
+			ERR("Invalid cpu list [%s]\n", cpus);
+		} else {
+			error = pthread_setaffinity_np(pthread_self(),
+					sizeof(set), &set);
+			if (error != 0)
+				ERR("pthread_setaffinity_np Fail [%d]\n", error);
+		}
+	}
+
+	if (ioprio[0] != '\0') {
+		value = __parse_ioprio(ioprio);
+		if (value < 0) {
+			ERR("Invalid ioprio [%s]\n", ioprio);
+		} else if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+					value) < 0) {
+			ERR("ioprio_set Fail, errno [%d]\n", errno);
+		}
+	}
+}
+
+/*
+ * Scheduling, affinity and I/O priority are applied by the new thread
+ * itself. ioprio_set() only works on the calling thread anyway.
+ */
+static void *__thread_start(void *data)
+{
+	thread_start_t start = *(thread_start_t *)data;
+
+	g_free(data);
+	_util_thread_set_class(start.tclass);
+
+	return start.func(start.arg);
+}
+
 mtp_bool _util_thread_create(pthread_t *tid, const mtp_char *tname,
-		mtp_int32 thread_state, thread_func_t thread_func, void *arg)
+		mtp_int32 thread_state, mtp_thread_class_t tclass,
+		thread_func_t thread_func, void *arg)
 {
 	int error = 0;
 	pthread_attr_t attr;
+	thread_start_t *start = NULL;
 
 	retv_if(tname == NULL, FALSE);
 	retv_if(thread_func == NULL, FALSE);
@@ -43,11 +213,17 @@ mtp_bool _util_thread_create(pthread_t *tid, const mtp_char *tname,
 		}
 	}
 
-	error = pthread_create(tid, &attr, thread_func, arg);
+	start = g_new0(thread_start_t, 1);
+	start->func = thread_func;
+	start->arg = arg;
+	start->tclass = tclass;
+
+	error = pthread_create(tid, &attr, __thread_start, start);
 	if (error != 0) {
 		/* LCOV_EXCL_START */
 		ERR("Thread creation Fail [%d], errno [%d]\n", error, errno);
 		pthread_attr_destroy(&attr);
+		g_free(start);
 		return FALSE;
 		/* LCOV_EXCL_STOP */
 	}